@@ -0,0 +1,107 @@
+/* arena.c
+ * Allocate cavern's many small fixed-size structures in bulk
+ * Copyright (C) 2016 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* cavern allocates a node, a pair of legs and usually a prefix and a pos for
+ * every station, and the reductions allocate and free legs as they go.
+ * Getting these from large chunks avoids the space and time overheads of
+ * malloc() for each one, and keeps structures allocated together close
+ * together in memory.  Freed blocks go on a free list for their size, and
+ * all the chunks are released at once by arena_release().
+ *
+ * The arenas aren't locked, so mustn't be used by the threads which solve
+ * parts of the network in parallel.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stddef.h>
+
+#include "arena.h"
+#include "debug.h"
+
+/* Size of each chunk obtained from osmalloc(). */
+#define ARENA_CHUNK_SIZE 65536
+
+struct arena_chunk {
+   arena_chunk *next;
+};
+
+/* Round up so blocks after the chunk header are suitably aligned. */
+#define ARENA_HEADER_SIZE \
+   ((ossizeof(arena_chunk) + ARENA_GRAIN - 1) / ARENA_GRAIN * ARENA_GRAIN)
+
+arena names_arena;
+arena network_arena;
+
+void *
+arena_alloc(arena *a, OSSIZE_T size)
+{
+   OSSIZE_T cls;
+   void *p;
+
+   SVX_ASSERT(size > 0 && size <= ARENA_MAX_SIZE);
+   cls = (size - 1) / ARENA_GRAIN;
+   p = a->free_list[cls];
+   if (p) {
+      a->free_list[cls] = *(void **)p;
+      return p;
+   }
+
+   size = (cls + 1) * ARENA_GRAIN;
+   if (a->end - a->next < (ptrdiff_t)size) {
+      arena_chunk *chunk = osmalloc(ARENA_CHUNK_SIZE);
+      chunk->next = a->chunks;
+      a->chunks = chunk;
+      a->next = (char *)chunk + ARENA_HEADER_SIZE;
+      a->end = (char *)chunk + ARENA_CHUNK_SIZE;
+   }
+   p = a->next;
+   a->next += size;
+   return p;
+}
+
+void
+arena_free(arena *a, void *p, OSSIZE_T size)
+{
+   OSSIZE_T cls;
+
+   if (!p) return;
+   SVX_ASSERT(size > 0 && size <= ARENA_MAX_SIZE);
+   cls = (size - 1) / ARENA_GRAIN;
+   *(void **)p = a->free_list[cls];
+   a->free_list[cls] = p;
+}
+
+void
+arena_release(arena *a)
+{
+   OSSIZE_T cls;
+
+   while (a->chunks) {
+      arena_chunk *chunk = a->chunks;
+      a->chunks = chunk->next;
+      osfree(chunk);
+   }
+   a->next = a->end = NULL;
+   for (cls = 0; cls < ARENA_MAX_SIZE / ARENA_GRAIN; cls++) {
+      a->free_list[cls] = NULL;
+   }
+}
@@ -0,0 +1,58 @@
+/* arena.h
+ * Allocate cavern's many small fixed-size structures in bulk
+ * Copyright (C) 2016 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef ARENA_H /* only include once */
+#define ARENA_H
+
+#include "osalloc.h"
+
+/* Allocations are rounded up to a multiple of this many bytes, and each size
+ * has its own free list. */
+#define ARENA_GRAIN 8
+/* The largest allocation supported. */
+#define ARENA_MAX_SIZE 256
+
+typedef struct arena_chunk arena_chunk;
+
+typedef struct {
+   arena_chunk *chunks;
+   char *next, *end; /* unused space in the current chunk */
+   void *free_list[ARENA_MAX_SIZE / ARENA_GRAIN];
+} arena;
+
+/* Prefixes, positions and survey metadata, which last for the whole run. */
+extern arena names_arena;
+
+/* Nodes and legs, which are all released at the end of each solve. */
+extern arena network_arena;
+
+void *arena_alloc(arena *a, OSSIZE_T size);
+
+/* Return p to the arena for reuse.  size must be the size it was allocated
+ * with. */
+void arena_free(arena *a, void *p, OSSIZE_T size);
+
+/* Release everything allocated from a in one go. */
+void arena_release(arena *a);
+
+/* Allocate like C++ new -- call arena_new(<arena>, <type>) */
+#define arena_new(A, T) ((T*)arena_alloc((A), ossizeof(T)))
+#define arena_delete(A, P, T) arena_free((A), (P), ossizeof(T))
+
+#endif
@@ -58,6 +58,10 @@ static const struct option long_opts[] = {
     /* const char *name; int has_arg (0 no_argument, 1 required_*, 2 optional_*); int *flag; int val; */
     {"survey", required_argument, 0, 's'},
     {"print", no_argument, 0, 'p'},
+    {"presentation", required_argument, 0, 1},
+    {"screenshot", required_argument, 0, 2},
+    {"movie", required_argument, 0, 3},
+    {"size", required_argument, 0, 4},
     {"help", no_argument, 0, HLP_HELP},
     {"version", no_argument, 0, HLP_VERSION},
     {0, 0, 0, 0}
@@ -73,6 +77,15 @@ static struct help_msg help[] = {
     {HLP_ENCODELONG(0),       /*only load the sub-survey with this prefix*/199, 0},
     /* TRANSLATORS: --help output for aven --print option */
     {HLP_ENCODELONG(1),       /*print and exit (requires a 3d file)*/119, 0},
+    /* TRANSLATORS: --help output for aven --presentation option */
+    {HLP_ENCODELONG(2),       /*presentation to take the view from, or to play for --movie*/526, 0},
+    /* TRANSLATORS: --help output for aven --screenshot option */
+    {HLP_ENCODELONG(3),       /*save a PNG image of the view and exit (requires a 3d file)*/527, 0},
+    /* TRANSLATORS: --help output for aven --movie option */
+    {HLP_ENCODELONG(4),       /*export the presentation as a movie and exit (requires a 3d file)*/528, 0},
+    /* TRANSLATORS: --help output for aven --size option.  Don't translate
+     * "x" in "WIDTHxHEIGHT" */
+    {HLP_ENCODELONG(5),       /*size in pixels for --screenshot and --movie as WIDTHxHEIGHT*/529, 0},
     {0, 0, 0}
 };
 
@@ -84,7 +97,7 @@ IMPLEMENT_WX_THEME_SUPPORT
 #endif
 
 Aven::Aven() :
-    m_Frame(NULL), m_pageSetupData(NULL)
+    m_Frame(NULL), m_pageSetupData(NULL), m_Batch(false)
 {
     wxFont::SetDefaultEncoding(wxFONTENCODING_UTF8);
 }
@@ -249,6 +262,8 @@ bool Aven::OnInit()
 
     wxString survey;
     bool print_and_exit = false;
+    wxString pres, image, movie;
+    int width = 0, height = 0;
 
     while (true) {
 	int opt;
@@ -265,9 +280,33 @@ bool Aven::OnInit()
 	if (opt == 'p') {
 	    print_and_exit = true;
 	}
+	if (opt == 1) {
+	    pres = wxString(optarg, wxConvUTF8);
+	}
+	if (opt == 2) {
+	    image = wxString(optarg, wxConvUTF8);
+	}
+	if (opt == 3) {
+	    movie = wxString(optarg, wxConvUTF8);
+	}
+	if (opt == 4) {
+	    char dummy;
+	    if (sscanf(optarg, "%dx%d%c", &width, &height, &dummy) != 2 ||
+		width <= 0 || height <= 0) {
+		cmdline_syntax(); // FIXME : not a helpful error...
+		exit(1);
+	    }
+	}
     }
 
-    if (print_and_exit && !utf8_argv[optind]) {
+    m_Batch = !image.empty() || !movie.empty();
+    if ((print_and_exit || m_Batch) && !utf8_argv[optind]) {
+	cmdline_syntax(); // FIXME : not a helpful error...
+	exit(1);
+    }
+    if ((!pres.empty() && !m_Batch) || (!movie.empty() && pres.empty())) {
+	// A presentation is only used when rendering, and is needed to make
+	// a movie.
 	cmdline_syntax(); // FIXME : not a helpful error...
 	exit(1);
     }
@@ -366,6 +405,13 @@ bool Aven::OnInit()
 	return true;
     }
 
+    if (m_Batch) {
+	// The window needs to be shown for OpenGL to be initialised, but we
+	// render into a framebuffer object if we can, so it doesn't matter if
+	// it's visible.
+	m_Frame->RenderAndExit(pres, image, movie, width, height);
+    }
+
     m_Frame->Show(true);
 #ifdef _WIN32
     m_Frame->SetFocus();
@@ -437,6 +483,11 @@ Aven::MacPrintFiles(const wxArrayString & filenames)
 
 void Aven::ReportError(const wxString& msg)
 {
+    if (m_Batch) {
+	// There's nobody to dismiss a dialog, so just give up.
+	fprintf(stderr, "%s: %s\n", msg_appname(), (const char *)msg.utf8_str());
+	exit(1);
+    }
     if (!m_Frame) {
 	wxMessageBox(msg, APP_NAME, wxOK | wxICON_ERROR);
 	return;
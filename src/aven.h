@@ -4,7 +4,7 @@
 //  Main class for Aven.
 //
 //  Copyright (C) 2001, Mark R. Shinwell.
-//  Copyright (C) 2002,2003,2004,2005,2006,2015 Olly Betts
+//  Copyright (C) 2002,2003,2004,2005,2006,2015,2016 Olly Betts
 //
 //  This program is free software; you can redistribute it and/or modify
 //  it under the terms of the GNU General Public License as published by
@@ -90,6 +90,10 @@ class Aven : public wxGLApp {
     // when the Aven class is constructed.
     wxPageSetupDialogData * m_pageSetupData;
 
+    // True if rendering to files from the command line, in which case errors
+    // are written to stderr and are fatal.
+    bool m_Batch;
+
 public:
     Aven();
     ~Aven();
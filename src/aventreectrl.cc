@@ -34,6 +34,7 @@ BEGIN_EVENT_TABLE(AvenTreeCtrl, wxTreeCtrl)
     EVT_LEAVE_WINDOW(AvenTreeCtrl::OnLeaveWindow)
     EVT_TREE_SEL_CHANGED(-1, AvenTreeCtrl::OnSelChanged)
     EVT_TREE_ITEM_ACTIVATED(-1, AvenTreeCtrl::OnItemActivated)
+    EVT_TREE_ITEM_EXPANDING(-1, AvenTreeCtrl::OnItemExpanding)
     EVT_CHAR(AvenTreeCtrl::OnKeyPress)
     EVT_TREE_ITEM_MENU(-1, AvenTreeCtrl::OnMenu)
     EVT_MENU(menu_SURVEY_SHOW_ALL, AvenTreeCtrl::OnRestrict)
@@ -116,6 +117,12 @@ void AvenTreeCtrl::OnItemActivated(wxTreeEvent& e)
     }
 }
 
+void AvenTreeCtrl::OnItemExpanding(wxTreeEvent& e)
+{
+    // Survey items are only filled in when first expanded.
+    m_Parent->FillTreeItem(e.GetItem());
+}
+
 void AvenTreeCtrl::OnMenu(wxTreeEvent& e)
 {
     if (m_Enabled) {
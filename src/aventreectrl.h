@@ -4,7 +4,7 @@
 //  Tree control used for the survey tree.
 //
 //  Copyright (C) 2001, Mark R. Shinwell.
-//  Copyright (C) 2002,2006 Olly Betts
+//  Copyright (C) 2002,2006,2016 Olly Betts
 //  Copyright (C) 2005 Martin Green
 //
 //  This program is free software; you can redistribute it and/or modify
@@ -33,13 +33,18 @@ class LabelInfo;
 class TreeData : public wxTreeItemData {
     const LabelInfo* m_Label;
     wxString survey;
+    // For a survey, the range of MainFrm's tree labels which are in it.
+    size_t first, end;
 
 public:
-    explicit TreeData(const LabelInfo* label) : m_Label(label) {}
-    explicit TreeData(const wxString & survey_)
-	: m_Label(NULL), survey(survey_) {}
+    explicit TreeData(const LabelInfo* label)
+	: m_Label(label), first(0), end(0) {}
+    TreeData(const wxString & survey_, size_t first_, size_t end_)
+	: m_Label(NULL), survey(survey_), first(first_), end(end_) {}
     const LabelInfo* GetLabel() const { return m_Label; }
     const wxString & GetSurvey() const { return survey; }
+    size_t GetFirst() const { return first; }
+    size_t GetEnd() const { return end; }
     bool IsStation() const { return m_Label != NULL; }
 };
 
@@ -62,6 +67,7 @@ public:
     void OnSelChanged(wxTreeEvent& event);
     void OnKeyPress(wxKeyEvent &e);
     void OnItemActivated(wxTreeEvent& e);
+    void OnItemExpanding(wxTreeEvent& e);
     void OnMenu(wxTreeEvent& e);
 
     void OnRestrict(wxCommandEvent& e);
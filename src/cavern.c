@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <time.h>
 
+#include "arena.h"
 #include "cavern.h"
 #include "cmdline.h"
 #include "commands.h"
@@ -40,6 +41,7 @@
 #include "netskel.h"
 #include "osdepend.h"
 #include "out.h"
+#include "solvecache.h"
 #include "str.h"
 #include "validate.h"
 #include "whichos.h"
@@ -70,7 +72,9 @@ img *pimg = NULL;
 bool fQuiet = fFalse; /* just show brief summary + errors */
 bool fMute = fFalse; /* just show errors */
 bool fSuppress = fFalse; /* only output 3d file */
+int cJobs = 1; /* number of threads to use for solving */
 static bool fLog = fFalse; /* stdout to .log file */
+static bool fCache = fFalse; /* reuse solutions from the last run */
 static bool f_warnings_are_errors = fFalse; /* turn warnings into errors */
 
 nosurveylink *nosurveyhead;
@@ -103,6 +107,8 @@ static const struct option long_opts[] = {
    {"warnings-are-errors", no_argument, 0, 'w'},
    {"log", no_argument, 0, 1},
    {"3d-version", required_argument, 0, 'v'},
+   {"jobs", required_argument, 0, 'j'},
+   {"cache", no_argument, 0, 3},
 #if OS_WIN32
    {"pause", no_argument, 0, 2},
 #endif
@@ -111,7 +117,7 @@ static const struct option long_opts[] = {
    {0, 0, 0, 0}
 };
 
-#define short_opts "pao:qsv:wz:"
+#define short_opts "paj:o:qsv:wz:"
 
 static struct help_msg help[] = {
 /*				<-- */
@@ -127,6 +133,10 @@ static struct help_msg help[] = {
    {HLP_ENCODELONG(6),	      /*log output to .log file*/170, 0},
    /* TRANSLATORS: --help output for cavern --3d-version option */
    {HLP_ENCODELONG(7),	      /*specify the 3d file format version to output*/171, 0},
+   /* TRANSLATORS: --help output for cavern --jobs option */
+   {HLP_ENCODELONG(8),	      /*number of threads to use to solve the network*/523, 0},
+   /* TRANSLATORS: --help output for cavern --cache option */
+   {HLP_ENCODELONG(9),	      /*reuse solutions of unchanged parts of the network*/524, 0},
  /*{'z',			"set optimizations for network reduction"},*/
    {0, 0, 0}
 };
@@ -148,6 +158,30 @@ pause_on_exit(void)
 }
 #endif
 
+/* Work out the name of an output file with extension ext before we've read
+ * any survey data. */
+static char *
+output_filename(const char *fnm_input, const char *ext)
+{
+   char *fnm;
+   if (!fnm_output_base) {
+      char *p;
+      p = baseleaf_from_fnm(fnm_input);
+      fnm = add_ext(p, ext);
+      osfree(p);
+   } else if (fnm_output_base_is_dir) {
+      char *p;
+      fnm = baseleaf_from_fnm(fnm_input);
+      p = use_path(fnm_output_base, fnm);
+      osfree(fnm);
+      fnm = add_ext(p, ext);
+      osfree(p);
+   } else {
+      fnm = add_ext(fnm_output_base, ext);
+   }
+   return fnm;
+}
+
 int current_days_since_1900;
 
 extern CDECL int
@@ -181,7 +215,7 @@ main(int argc, char **argv)
    pcs->convergence = 0.0;
 
    /* Set up root of prefix hierarchy */
-   root = osnew(prefix);
+   root = arena_new(&names_arena, prefix);
    root->up = root->right = root->down = NULL;
    root->stn = NULL;
    root->pos = NULL;
@@ -211,6 +245,10 @@ main(int argc, char **argv)
        case 'p':
 	 /* Ignore for compatibility with older versions. */
 	 break;
+       case 'j':
+	 cJobs = cmdline_int_arg();
+	 if (cJobs < 1) cJobs = 1;
+	 break;
        case 'o': {
 	 osfree(fnm_output_base); /* in case of multiple -o options */
 	 /* can be a directory (in which case use basename of leaf input)
@@ -251,13 +289,16 @@ main(int argc, char **argv)
 	    optimize = 0;
 	    first_opt_z = 0;
 	 }
-	 /* Lollipops, Parallel legs, Iterate mx, Delta* */
+	 /* Lollipops, Parallel legs, Iterate mx, Delta*, Sparse mx */
 	 while ((c = *optarg++) != '\0')
 	    if (islower((unsigned char)c)) optimize |= BITA(c);
 	 break;
        case 1:
 	 fLog = fTrue;
 	 break;
+       case 3:
+	 fCache = fTrue;
+	 break;
 #if OS_WIN32
        case 2:
 	 atexit(pause_on_exit);
@@ -268,23 +309,7 @@ main(int argc, char **argv)
    }
 
    if (fLog) {
-      char *fnm;
-      if (!fnm_output_base) {
-	 char *p;
-	 p = baseleaf_from_fnm(argv[optind]);
-	 fnm = add_ext(p, EXT_LOG);
-	 osfree(p);
-      } else if (fnm_output_base_is_dir) {
-	 char *p;
-	 fnm = baseleaf_from_fnm(argv[optind]);
-	 p = use_path(fnm_output_base, fnm);
-	 osfree(fnm);
-	 fnm = add_ext(p, EXT_LOG);
-	 osfree(p);
-      } else {
-	 fnm = add_ext(fnm_output_base, EXT_LOG);
-      }
-
+      char *fnm = output_filename(argv[optind], EXT_LOG);
       if (!freopen(fnm, "w", stdout))
 	 fatalerror(/*Failed to open output file “%s”*/47, fnm);
 
@@ -307,6 +332,13 @@ main(int argc, char **argv)
       }
    }
 
+   if (fCache) {
+      /* Some parts of the network may be the same as last time. */
+      char *fnm = output_filename(argv[optind], EXT_SOLVE);
+      solvecache_open(fnm);
+      osfree(fnm);
+   }
+
    atexit(delete_output_on_error);
 
    /* end of options, now process data files */
@@ -332,6 +364,7 @@ main(int argc, char **argv)
 
    solve_network(/*stnlist*/); /* Find coordinates of all points */
    validate();
+   solvecache_write();
 
    /* close .3d file */
    if (!img_close(pimg)) {
@@ -40,6 +40,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <wx/confbase.h>
 #include <wx/process.h>
 
 enum { LOG_REPROCESS = 1234, LOG_SAVE = 1235 };
@@ -427,6 +428,12 @@ CavernLogWindow::process(const wxString &file)
     wxString escaped_file = escape_for_shell(file, true);
     wxString cmd = get_command_path(L"cavern");
     cmd = escape_for_shell(cmd, false);
+    // If the user has asked for it, reuse the solutions of any parts of the
+    // network which haven't changed since the last time.  This is off by
+    // default as cavern saves the solutions in a file alongside the output.
+    bool cache;
+    wxConfigBase::Get()->Read(wxT("cavern_cache"), &cache, false);
+    if (cache) cmd += wxT(" --cache");
     cmd += wxT(" -o ");
     cmd += escaped_file;
     cmd += wxT(' ');
@@ -0,0 +1,149 @@
+/* choleski.c
+ * Dense LDL' solver used by the network adjustment
+ * Copyright (C) 1993-2003,2010,2013,2016 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "cavern.h"
+#include "choleski.h"
+#include "osalloc.h"
+
+/* Start of row X of the packed lower triangle */
+#define ROW(X) (M + ((((OSSIZE_T)(X)) * ((X) + 1)) >> 1))
+
+/* Number of rows of L to compute together.  Each earlier row of L then only
+ * has to be pulled into the cache once per block rather than once per row,
+ * which matters once the matrix is too big to stay in the cache.  A multiple
+ * of 3 keeps each station's x, y and z rows in the same block.
+ */
+#define BLOCK_ROWS 12
+
+/* GCC can compile a function for several instruction sets and pick the best
+ * one the CPU supports when the program starts.  The inner loops below are
+ * written so that they vectorise, so this lets us use AVX2 where available
+ * without requiring it.
+ */
+#ifdef HAVE_FUNC_ATTRIBUTE_TARGET_CLONES
+# define TARGET_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+# define TARGET_CLONES
+#endif
+
+/* Dot product of the n values at a and b.  Using four partial sums breaks
+ * the dependency between successive additions and allows SIMD instructions
+ * to be used without the compiler having to reorder a single sum.
+ */
+static inline real
+dot(const real *a, const real *b, long n)
+{
+   real s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+   long k;
+   for (k = 0; k + 4 <= n; k += 4) {
+      s0 += a[k] * b[k];
+      s1 += a[k + 1] * b[k + 1];
+      s2 += a[k + 2] * b[k + 2];
+      s3 += a[k + 3] * b[k + 3];
+   }
+   for ( ; k < n; k++) s0 += a[k] * b[k];
+   return (s0 + s1) + (s2 + s3);
+}
+
+/* Solve MX=B for X by Choleski factorisation - modified Choleski actually
+ * since we factor into LDL' while Choleski is just LL'
+ *
+ * The factor is computed a row at a time, working along each row of L with
+ * a copy of the row multiplied through by D so that the inner loop is a
+ * straight dot product of two rows.  L can't have a non-zero to the left of
+ * the first non-zero in the same row of M, so each row only needs to be
+ * processed from there on, which saves a lot of work when stations which
+ * are close together in the matrix are also close together in the network.
+ */
+TARGET_CLONES void
+choleski(real *M, real *B, long n)
+{
+   long *first;
+   real *W;
+   long i, j, j0;
+
+   if (n <= 0) return;
+
+   first = osmalloc(n * ossizeof(long));
+   for (j = 0; j < n; j++) {
+      const real *row_j = ROW(j);
+      long k = 0;
+      while (k < j && row_j[k] == (real)0.0) k++;
+      first[j] = k;
+   }
+
+   /* Row j - j0 of W holds row j of L multiplied by D */
+   W = osmalloc((OSSIZE_T)BLOCK_ROWS * n * ossizeof(real));
+
+   for (j0 = 0; j0 < n; j0 += BLOCK_ROWS) {
+      long j1 = j0 + BLOCK_ROWS;
+      long start = j0;
+      if (j1 > n) j1 = n;
+      for (j = j0; j < j1; j++) {
+	 if (first[j] < start) start = first[j];
+      }
+      for (i = start; i < j1; i++) {
+	 real *row_i = ROW(i);
+	 real d;
+	 if (i >= j0) {
+	    /* Row i of L is now complete, so we can find D(i). */
+	    const real *w = W + (i - j0) * n;
+	    long f = first[i];
+	    row_i[i] -= dot(row_i + f, w + f, i - f);
+	 }
+	 d = row_i[i];
+	 for (j = (i < j0 ? j0 : i + 1); j < j1; j++) {
+	    real *row_j, *w;
+	    long s;
+	    if (i < first[j]) continue;
+	    row_j = ROW(j);
+	    w = W + (j - j0) * n;
+	    s = (first[i] > first[j] ? first[i] : first[j]);
+	    w[i] = row_j[i] - dot(row_i + s, w + s, i - s);
+	    row_j[i] = w[i] / d;
+	 }
+      }
+   }
+
+   osfree(W);
+
+   /* Multiply x by L inverse */
+   for (j = 1; j < n; j++) {
+      long f = first[j];
+      B[j] -= dot(ROW(j) + f, B + f, j - f);
+   }
+
+   /* Multiply x by D inverse */
+   for (i = 0; i < n; i++) {
+      B[i] /= ROW(i)[i];
+   }
+
+   /* Multiply x by (L transpose) inverse */
+   for (i = n - 1; i > 0; i--) {
+      const real *row_i = ROW(i);
+      real x = B[i];
+      for (j = first[i]; j < i; j++) B[j] -= row_i[j] * x;
+   }
+
+   osfree(first);
+}
@@ -0,0 +1,27 @@
+/* choleski.h
+ * Dense LDL' solver used by the network adjustment
+ * Copyright (C) 1993,1994,2001,2016 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* M is the lower triangle of a symmetric n by n matrix, stored packed by
+ * rows (so element (row, col) with col <= row is at index
+ * row * (row + 1) / 2 + col).
+ *
+ * Solve MX=B for X, leaving X in B.  M must be symmetric positive definite.
+ * The factorisation is left in M, so the contents of M are scribbled on.
+ */
+void choleski(real *M, real *B, long n);
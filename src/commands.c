@@ -28,6 +28,7 @@
 
 #include <proj_api.h>
 
+#include "arena.h"
 #include "cavern.h"
 #include "commands.h"
 #include "datain.h"
@@ -709,7 +710,7 @@ free_settings(settings *p) {
 
    /* free meta if not used by parent, or in this block */
    if (p->meta && (!p->next || p->meta != p->next->meta) && p->meta->ref_count == 0)
-       osfree(p->meta);
+       arena_delete(&names_arena, p->meta, meta_data);
 
    /* free proj if not used by parent, or as the output projection */
    if (p->proj && (!p->next || p->proj != p->next->proj) && p->proj != proj_out)
@@ -906,10 +907,10 @@ cmd_fix(void)
 	 }
 	 stn = StnFromPfx(fix_name);
 	 if (!fixed(stn)) {
-	    node *fixpt = osnew(node);
+	    node *fixpt = arena_new(&network_arena, node);
 	    prefix *name;
-	    name = osnew(prefix);
-	    name->pos = osnew(pos);
+	    name = arena_new(&names_arena, prefix);
+	    name->pos = arena_new(&names_arena, pos);
 	    name->ident = NULL;
 	    name->shape = 0;
 	    fixpt->name = name;
@@ -2249,7 +2250,7 @@ void
 copy_on_write_meta(settings *s)
 {
    if (!s->meta || s->meta->ref_count != 0) {
-       meta_data * meta_new = osnew(meta_data);
+       meta_data * meta_new = arena_new(&names_arena, meta_data);
        if (!s->meta) {
 	   meta_new->days1 = meta_new->days2 = -1;
        } else {
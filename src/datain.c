@@ -24,6 +24,11 @@
 
 #include <limits.h>
 #include <stdarg.h>
+#ifdef HAVE_MMAP
+# include <sys/types.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
 
 #include "debug.h"
 #include "cavern.h"
@@ -76,24 +81,25 @@ void
 get_pos(filepos *fp)
 {
    fp->ch = ch;
-   fp->offset = ftell(file.fh);
-   if (fp->offset == -1)
-      fatalerror_in_file(file.filename, 0, /*Error reading file*/18);
+   fp->offset = (long)(file.p - file.start);
 }
 
 void
 set_pos(const filepos *fp)
 {
    ch = fp->ch;
-   if (fseek(file.fh, fp->offset, SEEK_SET) == -1)
-      fatalerror_in_file(file.filename, 0, /*Error reading file*/18);
+   file.p = file.start + fp->offset;
+   file.eof = fFalse;
 }
 
 static void
 push_back(int c)
 {
-   if (c != EOF && ungetc(c, file.fh) == EOF)
-      fatalerror_in_file(file.filename, 0, /*Error reading file*/18);
+   if (c != EOF) {
+      SVX_ASSERT(file.p != file.start && (unsigned char)file.p[-1] == c);
+      file.p--;
+      file.eof = fFalse;
+   }
 }
 
 static void
@@ -128,7 +134,7 @@ compile_v_report(int severity, int en, va_list ap)
    error_list_parent_files();
    if (en < 0) {
       en = -en;
-      if (file.fh) col = ftell(file.fh) - file.lpos;
+      if (file.start) col = (int)(file.p - file.start - file.lpos);
    }
    v_report(severity, file.filename, file.line, col, en, ap);
 }
@@ -280,7 +286,7 @@ process_eol(void)
       }
       if (ch == '\n') eolchar = ch;
    }
-   file.lpos = ftell(file.fh);
+   file.lpos = (long)(file.p - file.start);
 }
 
 static bool
@@ -358,6 +364,66 @@ nextch_handling_eol(void)
    }
 }
 
+/* Make the contents of fh available for nextch() to read, then close fh.
+ * Reading a character at a time through stdio is a significant part of the
+ * time taken to process large files, so we map the file into memory if we
+ * can, and otherwise read it all into a buffer.
+ */
+static void
+load_data_file(FILE *fh)
+{
+   char *buf = NULL;
+   size_t len = 0;
+
+   file.mapped = fFalse;
+#ifdef HAVE_MMAP
+   {
+      struct stat sb;
+      int fd = fileno(fh);
+      if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0 &&
+	  (off_t)(size_t)sb.st_size == sb.st_size) {
+	 void *p = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	 if (p != MAP_FAILED) {
+	    buf = p;
+	    len = (size_t)sb.st_size;
+	    file.mapped = fTrue;
+	 }
+      }
+   }
+#endif
+
+   if (!file.mapped) {
+      size_t size = 65536;
+      buf = osmalloc(size);
+      while (1) {
+	 len += fread(buf + len, 1, size - len, fh);
+	 if (len < size) break;
+	 size *= 2;
+	 buf = osrealloc(buf, size);
+      }
+      if (ferror(fh))
+	 fatalerror_in_file(file.filename, 0, /*Error reading file*/18);
+   }
+
+   (void)fclose(fh);
+
+   file.start = file.p = buf;
+   file.end = buf + len;
+   file.eof = fFalse;
+}
+
+static void
+unload_data_file(void)
+{
+#ifdef HAVE_MMAP
+   if (file.mapped) {
+      munmap((void *)file.start, file.end - file.start);
+      return;
+   }
+#endif
+   osfree((void *)file.start);
+}
+
 #define LITLEN(S) (sizeof(S"") - 1)
 #define has_ext(F,L,E) ((L) > LITLEN(E) + 1 &&\
 			(F)[(L) - LITLEN(E) - 1] == FNM_SEP_EXT &&\
@@ -394,9 +460,9 @@ data_file(const char *pth, const char *fnm)
       }
 
       file_store = file;
-      if (file.fh) file.parent = &file_store;
-      file.fh = fh;
+      if (file.start) file.parent = &file_store;
       file.filename = filename;
+      load_data_file(fh);
       file.line = 1;
       file.lpos = 0;
       file.reported_where = fFalse;
@@ -482,7 +548,7 @@ data_file(const char *pth, const char *fnm)
 #endif
 
    if (fmt == FMT_DAT) {
-      while (!feof(file.fh) && !ferror(file.fh)) {
+      while (!file.eof) {
 	 static reading compass_order[] = {
 	    Fr, To, Tape, CompassDATComp, CompassDATClino,
 	    CompassDATLeft, CompassDATRight, CompassDATUp, CompassDATDown,
@@ -579,7 +645,7 @@ data_file(const char *pth, const char *fnm)
 	 process_bol();
 	 skipline();
 	 process_eol();
-	 while (!feof(file.fh)) {
+	 while (!file.eof) {
 	    process_bol();
 	    if (ch == '\x0c') {
 	       nextch();
@@ -599,7 +665,7 @@ data_file(const char *pth, const char *fnm)
       }
    } else if (fmt == FMT_MAK) {
       nextch_handling_eol();
-      while (!feof(file.fh) && !ferror(file.fh)) {
+      while (!file.eof) {
 	 if (ch == '#') {
 	    /* include a file */
 	    int ch_store;
@@ -684,7 +750,7 @@ data_file(const char *pth, const char *fnm)
 	 pcs = pcsParent;
       }
    } else {
-      while (!feof(file.fh) && !ferror(file.fh)) {
+      while (!file.eof) {
 	 if (!process_non_data_line()) {
 	    f_export_ok = fFalse;
 	    switch (pcs->style) {
@@ -731,10 +797,7 @@ data_file(const char *pth, const char *fnm)
 
    pcs->begin_lineno = begin_lineno_store;
 
-   if (ferror(file.fh))
-      fatalerror_in_file(file.filename, 0, /*Error reading file*/18);
-
-   (void)fclose(file.fh);
+   unload_data_file();
 
    file = file_store;
 
@@ -1,7 +1,7 @@
 /* datain.h
  * Header file for code that...
  * Reads in survey files, dealing with special characters, keywords & data
- * Copyright (C) 1994-2002,2005,2010,2012,2014 Olly Betts
+ * Copyright (C) 1994-2002,2005,2010,2012,2014,2016 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -25,7 +25,10 @@
 #include <stdio.h> /* for FILE */
 
 typedef struct parse {
-   FILE *fh;
+   /* The file contents, which nextch() reads from p. */
+   const char *start, *p, *end;
+   bool eof; /* set once nextch() has tried to read past end */
+   bool mapped;
    const char *filename;
    unsigned int line;
    long lpos;
@@ -40,7 +43,8 @@ extern int ch;
 extern parse file;
 extern bool f_export_ok;
 
-#define nextch() (ch = GETC(file.fh))
+#define nextch() (ch = (file.p != file.end ? (unsigned char)*file.p++ :\
+			   (file.eof = fTrue, EOF)))
 
 typedef struct {
    long offset;
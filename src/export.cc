@@ -1355,8 +1355,8 @@ Export(const wxString &fnm_out, const wxString &title,
 	}
    }
    {
-	list<LabelInfo*>::const_iterator pos = mainfrm->GetLabels();
-	list<LabelInfo*>::const_iterator end = mainfrm->GetLabelsEnd();
+	vector<LabelInfo*>::const_iterator pos = mainfrm->GetLabels();
+	vector<LabelInfo*>::const_iterator end = mainfrm->GetLabelsEnd();
 	for ( ; pos != end; ++pos) {
 	    p.x = (*pos)->GetX();
 	    p.y = (*pos)->GetY();
@@ -1507,8 +1507,8 @@ Export(const wxString &fnm_out, const wxString &title,
 	 }
       }
       if (pass_mask & (STNS|LABELS|ENTS|FIXES|EXPORTS)) {
-	  list<LabelInfo*>::const_iterator pos = mainfrm->GetLabels();
-	  list<LabelInfo*>::const_iterator end = mainfrm->GetLabelsEnd();
+	  vector<LabelInfo*>::const_iterator pos = mainfrm->GetLabels();
+	  vector<LabelInfo*>::const_iterator end = mainfrm->GetLabelsEnd();
 	  for ( ; pos != end; ++pos) {
 	      p.x = (*pos)->GetX() + x_offset;
 	      p.y = (*pos)->GetY() + y_offset;
@@ -28,6 +28,10 @@
 
 #include <assert.h>
 #include <float.h>
+#include <string.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 
 #include "aven.h"
 #include "date.h"
@@ -41,6 +45,7 @@
 #include "moviemaker.h"
 
 #include <wx/confbase.h>
+#include <wx/file.h>
 #include <wx/wfstream.h>
 #include <wx/image.h>
 #include <wx/zipstrm.h>
@@ -50,6 +55,12 @@
 const unsigned long DEFAULT_HGT_DIM = 3601;
 const unsigned long DEFAULT_HGT_SIZE = sqrd(DEFAULT_HGT_DIM) * 2;
 
+#ifdef WORDS_BIGENDIAN
+const bool MACHINE_BIGENDIAN = true;
+#else
+const bool MACHINE_BIGENDIAN = false;
+#endif
+
 // Values for m_SwitchingTo
 #define PLAN 1
 #define ELEVATION 2
@@ -68,6 +79,14 @@ const Double LOG_LEN_MAX = 1.5;
 // labels.
 const unsigned int QUANTISE_FACTOR = 2;
 
+// The error allowed at level of detail 1, as a fraction of the diameter of
+// the survey.  Each further level allows LOD_ERROR_RATIO times as much.
+const Double LOD_BASE_ERROR = 4e-6;
+const Double LOD_ERROR_RATIO = 4.0;
+
+// Simplified legs and tubes are drawn with at most this much error in pixels.
+const Double LOD_MAX_PIXEL_ERROR = 0.5;
+
 #include "avenpal.h"
 
 static const int INDICATOR_BOX_SIZE = 60;
@@ -91,9 +110,6 @@ static const gla_colour HERE_COLOUR = col_WHITE;
 static const gla_colour NAME_COLOUR = col_GREEN;
 static const gla_colour SEL_COLOUR = col_WHITE;
 
-// Number of entries across and down the hit-test grid:
-#define HITTEST_SIZE 20
-
 // How close the pointer needs to be to a station to be considered:
 #define MEASURE_THRESHOLD 7
 
@@ -142,6 +158,7 @@ GfxCore::GfxCore(MainFrm* parent, wxWindow* parent_win, GUIControl* control) :
     m_Tubes(false),
     m_ColourBy(COLOUR_BY_DEPTH),
     m_HaveData(false),
+    m_Previewing(false),
     m_HaveTerrain(true),
     m_MouseOutsideCompass(false),
     m_MouseOutsideElev(false),
@@ -157,22 +174,25 @@ GfxCore::GfxCore(MainFrm* parent, wxWindow* parent_win, GUIControl* control) :
     m_Percent(false),
     m_HitTestDebug(false),
     m_RenderStats(false),
-    m_PointGrid(NULL),
-    m_HitTestGridValid(false),
+    m_HitTestCount(0),
     m_here(NULL),
     m_there(NULL),
     presentation_mode(0),
     pres_reverse(false),
     pres_speed(0.0),
     movie(NULL),
+    batch_width(0),
+    batch_height(0),
     current_cursor(GfxCore::CURSOR_DEFAULT),
     sqrd_measure_threshold(sqrd(MEASURE_THRESHOLD)),
-    dem(NULL),
+    m_SplayTraversesEnd(0),
+    m_UndergroundTraversesEnd(0),
+    m_LegSegmentsValid(false),
+    m_TubesLevel(0),
     last_time(0),
     n_tris(0)
 {
     AddQuad = &GfxCore::AddQuadrilateralDepth;
-    AddPoly = &GfxCore::AddPolylineDepth;
     wxConfigBase::Get()->Read(wxT("metric"), &m_Metric, true);
     wxConfigBase::Get()->Read(wxT("degrees"), &m_Degrees, true);
     wxConfigBase::Get()->Read(wxT("percent"), &m_Percent, false);
@@ -189,8 +209,7 @@ GfxCore::GfxCore(MainFrm* parent, wxWindow* parent_win, GUIControl* control) :
 GfxCore::~GfxCore()
 {
     TryToFreeArrays();
-
-    delete[] m_PointGrid;
+    FreeDEM();
 }
 
 void GfxCore::TryToFreeArrays()
@@ -212,7 +231,6 @@ void GfxCore::Initialise(bool same_file)
 
     m_DoneFirstShow = false;
 
-    m_HitTestGridValid = false;
     m_here = NULL;
     m_there = NULL;
 
@@ -224,6 +242,12 @@ void GfxCore::Initialise(bool same_file)
     }
 
     m_HaveData = true;
+    EndPreview();
+
+    m_LegSegmentsValid = false;
+    m_TubeErrors.clear();
+
+    m_LabelIndex.Build(m_Parent->GetLabels(), m_Parent->GetLabelsEnd());
 
     // Clear any cached OpenGL lists which depend on the data.
     InvalidateList(LIST_SCALE_BAR);
@@ -232,14 +256,15 @@ void GfxCore::Initialise(bool same_file)
     InvalidateList(LIST_ERROR_KEY);
     InvalidateList(LIST_GRADIENT_KEY);
     InvalidateList(LIST_LENGTH_KEY);
-    InvalidateList(LIST_UNDERGROUND_LEGS);
     InvalidateList(LIST_TUBES);
-    InvalidateList(LIST_SURFACE_LEGS);
     InvalidateList(LIST_BLOBS);
     InvalidateList(LIST_CROSSES);
     InvalidateList(LIST_GRID);
     InvalidateList(LIST_SHADOW);
     InvalidateList(LIST_TERRAIN);
+    // The offset may have changed, so the terrain needs projecting again.
+    m_TerrainTiles.clear();
+    m_TerrainLevels.clear();
 
     // Set diameter of the viewing volume.
     double cave_diameter = sqrt(sqrd(m_Parent->GetXExtent()) +
@@ -277,8 +302,10 @@ void GfxCore::FirstShow()
 {
     GLACanvas::FirstShow();
 
+    SetColourLookup(m_Pens, NUM_COLOUR_BANDS);
+
     const unsigned int quantise(GetFontSize() / QUANTISE_FACTOR);
-    list<LabelInfo*>::iterator pos = m_Parent->GetLabelsNC();
+    vector<LabelInfo*>::iterator pos = m_Parent->GetLabelsNC();
     while (pos != m_Parent->GetLabelsNCEnd()) {
 	LabelInfo* label = *pos++;
 	// Calculate and set the label width for use when plotting
@@ -304,7 +331,6 @@ void GfxCore::SetScale(Double scale)
     }
 
     m_Scale = scale;
-    m_HitTestGridValid = false;
     if (m_here && m_here == &temp_here) SetHere();
 
     GLACanvas::SetScale(scale);
@@ -347,6 +373,15 @@ void GfxCore::OnLeaveWindow(wxMouseEvent&) {
 void GfxCore::OnIdle(wxIdleEvent& event)
 {
     // Handle an idle event.
+    if (!batch_image.empty() || !batch_movie.empty()) {
+	// Wait until we've been drawn once, so OpenGL is initialised.
+	if (m_DoneFirstShow) RunBatch();
+	return;
+    }
+
+    // Leave the old survey alone while a new one is loading.
+    if (m_Previewing) return;
+
     if (Animating()) {
 	Animate();
 	// If still animating, we want more idle events.
@@ -365,174 +400,271 @@ void GfxCore::OnPaint(wxPaintEvent&)
     // Get a graphics context.
     wxPaintDC dc(this);
 
-    if (m_HaveData) {
-	// Make sure we're initialised.
-	bool first_time = !m_DoneFirstShow;
-	if (first_time) {
-	    FirstShow();
-	}
+    if (m_Previewing) {
+	DrawPreview(dc, m_PreviewLegs, true);
+    } else if (m_HaveData) {
+	Render();
+    } else {
+	dc.SetBackground(wxSystemSettings::GetColour(wxSYS_COLOUR_WINDOWFRAME));
+	dc.Clear();
+    }
+}
 
-	StartDrawing();
+// Limit on the number of leg ends we keep for redrawing the preview - any
+// beyond this are drawn as they arrive, but not if the window is repainted.
+static const size_t MAX_PREVIEW_LEG_ENDS = 2 * 1024 * 1024;
 
-	// Clear the background.
-	Clear();
+void GfxCore::StartPreview(Double xmin, Double xmax, Double ymin, Double ymax)
+{
+    // Show a plan of the legs as they're read in, scaled to fit the given
+    // extents, until Initialise() or EndPreview() is called.
+    m_Previewing = true;
+    m_PreviewLegs.clear();
+    m_PreviewXMin = xmin;
+    m_PreviewXMax = xmax;
+    m_PreviewYMin = ymin;
+    m_PreviewYMax = ymax;
+    Refresh();
+}
 
-	// Set up model transformation matrix.
-	SetDataTransform();
+void GfxCore::AddToPreview(const vector<wxRealPoint> & legs)
+{
+    if (!m_Previewing) return;
 
-	if (m_Legs || m_Tubes) {
-	    if (m_Tubes) {
-		EnableSmoothPolygons(true); // FIXME: allow false for wireframe view
-		DrawList(LIST_TUBES);
-		DisableSmoothPolygons();
-	    }
+    size_t n = min(legs.size(), MAX_PREVIEW_LEG_ENDS - m_PreviewLegs.size());
+    m_PreviewLegs.insert(m_PreviewLegs.end(), legs.begin(), legs.begin() + n);
 
-	    // Draw the underground legs.  Do this last so that anti-aliasing
-	    // works over polygons.
-	    SetColour(col_GREEN);
-	    DrawList(LIST_UNDERGROUND_LEGS);
-	}
+    if (!IsShownOnScreen()) return;
 
-	if (m_Surface) {
-	    // Draw the surface legs.
-	    DrawList(LIST_SURFACE_LEGS);
-	}
+    // Just draw the new legs, rather than repainting the whole window.
+    wxClientDC dc(this);
+    DrawPreview(dc, legs, false);
+}
 
-	if (m_BoundingBox) {
-	    DrawShadowedBoundingBox();
-	}
-	if (m_Grid) {
-	    // Draw the grid.
-	    DrawList(LIST_GRID);
-	}
+void GfxCore::EndPreview()
+{
+    if (!m_Previewing) return;
 
-	if (m_Terrain) {
-	    // We don't want to be able to see the terrain through itself, so
-	    // do a "Z-prepass" - plot the terrain once only updating the
-	    // Z-buffer, then again with Z-clipping only plotting where the
-	    // depth matches the value in the Z-buffer.
-	    DrawListZPrepass(LIST_TERRAIN);
-	}
+    m_Previewing = false;
+    vector<wxRealPoint> empty;
+    m_PreviewLegs.swap(empty);
+    Refresh();
+}
 
-	DrawList(LIST_BLOBS);
+void GfxCore::DrawPreview(wxDC & dc, const vector<wxRealPoint> & legs,
+			  bool clear) const
+{
+    const int MARGIN = 16;
+    int width, height;
+    GetClientSize(&width, &height);
 
-	if (m_Crosses) {
-	    DrawList(LIST_CROSSES);
-	}
+    if (clear) {
+	dc.SetBackground(*wxBLACK_BRUSH);
+	dc.Clear();
+    }
 
-	SetIndicatorTransform();
+    Double xsize = max(m_PreviewXMax - m_PreviewXMin, 1.0);
+    Double ysize = max(m_PreviewYMax - m_PreviewYMin, 1.0);
+    Double scale = min((width - 2 * MARGIN) / xsize,
+		       (height - 2 * MARGIN) / ysize);
+    if (scale <= 0) return;
+    Double xc = (m_PreviewXMin + m_PreviewXMax) * 0.5;
+    Double yc = (m_PreviewYMin + m_PreviewYMax) * 0.5;
 
-	// Draw station names.
-	if (m_Names /*&& !m_Control->MouseDown() && !Animating()*/) {
-	    SetColour(NAME_COLOUR);
+    // Legs beyond the extents we were given may be off the window, possibly
+    // a long way, so clamp the coordinates to keep them in a sane range.
+    const Double LIMIT = 30000;
+    dc.SetPen(*wxWHITE_PEN);
+    for (size_t i = 0; i + 1 < legs.size(); i += 2) {
+	const wxRealPoint & a = legs[i];
+	const wxRealPoint & b = legs[i + 1];
+	Double x0 = width * 0.5 + (a.x - xc) * scale;
+	Double y0 = height * 0.5 - (a.y - yc) * scale;
+	Double x1 = width * 0.5 + (b.x - xc) * scale;
+	Double y1 = height * 0.5 - (b.y - yc) * scale;
+	x0 = max(-LIMIT, min(LIMIT, x0));
+	y0 = max(-LIMIT, min(LIMIT, y0));
+	x1 = max(-LIMIT, min(LIMIT, x1));
+	y1 = max(-LIMIT, min(LIMIT, y1));
+	dc.DrawLine(int(x0), int(y0), int(x1), int(y1));
+    }
+}
 
-	    if (m_OverlappingNames) {
-		SimpleDrawNames();
-	    } else {
-		NattyDrawNames();
-	    }
-	}
+void GfxCore::Render()
+{
+    // Make sure we're initialised.
+    bool first_time = !m_DoneFirstShow;
+    if (first_time) {
+	FirstShow();
+    }
 
-	if (m_HitTestDebug) {
-	    // Show the hit test grid bucket sizes...
-	    SetColour(m_HitTestGridValid ? col_LIGHT_GREY : col_DARK_GREY);
-	    if (m_PointGrid) {
-		for (int i = 0; i != HITTEST_SIZE; ++i) {
-		    int x = (GetXSize() + 1) * i / HITTEST_SIZE + 2;
-		    for (int j = 0; j != HITTEST_SIZE; ++j) {
-			int square = i + j * HITTEST_SIZE;
-			unsigned long bucket_size = m_PointGrid[square].size();
-			if (bucket_size) {
-			    int y = (GetYSize() + 1) * (HITTEST_SIZE - 1 - j) / HITTEST_SIZE;
-			    DrawIndicatorText(x, y, wxString::Format(wxT("%lu"), bucket_size));
-			}
-		    }
-		}
-	    }
+    StartDrawing();
 
-	    EnableDashedLines();
-	    BeginLines();
-	    for (int i = 0; i != HITTEST_SIZE; ++i) {
-		int x = (GetXSize() + 1) * i / HITTEST_SIZE;
-		PlaceIndicatorVertex(x, 0);
-		PlaceIndicatorVertex(x, GetYSize());
-	    }
-	    for (int j = 0; j != HITTEST_SIZE; ++j) {
-		int y = (GetYSize() + 1) * (HITTEST_SIZE - 1 - j) / HITTEST_SIZE;
-		PlaceIndicatorVertex(0, y);
-		PlaceIndicatorVertex(GetXSize(), y);
+    // Clear the background.
+    Clear();
+
+    // Set up model transformation matrix.
+    SetDataTransform();
+
+    if (m_Legs || m_Tubes) {
+	if (m_Tubes) {
+	    // The tubes are drawn from a cached list, so we use the same
+	    // level of detail for all of them and regenerate the list when
+	    // that changes.  FIXME: With perspective the level should vary
+	    // with distance, but for now we always use full detail.
+	    int level = 0;
+	    if (!GetPerspective()) {
+		double pixel_plane[4];
+		GetPixelSizePlane(pixel_plane);
+		level = LevelOfDetail(pixel_plane[3]);
 	    }
-	    EndLines();
-	    DisableDashedLines();
-	}
-
-	long now = timer.Time();
-	if (m_RenderStats) {
-	    // Show stats about rendering.
-	    SetColour(col_TURQUOISE);
-	    int y = GetYSize() - GetFontSize();
-	    if (last_time != 0.0) {
-		// timer.Time() measure in milliseconds.
-		double fps = 1000.0 / (now - last_time);
-		DrawIndicatorText(1, y, wxString::Format(wxT("FPS:% 5.1f"), fps));
+	    if (level != m_TubesLevel) {
+		m_TubesLevel = level;
+		InvalidateList(LIST_TUBES);
 	    }
-	    y -= GetFontSize();
-	    DrawIndicatorText(1, y, wxString::Format(wxT("▲:%lu"), (unsigned long)n_tris));
+	    EnableSmoothPolygons(true); // FIXME: allow false for wireframe view
+	    DrawList(LIST_TUBES);
+	    DisableSmoothPolygons();
 	}
-	last_time = now;
 
-	// Draw indicators.
-	//
-	// There's no advantage in generating an OpenGL list for the
-	// indicators since they change with almost every redraw (and
-	// sometimes several times between redraws).  This way we avoid
-	// the need to track when to update the indicator OpenGL list,
-	// and also avoid indicator update bugs when we don't quite get this
-	// right...
-	DrawIndicators();
-
-	if (zoombox.active()) {
-	    SetColour(SEL_COLOUR);
-	    EnableDashedLines();
-	    BeginPolyline();
-	    glaCoord Y = GetYSize();
-	    PlaceIndicatorVertex(zoombox.x1, Y - zoombox.y1);
-	    PlaceIndicatorVertex(zoombox.x1, Y - zoombox.y2);
-	    PlaceIndicatorVertex(zoombox.x2, Y - zoombox.y2);
-	    PlaceIndicatorVertex(zoombox.x2, Y - zoombox.y1);
-	    PlaceIndicatorVertex(zoombox.x1, Y - zoombox.y1);
-	    EndPolyline();
-	    DisableDashedLines();
-	} else if (MeasuringLineActive()) {
-	    // Draw "here" and "there".
-	    double hx, hy;
-	    SetColour(HERE_COLOUR);
+	// Draw the underground legs.  Do this last so that anti-aliasing
+	// works over polygons.
+	DrawUndergroundLegs();
+    }
+
+    if (m_Surface) {
+	// Draw the surface legs.
+	DrawSurfaceLegs();
+    }
+
+    if (m_BoundingBox) {
+	DrawShadowedBoundingBox();
+    }
+    if (m_Grid) {
+	// Draw the grid.
+	DrawList(LIST_GRID);
+    }
+
+    if (m_Terrain) {
+	// The terrain is drawn from a cached list, so regenerate it if
+	// any tile should now be drawn at a different level of detail.
+	if (!m_TerrainTiles.empty()) {
+	    vector<int> levels;
+	    GetTerrainLevels(levels);
+	    if (levels != m_TerrainLevels) InvalidateList(LIST_TERRAIN);
+	}
+
+	// We don't want to be able to see the terrain through itself, so
+	// do a "Z-prepass" - plot the terrain once only updating the
+	// Z-buffer, then again with Z-clipping only plotting where the
+	// depth matches the value in the Z-buffer.
+	DrawListZPrepass(LIST_TERRAIN);
+    }
+
+    DrawList(LIST_BLOBS);
+
+    if (m_Crosses) {
+	DrawList(LIST_CROSSES);
+    }
+
+    SetIndicatorTransform();
+
+    // Draw station names.
+    if (m_Names /*&& !m_Control->MouseDown() && !Animating()*/) {
+	SetColour(NAME_COLOUR);
+
+	if (m_OverlappingNames) {
+	    SimpleDrawNames();
+	} else {
+	    NattyDrawNames();
+	}
+    }
+
+    if (m_HitTestDebug) {
+	// Show the area searched by the last hit test, and how many
+	// stations were found in it.
+	SetColour(col_LIGHT_GREY);
+	int x0 = m_HitTestPoint.x - MEASURE_THRESHOLD;
+	int x1 = m_HitTestPoint.x + MEASURE_THRESHOLD;
+	int y0 = GetYSize() - m_HitTestPoint.y - MEASURE_THRESHOLD;
+	int y1 = GetYSize() - m_HitTestPoint.y + MEASURE_THRESHOLD;
+	EnableDashedLines();
+	BeginPolyline();
+	PlaceIndicatorVertex(x0, y0);
+	PlaceIndicatorVertex(x1, y0);
+	PlaceIndicatorVertex(x1, y1);
+	PlaceIndicatorVertex(x0, y1);
+	PlaceIndicatorVertex(x0, y0);
+	EndPolyline();
+	DisableDashedLines();
+	DrawIndicatorText(x1 + 2, y0,
+			  wxString::Format(wxT("%lu"),
+					   (unsigned long)m_HitTestCount));
+    }
+
+    long now = timer.Time();
+    if (m_RenderStats) {
+	// Show stats about rendering.
+	SetColour(col_TURQUOISE);
+	int y = GetYSize() - GetFontSize();
+	if (last_time != 0.0) {
+	    // timer.Time() measure in milliseconds.
+	    double fps = 1000.0 / (now - last_time);
+	    DrawIndicatorText(1, y, wxString::Format(wxT("FPS:% 5.1f"), fps));
+	}
+	y -= GetFontSize();
+	DrawIndicatorText(1, y, wxString::Format(wxT("▲:%lu"), (unsigned long)n_tris));
+    }
+    last_time = now;
+
+    // Draw indicators.
+    //
+    // There's no advantage in generating an OpenGL list for the
+    // indicators since they change with almost every redraw (and
+    // sometimes several times between redraws).  This way we avoid
+    // the need to track when to update the indicator OpenGL list,
+    // and also avoid indicator update bugs when we don't quite get this
+    // right...
+    DrawIndicators();
+
+    if (zoombox.active()) {
+	SetColour(SEL_COLOUR);
+	EnableDashedLines();
+	BeginPolyline();
+	glaCoord Y = GetYSize();
+	PlaceIndicatorVertex(zoombox.x1, Y - zoombox.y1);
+	PlaceIndicatorVertex(zoombox.x1, Y - zoombox.y2);
+	PlaceIndicatorVertex(zoombox.x2, Y - zoombox.y2);
+	PlaceIndicatorVertex(zoombox.x2, Y - zoombox.y1);
+	PlaceIndicatorVertex(zoombox.x1, Y - zoombox.y1);
+	EndPolyline();
+	DisableDashedLines();
+    } else if (MeasuringLineActive()) {
+	// Draw "here" and "there".
+	double hx, hy;
+	SetColour(HERE_COLOUR);
+	if (m_here) {
+	    double dummy;
+	    Transform(*m_here, &hx, &hy, &dummy);
+	    if (m_here != &temp_here) DrawRing(hx, hy);
+	}
+	if (m_there) {
+	    double tx, ty;
+	    double dummy;
+	    Transform(*m_there, &tx, &ty, &dummy);
 	    if (m_here) {
-		double dummy;
-		Transform(*m_here, &hx, &hy, &dummy);
-		if (m_here != &temp_here) DrawRing(hx, hy);
-	    }
-	    if (m_there) {
-		double tx, ty;
-		double dummy;
-		Transform(*m_there, &tx, &ty, &dummy);
-		if (m_here) {
-		    BeginLines();
-		    PlaceIndicatorVertex(hx, hy);
-		    PlaceIndicatorVertex(tx, ty);
-		    EndLines();
-		}
-		BeginBlobs();
-		DrawBlob(tx, ty);
-		EndBlobs();
+		BeginLines();
+		PlaceIndicatorVertex(hx, hy);
+		PlaceIndicatorVertex(tx, ty);
+		EndLines();
 	    }
+	    BeginBlobs();
+	    DrawBlob(tx, ty);
+	    EndBlobs();
 	}
-
-	FinishDrawing();
-    } else {
-	dc.SetBackground(wxSystemSettings::GetColour(wxSYS_COLOUR_WINDOWFRAME));
-	dc.Clear();
     }
+
+    FinishDrawing();
 }
 
 void GfxCore::DrawBoundingBox()
@@ -900,6 +1032,12 @@ void GfxCore::Draw2dIndicators()
     }
 }
 
+static bool
+is_highlighted(const LabelInfo * label)
+{
+    return label->IsHighLighted();
+}
+
 void GfxCore::NattyDrawNames()
 {
     // Draw station names, without overlapping.
@@ -913,8 +1051,22 @@ void GfxCore::NattyDrawNames()
 
     memset((void*) m_LabelGrid, 0, buffer_size);
 
-    list<LabelInfo*>::const_iterator label = m_Parent->GetLabels();
-    for ( ; label != m_Parent->GetLabelsEnd(); ++label) {
+    // Apply a small shift so that translating the view doesn't make which
+    // labels are displayed change as the resulting twinkling effect is
+    // distracting.
+    double shift_x, shift_y, shift_z;
+    Transform(Vector3(), &shift_x, &shift_y, &shift_z);
+    shift_x -= floor(shift_x / quantise) * quantise;
+    shift_y -= floor(shift_y / quantise) * quantise;
+
+    vector<LabelInfo*> labels;
+    FindLabelsInView(0, labels);
+    // The labels are in LabelPlotCmp order, except that finding stations
+    // doesn't re-sort them, so put highlighted stations first here as
+    // LabelPlotCmp would.
+    stable_partition(labels.begin(), labels.end(), is_highlighted);
+    vector<LabelInfo*>::const_iterator label;
+    for (label = labels.begin(); label != labels.end(); ++label) {
 	if (!((m_Surface && (*label)->IsSurface()) ||
 	      (m_Legs && (*label)->IsUnderground()) ||
 	      (!(*label)->IsSurface() && !(*label)->IsUnderground()))) {
@@ -929,18 +1081,10 @@ void GfxCore::NattyDrawNames()
 	// Check if the label is behind us (in perspective view).
 	if (z <= 0.0 || z >= 1.0) continue;
 
-	// Apply a small shift so that translating the view doesn't make which
-	// labels are displayed change as the resulting twinkling effect is
-	// distracting.
-	double tx, ty, tz;
-	Transform(Vector3(), &tx, &ty, &tz);
-	tx -= floor(tx / quantise) * quantise;
-	ty -= floor(ty / quantise) * quantise;
-
-	tx = x - tx;
+	double tx = x - shift_x;
 	if (tx < 0) continue;
 
-	ty = y - ty;
+	double ty = y - shift_y;
 	if (ty < 0) continue;
 
 	unsigned int iy = unsigned(ty) / quantise;
@@ -969,8 +1113,10 @@ void GfxCore::NattyDrawNames()
 void GfxCore::SimpleDrawNames()
 {
     // Draw all station names, without worrying about overlaps
-    list<LabelInfo*>::const_iterator label = m_Parent->GetLabels();
-    for ( ; label != m_Parent->GetLabelsEnd(); ++label) {
+    vector<LabelInfo*> labels;
+    FindLabelsInView(0, labels);
+    vector<LabelInfo*>::const_iterator label;
+    for (label = labels.begin(); label != labels.end(); ++label) {
 	if (!((m_Surface && (*label)->IsSurface()) ||
 	      (m_Legs && (*label)->IsUnderground()) ||
 	      (!(*label)->IsSurface() && !(*label)->IsUnderground()))) {
@@ -1350,19 +1496,30 @@ bool GfxCore::CheckHitTestGrid(const wxPoint& point, bool centre)
 
     SetDataTransform();
 
-    if (!m_HitTestGridValid) CreateHitTestGrid();
-
-    int grid_x = point.x * HITTEST_SIZE / (GetXSize() + 1);
-    int grid_y = point.y * HITTEST_SIZE / (GetYSize() + 1);
+    // Find the stations in the square around the pointer which contains all
+    // those within MEASURE_THRESHOLD pixels of it.
+    vector<LabelInfo*> labels;
+    double y = GetYSize() - point.y;
+    FindLabels(point.x - MEASURE_THRESHOLD, y - MEASURE_THRESHOLD,
+	       point.x + MEASURE_THRESHOLD, y + MEASURE_THRESHOLD, labels);
+    m_HitTestPoint = point;
+    m_HitTestCount = labels.size();
 
     LabelInfo *best = NULL;
     int dist_sqrd = sqrd_measure_threshold;
-    int square = grid_x + grid_y * HITTEST_SIZE;
-    list<LabelInfo*>::iterator iter = m_PointGrid[square].begin();
+    vector<LabelInfo*>::const_iterator iter = labels.begin();
 
-    while (iter != m_PointGrid[square].end()) {
+    while (iter != labels.end()) {
 	LabelInfo *pt = *iter++;
 
+	if (!((m_Surface && pt->IsSurface()) ||
+	      (m_Legs && pt->IsUnderground()) ||
+	      (!pt->IsSurface() && !pt->IsUnderground()))) {
+	    // if this station isn't to be displayed, skip to the next
+	    // (last case is for stns with no legs attached)
+	    continue;
+	}
+
 	double cx, cy, cz;
 
 	Transform(*pt, &cx, &cy, &cz);
@@ -1429,8 +1586,6 @@ void GfxCore::OnSize(wxSizeEvent& event)
     if (m_DoneFirstShow) {
 	TryToFreeArrays();
 
-	m_HitTestGridValid = false;
-
 	ForceRefresh();
     }
 }
@@ -1500,9 +1655,12 @@ void GfxCore::Animate()
 
     long t;
     if (movie) {
-	ReadPixels(movie->GetWidth(), movie->GetHeight(), movie->GetBuffer());
-	if (!movie->AddFrame()) {
+	// The pixels may lag a frame behind while the readback is pipelined,
+	// in which case nothing is added the first time.
+	if (ReadPixels(movie->GetWidth(), movie->GetHeight(), movie->GetBuffer()) &&
+	    !movie->AddFrame()) {
 	    wxGetApp().ReportError(wxString(movie->get_error_string(), wxConvUTF8));
+	    FinishReadPixels(NULL);
 	    delete movie;
 	    movie = NULL;
 	    presentation_mode = 0;
@@ -1540,8 +1698,14 @@ void GfxCore::Animate()
 	    if (!next_mark.is_valid()) {
 		SetView(prev_mark);
 		presentation_mode = 0;
-		if (movie && !movie->Close()) {
-		    wxGetApp().ReportError(wxString(movie->get_error_string(), wxConvUTF8));
+		if (movie) {
+		    bool ok = true;
+		    if (FinishReadPixels(movie->GetBuffer()))
+			ok = movie->AddFrame();
+		    if (!movie->Close()) ok = false;
+		    if (!ok) {
+			wxGetApp().ReportError(wxString(movie->get_error_string(), wxConvUTF8));
+		    }
 		}
 		delete movie;
 		movie = NULL;
@@ -1773,48 +1937,18 @@ void GfxCore::SetThere(const LabelInfo * p)
     RefreshLine(m_here, old, m_there);
 }
 
-void GfxCore::CreateHitTestGrid()
+void GfxCore::FindLabels(double x0, double y0, double x1, double y1,
+			 vector<LabelInfo*> & labels) const
 {
-    if (!m_PointGrid) {
-	// Initialise hit-test grid.
-	m_PointGrid = new list<LabelInfo*>[HITTEST_SIZE * HITTEST_SIZE];
-    } else {
-	// Clear hit-test grid.
-	for (int i = 0; i < HITTEST_SIZE * HITTEST_SIZE; i++) {
-	    m_PointGrid[i].clear();
-	}
-    }
-
-    // Fill the grid.
-    list<LabelInfo*>::const_iterator pos = m_Parent->GetLabels();
-    list<LabelInfo*>::const_iterator end = m_Parent->GetLabelsEnd();
-    while (pos != end) {
-	LabelInfo* label = *pos++;
-
-	if (!((m_Surface && label->IsSurface()) ||
-	      (m_Legs && label->IsUnderground()) ||
-	      (!label->IsSurface() && !label->IsUnderground()))) {
-	    // if this station isn't to be displayed, skip to the next
-	    // (last case is for stns with no legs attached)
-	    continue;
-	}
-
-	// Calculate screen coordinates.
-	double cx, cy, cz;
-	Transform(*label, &cx, &cy, &cz);
-	if (cx < 0 || cx >= GetXSize()) continue;
-	if (cy < 0 || cy >= GetYSize()) continue;
-
-	cy = GetYSize() - cy;
-
-	// On-screen, so add to hit-test grid...
-	int grid_x = int(cx * HITTEST_SIZE / (GetXSize() + 1));
-	int grid_y = int(cy * HITTEST_SIZE / (GetYSize() + 1));
-
-	m_PointGrid[grid_x + grid_y * HITTEST_SIZE].push_back(label);
-    }
+    double planes[6][4];
+    GetViewPlanes(x0, y0, x1, y1, planes);
+    m_LabelIndex.Find(planes, 6, labels);
+}
 
-    m_HitTestGridValid = true;
+void GfxCore::FindLabelsInView(int margin, vector<LabelInfo*> & labels) const
+{
+    FindLabels(-margin, -margin,
+	       GetXSize() + margin, GetYSize() + margin, labels);
 }
 
 //
@@ -1832,7 +1966,6 @@ void GfxCore::TurnCave(Double angle)
 	m_PanAngle += 360.0;
     }
 
-    m_HitTestGridValid = false;
     if (m_here && m_here == &temp_here) SetHere();
 
     SetRotation(m_PanAngle, m_TiltAngle);
@@ -1870,7 +2003,6 @@ void GfxCore::TiltCave(Double tilt_angle)
 	m_TiltAngle += tilt_angle;
     }
 
-    m_HitTestGridValid = false;
     if (m_here && m_here == &temp_here) SetHere();
 
     SetRotation(m_PanAngle, m_TiltAngle);
@@ -1879,7 +2011,6 @@ void GfxCore::TiltCave(Double tilt_angle)
 void GfxCore::TranslateCave(int dx, int dy)
 {
     AddTranslationScreenCoordinates(dx, dy);
-    m_HitTestGridValid = false;
 
     if (m_here && m_here == &temp_here) SetHere();
 
@@ -2281,7 +2412,6 @@ void GfxCore::ToggleFlag(bool* flag, int update)
     } else if (update == UPDATE_BLOBS_AND_CROSSES) {
 	UpdateBlobs();
 	InvalidateList(LIST_CROSSES);
-	m_HitTestGridValid = false;
     }
     ForceRefresh();
 }
@@ -2304,7 +2434,7 @@ int GfxCore::GetNumExportedPts() const
 void GfxCore::ToggleTerrain()
 {
     ToggleFlag(&m_Terrain);
-    if (m_Terrain && !dem) {
+    if (m_Terrain && dem.empty()) {
 	wxCommandEvent dummy;
 	m_Parent->OnOpenTerrain(dummy);
     }
@@ -2329,7 +2459,6 @@ void GfxCore::ClearTreeSelection()
 void GfxCore::CentreOn(const Point &p)
 {
     SetTranslation(-p);
-    m_HitTestGridValid = false;
 
     ForceRefresh();
 }
@@ -2371,23 +2500,24 @@ void GfxCore::GenerateList(unsigned int l)
 	case LIST_LENGTH_KEY:
 	    DrawLengthKey();
 	    break;
-	case LIST_UNDERGROUND_LEGS:
-	    GenerateDisplayList();
-	    break;
 	case LIST_TUBES:
 	    GenerateDisplayListTubes();
 	    break;
-	case LIST_SURFACE_LEGS:
-	    GenerateDisplayListSurface();
-	    break;
 	case LIST_BLOBS:
 	    GenerateBlobsDisplayList();
 	    break;
 	case LIST_CROSSES: {
 	    BeginCrosses();
 	    SetColour(col_LIGHT_GREY);
-	    list<LabelInfo*>::const_iterator pos = m_Parent->GetLabels();
-	    while (pos != m_Parent->GetLabelsEnd()) {
+	    vector<LabelInfo*> labels;
+	    if (GeneratingUncachedList()) {
+		// Allow for the arms of crosses just outside the view.
+		FindLabelsInView(3, labels);
+	    } else {
+		labels.assign(m_Parent->GetLabels(), m_Parent->GetLabelsEnd());
+	    }
+	    vector<LabelInfo*>::const_iterator pos = labels.begin();
+	    while (pos != labels.end()) {
 		const LabelInfo* label = *pos++;
 
 		if ((m_Surface && label->IsSurface()) ||
@@ -2423,28 +2553,345 @@ void GfxCore::ToggleSmoothShading()
     ForceRefresh();
 }
 
-void GfxCore::GenerateDisplayList()
+// How far p is from the line segment a-b.  Also sets t to how far along a-b
+// the nearest point to p is (from 0 to 1).
+static Double
+distance_from_segment(const Vector3 & a, const Vector3 & b, const Vector3 & p,
+		      Double & t)
+{
+    Vector3 ab = b - a;
+    Double len_sqrd = dot(ab, ab);
+    t = 0.0;
+    if (len_sqrd > 0.0) {
+	t = min(max(dot(p - a, ab) / len_sqrd, 0.0), 1.0);
+    }
+    return (p - (a + ab * t)).magnitude();
+}
+
+static Double
+simplification_error(const PointInfo & a, const PointInfo & b,
+		     const PointInfo & p)
+{
+    Double t;
+    return distance_from_segment(a, b, p, t);
+}
+
+static Double
+simplification_error(const XSect & a, const XSect & b, const XSect & p)
+{
+    // For a tube, the passage dimensions also need to be close to those
+    // interpolated between a and b.
+    Double t;
+    Double e = distance_from_segment(a, b, p, t);
+    e = max(e, fabs(p.GetL() - (a.GetL() + t * (b.GetL() - a.GetL()))));
+    e = max(e, fabs(p.GetR() - (a.GetR() + t * (b.GetR() - a.GetR()))));
+    e = max(e, fabs(p.GetU() - (a.GetU() + t * (b.GetU() - a.GetU()))));
+    e = max(e, fabs(p.GetD() - (a.GetD() + t * (b.GetD() - a.GetD()))));
+    return e;
+}
+
+// Set errors[i] to the error introduced by removing points[i] when
+// simplifying the polyline with the Douglas-Peucker algorithm.  A point's
+// error is never more than those of the points it was split between, so
+// simplifying to within any error e just means keeping the points with
+// errors[i] > e.  The end points are always kept.
+template<class P>
+static void
+simplification_errors(const vector<P> & points, vector<float> & errors)
+{
+    size_t n = points.size();
+    errors.assign(n, FLT_MAX);
+    if (n <= 2) return;
+
+    // Traverses can be very long, so use an explicit stack rather than
+    // recursing.
+    vector<pair<size_t, size_t> > todo;
+    todo.push_back(make_pair(size_t(0), n - 1));
+    while (!todo.empty()) {
+	size_t a = todo.back().first;
+	size_t b = todo.back().second;
+	todo.pop_back();
+	if (b - a < 2) continue;
+
+	size_t worst = a + 1;
+	Double worst_error = -1.0;
+	for (size_t i = a + 1; i != b; ++i) {
+	    Double e = simplification_error(points[a], points[b], points[i]);
+	    if (e > worst_error) {
+		worst = i;
+		worst_error = e;
+	    }
+	}
+	errors[worst] = min(float(worst_error), min(errors[a], errors[b]));
+	todo.push_back(make_pair(a, worst));
+	todo.push_back(make_pair(worst, b));
+    }
+}
+
+// The largest and smallest values of plane[0] * x + plane[1] * y +
+// plane[2] * z + plane[3] over a box.
+static double
+box_plane_max(const double plane[4], const float min[3], const float max[3])
 {
-    // Generate the display list for the underground legs.
-    list<traverse>::const_iterator trav = m_Parent->traverses_begin();
+    double v = plane[3];
+    for (int axis = 0; axis < 3; ++axis) {
+	v += plane[axis] * (plane[axis] > 0 ? max[axis] : min[axis]);
+    }
+    return v;
+}
+
+static double
+box_plane_min(const double plane[4], const float min[3], const float max[3])
+{
+    double v = plane[3];
+    for (int axis = 0; axis < 3; ++axis) {
+	v += plane[axis] * (plane[axis] > 0 ? min[axis] : max[axis]);
+    }
+    return v;
+}
+
+Double GfxCore::LevelOfDetailError(int level) const
+{
+    // The error allowed at a level of detail, in survey units.
+    if (level == 0) return 0.0;
+    return GetVolumeDiameter() * LOD_BASE_ERROR *
+	   pow(LOD_ERROR_RATIO, level - 1);
+}
+
+int GfxCore::LevelOfDetail(Double pixel_size) const
+{
+    // Pick the coarsest level of detail which looks the same when a pixel is
+    // pixel_size across.
+    Double max_error = pixel_size * LOD_MAX_PIXEL_ERROR;
+    Double base_error = LevelOfDetailError(1);
+    if (max_error < base_error) return 0;
+    int level = int(log(max_error / base_error) / log(LOD_ERROR_RATIO)) + 1;
+    return min(level, LOD_LEVELS - 1);
+}
+
+void GfxCore::GenerateLegSegments()
+{
+    // Each vertex includes its colour for every way of colouring the legs, so
+    // we only need to regenerate these when the data changes.
+    vector<const traverse *> travs;
+    list<traverse>::const_iterator trav;
     list<traverse>::const_iterator tend = m_Parent->traverses_end();
+    for (trav = m_Parent->traverses_begin(); trav != tend; ++trav) {
+	if ((*trav).isSplay)
+	    travs.push_back(&*trav);
+    }
+    m_SplayTraversesEnd = travs.size();
+    for (trav = m_Parent->traverses_begin(); trav != tend; ++trav) {
+	if (!(*trav).isSplay)
+	    travs.push_back(&*trav);
+    }
+    m_UndergroundTraversesEnd = travs.size();
+    tend = m_Parent->surface_traverses_end();
+    for (trav = m_Parent->surface_traverses_begin(); trav != tend; ++trav) {
+	travs.push_back(&*trav);
+    }
+
+    vector<GLASegmentVertex> vertices;
+    m_TraverseSegments.resize(travs.size());
+    AddLegSegments(vertices, travs, 0, m_SplayTraversesEnd);
+    AddLegSegments(vertices, travs, m_SplayTraversesEnd,
+		   m_UndergroundTraversesEnd);
+    AddLegSegments(vertices, travs, m_UndergroundTraversesEnd, travs.size());
+    UploadSegments(m_LegSegments, vertices);
+    m_LegSegmentsValid = true;
+}
+
+void GfxCore::AddLegSegments(vector<GLASegmentVertex> & vertices,
+			     const vector<const traverse *> & travs,
+			     size_t begin, size_t end)
+{
+    vector<vector<float> > errors(end - begin);
+    for (size_t t = begin; t != end; ++t) {
+	const traverse & centreline = *travs[t];
+	TraverseSegments & segs = m_TraverseSegments[t];
+	for (int axis = 0; axis < 3; ++axis) {
+	    segs.min[axis] = FLT_MAX;
+	    segs.max[axis] = -FLT_MAX;
+	}
+	vector<PointInfo>::const_iterator i;
+	for (i = centreline.begin(); i != centreline.end(); ++i) {
+	    float c[3] = { float(i->GetX()), float(i->GetY()), float(i->GetZ()) };
+	    for (int axis = 0; axis < 3; ++axis) {
+		segs.min[axis] = min(segs.min[axis], c[axis]);
+		segs.max[axis] = max(segs.max[axis], c[axis]);
+	    }
+	}
+	simplification_errors(centreline, errors[t - begin]);
+    }
+
+    // Store all the traverses at each level of detail in turn, so that
+    // neighbouring traverses drawn at the same level are contiguous and can
+    // be drawn together.
+    for (int level = 0; level < LOD_LEVELS; ++level) {
+	float max_error = -1.0f;
+	if (level) max_error = float(LevelOfDetailError(level));
+	for (size_t t = begin; t != end; ++t) {
+	    TraverseSegments & segs = m_TraverseSegments[t];
+	    const vector<float> & errs = errors[t - begin];
+	    if (level) {
+		// Reuse the previous level unless this one has at most half as
+		// many legs, which limits the extra memory we use to the same
+		// again as full detail.
+		size_t n_points = 0;
+		for (size_t i = 0; i != errs.size(); ++i) {
+		    if (errs[i] > max_error) ++n_points;
+		}
+		if (n_points < 2 || 4 * (n_points - 1) > segs.count[level - 1]) {
+		    segs.first[level] = segs.first[level - 1];
+		    segs.count[level] = segs.count[level - 1];
+		    continue;
+		}
+	    }
+	    segs.first[level] = vertices.size();
+	    AddLegSegments(vertices, *travs[t], errs, max_error);
+	    segs.count[level] = vertices.size() - segs.first[level];
+	}
+    }
+}
+
+void GfxCore::AddLegSegments(vector<GLASegmentVertex> & vertices,
+			     const traverse & centreline,
+			     const vector<float> & errors,
+			     float max_error) const
+{
+    // Work out where each leg's colour is in the colour lookup texture for
+    // each of COLOUR_BY_DEPTH to COLOUR_BY_LENGTH, following
+    // SetDepthColour(), SetColourFromDate(), etc.
+    const int DEPTH_COL = COLOUR_BY_DEPTH - COLOUR_BY_DEPTH;
+    const int DATE_COL = COLOUR_BY_DATE - COLOUR_BY_DEPTH;
+    const int ERROR_COL = COLOUR_BY_ERROR - COLOUR_BY_DEPTH;
+    const int GRADIENT_COL = COLOUR_BY_GRADIENT - COLOUR_BY_DEPTH;
+    const int LENGTH_COL = COLOUR_BY_LENGTH - COLOUR_BY_DEPTH;
+
+    Double depth_min = m_Parent->GetDepthMin();
+    Double depth_ext = m_Parent->GetDepthExtent();
+    int date_min = m_Parent->GetDateMin();
+    int date_ext = m_Parent->GetDateExtent();
+
+    GLASegmentVertex v;
+    if (centreline.E < 0) {
+	v.colour[ERROR_COL] = ColourLookupWhite();
+    } else {
+	v.colour[ERROR_COL] = ColourLookup(min(centreline.E / MAX_ERROR, 1.0));
+    }
+
+    size_t prev = 0;
+    for (size_t j = 1; j < centreline.size(); ++j) {
+	if (errors[j] <= max_error) continue;
+
+	// Draw a leg from point prev to point j, which replaces any legs
+	// between them when simplifying, so colour it like the longest of
+	// those.
+	size_t longest = j;
+	Vector3 leg = centreline[j] - centreline[j - 1];
+	for (size_t k = prev + 1; k < j; ++k) {
+	    Vector3 other = centreline[k] - centreline[k - 1];
+	    if (other.magnitude() > leg.magnitude()) {
+		longest = k;
+		leg = other;
+	    }
+	}
+
+	int date = centreline[longest].GetDate();
+	if (date == -1) {
+	    v.colour[DATE_COL] = ColourLookupWhite();
+	} else if (date_ext == 0) {
+	    v.colour[DATE_COL] = ColourLookup(0.0);
+	} else {
+	    v.colour[DATE_COL] = ColourLookup(Double(date - date_min) / date_ext);
+	}
+
+	v.colour[GRADIENT_COL] = ColourLookup(fabs(leg.gradient()) / M_PI_2);
+	Double how_far = log10(leg.magnitude()) / LOG_LEN_MAX;
+	v.colour[LENGTH_COL] = ColourLookup(min(max(how_far, 0.0), 1.0));
+
+	const PointInfo * ends[2] = { &centreline[prev], &centreline[j] };
+	for (int e = 0; e < 2; ++e) {
+	    const PointInfo & p = *ends[e];
+	    v.x = p.GetX();
+	    v.y = p.GetY();
+	    v.z = p.GetZ();
+	    // Points arising from tubes may be slightly outside the limits.
+	    Double z = p.GetZ() - depth_min;
+	    if (z <= 0 || depth_ext <= 0) {
+		v.colour[DEPTH_COL] = ColourLookup(0.0);
+	    } else {
+		v.colour[DEPTH_COL] = ColourLookup(min(z / depth_ext, 1.0));
+	    }
+	    vertices.push_back(v);
+	}
+	prev = j;
+    }
+}
+
+void GfxCore::GetLegRanges(size_t begin, size_t end,
+			   GLASegmentRanges & ranges) const
+{
+    // Find the traverses which are in view, and draw each at the level of
+    // detail for the size of a pixel at the nearest point of its bounding
+    // box.
+    double planes[6][4];
+    GetViewPlanes(0, 0, GetXSize(), GetYSize(), planes);
+    double pixel_plane[4];
+    GetPixelSizePlane(pixel_plane);
 
+    ranges.clear();
+    for (size_t t = begin; t != end; ++t) {
+	const TraverseSegments & segs = m_TraverseSegments[t];
+	int i;
+	for (i = 0; i < 6; ++i) {
+	    if (box_plane_max(planes[i], segs.min, segs.max) < 0) break;
+	}
+	if (i < 6) continue;
+
+	int level = 0;
+	double pixel_size = box_plane_min(pixel_plane, segs.min, segs.max);
+	if (pixel_size > 0) level = LevelOfDetail(pixel_size);
+	ranges.add(segs.first[level], segs.count[level]);
+    }
+}
+
+void GfxCore::DrawUndergroundLegs()
+{
+    if (!m_LegSegmentsValid) GenerateLegSegments();
+
+    // -1 for COLOUR_BY_NONE, which DrawSegments() draws in the current
+    // colour.
+    int colouring = m_ColourBy - COLOUR_BY_DEPTH;
+    GLASegmentRanges ranges;
     if (m_Splays == SPLAYS_SHOW_FADED) {
+	GetLegRanges(0, m_SplayTraversesEnd, ranges);
 	SetAlpha(0.4);
-	while (trav != tend) {
-	    if ((*trav).isSplay)
-		(this->*AddPoly)(*trav);
-	    ++trav;
-	}
+	SetColour(col_WHITE);
+	DrawSegments(m_LegSegments, ranges, colouring);
 	SetAlpha(1.0);
-	trav = m_Parent->traverses_begin();
     }
 
-    while (trav != tend) {
-	if (m_Splays == SPLAYS_SHOW_NORMAL || !(*trav).isSplay)
-	    (this->*AddPoly)(*trav);
-	++trav;
-    }
+    size_t first = (m_Splays == SPLAYS_SHOW_NORMAL) ? 0 : m_SplayTraversesEnd;
+    GetLegRanges(first, m_UndergroundTraversesEnd, ranges);
+    SetColour(col_WHITE);
+    DrawSegments(m_LegSegments, ranges, colouring);
+}
+
+void GfxCore::DrawSurfaceLegs()
+{
+    if (!m_LegSegmentsValid) GenerateLegSegments();
+
+    // Surface legs are only coloured by error.
+    int colouring = -1;
+    if (m_ColourBy == COLOUR_BY_ERROR)
+	colouring = COLOUR_BY_ERROR - COLOUR_BY_DEPTH;
+    GLASegmentRanges ranges;
+    GetLegRanges(m_UndergroundTraversesEnd, m_TraverseSegments.size(), ranges);
+    EnableDashedLines();
+    SetColour(col_WHITE);
+    DrawSegments(m_LegSegments, ranges, colouring);
+    DisableDashedLines();
 }
 
 void GfxCore::GenerateDisplayListTubes()
@@ -2452,27 +2899,32 @@ void GfxCore::GenerateDisplayListTubes()
     // Generate the display list for the tubes.
     list<vector<XSect> >::iterator trav = m_Parent->tubes_begin();
     list<vector<XSect> >::iterator tend = m_Parent->tubes_end();
-    while (trav != tend) {
-	SkinPassage(*trav);
-	++trav;
+    if (m_TubesLevel == 0) {
+	while (trav != tend) {
+	    SkinPassage(*trav);
+	    ++trav;
+	}
+	return;
     }
-}
 
-void GfxCore::GenerateDisplayListSurface()
-{
-    // Generate the display list for the surface legs.
-    EnableDashedLines();
-    list<traverse>::const_iterator trav = m_Parent->surface_traverses_begin();
-    list<traverse>::const_iterator tend = m_Parent->surface_traverses_end();
-    while (trav != tend) {
-	if (m_ColourBy == COLOUR_BY_ERROR) {
-	    AddPolylineError(*trav);
-	} else {
-	    AddPolyline(*trav);
+    if (m_TubeErrors.empty()) {
+	for ( ; trav != tend; ++trav) {
+	    m_TubeErrors.push_back(vector<float>());
+	    simplification_errors(*trav, m_TubeErrors.back());
 	}
-	++trav;
+	trav = m_Parent->tubes_begin();
+    }
+
+    float max_error = float(LevelOfDetailError(m_TubesLevel));
+    vector<vector<float> >::const_iterator errors = m_TubeErrors.begin();
+    vector<XSect> simplified;
+    for ( ; trav != tend; ++trav, ++errors) {
+	simplified.clear();
+	for (size_t i = 0; i != trav->size(); ++i) {
+	    if ((*errors)[i] > max_error) simplified.push_back((*trav)[i]);
+	}
+	SkinPassage(simplified);
     }
-    DisableDashedLines();
 }
 
 void GfxCore::GenerateDisplayListShadow()
@@ -2486,29 +2938,70 @@ void GfxCore::GenerateDisplayListShadow()
     }
 }
 
+// Swap the byte order of n 16-bit values.  This is simple enough for the
+// compiler to vectorise.
+static void
+swap_bytes16(unsigned short * p, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+	p[i] = (p[i] >> 8) | (p[i] << 8);
+    }
+}
+
+void GfxCore::DEMTile::GetRow(size_t x, size_t y, size_t n, short * out) const
+{
+    memcpy(out, data + (x + y * width) * 2, n * 2);
+    if (bigendian != MACHINE_BIGENDIAN)
+	swap_bytes16(reinterpret_cast<unsigned short *>(out), n);
+}
+
+void GfxCore::DEMTile::Free()
+{
+#ifdef HAVE_MMAP
+    if (mapping) {
+	munmap(mapping, mapping_size);
+	mapping = NULL;
+	data = NULL;
+	return;
+    }
+#endif
+    delete [] data;
+    data = NULL;
+}
+
+void GfxCore::FreeDEM()
+{
+    vector<DEMTile>::iterator i;
+    for (i = dem.begin(); i != dem.end(); ++i) {
+	i->Free();
+    }
+    dem.clear();
+}
+
 void
-GfxCore::parse_hgt_filename(const wxString & lc_name)
+GfxCore::parse_hgt_filename(const wxString & lc_name, DEMTile & tile)
 {
     char * leaf = leaf_from_fnm(lc_name.utf8_str());
     const char * p = leaf;
     char * q;
     char dirn = *p++;
-    o_y = strtoul(p, &q, 10);
+    tile.o_y = strtoul(p, &q, 10);
     p = q;
     if (dirn == 's')
-	o_y = -o_y;
-    ++o_y;
+	tile.o_y = -tile.o_y;
+    ++tile.o_y;
     dirn = *p++;
-    o_x = strtoul(p, &q, 10);
+    tile.o_x = strtoul(p, &q, 10);
     if (dirn == 'w')
-	o_x = -o_x;
-    bigendian = true;
-    nodata_value = -32768;
+	tile.o_x = -tile.o_x;
+    tile.bigendian = true;
+    tile.nodata_value = -32768;
     osfree(leaf);
 }
 
 size_t
-GfxCore::parse_hdr(wxInputStream & is, unsigned long & skipbytes)
+GfxCore::parse_hdr(wxInputStream & is, unsigned long & skipbytes,
+		   DEMTile & tile)
 {
     unsigned long nbits;
     while (!is.Eof()) {
@@ -2528,32 +3021,91 @@ err += wxT("Unexpected value for " X); \
 	unsigned long dummy;
 	if (false) {
 	// I = little-endian; M = big-endian
-	CHECK("BYTEORDER", (bigendian = (line[v] == 'M')) || line[v] == 'I')
+	CHECK("BYTEORDER", (tile.bigendian = (line[v] == 'M')) || line[v] == 'I')
 	CHECK("LAYOUT", line.substr(v) == wxT("BIL"))
-	CHECK("NROWS", line.substr(v).ToCULong(&dem_width))
-	CHECK("NCOLS", line.substr(v).ToCULong(&dem_height))
+	CHECK("NROWS", line.substr(v).ToCULong(&tile.width))
+	CHECK("NCOLS", line.substr(v).ToCULong(&tile.height))
 	CHECK("NBANDS", line.substr(v).ToCULong(&dummy) && dummy == 1)
 	CHECK("NBITS", line.substr(v).ToCULong(&nbits) && nbits == 16)
 	//: BANDROWBYTES   7202
 	//: TOTALROWBYTES  7202
 	// PIXELTYPE is a GDAL extension, so may not be present.
 	CHECK("PIXELTYPE", line.substr(v) == wxT("SIGNEDINT"))
-	CHECK("ULXMAP", line.substr(v).ToCDouble(&o_x))
-	CHECK("ULYMAP", line.substr(v).ToCDouble(&o_y))
-	CHECK("XDIM", line.substr(v).ToCDouble(&step_x))
-	CHECK("YDIM", line.substr(v).ToCDouble(&step_y))
-	CHECK("NODATA", line.substr(v).ToCLong(&nodata_value))
+	CHECK("ULXMAP", line.substr(v).ToCDouble(&tile.o_x))
+	CHECK("ULYMAP", line.substr(v).ToCDouble(&tile.o_y))
+	CHECK("XDIM", line.substr(v).ToCDouble(&tile.step_x))
+	CHECK("YDIM", line.substr(v).ToCDouble(&tile.step_y))
+	CHECK("NODATA", line.substr(v).ToCLong(&tile.nodata_value))
 	CHECK("SKIPBYTES", line.substr(v).ToCULong(&skipbytes))
 	}
 	if (!err.empty()) {
 	    wxMessageBox(err);
 	}
     }
-    return ((nbits + 7) / 8) * dem_width * dem_height;
+    return ((nbits + 7) / 8) * tile.width * tile.height;
 }
 
 bool
-GfxCore::read_bil(wxInputStream & is, size_t size, unsigned long skipbytes)
+GfxCore::check_dem_size(DEMTile & tile, size_t size)
+{
+    if (tile.width == 0 && tile.height == 0) {
+	tile.width = tile.height = sqrt(size / 2);
+	if (tile.width * tile.height * 2 != size) {
+	    wxMessageBox(wxT("HGT format data doesn't form a square"));
+	    return false;
+	}
+	// The first and last rows and columns are on the edges of the
+	// square, and shared with the adjacent tiles.
+	tile.step_x = tile.step_y = 1.0 / (tile.width - 1);
+    } else if (tile.width * tile.height * 2 > size) {
+	wxMessageBox(wxT("Failed to read terrain data"));
+	return false;
+    }
+    return true;
+}
+
+bool
+GfxCore::map_bil(const wxString & file, size_t size, unsigned long skipbytes,
+		 DEMTile & tile)
+{
+#ifdef HAVE_MMAP
+    // Map the file rather than reading it, so only the pages we actually
+    // look at get read, and the OS can drop them again if memory is short.
+    wxFile f(file);
+    if (!f.IsOpened()) return false;
+    wxFileOffset len = f.Length();
+    if (len <= wxFileOffset(skipbytes)) return false;
+    if (!size) {
+	size = len - skipbytes;
+    } else if (wxFileOffset(size) > len - wxFileOffset(skipbytes)) {
+	// The file is too short to hold the data - reading it would run off
+	// the end of the mapping.
+	wxMessageBox(wxT("Failed to read terrain data"));
+	return true;
+    }
+    void * p = mmap(NULL, len, PROT_READ, MAP_SHARED, f.fd(), 0);
+    if (p == MAP_FAILED) return false;
+    tile.mapping = p;
+    tile.mapping_size = len;
+    tile.data = static_cast<const unsigned char *>(p) + skipbytes;
+    if (!check_dem_size(tile, size)) {
+	// We've reported the problem, so don't go on to try reading the file
+	// instead.
+	tile.Free();
+    }
+    return true;
+#else
+    (void)file;
+    (void)size;
+    (void)skipbytes;
+    (void)tile;
+    return false;
+#endif
+}
+
+bool
+GfxCore::read_bil(wxInputStream & is, size_t size, unsigned long skipbytes,
+		  DEMTile & tile)
 {
     bool know_size = true;
     if (!size) {
@@ -2564,13 +3116,13 @@ GfxCore::read_bil(wxInputStream & is, size_t size, unsigned long skipbytes)
 	    know_size = false;
 	}
     }
-    dem = new unsigned short[size / 2];
+    unsigned char * data = new unsigned char[size];
     if (skipbytes) {
 	if (is.SeekI(skipbytes, wxFromStart) == ::wxInvalidOffset) {
 	    while (skipbytes) {
 		unsigned long to_read = skipbytes;
 		if (size < to_read) to_read = size;
-		is.Read(reinterpret_cast<char *>(dem), to_read);
+		is.Read(reinterpret_cast<char *>(data), to_read);
 		size_t c = is.LastRead();
 		if (c == 0) {
 		    wxMessageBox(wxT("Failed to skip terrain data header"));
@@ -2582,19 +3134,18 @@ GfxCore::read_bil(wxInputStream & is, size_t size, unsigned long skipbytes)
     }
 
 #if wxCHECK_VERSION(2,9,5)
-    if (!is.ReadAll(dem, size)) {
+    if (!is.ReadAll(data, size)) {
 	if (know_size) {
 	    // FIXME: On __WXMSW__ currently we fail to
 	    // read any data from files in zips.
-	    delete [] dem;
-	    dem = NULL;
+	    delete [] data;
 	    wxMessageBox(wxT("Failed to read terrain data"));
 	    return false;
 	}
 	size = is.LastRead();
     }
 #else
-    char * p = reinterpret_cast<char *>(dem);
+    char * p = reinterpret_cast<char *>(data);
     while (size) {
 	is.Read(p, size);
 	size_t c = is.LastRead();
@@ -2604,8 +3155,7 @@ GfxCore::read_bil(wxInputStream & is, size_t size, unsigned long skipbytes)
 		if (size)
 		    break;
 	    }
-	    delete [] dem;
-	    dem = NULL;
+	    delete [] data;
 	    wxMessageBox(wxT("Failed to read terrain data"));
 	    return false;
 	}
@@ -2614,60 +3164,81 @@ GfxCore::read_bil(wxInputStream & is, size_t size, unsigned long skipbytes)
     }
 #endif
 
-    if (dem_width == 0 && dem_height == 0) {
-	dem_width = dem_height = sqrt(size / 2);
-	if (dem_width * dem_height * 2 != size) {
-	    delete [] dem;
-	    dem = NULL;
-	    wxMessageBox(wxT("HGT format data doesn't form a square"));
-	    return false;
-	}
-	step_x = step_y = 1.0 / dem_width;
+    tile.data = data;
+    if (!check_dem_size(tile, size)) {
+	tile.Free();
+	return false;
     }
 
+    // We have our own copy, so put it in our byte order now rather than
+    // every time we read it.
+    if (tile.bigendian != MACHINE_BIGENDIAN) {
+	swap_bytes16(reinterpret_cast<unsigned short *>(data),
+		     tile.width * tile.height);
+	tile.bigendian = MACHINE_BIGENDIAN;
+    }
     return true;
 }
 
-bool GfxCore::LoadDEM(const wxString & file)
+bool GfxCore::LoadDEM(const wxArrayString & files)
 {
     if (m_Parent->m_cs_proj.empty()) {
 	wxMessageBox(wxT("No coordinate system specified in survey data"));
 	return false;
     }
 
-    delete [] dem;
-    dem = NULL;
+    FreeDEM();
+    m_TerrainTiles.clear();
+    m_TerrainLevels.clear();
+
+    // Several files covering adjacent areas can be loaded together, and each
+    // .zip file can contain several .hgt files.
+    for (size_t i = 0; i < files.GetCount(); ++i) {
+	LoadDEMFile(files[i]);
+    }
 
+    if (dem.empty()) {
+	return false;
+    }
+
+    InvalidateList(LIST_TERRAIN);
+    ForceRefresh();
+    return true;
+}
+
+void GfxCore::LoadDEMFile(const wxString & file)
+{
+    DEMTile tile;
     size_t size = 0;
     // Default is to not skip any bytes.
     unsigned long skipbytes = 0;
-    // For .hgt files, default to using filesize to determine.
-    dem_width = dem_height = 0;
-    // ESRI say "The default byte order is the same as that of the host machine
-    // executing the software", but that's stupid so we default to
-    // little-endian.
-    bigendian = false;
 
     wxFileInputStream fs(file);
     if (!fs.IsOk()) {
 	wxMessageBox(wxT("Failed to open DEM file"));
-	return false;
+	return;
     }
 
     const wxString & lc_file = file.Lower();
     if (lc_file.EndsWith(wxT(".hgt"))) {
-	parse_hgt_filename(lc_file);
-	read_bil(fs, size, skipbytes);
+	parse_hgt_filename(lc_file, tile);
+	if (map_bil(file, size, skipbytes, tile) ||
+	    read_bil(fs, size, skipbytes, tile)) {
+	    if (tile.data) dem.push_back(tile);
+	}
     } else if (lc_file.EndsWith(wxT(".bil"))) {
 	wxString hdr_file = file;
 	hdr_file.replace(file.size() - 4, 4, wxT(".hdr"));
 	wxFileInputStream hdr_is(hdr_file);
 	if (!hdr_is.IsOk()) {
 	    wxMessageBox(wxT("Failed to open HDR file '") + hdr_file + wxT("'"));
-	    return false;
+	    return;
+	}
+	size = parse_hdr(hdr_is, skipbytes, tile);
+	if (map_bil(file, size, skipbytes, tile) ||
+	    read_bil(fs, size, skipbytes, tile)) {
+	    if (tile.data) dem.push_back(tile);
 	}
-	size = parse_hdr(hdr_is, skipbytes);
-	read_bil(fs, size, skipbytes);
     } else if (lc_file.EndsWith(wxT(".zip"))) {
 	wxZipEntry * ze_data = NULL;
 	wxZipInputStream zs(fs);
@@ -2675,32 +3246,36 @@ bool GfxCore::LoadDEM(const wxString & file)
 	while ((ze = zs.GetNextEntry()) != NULL) {
 	    if (!ze->IsDir()) {
 		const wxString & lc_name = ze->GetName().Lower();
-		if (!ze_data && lc_name.EndsWith(wxT(".hgt"))) {
+		if (lc_name.EndsWith(wxT(".hgt"))) {
 		    // SRTM .hgt files are raw binary data, with the filename
 		    // encoding the coordinates.
-		    parse_hgt_filename(lc_name);
-		    read_bil(zs, size, skipbytes);
+		    DEMTile hgt_tile;
+		    parse_hgt_filename(lc_name, hgt_tile);
+		    if (read_bil(zs, 0, 0, hgt_tile)) dem.push_back(hgt_tile);
 		    delete ze;
-		    break;
+		    continue;
 		}
 
 		if (!ze_data && lc_name.EndsWith(wxT(".bil"))) {
 		    if (size) {
-			read_bil(zs, size, skipbytes);
-			break;
+			if (read_bil(zs, size, skipbytes, tile))
+			    dem.push_back(tile);
+			delete ze;
+			continue;
 		    }
 		    ze_data = ze;
 		    continue;
 		}
 
 		if (lc_name.EndsWith(wxT(".hdr"))) {
-		    size = parse_hdr(zs, skipbytes);
+		    size = parse_hdr(zs, skipbytes, tile);
 		    if (ze_data) {
 			if (!zs.OpenEntry(*ze_data)) {
 			    wxMessageBox(wxT("Couldn't read DEM data from .zip file"));
 			    break;
 			}
-			read_bil(zs, size, skipbytes);
+			if (read_bil(zs, size, skipbytes, tile))
+			    dem.push_back(tile);
 		    }
 		} else if (lc_name.EndsWith(wxT(".prj"))) {
 		    //FIXME: check this matches the datum string we use
@@ -2718,14 +3293,6 @@ bool GfxCore::LoadDEM(const wxString & file)
 	}
 	delete ze_data;
     }
-
-    if (!dem) {
-	return false;
-    }
-
-    InvalidateList(LIST_TERRAIN);
-    ForceRefresh();
-    return true;
 }
 
 void GfxCore::DrawTerrainTriangle(const Vector3 & a, const Vector3 & b, const Vector3 & c)
@@ -2740,12 +3307,142 @@ void GfxCore::DrawTerrainTriangle(const Vector3 & a, const Vector3 & b, const Ve
     ++n_tris;
 }
 
-void GfxCore::DrawTerrain()
+void GfxCore::DrawTerrainQuad(const Vector3 & prev, const Vector3 & a,
+			      const Vector3 & b, const Vector3 & pt)
+{
+    // If all points are valid, split the quadrilateral into triangles along
+    // the shorter 3D diagonal, which typically looks better:
+    //
+    //               ----->
+    //     prev---a    x     prev---a
+    //   |   |P  /|            |\  S|
+    // y |   |  / |    or      | \  |
+    //   V   | /  |            |  \ |
+    //       |/  Q|            |R  \|
+    //       b----pt           b----pt
+    //
+    //       FORWARD           BACKWARD
+    enum { NONE = 0, P = 1, Q = 2, R = 4, S = 8, ALL = P|Q|R|S };
+    int valid =
+	((prev.GetZ() != DBL_MAX)) |
+	((a.GetZ() != DBL_MAX) << 1) |
+	((b.GetZ() != DBL_MAX) << 2) |
+	((pt.GetZ() != DBL_MAX) << 3);
+    static const int tris_map[16] = {
+	NONE, // nothing valid
+	NONE, // prev
+	NONE, // a
+	NONE, // a, prev
+	NONE, // b
+	NONE, // b, prev
+	NONE, // b, a
+	P, // b, a, prev
+	NONE, // pt
+	NONE, // pt, prev
+	NONE, // pt, a
+	S, // pt, a, prev
+	NONE, // pt, b
+	R, // pt, b, prev
+	Q, // pt, b, a
+	ALL, // pt, b, a, prev
+    };
+    int tris = tris_map[valid];
+    if (tris == ALL) {
+	// All points valid.
+	if ((a - b).magnitude() < (prev - pt).magnitude()) {
+	    tris = P | Q;
+	} else {
+	    tris = R | S;
+	}
+    }
+    if (tris & P)
+	DrawTerrainTriangle(a, prev, b);
+    if (tris & Q)
+	DrawTerrainTriangle(a, b, pt);
+    if (tris & R)
+	DrawTerrainTriangle(pt, prev, b);
+    if (tris & S)
+	DrawTerrainTriangle(a, prev, pt);
+}
+
+Vector3 GfxCore::TerrainTile::GetPoint(unsigned i, unsigned j) const
 {
-    if (!dem) return;
+    const float * p = &points[(i + j * (w + 1)) * 3];
+    if (p[2] == FLT_MAX) return Vector3(DBL_MAX, DBL_MAX, DBL_MAX);
+    return Vector3(p[0], p[1], p[2]);
+}
 
-    wxBusyCursor hourglass;
+bool GfxCore::TerrainTile::AllValid(unsigned i0, unsigned j0,
+				    unsigned i1, unsigned j1) const
+{
+    if (all_valid) return true;
+    for (unsigned j = j0; j <= j1; ++j) {
+	for (unsigned i = i0; i <= i1; ++i) {
+	    if (points[(i + j * (w + 1)) * 3 + 2] == FLT_MAX) return false;
+	}
+    }
+    return true;
+}
 
+float GfxCore::TerrainTile::Error(unsigned step) const
+{
+    // Find how far the points are from the surface through every step-th
+    // point (interpolated bilinearly, which is close enough to the
+    // triangles we actually draw).  Cells with points missing get split
+    // into cells from finer levels when drawn, so don't count here.
+    double max_d2 = 0.0;
+    for (unsigned j0 = 0; j0 < h; j0 += step) {
+	unsigned j1 = std::min(j0 + step, h);
+	for (unsigned i0 = 0; i0 < w; i0 += step) {
+	    unsigned i1 = std::min(i0 + step, w);
+	    if (!AllValid(i0, j0, i1, j1)) continue;
+	    const float * p00 = &points[(i0 + j0 * (w + 1)) * 3];
+	    const float * p10 = &points[(i1 + j0 * (w + 1)) * 3];
+	    const float * p01 = &points[(i0 + j1 * (w + 1)) * 3];
+	    const float * p11 = &points[(i1 + j1 * (w + 1)) * 3];
+	    for (unsigned j = j0; j <= j1; ++j) {
+		double fj = double(j - j0) / (j1 - j0);
+		for (unsigned i = i0; i <= i1; ++i) {
+		    double fi = double(i - i0) / (i1 - i0);
+		    const float * p = &points[(i + j * (w + 1)) * 3];
+		    double d2 = 0.0;
+		    for (int axis = 0; axis < 3; ++axis) {
+			double top = p00[axis] * (1 - fi) + p10[axis] * fi;
+			double bottom = p01[axis] * (1 - fi) + p11[axis] * fi;
+			d2 += sqrd(top * (1 - fj) + bottom * fj - p[axis]);
+		    }
+		    if (d2 > max_d2) max_d2 = d2;
+		}
+	    }
+	}
+    }
+    return float(sqrt(max_d2));
+}
+
+// Check if the projected corners of a terrain tile show it's entirely more
+// than sqrt(r_sqrd) horizontally from the survey.  We allow a generous margin
+// as the points in between won't project exactly onto the box.
+static bool
+corners_beyond(const double * x, const double * y, const Vector3 & off,
+	       double r_sqrd)
+{
+    double min_x = DBL_MAX, max_x = -DBL_MAX;
+    double min_y = DBL_MAX, max_y = -DBL_MAX;
+    for (int c = 0; c < 4; ++c) {
+	if (x[c] == HUGE_VAL) return false;
+	min_x = min(min_x, x[c] - off.GetX());
+	max_x = max(max_x, x[c] - off.GetX());
+	min_y = min(min_y, y[c] - off.GetY());
+	max_y = max(max_y, y[c] - off.GetY());
+    }
+    double margin = 0.25 * sqrt(sqrd(max_x - min_x) + sqrd(max_y - min_y));
+    double d_x = max(0.0, max(min_x - margin, -max_x - margin));
+    double d_y = max(0.0, max(min_y - margin, -max_y - margin));
+    return sqrd(d_x) + sqrd(d_y) > r_sqrd;
+}
+
+bool GfxCore::GenerateTerrainTiles()
+{
     // Draw terrain to twice the extent, or at least 1km.
     double r_sqrd = sqrd(max(m_Parent->GetExtent().magnitude(), 1000.0));
 #define WGS84_DATUM_STRING "+proj=longlat +ellps=WGS84 +datum=WGS84"
@@ -2753,110 +3450,188 @@ void GfxCore::DrawTerrain()
     if (!pj_in) {
 	ToggleTerrain();
 	error(/*Failed to initialise input coordinate system “%s”*/287, WGS84_DATUM_STRING);
-	return;
+	return false;
     }
     static projPJ pj_out = pj_init_plus(m_Parent->m_cs_proj.c_str());
     if (!pj_out) {
 	ToggleTerrain();
 	error(/*Failed to initialise output coordinate system “%s”*/288, (const char *)m_Parent->m_cs_proj.c_str());
-	return;
+	return false;
     }
-    n_tris = 0;
-    SetAlpha(0.3);
-    BeginTriangles();
+
     const Vector3 & off = m_Parent->GetOffset();
-    vector<Vector3> prevcol(dem_height + 1);
-    for (size_t x = 0; x < dem_width; ++x) {
-	double X_ = (o_x + x * step_x) * DEG_TO_RAD;
-	Vector3 prev;
-	for (size_t y = 0; y < dem_height; ++y) {
-	    unsigned short elev = dem[x + y * dem_width];
-#ifdef WORDS_BIGENDIAN
-	    const bool MACHINE_BIGENDIAN = true;
-#else
-	    const bool MACHINE_BIGENDIAN = false;
-#endif
-	    if (bigendian != MACHINE_BIGENDIAN) {
-#if defined __GNUC__ && (__GNUC__ * 100 + __GNUC_MINOR__ >= 408)
-		elev = __builtin_bswap16(elev);
-#else
-		elev = (elev >> 8) | (elev << 8);
-#endif
-	    }
-	    double Z = (short)elev;
-	    Vector3 pt;
-	    if (Z == nodata_value) {
-		pt = Vector3(DBL_MAX, DBL_MAX, DBL_MAX);
-	    } else {
-		double X = X_;
-		double Y = (o_y - y * step_y) * DEG_TO_RAD;
-		pj_transform(pj_in, pj_out, 1, 1, &X, &Y, &Z);
-		pt = Vector3(X, Y, Z) - off;
-		double dist_2 = sqrd(pt.GetX()) + sqrd(pt.GetY());
-		if (dist_2 > r_sqrd) {
-		    pt = Vector3(DBL_MAX, DBL_MAX, DBL_MAX);
+    // We project each tile's points with a single call to pj_transform(),
+    // which is much faster than a call per point.
+    vector<double> X, Y, Z;
+    vector<short> heights;
+    vector<DEMTile>::const_iterator d;
+    for (d = dem.begin(); d != dem.end(); ++d) {
+	if (d->width < 2 || d->height < 2) continue;
+	size_t n_x = (d->width - 2) / TERRAIN_TILE_SIZE + 1;
+	size_t n_y = (d->height - 2) / TERRAIN_TILE_SIZE + 1;
+	m_TerrainTiles.reserve(m_TerrainTiles.size() + n_x * n_y);
+	for (size_t t_x = 0; t_x < n_x; ++t_x) {
+	    for (size_t t_y = 0; t_y < n_y; ++t_y) {
+		size_t x0 = t_x * TERRAIN_TILE_SIZE;
+		size_t y0 = t_y * TERRAIN_TILE_SIZE;
+		unsigned w = min(size_t(TERRAIN_TILE_SIZE),
+				 size_t(d->width - 1 - x0));
+		unsigned h = min(size_t(TERRAIN_TILE_SIZE),
+				 size_t(d->height - 1 - y0));
+
+		// Skip tiles which are clearly too far from the survey
+		// without reading their heights, so the parts of a mapped
+		// file away from the survey never need to be paged in.
+		double c_x[4], c_y[4], c_z[4] = { 0, 0, 0, 0 };
+		for (int c = 0; c < 4; ++c) {
+		    size_t x = x0 + ((c & 1) ? w : 0);
+		    size_t y = y0 + ((c & 2) ? h : 0);
+		    c_x[c] = (d->o_x + x * d->step_x) * DEG_TO_RAD;
+		    c_y[c] = (d->o_y - y * d->step_y) * DEG_TO_RAD;
 		}
-	    }
-	    if (x > 0 && y > 0) {
-		const Vector3 & a = prevcol[y - 1];
-		const Vector3 & b = prevcol[y];
-		// If all points are valid, split the quadrilateral into
-		// triangles along the shorter 3D diagonal, which typically
-		// looks better:
-		//
-		//               ----->
-		//     prev---a    x     prev---a
-		//   |   |P  /|            |\  S|
-		// y |   |  / |    or      | \  |
-		//   V   | /  |            |  \ |
-		//       |/  Q|            |R  \|
-		//       b----pt           b----pt
-		//
-		//       FORWARD           BACKWARD
-		enum { NONE = 0, P = 1, Q = 2, R = 4, S = 8, ALL = P|Q|R|S };
-		int valid =
-		    ((prev.GetZ() != DBL_MAX)) |
-		    ((a.GetZ() != DBL_MAX) << 1) |
-		    ((b.GetZ() != DBL_MAX) << 2) |
-		    ((pt.GetZ() != DBL_MAX) << 3);
-		static const int tris_map[16] = {
-		    NONE, // nothing valid
-		    NONE, // prev
-		    NONE, // a
-		    NONE, // a, prev
-		    NONE, // b
-		    NONE, // b, prev
-		    NONE, // b, a
-		    P, // b, a, prev
-		    NONE, // pt
-		    NONE, // pt, prev
-		    NONE, // pt, a
-		    S, // pt, a, prev
-		    NONE, // pt, b
-		    R, // pt, b, prev
-		    Q, // pt, b, a
-		    ALL, // pt, b, a, prev
-		};
-		int tris = tris_map[valid];
-		if (tris == ALL) {
-		    // All points valid.
-		    if ((a - b).magnitude() < (prev - pt).magnitude()) {
-			tris = P | Q;
-		    } else {
-			tris = R | S;
+		pj_transform(pj_in, pj_out, 4, 1, c_x, c_y, c_z);
+		if (corners_beyond(c_x, c_y, off, r_sqrd)) continue;
+
+		size_t n = (w + 1) * (h + 1);
+		X.resize(n);
+		Y.resize(n);
+		Z.resize(n);
+		heights.resize(w + 1);
+		size_t k = 0;
+		for (unsigned j = 0; j <= h; ++j) {
+		    size_t y = y0 + j;
+		    d->GetRow(x0, y, w + 1, &heights[0]);
+		    for (unsigned i = 0; i <= w; ++i) {
+			size_t x = x0 + i;
+			Z[k] = heights[i];
+			if (Z[k] == d->nodata_value) {
+			    // pj_transform() skips points with X set to
+			    // HUGE_VAL.
+			    X[k] = Y[k] = HUGE_VAL;
+			} else {
+			    X[k] = (d->o_x + x * d->step_x) * DEG_TO_RAD;
+			    Y[k] = (d->o_y - y * d->step_y) * DEG_TO_RAD;
+			}
+			++k;
 		    }
 		}
-		if (tris & P)
-		    DrawTerrainTriangle(a, prev, b);
-		if (tris & Q)
-		    DrawTerrainTriangle(a, b, pt);
-		if (tris & R)
-		    DrawTerrainTriangle(pt, prev, b);
-		if (tris & S)
-		    DrawTerrainTriangle(a, prev, pt);
+		pj_transform(pj_in, pj_out, n, 1, &X[0], &Y[0], &Z[0]);
+
+		m_TerrainTiles.push_back(TerrainTile());
+		TerrainTile & tile = m_TerrainTiles.back();
+		tile.w = w;
+		tile.h = h;
+		tile.points.resize(n * 3);
+		for (int axis = 0; axis < 3; ++axis) {
+		    tile.min[axis] = FLT_MAX;
+		    tile.max[axis] = -FLT_MAX;
+		}
+		size_t n_valid = 0;
+		for (k = 0; k < n; ++k) {
+		    float * p = &tile.points[k * 3];
+		    p[2] = FLT_MAX;
+		    if (X[k] == HUGE_VAL) continue;
+		    Vector3 pt = Vector3(X[k], Y[k], Z[k]) - off;
+		    double dist_2 = sqrd(pt.GetX()) + sqrd(pt.GetY());
+		    if (dist_2 > r_sqrd) continue;
+		    p[0] = pt.GetX();
+		    p[1] = pt.GetY();
+		    p[2] = pt.GetZ();
+		    for (int axis = 0; axis < 3; ++axis) {
+			if (p[axis] < tile.min[axis]) tile.min[axis] = p[axis];
+			if (p[axis] > tile.max[axis]) tile.max[axis] = p[axis];
+		    }
+		    ++n_valid;
+		}
+
+		if (n_valid == 0) {
+		    // Nothing to draw in this tile.
+		    m_TerrainTiles.pop_back();
+		    continue;
+		}
+
+		tile.all_valid = (n_valid == n);
+		tile.error[0] = 0.0f;
+		for (int level = 1; level < TERRAIN_LEVELS; ++level) {
+		    float e = tile.Error(1u << level);
+		    // Make sure a coarser level never claims to be more
+		    // accurate.
+		    tile.error[level] = max(e, tile.error[level - 1]);
+		}
+	    }
+	}
+    }
+    return true;
+}
+
+void GfxCore::DrawTerrainCell(const TerrainTile & tile,
+			      unsigned i0, unsigned j0, unsigned step)
+{
+    unsigned i1 = min(i0 + step, tile.w);
+    unsigned j1 = min(j0 + step, tile.h);
+    if (step == 1 || tile.AllValid(i0, j0, i1, j1)) {
+	DrawTerrainQuad(tile.GetPoint(i0, j0), tile.GetPoint(i1, j0),
+			tile.GetPoint(i0, j1), tile.GetPoint(i1, j1));
+	return;
+    }
+
+    // Some points are missing, so split the cell into four, recursively.
+    // Each smaller cell is in the grid for a finer level of detail, and its
+    // error was included in that level's error.
+    step /= 2;
+    for (unsigned i = i0; i < i1; i += step) {
+	for (unsigned j = j0; j < j1; j += step) {
+	    DrawTerrainCell(tile, i, j, step);
+	}
+    }
+}
+
+void GfxCore::GetTerrainLevels(vector<int> & levels) const
+{
+    // Draw each tile at the coarsest level of detail which is within half
+    // a pixel at the nearest point of its bounding box.  With perspective
+    // on, this gives less detail further away.
+    double pixel_plane[4];
+    GetPixelSizePlane(pixel_plane);
+
+    levels.resize(m_TerrainTiles.size());
+    for (size_t t = 0; t != m_TerrainTiles.size(); ++t) {
+	const TerrainTile & tile = m_TerrainTiles[t];
+	int level = 0;
+	double pixel_size = box_plane_min(pixel_plane, tile.min, tile.max);
+	if (pixel_size > 0) {
+	    double max_error = pixel_size * LOD_MAX_PIXEL_ERROR;
+	    while (level + 1 < TERRAIN_LEVELS &&
+		   tile.error[level + 1] <= max_error) {
+		++level;
+	    }
+	}
+	levels[t] = level;
+    }
+}
+
+void GfxCore::DrawTerrain()
+{
+    if (dem.empty()) return;
+
+    if (m_TerrainTiles.empty()) {
+	wxBusyCursor hourglass;
+	if (!GenerateTerrainTiles()) return;
+    }
+
+    GetTerrainLevels(m_TerrainLevels);
+
+    n_tris = 0;
+    SetAlpha(0.3);
+    BeginTriangles();
+    for (size_t t = 0; t != m_TerrainTiles.size(); ++t) {
+	const TerrainTile & tile = m_TerrainTiles[t];
+	// Use every step-th column and row, plus the last.
+	unsigned step = 1u << m_TerrainLevels[t];
+	for (unsigned i = 0; i < tile.w; i += step) {
+	    for (unsigned j = 0; j < tile.h; j += step) {
+		DrawTerrainCell(tile, i, j, step);
 	    }
-	    prev = prevcol[y];
-	    prevcol[y].assign(pt);
 	}
     }
     EndTriangles();
@@ -2872,7 +3647,7 @@ void GfxCore::GenerateBlobsDisplayList()
 
     // Plot blobs.
     gla_colour prev_col = col_BLACK; // not a colour used for blobs
-    list<LabelInfo*>::const_iterator pos = m_Parent->GetLabels();
+    vector<LabelInfo*>::const_iterator pos = m_Parent->GetLabels();
     BeginBlobs();
     while (pos != m_Parent->GetLabelsEnd()) {
 	const LabelInfo* label = *pos++;
@@ -3063,20 +3838,6 @@ Double GfxCore::GetDepthBoundaryBetweenBands(int a, int b) const
     return (z_ext * band / (GetNumColourBands() - 1)) + m_Parent->GetDepthMin();
 }
 
-void GfxCore::AddPolyline(const traverse & centreline)
-{
-    BeginPolyline();
-    SetColour(col_WHITE);
-    vector<PointInfo>::const_iterator i = centreline.begin();
-    PlaceVertex(*i);
-    ++i;
-    while (i != centreline.end()) {
-	PlaceVertex(*i);
-	++i;
-    }
-    EndPolyline();
-}
-
 void GfxCore::AddPolylineShadow(const traverse & centreline)
 {
     BeginPolyline();
@@ -3091,28 +3852,6 @@ void GfxCore::AddPolylineShadow(const traverse & centreline)
     EndPolyline();
 }
 
-void GfxCore::AddPolylineDepth(const traverse & centreline)
-{
-    BeginPolyline();
-    vector<PointInfo>::const_iterator i, prev_i;
-    i = centreline.begin();
-    int band0 = GetDepthColour(i->GetZ());
-    PlaceVertexWithDepthColour(*i);
-    prev_i = i;
-    ++i;
-    while (i != centreline.end()) {
-	int band = GetDepthColour(i->GetZ());
-	if (band != band0) {
-	    SplitLineAcrossBands(band0, band, *prev_i, *i);
-	    band0 = band;
-	}
-	PlaceVertexWithDepthColour(*i);
-	prev_i = i;
-	++i;
-    }
-    EndPolyline();
-}
-
 void GfxCore::AddQuadrilateral(const Vector3 &a, const Vector3 &b,
 			       const Vector3 &c, const Vector3 &d)
 {
@@ -3194,30 +3933,6 @@ void GfxCore::SetColourFromDate(int date, Double factor)
     SetColourFrom01(how_far, factor);
 }
 
-void GfxCore::AddPolylineDate(const traverse & centreline)
-{
-    BeginPolyline();
-    vector<PointInfo>::const_iterator i, prev_i;
-    i = centreline.begin();
-    int date = i->GetDate();
-    SetColourFromDate(date, 1.0);
-    PlaceVertex(*i);
-    prev_i = i;
-    while (++i != centreline.end()) {
-	int newdate = i->GetDate();
-	if (newdate != date) {
-	    EndPolyline();
-	    BeginPolyline();
-	    date = newdate;
-	    SetColourFromDate(date, 1.0);
-	    PlaceVertex(*prev_i);
-	}
-	PlaceVertex(*i);
-	prev_i = i;
-    }
-    EndPolyline();
-}
-
 static int static_date_hack; // FIXME
 
 void GfxCore::AddQuadrilateralDate(const Vector3 &a, const Vector3 &b,
@@ -3275,17 +3990,6 @@ void GfxCore::AddQuadrilateralError(const Vector3 &a, const Vector3 &b,
     EndQuadrilaterals();
 }
 
-void GfxCore::AddPolylineError(const traverse & centreline)
-{
-    BeginPolyline();
-    SetColourFromError(centreline.E, 1.0);
-    vector<PointInfo>::const_iterator i;
-    for(i = centreline.begin(); i != centreline.end(); ++i) {
-	PlaceVertex(*i);
-    }
-    EndPolyline();
-}
-
 // gradient is in *radians*.
 void GfxCore::SetColourFromGradient(double gradient, Double factor)
 {
@@ -3297,21 +4001,6 @@ void GfxCore::SetColourFromGradient(double gradient, Double factor)
     SetColourFrom01(how_far, factor);
 }
 
-void GfxCore::AddPolylineGradient(const traverse & centreline)
-{
-    vector<PointInfo>::const_iterator i, prev_i;
-    i = centreline.begin();
-    prev_i = i;
-    while (++i != centreline.end()) {
-	BeginPolyline();
-	SetColourFromGradient((*i - *prev_i).gradient(), 1.0);
-	PlaceVertex(*prev_i);
-	PlaceVertex(*i);
-	prev_i = i;
-	EndPolyline();
-    }
-}
-
 static double static_gradient_hack; // FIXME
 
 void GfxCore::AddQuadrilateralGradient(const Vector3 &a, const Vector3 &b,
@@ -3358,21 +4047,6 @@ void GfxCore::SetColourFrom01(double how_far, Double factor)
     SetColour(pen1, factor);
 }
 
-void GfxCore::AddPolylineLength(const traverse & centreline)
-{
-    vector<PointInfo>::const_iterator i, prev_i;
-    i = centreline.begin();
-    prev_i = i;
-    while (++i != centreline.end()) {
-	BeginPolyline();
-	SetColourFromLength((*i - *prev_i).magnitude(), 1.0);
-	PlaceVertex(*prev_i);
-	PlaceVertex(*i);
-	prev_i = i;
-	EndPolyline();
-    }
-}
-
 static double static_length_hack; // FIXME
 
 void GfxCore::AddQuadrilateralLength(const Vector3 &a, const Vector3 &b,
@@ -3694,32 +4368,26 @@ void GfxCore::SetColourBy(int colour_by) {
     switch (colour_by) {
 	case COLOUR_BY_DEPTH:
 	    AddQuad = &GfxCore::AddQuadrilateralDepth;
-	    AddPoly = &GfxCore::AddPolylineDepth;
 	    break;
 	case COLOUR_BY_DATE:
 	    AddQuad = &GfxCore::AddQuadrilateralDate;
-	    AddPoly = &GfxCore::AddPolylineDate;
 	    break;
 	case COLOUR_BY_ERROR:
 	    AddQuad = &GfxCore::AddQuadrilateralError;
-	    AddPoly = &GfxCore::AddPolylineError;
 	    break;
 	case COLOUR_BY_GRADIENT:
 	    AddQuad = &GfxCore::AddQuadrilateralGradient;
-	    AddPoly = &GfxCore::AddPolylineGradient;
 	    break;
 	case COLOUR_BY_LENGTH:
 	    AddQuad = &GfxCore::AddQuadrilateralLength;
-	    AddPoly = &GfxCore::AddPolylineLength;
 	    break;
 	default: // case COLOUR_BY_NONE:
 	    AddQuad = &GfxCore::AddQuadrilateral;
-	    AddPoly = &GfxCore::AddPolyline;
 	    break;
     }
 
-    InvalidateList(LIST_UNDERGROUND_LEGS);
-    InvalidateList(LIST_SURFACE_LEGS);
+    // The legs don't need regenerating as they include the colours for
+    // every way of colouring them.
     InvalidateList(LIST_TUBES);
 
     ForceRefresh();
@@ -3727,9 +4395,8 @@ void GfxCore::SetColourBy(int colour_by) {
 
 bool GfxCore::ExportMovie(const wxString & fnm)
 {
-    int width;
-    int height;
-    GetSize(&width, &height);
+    int width = GetXSize();
+    int height = GetYSize();
     // Round up to next multiple of 2 (required by ffmpeg).
     width += (width & 1);
     height += (height & 1);
@@ -3749,6 +4416,64 @@ bool GfxCore::ExportMovie(const wxString & fnm)
     return true;
 }
 
+void GfxCore::RenderAndExit(const wxString & image, const wxString & movie_fnm,
+			    int width, int height)
+{
+    // We render once OpenGL has been initialised - see OnIdle().
+    batch_image = image;
+    batch_movie = movie_fnm;
+    batch_width = width;
+    batch_height = height;
+}
+
+void GfxCore::RunBatch()
+{
+    wxString image = batch_image;
+    wxString movie_fnm = batch_movie;
+    batch_image = wxString();
+    batch_movie = wxString();
+
+    int width = batch_width;
+    int height = batch_height;
+    if (width <= 0 || height <= 0) {
+	width = GetXSize();
+	height = GetYSize();
+    }
+    if (!movie_fnm.empty()) {
+	// Round up to next multiple of 2 (required by ffmpeg).
+	width += (width & 1);
+	height += (height & 1);
+    }
+
+    // Render into a framebuffer object if we can, so the output doesn't
+    // depend on the size of the window or whether it's visible.  Otherwise
+    // we render in the window.
+    bool use_framebuffer = StartFramebuffer(width, height);
+
+    PresentationMark mark = m_Parent->GetPresMark(MARK_FIRST);
+    if (mark.is_valid()) SetView(mark);
+
+    if (!image.empty()) {
+	Render();
+	if (!SaveScreenshot(image, wxBITMAP_TYPE_PNG)) {
+	    wxGetApp().ReportError(wxString::Format(wmsg(/*Error writing to file “%s”*/110), image.c_str()));
+	}
+    }
+
+    if (!movie_fnm.empty() && ExportMovie(movie_fnm)) {
+	// Render each frame in turn rather than waiting for paint events,
+	// which we won't get if the window isn't visible.  Animate() adds
+	// the frame to the movie, and closes it after the last one.
+	while (movie) {
+	    Render();
+	    Animate();
+	}
+    }
+
+    if (use_framebuffer) EndFramebuffer();
+    m_Parent->Close();
+}
+
 void
 GfxCore::OnPrint(const wxString &filename, const wxString &title,
 		 const wxString &datestamp, time_t datestamp_numeric,
@@ -32,6 +32,7 @@
 #include "img_hosted.h"
 
 #include "guicontrol.h"
+#include "labelindex.h"
 #include "labelinfo.h"
 #include "vector3.h"
 #include "wx.h"
@@ -113,6 +114,17 @@ enum {
 // This is the maximum framerate we'll redraw at.
 const int MAX_FRAMERATE = 50;
 
+// The number of levels of detail we simplify legs and tubes to.  Level 0 is
+// full detail.
+const int LOD_LEVELS = 8;
+
+// Terrain is split into tiles of up to this many DEM squares each way.
+const unsigned TERRAIN_TILE_SIZE = 64;
+
+// Terrain tiles can be drawn using every point, every 2nd point, every 4th
+// point, and so on up to just their corners.
+const int TERRAIN_LEVELS = 7;
+
 class GfxCore : public GLACanvas {
     Double m_Scale;
     Double initial_scale;
@@ -128,9 +140,7 @@ class GfxCore : public GLACanvas {
 	LIST_ERROR_KEY,
 	LIST_GRADIENT_KEY,
 	LIST_LENGTH_KEY,
-	LIST_UNDERGROUND_LEGS,
 	LIST_TUBES,
-	LIST_SURFACE_LEGS,
 	LIST_BLOBS,
 	LIST_CROSSES,
 	LIST_GRID,
@@ -190,6 +200,10 @@ private:
     int m_ColourBy;
 
     bool m_HaveData;
+    // While a file is loading, we draw a plan of the legs read so far.
+    bool m_Previewing;
+    vector<wxRealPoint> m_PreviewLegs;
+    Double m_PreviewXMin, m_PreviewXMax, m_PreviewYMin, m_PreviewYMax;
     bool m_HaveTerrain;
     bool m_MouseOutsideCompass;
     bool m_MouseOutsideElev;
@@ -208,8 +222,11 @@ private:
     bool m_HitTestDebug;
     bool m_RenderStats;
 
-    list<LabelInfo*> *m_PointGrid;
-    bool m_HitTestGridValid;
+    LabelIndex m_LabelIndex;
+
+    // The last hit test, for m_HitTestDebug.
+    wxPoint m_HitTestPoint;
+    size_t m_HitTestCount;
 
     LabelInfo temp_here;
     const LabelInfo * m_here;
@@ -223,6 +240,27 @@ private:
 
     GLAPen m_Pens[NUM_COLOUR_BANDS + 1];
 
+    // Where a traverse's legs are in m_LegSegments at each level of detail,
+    // and its bounding box.
+    struct TraverseSegments {
+	float min[3], max[3];
+	unsigned first[LOD_LEVELS];
+	unsigned count[LOD_LEVELS];
+    };
+
+    // All the legs at each level of detail, and an entry for each traverse,
+    // with splays first, then other underground legs, then surface legs.
+    GLASegments m_LegSegments;
+    vector<TraverseSegments> m_TraverseSegments;
+    size_t m_SplayTraversesEnd;
+    size_t m_UndergroundTraversesEnd;
+    bool m_LegSegmentsValid;
+
+    // The level of detail LIST_TUBES was generated at, and how much error
+    // removing each cross-section from each tube would introduce.
+    int m_TubesLevel;
+    vector<vector<float> > m_TubeErrors;
+
 #define PLAYING 1
     int presentation_mode; // for now, 0 => off, PLAYING => continuous play
     bool pres_reverse;
@@ -233,6 +271,14 @@ private:
 
     MovieMaker * movie;
 
+    // What to render for RenderAndExit() - empty filenames mean there's
+    // nothing to render.
+    wxString batch_image, batch_movie;
+    int batch_width, batch_height;
+
+    void Render();
+    void RunBatch();
+
     cursor current_cursor;
 
     int sqrd_measure_threshold;
@@ -249,11 +295,57 @@ private:
     Vector3 offsets;
 
     // DEM:
-    unsigned short * dem;
-    unsigned long dem_width, dem_height;
-    double o_x, o_y, step_x, step_y;
-    long nodata_value;
-    bool bigendian;
+    //
+    // Each file (or .hgt file in a .zip) gives us a tile of heights.  We map
+    // the file if we can, otherwise we read it into memory.
+    struct DEMTile {
+	// The 16-bit heights, row by row, in the byte order given by
+	// bigendian.  We access them with memcpy() as the file's header may
+	// leave them unaligned.
+	const unsigned char * data;
+	// The mapping data is in, or NULL if data was allocated with new[].
+	void * mapping;
+	size_t mapping_size;
+	unsigned long width, height;
+	double o_x, o_y, step_x, step_y;
+	long nodata_value;
+	bool bigendian;
+
+	DEMTile()
+	    : data(NULL), mapping(NULL), mapping_size(0), width(0), height(0),
+	      o_x(0), o_y(0), step_x(0), step_y(0), nodata_value(LONG_MIN),
+	      bigendian(false) { }
+
+	// Read n heights starting from (x, y), in our byte order.
+	void GetRow(size_t x, size_t y, size_t n, short * out) const;
+
+	void Free();
+    };
+    vector<DEMTile> dem;
+
+    // The DEM projected into survey coordinates, which is only done once for
+    // each file loaded since it's slow.
+    struct TerrainTile {
+	float min[3], max[3];
+	// The size in DEM squares.
+	unsigned w, h;
+	// How far the surface drawn at each level of detail can be from the
+	// full detail surface.
+	float error[TERRAIN_LEVELS];
+	// The (w + 1) * (h + 1) points, row by row, as x, y, z.  Points with
+	// no data or too far from the survey have z set to FLT_MAX.
+	vector<float> points;
+	bool all_valid;
+
+	Vector3 GetPoint(unsigned i, unsigned j) const;
+	bool AllValid(unsigned i0, unsigned j0, unsigned i1, unsigned j1) const;
+	float Error(unsigned step) const;
+    };
+    vector<TerrainTile> m_TerrainTiles;
+
+    // The level of detail each tile was drawn at in LIST_TERRAIN.
+    vector<int> m_TerrainLevels;
+
     long last_time;
     size_t n_tris;
 
@@ -278,10 +370,27 @@ private:
     void SkinPassage(vector<XSect> & centreline, bool draw = true);
 
     virtual void GenerateList(unsigned int l);
-    void GenerateDisplayList();
+    Double LevelOfDetailError(int level) const;
+    int LevelOfDetail(Double pixel_size) const;
+    void GenerateLegSegments();
+    void AddLegSegments(vector<GLASegmentVertex> & vertices,
+			const vector<const traverse *> & travs,
+			size_t begin, size_t end);
+    void AddLegSegments(vector<GLASegmentVertex> & vertices,
+			const traverse & centreline,
+			const vector<float> & errors, float max_error) const;
+    void GetLegRanges(size_t begin, size_t end,
+		      GLASegmentRanges & ranges) const;
+    void DrawUndergroundLegs();
+    void DrawSurfaceLegs();
     void GenerateDisplayListTubes();
-    void GenerateDisplayListSurface();
     void DrawTerrainTriangle(const Vector3 & a, const Vector3 & b, const Vector3 & c);
+    void DrawTerrainQuad(const Vector3 & prev, const Vector3 & a,
+			 const Vector3 & b, const Vector3 & pt);
+    bool GenerateTerrainTiles();
+    void DrawTerrainCell(const TerrainTile & tile,
+			 unsigned i0, unsigned j0, unsigned step);
+    void GetTerrainLevels(vector<int> & levels) const;
     void DrawTerrain();
     void GenerateDisplayListShadow();
     void GenerateBlobsDisplayList();
@@ -311,7 +420,9 @@ private:
 
     void Repaint();
 
-    void CreateHitTestGrid();
+    void FindLabels(double x0, double y0, double x1, double y1,
+		    vector<LabelInfo*> & labels) const;
+    void FindLabelsInView(int margin, vector<LabelInfo*> & labels) const;
 
     int GetCompassXPosition() const;
     int GetClinoXPosition() const;
@@ -332,12 +443,19 @@ private:
     void DrawShadowedBoundingBox();
     void DrawBoundingBox();
 
+    void DrawPreview(wxDC & dc, const vector<wxRealPoint> & legs,
+		     bool clear) const;
+
 public:
     GfxCore(MainFrm* parent, wxWindow* parent_window, GUIControl* control);
     ~GfxCore();
 
     void Initialise(bool same_file);
 
+    void StartPreview(Double xmin, Double xmax, Double ymin, Double ymax);
+    void AddToPreview(const vector<wxRealPoint> & legs);
+    void EndPreview();
+
     void UpdateBlobs();
     void ForceRefresh();
 
@@ -462,7 +580,6 @@ public:
     void SetSplaysMode(int mode) {
 	m_Splays = mode;
 	UpdateBlobs();
-	InvalidateList(LIST_UNDERGROUND_LEGS);
 	ForceRefresh();
     }
     void ToggleSurfaceLegs() {
@@ -537,12 +654,6 @@ public:
 			      Double factor = 1.0);
     int GetDepthColour(Double z) const;
     Double GetDepthBoundaryBetweenBands(int a, int b) const;
-    void AddPolyline(const traverse & centreline);
-    void AddPolylineDepth(const traverse & centreline);
-    void AddPolylineDate(const traverse & centreline);
-    void AddPolylineError(const traverse & centreline);
-    void AddPolylineGradient(const traverse & centreline);
-    void AddPolylineLength(const traverse & centreline);
     void AddQuadrilateral(const Vector3 &a, const Vector3 &b,
 			  const Vector3 &c, const Vector3 &d);
     void AddPolylineShadow(const traverse & centreline);
@@ -560,7 +671,6 @@ public:
 
     void (GfxCore::* AddQuad)(const Vector3 &a, const Vector3 &b,
 			      const Vector3 &c, const Vector3 &d);
-    void (GfxCore::* AddPoly)(const traverse & centreline);
 
     PresentationMark GetView() const;
     void SetView(const PresentationMark & p);
@@ -570,6 +680,8 @@ public:
 
     void SetColourBy(int colour_by);
     bool ExportMovie(const wxString & fnm);
+    void RenderAndExit(const wxString & image, const wxString & movie_fnm,
+		       int width, int height);
     void OnPrint(const wxString &filename, const wxString &title,
 		 const wxString &datestamp, time_t datestamp_numeric,
 		 const wxString &cs_proj,
@@ -598,12 +710,20 @@ public:
 
     void ZoomBoxGo();
 
-    void parse_hgt_filename(const wxString & lc_name);
-    size_t parse_hdr(wxInputStream & is, unsigned long & skipbytes);
-    bool read_bil(wxInputStream & is, size_t size, unsigned long skipbytes);
-    bool LoadDEM(const wxString & file);
+    bool LoadDEM(const wxArrayString & files);
 
 private:
+    void FreeDEM();
+    void parse_hgt_filename(const wxString & lc_name, DEMTile & tile);
+    size_t parse_hdr(wxInputStream & is, unsigned long & skipbytes,
+		     DEMTile & tile);
+    bool check_dem_size(DEMTile & tile, size_t size);
+    bool map_bil(const wxString & file, size_t size, unsigned long skipbytes,
+		 DEMTile & tile);
+    bool read_bil(wxInputStream & is, size_t size, unsigned long skipbytes,
+		  DEMTile & tile);
+    void LoadDEMFile(const wxString & file);
+
     DECLARE_EVENT_TABLE()
 };
 
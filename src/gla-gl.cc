@@ -4,7 +4,7 @@
 //  OpenGL implementation for the GLA abstraction layer.
 //
 //  Copyright (C) 2002-2003,2005 Mark R. Shinwell
-//  Copyright (C) 2003,2004,2005,2006,2007,2010,2011,2012,2013,2014,2015 Olly Betts
+//  Copyright (C) 2003,2004,2005,2006,2007,2010,2011,2012,2013,2014,2015,2016 Olly Betts
 //
 //  This program is free software; you can redistribute it and/or modify
 //  it under the terms of the GNU General Public License as published by
@@ -30,6 +30,8 @@
 
 #include <algorithm>
 
+#include <stddef.h>
+
 #include "aven.h"
 #include "gla.h"
 #include "message.h"
@@ -70,6 +72,46 @@
 #ifndef GL_ALIASED_POINT_SIZE_RANGE
 #define GL_ALIASED_POINT_SIZE_RANGE 0x846D
 #endif
+// Vertex buffer objects were added in OpenGL 1.5.
+#ifndef GL_ARRAY_BUFFER
+#define GL_ARRAY_BUFFER 0x8892
+#endif
+#ifndef GL_STATIC_DRAW
+#define GL_STATIC_DRAW 0x88E4
+#endif
+// Pixel buffer objects were added in OpenGL 2.1.
+#ifndef GL_PIXEL_PACK_BUFFER
+#define GL_PIXEL_PACK_BUFFER 0x88EB
+#endif
+#ifndef GL_STREAM_READ
+#define GL_STREAM_READ 0x88E1
+#endif
+#ifndef GL_READ_ONLY
+#define GL_READ_ONLY 0x88B8
+#endif
+// Framebuffer objects were added in OpenGL 3.0.
+#ifndef GL_FRAMEBUFFER
+#define GL_FRAMEBUFFER 0x8D40
+#endif
+#ifndef GL_RENDERBUFFER
+#define GL_RENDERBUFFER 0x8D41
+#endif
+#ifndef GL_COLOR_ATTACHMENT0
+#define GL_COLOR_ATTACHMENT0 0x8CE0
+#endif
+#ifndef GL_DEPTH_ATTACHMENT
+#define GL_DEPTH_ATTACHMENT 0x8D00
+#endif
+#ifndef GL_FRAMEBUFFER_COMPLETE
+#define GL_FRAMEBUFFER_COMPLETE 0x8CD5
+#endif
+#ifndef GL_DEPTH_COMPONENT24
+#define GL_DEPTH_COMPONENT24 0x81A6
+#endif
+
+#ifndef APIENTRY
+#define APIENTRY
+#endif
 
 using namespace std;
 
@@ -77,6 +119,63 @@ const int BLOB_DIAMETER = 5;
 
 static bool opengl_initialised = false;
 
+// The OpenGL library on some platforms only provides OpenGL 1.1 entry points,
+// so we look up the vertex buffer object functions at runtime.  If they
+// aren't available, these remain NULL and we use client-side vertex arrays.
+typedef void (APIENTRY * gla_GenBuffers_t)(GLsizei, GLuint *);
+typedef void (APIENTRY * gla_BindBuffer_t)(GLenum, GLuint);
+typedef void (APIENTRY * gla_BufferData_t)(GLenum, ptrdiff_t, const GLvoid *,
+					   GLenum);
+typedef void (APIENTRY * gla_DeleteBuffers_t)(GLsizei, const GLuint *);
+typedef void (APIENTRY * gla_MultiDrawArrays_t)(GLenum, const GLint *,
+						const GLsizei *, GLsizei);
+typedef GLvoid * (APIENTRY * gla_MapBuffer_t)(GLenum, GLenum);
+typedef GLboolean (APIENTRY * gla_UnmapBuffer_t)(GLenum);
+typedef void (APIENTRY * gla_GenFramebuffers_t)(GLsizei, GLuint *);
+typedef void (APIENTRY * gla_BindFramebuffer_t)(GLenum, GLuint);
+typedef void (APIENTRY * gla_DeleteFramebuffers_t)(GLsizei, const GLuint *);
+typedef GLenum (APIENTRY * gla_CheckFramebufferStatus_t)(GLenum);
+typedef void (APIENTRY * gla_FramebufferRenderbuffer_t)(GLenum, GLenum, GLenum,
+							GLuint);
+typedef void (APIENTRY * gla_GenRenderbuffers_t)(GLsizei, GLuint *);
+typedef void (APIENTRY * gla_BindRenderbuffer_t)(GLenum, GLuint);
+typedef void (APIENTRY * gla_DeleteRenderbuffers_t)(GLsizei, const GLuint *);
+typedef void (APIENTRY * gla_RenderbufferStorage_t)(GLenum, GLenum, GLsizei,
+						    GLsizei);
+
+static gla_GenBuffers_t gla_GenBuffers = NULL;
+static gla_BindBuffer_t gla_BindBuffer = NULL;
+static gla_BufferData_t gla_BufferData = NULL;
+static gla_DeleteBuffers_t gla_DeleteBuffers = NULL;
+static gla_MultiDrawArrays_t gla_MultiDrawArrays = NULL;
+// Only set if we can use pixel buffer objects.
+static gla_MapBuffer_t gla_MapBuffer = NULL;
+static gla_UnmapBuffer_t gla_UnmapBuffer = NULL;
+// Only set if we can use framebuffer objects.
+static gla_GenFramebuffers_t gla_GenFramebuffers = NULL;
+static gla_BindFramebuffer_t gla_BindFramebuffer = NULL;
+static gla_DeleteFramebuffers_t gla_DeleteFramebuffers = NULL;
+static gla_CheckFramebufferStatus_t gla_CheckFramebufferStatus = NULL;
+static gla_FramebufferRenderbuffer_t gla_FramebufferRenderbuffer = NULL;
+static gla_GenRenderbuffers_t gla_GenRenderbuffers = NULL;
+static gla_BindRenderbuffer_t gla_BindRenderbuffer = NULL;
+static gla_DeleteRenderbuffers_t gla_DeleteRenderbuffers = NULL;
+static gla_RenderbufferStorage_t gla_RenderbufferStorage = NULL;
+
+static void *
+gla_get_proc_address(const char * name)
+{
+#if defined __WXMSW__
+    return (void *)wglGetProcAddress(name);
+#elif defined __WXGTK__ || defined __WXX11__ || defined __WXMOTIF__
+    return (void *)glXGetProcAddressARB((const GLubyte *)name);
+#else
+    // FIXME: Look up the functions on other platforms.
+    (void)name;
+    return NULL;
+#endif
+}
+
 string GetGLSystemDescription()
 {
     // If OpenGL isn't initialised we may get a SEGV from glGetString.
@@ -309,6 +408,13 @@ GLACanvas::GLACanvas(wxWindow* parent, int id)
     m_VolumeDiameter = 1.0;
     m_SmoothShading = false;
     m_Texture = 0;
+    m_ColourLookupTexture = 0;
+    m_PixelBuffers[0] = m_PixelBuffers[1] = 0;
+    m_PixelBufferSize = 0;
+    m_PixelBuffer = 0;
+    m_PixelsPending = false;
+    m_Framebuffer = 0;
+    m_RenderBuffers[0] = m_RenderBuffers[1] = 0;
     m_Textured = false;
     m_Perspective = false;
     m_Fog = false;
@@ -330,9 +436,11 @@ GLACanvas::~GLACanvas()
 void GLACanvas::FirstShow()
 {
     // Update our record of the client area size and centre.
-    GetClientSize(&x_size, &y_size);
-    if (x_size < 1) x_size = 1;
-    if (y_size < 1) y_size = 1;
+    if (!m_Framebuffer) {
+	GetClientSize(&x_size, &y_size);
+	if (x_size < 1) x_size = 1;
+	if (y_size < 1) y_size = 1;
+    }
 
     ctx.SetCurrent(*this);
     opengl_initialised = true;
@@ -386,8 +494,9 @@ void GLACanvas::FirstShow()
     //CHECK_GL_ERROR("FirstShow", "glAlphaFunc");
 
     // We want glReadPixels() to read from the front buffer (which is the
-    // default for single-buffered displays).
-    if (double_buffered) {
+    // default for single-buffered displays).  A framebuffer object reads
+    // from the buffer we draw into.
+    if (double_buffered && !m_Framebuffer) {
 	glReadBuffer(GL_FRONT);
 	CHECK_GL_ERROR("FirstShow", "glReadBuffer");
     }
@@ -484,6 +593,44 @@ void GLACanvas::FirstShow()
 	save_hints = true;
     }
 
+    {
+	// Vertex buffer objects are in OpenGL >= 1.5.
+	int major = 0, minor = 0;
+	sscanf((const char *)glGetString(GL_VERSION), "%d.%d", &major, &minor);
+	if (major > 1 || (major == 1 && minor >= 5)) {
+	    gla_GenBuffers = (gla_GenBuffers_t)gla_get_proc_address("glGenBuffers");
+	    gla_BindBuffer = (gla_BindBuffer_t)gla_get_proc_address("glBindBuffer");
+	    gla_BufferData = (gla_BufferData_t)gla_get_proc_address("glBufferData");
+	    gla_DeleteBuffers = (gla_DeleteBuffers_t)gla_get_proc_address("glDeleteBuffers");
+	    if (!gla_BindBuffer || !gla_BufferData || !gla_DeleteBuffers)
+		gla_GenBuffers = NULL;
+	    gla_MultiDrawArrays = (gla_MultiDrawArrays_t)gla_get_proc_address("glMultiDrawArrays");
+	}
+	// Pixel buffer objects are in OpenGL >= 2.1.
+	if (gla_GenBuffers && (major > 2 || (major == 2 && minor >= 1))) {
+	    gla_MapBuffer = (gla_MapBuffer_t)gla_get_proc_address("glMapBuffer");
+	    gla_UnmapBuffer = (gla_UnmapBuffer_t)gla_get_proc_address("glUnmapBuffer");
+	    if (!gla_UnmapBuffer) gla_MapBuffer = NULL;
+	}
+	// Framebuffer objects are in OpenGL >= 3.0.
+	if (major >= 3) {
+	    gla_GenFramebuffers = (gla_GenFramebuffers_t)gla_get_proc_address("glGenFramebuffers");
+	    gla_BindFramebuffer = (gla_BindFramebuffer_t)gla_get_proc_address("glBindFramebuffer");
+	    gla_DeleteFramebuffers = (gla_DeleteFramebuffers_t)gla_get_proc_address("glDeleteFramebuffers");
+	    gla_CheckFramebufferStatus = (gla_CheckFramebufferStatus_t)gla_get_proc_address("glCheckFramebufferStatus");
+	    gla_FramebufferRenderbuffer = (gla_FramebufferRenderbuffer_t)gla_get_proc_address("glFramebufferRenderbuffer");
+	    gla_GenRenderbuffers = (gla_GenRenderbuffers_t)gla_get_proc_address("glGenRenderbuffers");
+	    gla_BindRenderbuffer = (gla_BindRenderbuffer_t)gla_get_proc_address("glBindRenderbuffer");
+	    gla_DeleteRenderbuffers = (gla_DeleteRenderbuffers_t)gla_get_proc_address("glDeleteRenderbuffers");
+	    gla_RenderbufferStorage = (gla_RenderbufferStorage_t)gla_get_proc_address("glRenderbufferStorage");
+	    if (!gla_BindFramebuffer || !gla_DeleteFramebuffers ||
+		!gla_CheckFramebufferStatus || !gla_FramebufferRenderbuffer ||
+		!gla_GenRenderbuffers || !gla_BindRenderbuffer ||
+		!gla_DeleteRenderbuffers || !gla_RenderbufferStorage)
+		gla_GenFramebuffers = NULL;
+	}
+    }
+
     if (cross_method == SPRITE) {
 	glGenTextures(1, &m_CrossTexture);
 	CHECK_GL_ERROR("FirstShow", "glGenTextures");
@@ -539,11 +686,21 @@ void GLACanvas::SetScale(Double scale)
 
 void GLACanvas::OnSize(wxSizeEvent & event)
 {
+    event.Skip();
+
+    // When drawing into a framebuffer object, the window size doesn't
+    // matter.
+    if (m_Framebuffer) return;
+
     wxSize size = event.GetSize();
+    SetViewportSize(size.GetWidth(), size.GetHeight());
+}
 
+void GLACanvas::SetViewportSize(int width, int height)
+{
     unsigned int mask = 0;
-    if (size.GetWidth() != x_size) mask |= INVALIDATE_ON_X_RESIZE;
-    if (size.GetHeight() != y_size) mask |= INVALIDATE_ON_Y_RESIZE;
+    if (width != x_size) mask |= INVALIDATE_ON_X_RESIZE;
+    if (height != y_size) mask |= INVALIDATE_ON_Y_RESIZE;
     if (mask) {
 	vector<GLAList>::iterator i;
 	for (i = drawing_lists.begin(); i != drawing_lists.end(); ++i) {
@@ -552,19 +709,74 @@ void GLACanvas::OnSize(wxSizeEvent & event)
 
 	// The width and height go to zero when the panel is dragged right
 	// across so we clamp them to be at least 1 to avoid problems.
-	x_size = size.GetWidth();
-	y_size = size.GetHeight();
+	x_size = width;
+	y_size = height;
 	if (x_size < 1) x_size = 1;
 	if (y_size < 1) y_size = 1;
     }
 
-    event.Skip();
-
     if (!opengl_initialised) return;
 
     // Set viewport.
     glViewport(0, 0, x_size, y_size);
-    CHECK_GL_ERROR("OnSize", "glViewport");
+    CHECK_GL_ERROR("SetViewportSize", "glViewport");
+}
+
+bool GLACanvas::StartFramebuffer(int width, int height)
+{
+    if (!gla_GenFramebuffers) return false;
+
+    ctx.SetCurrent(*this);
+    EndFramebuffer();
+
+    gla_GenRenderbuffers(2, m_RenderBuffers);
+    CHECK_GL_ERROR("StartFramebuffer", "glGenRenderbuffers");
+    gla_BindRenderbuffer(GL_RENDERBUFFER, m_RenderBuffers[0]);
+    CHECK_GL_ERROR("StartFramebuffer", "glBindRenderbuffer");
+    gla_RenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    CHECK_GL_ERROR("StartFramebuffer", "glRenderbufferStorage");
+    gla_BindRenderbuffer(GL_RENDERBUFFER, m_RenderBuffers[1]);
+    CHECK_GL_ERROR("StartFramebuffer", "glBindRenderbuffer");
+    gla_RenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    CHECK_GL_ERROR("StartFramebuffer", "glRenderbufferStorage");
+    gla_BindRenderbuffer(GL_RENDERBUFFER, 0);
+    CHECK_GL_ERROR("StartFramebuffer", "glBindRenderbuffer");
+
+    gla_GenFramebuffers(1, &m_Framebuffer);
+    CHECK_GL_ERROR("StartFramebuffer", "glGenFramebuffers");
+    gla_BindFramebuffer(GL_FRAMEBUFFER, m_Framebuffer);
+    CHECK_GL_ERROR("StartFramebuffer", "glBindFramebuffer");
+    gla_FramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+				GL_RENDERBUFFER, m_RenderBuffers[0]);
+    CHECK_GL_ERROR("StartFramebuffer", "glFramebufferRenderbuffer");
+    gla_FramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+				GL_RENDERBUFFER, m_RenderBuffers[1]);
+    CHECK_GL_ERROR("StartFramebuffer", "glFramebufferRenderbuffer");
+    if (gla_CheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+	EndFramebuffer();
+	return false;
+    }
+
+    SetViewportSize(width, height);
+    return true;
+}
+
+void GLACanvas::EndFramebuffer()
+{
+    if (!m_Framebuffer) return;
+
+    gla_BindFramebuffer(GL_FRAMEBUFFER, 0);
+    CHECK_GL_ERROR("EndFramebuffer", "glBindFramebuffer");
+    gla_DeleteFramebuffers(1, &m_Framebuffer);
+    CHECK_GL_ERROR("EndFramebuffer", "glDeleteFramebuffers");
+    gla_DeleteRenderbuffers(2, m_RenderBuffers);
+    CHECK_GL_ERROR("EndFramebuffer", "glDeleteRenderbuffers");
+    m_Framebuffer = 0;
+    m_RenderBuffers[0] = m_RenderBuffers[1] = 0;
+
+    int width, height;
+    GetClientSize(&width, &height);
+    SetViewportSize(width, height);
 }
 
 void GLACanvas::AddTranslationScreenCoordinates(int dx, int dy)
@@ -880,7 +1092,7 @@ void GLACanvas::FinishDrawing()
 {
     // Complete a redraw operation.
 
-    if (double_buffered) {
+    if (double_buffered && !m_Framebuffer) {
 	SwapBuffers();
     } else {
 	glFlush();
@@ -986,6 +1198,140 @@ void GLACanvas::SetColour(gla_colour colour)
     }
 }
 
+void GLACanvas::SetColourLookup(const GLAPen * pens, int n_pens)
+{
+    // Fill the lookup texture by interpolating between the pens, with white
+    // in the last texel.
+    unsigned char texels[COLOUR_LOOKUP_SIZE * 3];
+    const int n_steps = COLOUR_LOOKUP_SIZE - 2;
+    for (int i = 0; i <= n_steps; ++i) {
+	double b;
+	double into_band = modf(double(i) * (n_pens - 1) / n_steps, &b);
+	int band(b);
+	GLAPen pen = pens[band];
+	if (band < n_pens - 1) pen.Interpolate(pens[band + 1], into_band);
+	texels[i * 3] = (unsigned char)(pen.GetRed() * 255.0 + 0.5);
+	texels[i * 3 + 1] = (unsigned char)(pen.GetGreen() * 255.0 + 0.5);
+	texels[i * 3 + 2] = (unsigned char)(pen.GetBlue() * 255.0 + 0.5);
+    }
+    memset(texels + (COLOUR_LOOKUP_SIZE - 1) * 3, 255, 3);
+
+    if (m_ColourLookupTexture == 0) {
+	glGenTextures(1, &m_ColourLookupTexture);
+	CHECK_GL_ERROR("SetColourLookup", "glGenTextures");
+    }
+    glBindTexture(GL_TEXTURE_1D, m_ColourLookupTexture);
+    CHECK_GL_ERROR("SetColourLookup", "glBindTexture");
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+    CHECK_GL_ERROR("SetColourLookup", "glTexParameteri GL_TEXTURE_WRAP_S");
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    CHECK_GL_ERROR("SetColourLookup", "glTexParameteri GL_TEXTURE_MAG_FILTER");
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    CHECK_GL_ERROR("SetColourLookup", "glTexParameteri GL_TEXTURE_MIN_FILTER");
+    glTexImage1D(GL_TEXTURE_1D, 0, GL_RGB, COLOUR_LOOKUP_SIZE, 0,
+		 GL_RGB, GL_UNSIGNED_BYTE, (GLvoid *)texels);
+    CHECK_GL_ERROR("SetColourLookup", "glTexImage1D");
+}
+
+void GLACanvas::UploadSegments(GLASegments & segments,
+			       vector<GLASegmentVertex> & vertices)
+{
+    // Take the vertices - vertices is left empty.
+    segments.n_vertices = vertices.size();
+    segments.vertices.clear();
+    if (gla_GenBuffers) {
+	if (segments.buffer == 0) {
+	    gla_GenBuffers(1, &segments.buffer);
+	    CHECK_GL_ERROR("UploadSegments", "glGenBuffers");
+	}
+	gla_BindBuffer(GL_ARRAY_BUFFER, segments.buffer);
+	CHECK_GL_ERROR("UploadSegments", "glBindBuffer");
+	gla_BufferData(GL_ARRAY_BUFFER,
+		       vertices.size() * sizeof(GLASegmentVertex),
+		       vertices.empty() ? NULL : &vertices[0], GL_STATIC_DRAW);
+	GLenum error_code = glGetError();
+	gla_BindBuffer(GL_ARRAY_BUFFER, 0);
+	CHECK_GL_ERROR("UploadSegments", "glBindBuffer 0");
+	if (error_code == GL_NO_ERROR) {
+	    vector<GLASegmentVertex>().swap(vertices);
+	    return;
+	}
+	// Probably GL_OUT_OF_MEMORY, so use a client-side array instead.
+	gla_DeleteBuffers(1, &segments.buffer);
+	CHECK_GL_ERROR("UploadSegments", "glDeleteBuffers");
+	segments.buffer = 0;
+    }
+    segments.vertices.swap(vertices);
+}
+
+void GLACanvas::DrawSegments(const GLASegments & segments,
+			     const GLASegmentRanges & ranges, int colouring)
+{
+    if (ranges.empty()) return;
+    assert(size_t(ranges.first.back()) + ranges.count.back() <= segments.size());
+    assert(colouring < GLA_SEGMENT_COLOURINGS);
+
+#ifdef GLA_DEBUG
+    for (size_t i = 0; i != ranges.count.size(); ++i) {
+	m_Vertices += ranges.count[i];
+    }
+#endif
+
+    const char * base = NULL;
+    if (segments.buffer) {
+	gla_BindBuffer(GL_ARRAY_BUFFER, segments.buffer);
+	CHECK_GL_ERROR("DrawSegments", "glBindBuffer");
+    } else {
+	base = reinterpret_cast<const char *>(&segments.vertices[0]);
+    }
+
+    glPushAttrib(GL_ENABLE_BIT);
+    CHECK_GL_ERROR("DrawSegments", "glPushAttrib");
+    glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+    CHECK_GL_ERROR("DrawSegments", "glPushClientAttrib");
+    glDisable(GL_TEXTURE_2D);
+    CHECK_GL_ERROR("DrawSegments", "glDisable GL_TEXTURE_2D");
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    CHECK_GL_ERROR("DrawSegments", "glEnableClientState GL_VERTEX_ARRAY");
+    glVertexPointer(3, GL_FLOAT, sizeof(GLASegmentVertex),
+		    base + offsetof(GLASegmentVertex, x));
+    CHECK_GL_ERROR("DrawSegments", "glVertexPointer");
+    if (colouring >= 0) {
+	glBindTexture(GL_TEXTURE_1D, m_ColourLookupTexture);
+	CHECK_GL_ERROR("DrawSegments", "glBindTexture");
+	glEnable(GL_TEXTURE_1D);
+	CHECK_GL_ERROR("DrawSegments", "glEnable GL_TEXTURE_1D");
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	CHECK_GL_ERROR("DrawSegments", "glEnableClientState GL_TEXTURE_COORD_ARRAY");
+	glTexCoordPointer(1, GL_FLOAT, sizeof(GLASegmentVertex),
+			  base + offsetof(GLASegmentVertex, colour) +
+			  colouring * sizeof(GLfloat));
+	CHECK_GL_ERROR("DrawSegments", "glTexCoordPointer");
+    }
+
+    GLsizei n_ranges = GLsizei(ranges.first.size());
+    if (gla_MultiDrawArrays && n_ranges > 1) {
+	gla_MultiDrawArrays(GL_LINES, &ranges.first[0], &ranges.count[0],
+			    n_ranges);
+	CHECK_GL_ERROR("DrawSegments", "glMultiDrawArrays");
+    } else {
+	for (GLsizei i = 0; i != n_ranges; ++i) {
+	    glDrawArrays(GL_LINES, ranges.first[i], ranges.count[i]);
+	    CHECK_GL_ERROR("DrawSegments", "glDrawArrays");
+	}
+    }
+
+    glPopClientAttrib();
+    CHECK_GL_ERROR("DrawSegments", "glPopClientAttrib");
+    glPopAttrib();
+    CHECK_GL_ERROR("DrawSegments", "glPopAttrib");
+    if (segments.buffer) {
+	gla_BindBuffer(GL_ARRAY_BUFFER, 0);
+	CHECK_GL_ERROR("DrawSegments", "glBindBuffer 0");
+    }
+}
+
 void GLACanvas::DrawText(glaCoord x, glaCoord y, glaCoord z, const wxString& str)
 {
     // Draw a text string on the current buffer in the current font.
@@ -1463,6 +1809,57 @@ void GLACanvas::ReverseTransform(Double x, Double y,
     CHECK_GL_ERROR("ReverseTransform", "gluUnProject");
 }
 
+void GLACanvas::GetViewPlanes(double x0, double y0, double x1, double y1,
+			      double planes[6][4]) const
+{
+    // Combine the projection and modelview matrices (which OpenGL stores in
+    // column-major order).
+    double m[16];
+    for (int c = 0; c < 4; ++c) {
+	for (int r = 0; r < 4; ++r) {
+	    double v = 0.0;
+	    for (int k = 0; k < 4; ++k) {
+		v += projection_matrix[k * 4 + r] * modelview_matrix[c * 4 + k];
+	    }
+	    m[c * 4 + r] = v;
+	}
+    }
+
+    // Convert the window rectangle to normalised device coordinates.
+    double nx0 = 2.0 * (x0 - viewport[0]) / viewport[2] - 1.0;
+    double nx1 = 2.0 * (x1 - viewport[0]) / viewport[2] - 1.0;
+    double ny0 = 2.0 * (y0 - viewport[1]) / viewport[3] - 1.0;
+    double ny1 = 2.0 * (y1 - viewport[1]) / viewport[3] - 1.0;
+
+    // A point with clip coordinates (X, Y, Z, W) is inside if
+    // nx0 <= X/W <= nx1, ny0 <= Y/W <= ny1 and -1 <= Z/W <= 1.
+    for (int i = 0; i < 4; ++i) {
+	double X = m[i * 4], Y = m[i * 4 + 1], Z = m[i * 4 + 2], W = m[i * 4 + 3];
+	planes[0][i] = X - nx0 * W;
+	planes[1][i] = nx1 * W - X;
+	planes[2][i] = Y - ny0 * W;
+	planes[3][i] = ny1 * W - Y;
+	planes[4][i] = W + Z;
+	planes[5][i] = W - Z;
+    }
+}
+
+void GLACanvas::GetPixelSizePlane(double plane[4]) const
+{
+    // A pixel is 2 / viewport[2] across in normalised device coordinates,
+    // which is projection_matrix[0] / W per unit in eye coordinates.  W is
+    // constant for an orthographic projection, and the distance from the eye
+    // for a perspective one.
+    double f = 2.0 / (projection_matrix[0] * viewport[2]);
+    for (int i = 0; i < 4; ++i) {
+	double w = 0.0;
+	for (int k = 0; k < 4; ++k) {
+	    w += projection_matrix[k * 4 + 3] * modelview_matrix[i * 4 + k];
+	}
+	plane[i] = w * f;
+    }
+}
+
 Double GLACanvas::SurveyUnitsAcrossViewport() const
 {
     // Measure the current viewport in survey units, taking into account the
@@ -1519,6 +1916,9 @@ bool GLACanvas::SaveScreenshot(const wxString & fnm, wxBitmapType type) const
     const int height = y_size;
     unsigned char *pixels = (unsigned char *)malloc(3 * width * (height + 1));
     if (!pixels) return false;
+    // Rows of pixels are packed together in the wxImage.
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    CHECK_GL_ERROR("SaveScreenshot", "glPixelStorei");
     glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, (GLvoid *)pixels);
     CHECK_GL_ERROR("SaveScreenshot", "glReadPixels");
     unsigned char * tmp_row = pixels + 3 * width * height;
@@ -1540,14 +1940,14 @@ bool GLACanvas::SaveScreenshot(const wxString & fnm, wxBitmapType type) const
 bool GLACanvas::CheckVisualFidelity(const unsigned char * target) const
 {
     unsigned char pixels[3 * 8 * 8];
-    if (double_buffered) {
+    if (double_buffered && !m_Framebuffer) {
 	glReadBuffer(GL_BACK);
 	CHECK_GL_ERROR("FirstShow", "glReadBuffer");
     }
     glReadPixels(x_size / 2 - 3, y_size / 2 - 4, 8, 8,
 		 GL_RGB, GL_UNSIGNED_BYTE, (GLvoid *)pixels);
     CHECK_GL_ERROR("CheckVisualFidelity", "glReadPixels");
-    if (double_buffered) {
+    if (double_buffered && !m_Framebuffer) {
 	glReadBuffer(GL_FRONT);
 	CHECK_GL_ERROR("FirstShow", "glReadBuffer");
     }
@@ -1569,10 +1969,86 @@ bool GLACanvas::CheckVisualFidelity(const unsigned char * target) const
     return (memcmp(pixels, target, sizeof(pixels)) == 0);
 }
 
-void GLACanvas::ReadPixels(int width, int height, unsigned char * buf) const
+bool GLACanvas::ReadPixels(int width, int height, unsigned char * buf)
 {
+    // Rows of pixels are packed together in buf.
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    CHECK_GL_ERROR("ReadPixels", "glPixelStorei");
+
+    if (!gla_MapBuffer) {
+	glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, (GLvoid *)buf);
+	CHECK_GL_ERROR("ReadPixels", "glReadPixels");
+	return true;
+    }
+
+    size_t size = size_t(width) * height * 3;
+    if (size != m_PixelBufferSize) {
+	DeletePixelBuffers();
+	gla_GenBuffers(2, m_PixelBuffers);
+	CHECK_GL_ERROR("ReadPixels", "glGenBuffers");
+	for (int i = 0; i != 2; ++i) {
+	    gla_BindBuffer(GL_PIXEL_PACK_BUFFER, m_PixelBuffers[i]);
+	    CHECK_GL_ERROR("ReadPixels", "glBindBuffer");
+	    gla_BufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+	    CHECK_GL_ERROR("ReadPixels", "glBufferData");
+	}
+	m_PixelBufferSize = size;
+    }
+
+    // With a buffer object bound, glReadPixels() queues the transfer and
+    // returns without waiting for it.
+    gla_BindBuffer(GL_PIXEL_PACK_BUFFER, m_PixelBuffers[m_PixelBuffer]);
+    CHECK_GL_ERROR("ReadPixels", "glBindBuffer");
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, NULL);
     CHECK_GL_ERROR("ReadPixels", "glReadPixels");
-    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, (GLvoid *)buf);
+    m_PixelBuffer ^= 1;
+
+    // The previous frame was read into the other buffer, and should be
+    // ready by now.
+    bool filled = m_PixelsPending;
+    if (filled) CopyPixelBuffer(m_PixelBuffers[m_PixelBuffer], buf);
+    m_PixelsPending = true;
+    gla_BindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    CHECK_GL_ERROR("ReadPixels", "glBindBuffer");
+    return filled;
+}
+
+bool GLACanvas::FinishReadPixels(unsigned char * buf)
+{
+    bool filled = (m_PixelsPending && buf);
+    if (filled) {
+	CopyPixelBuffer(m_PixelBuffers[m_PixelBuffer ^ 1], buf);
+	gla_BindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	CHECK_GL_ERROR("FinishReadPixels", "glBindBuffer");
+    }
+    DeletePixelBuffers();
+    return filled;
+}
+
+void GLACanvas::CopyPixelBuffer(GLuint buffer, unsigned char * buf) const
+{
+    // Leaves the buffer bound.
+    gla_BindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+    CHECK_GL_ERROR("CopyPixelBuffer", "glBindBuffer");
+    const GLvoid * p = gla_MapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    CHECK_GL_ERROR("CopyPixelBuffer", "glMapBuffer");
+    if (p) {
+	memcpy(buf, p, m_PixelBufferSize);
+	gla_UnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	CHECK_GL_ERROR("CopyPixelBuffer", "glUnmapBuffer");
+    }
+}
+
+void GLACanvas::DeletePixelBuffers()
+{
+    if (m_PixelBufferSize) {
+	gla_DeleteBuffers(2, m_PixelBuffers);
+	CHECK_GL_ERROR("DeletePixelBuffers", "glDeleteBuffers");
+	m_PixelBuffers[0] = m_PixelBuffers[1] = 0;
+	m_PixelBufferSize = 0;
+    }
+    m_PixelBuffer = 0;
+    m_PixelsPending = false;
 }
 
 void GLACanvas::PolygonOffset(bool on) const
@@ -4,7 +4,7 @@
 //  Header file for the GLA abstraction layer.
 //
 //  Copyright (C) 2002 Mark R. Shinwell.
-//  Copyright (C) 2003,2004,2005,2006,2007,2011,2012,2014 Olly Betts
+//  Copyright (C) 2003,2004,2005,2006,2007,2011,2012,2014,2016 Olly Betts
 //
 //  This program is free software; you can redistribute it and/or modify
 //  it under the terms of the GNU General Public License as published by
@@ -95,6 +95,60 @@ class GLAList {
     }
 };
 
+// Number of different ways a GLASegmentVertex can be coloured.
+const int GLA_SEGMENT_COLOURINGS = 5;
+
+// A vertex of a line segment drawn from a GLASegments buffer.
+struct GLASegmentVertex {
+    GLfloat x, y, z;
+    // Texture coordinates into the colour lookup texture - one for each way
+    // of colouring, so switching between them doesn't mean regenerating
+    // anything.
+    GLfloat colour[GLA_SEGMENT_COLOURINGS];
+};
+
+// Line segments uploaded to the graphics card once, in a vertex buffer object
+// if possible (otherwise we use client-side vertex arrays).
+class GLASegments {
+    friend class GLACanvas;
+
+    GLuint buffer;
+    size_t n_vertices;
+    // Only used if we couldn't create a vertex buffer object.
+    vector<GLASegmentVertex> vertices;
+
+  public:
+    GLASegments() : buffer(0), n_vertices(0) { }
+    size_t size() const { return n_vertices; }
+};
+
+// Ranges of vertices to draw from a GLASegments.
+class GLASegmentRanges {
+    friend class GLACanvas;
+
+    vector<GLint> first;
+    vector<GLsizei> count;
+
+  public:
+    void add(size_t start, size_t n) {
+	if (n == 0) return;
+	if (!first.empty() && size_t(first.back()) + count.back() == start) {
+	    // Extend the previous range rather than starting a new one.
+	    count.back() += GLsizei(n);
+	    return;
+	}
+	first.push_back(GLint(start));
+	count.push_back(GLsizei(n));
+    }
+
+    void clear() {
+	first.clear();
+	count.clear();
+    }
+
+    bool empty() const { return first.empty(); }
+};
+
 class GLACanvas : public wxGLCanvas {
     friend class GLAList; // For flag values.
 
@@ -122,6 +176,25 @@ class GLACanvas : public wxGLCanvas {
 
     GLuint m_Texture;
     GLuint m_CrossTexture;
+    GLuint m_ColourLookupTexture;
+
+    // Pixel buffer objects which ReadPixels() alternates between, and the
+    // size of each in bytes.
+    GLuint m_PixelBuffers[2];
+    size_t m_PixelBufferSize;
+    // The buffer which the next ReadPixels() reads into.
+    int m_PixelBuffer;
+    // True if the last ReadPixels() read into a buffer object and the pixels
+    // haven't been returned yet.
+    bool m_PixelsPending;
+
+    void CopyPixelBuffer(GLuint buffer, unsigned char * buf) const;
+    void DeletePixelBuffers();
+
+    // Framebuffer object we're drawing into instead of the window (or 0),
+    // and its colour and depth renderbuffers.
+    GLuint m_Framebuffer;
+    GLuint m_RenderBuffers[2];
 
     Double alpha;
 
@@ -132,6 +205,8 @@ class GLACanvas : public wxGLCanvas {
     bool m_AntiAlias;
     bool save_hints;
     enum { UNKNOWN = 0, POINT = 'P', LINES = 'L', SPRITE = 'S' };
+    // Number of texels in the colour lookup texture - the last is white.
+    enum { COLOUR_LOOKUP_SIZE = 256 };
     int blob_method;
     int cross_method;
 
@@ -153,6 +228,8 @@ class GLACanvas : public wxGLCanvas {
 
     bool CheckVisualFidelity(const unsigned char * target) const;
 
+    void SetViewportSize(int width, int height);
+
 public:
     GLACanvas(wxWindow* parent, int id);
     ~GLACanvas();
@@ -163,6 +240,13 @@ public:
     void StartDrawing();
     void FinishDrawing();
 
+    // Draw into a framebuffer object of the given size rather than the
+    // window, so the size of images we read back doesn't depend on the
+    // window's size or whether it's visible.  Returns false if framebuffer
+    // objects aren't supported.
+    bool StartFramebuffer(int width, int height);
+    void EndFramebuffer();
+
     void SetVolumeDiameter(glaCoord diameter);
     void SetDataTransform();
     void SetIndicatorTransform();
@@ -177,6 +261,13 @@ public:
 	}
     }
 
+    // True if the list being generated won't be cached (e.g. because it's
+    // drawn in window coordinates), so it only needs to include what's
+    // currently in view.
+    bool GeneratingUncachedList() const {
+	return (list_flags & NEVER_CACHE) != 0;
+    }
+
     virtual void GenerateList(unsigned int l) = 0;
 
     void SetColour(const GLAPen& pen, double rgb_scale);
@@ -185,6 +276,25 @@ public:
     void SetColour(gla_colour colour);
     void SetAlpha(double new_alpha) { alpha = new_alpha; }
 
+    // Set the colour bands for GLASegments drawn with a colouring.
+    void SetColourLookup(const GLAPen * pens, int n_pens);
+    // Coordinate to look up the colour how_far (0 to 1) through the bands.
+    static GLfloat ColourLookup(double how_far) {
+	return GLfloat((how_far * (COLOUR_LOOKUP_SIZE - 2) + 0.5) /
+		       COLOUR_LOOKUP_SIZE);
+    }
+    // Coordinate to look up white (used for undated legs, for example).
+    static GLfloat ColourLookupWhite() {
+	return GLfloat((COLOUR_LOOKUP_SIZE - 0.5) / COLOUR_LOOKUP_SIZE);
+    }
+
+    void UploadSegments(GLASegments & segments,
+			vector<GLASegmentVertex> & vertices);
+    // Draw ranges of vertices from segments, coloured using colouring (or in
+    // the current colour if colouring is negative).
+    void DrawSegments(const GLASegments & segments,
+		      const GLASegmentRanges & ranges, int colouring);
+
     void DrawText(glaCoord x, glaCoord y, glaCoord z, const wxString& str);
     void DrawIndicatorText(int x, int y, const wxString& str);
     void GetTextExtent(const wxString& str, int * x_ext, int * y_ext) const;
@@ -257,6 +367,15 @@ public:
 
     bool Transform(const Vector3 & v, double* x_out, double* y_out, double* z_out) const;
     void ReverseTransform(Double x, Double y, double* x_out, double* y_out, double* z_out) const;
+    // Get the planes bounding the part of the view volume which Transform()
+    // maps into the window rectangle (x0, y0)-(x1, y1).  Each plane is
+    // (a, b, c, d) with a*x + b*y + c*z + d >= 0 on the inside.
+    void GetViewPlanes(double x0, double y0, double x1, double y1,
+		       double planes[6][4]) const;
+    // Get a plane which gives the size of a pixel in survey units at a
+    // point (x, y, z) as a*x + b*y + c*z + d.  For an orthographic view,
+    // a, b and c are zero.
+    void GetPixelSizePlane(double plane[4]) const;
 
     int GetFontSize() const { return m_Font.get_font_size(); }
 
@@ -279,7 +398,15 @@ public:
 
     bool SaveScreenshot(const wxString & fnm, wxBitmapType type) const;
 
-    void ReadPixels(int width, int height, unsigned char * buf) const;
+    // Read the pixels of a frame (bottom row first).  If pixel buffer
+    // objects are available, the transfer is started and buf is filled with
+    // the frame read by the previous call, so we don't wait for the transfer
+    // to finish.  Returns false if buf wasn't filled.
+    bool ReadPixels(int width, int height, unsigned char * buf);
+
+    // Fill buf with the frame still pending from ReadPixels(), if any (buf
+    // may be NULL to discard it).  Returns false if buf wasn't filled.
+    bool FinishReadPixels(unsigned char * buf);
 
     void PolygonOffset(bool on) const;
 
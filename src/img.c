@@ -1,6 +1,6 @@
 /* img.c
  * Routines for reading and writing Survex ".3d" image files
- * Copyright (C) 1993-2004,2005,2006,2010,2011,2013,2014 Olly Betts
+ * Copyright (C) 1993-2004,2005,2006,2010,2011,2013,2014,2016 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -363,6 +363,450 @@ check_label_space(img *pimg, size_t len)
    return 1;
 }
 
+/* Format version 8 files can have an optional index appended after the end
+ * of data marker (so older readers never see it), which splits the data into
+ * spans and records a survey prefix which all the labelled items in each span
+ * start with, plus the decoder state at the start of each span.  This allows
+ * img_open_survey() to seek straight past spans which can't contain any data
+ * for the requested survey.
+ *
+ * The index ends with a fixed size footer so it can be found by seeking from
+ * the end of the file:
+ *
+ * 4 bytes: offset of start of index
+ * 4 bytes: number of spans
+ * 8 bytes: INDEX_MAGIC
+ *
+ * Each span is stored as:
+ *
+ * 4 bytes: offset of start of span
+ * 2 bytes: style
+ * 4 bytes: days1 (-1 for none)
+ * 4 bytes: days2 (-1 for none)
+ * 1 byte:  1 if a point follows, else 0
+ * [12 bytes: last point from a MOVE or LINE]
+ * 4 bytes + label: label_buf contents
+ * 4 bytes + prefix: survey prefix
+ */
+#define INDEX_MAGIC "Svx3dIdx"
+
+#define INDEX_FOOTER_LEN (8 + LITLEN(INDEX_MAGIC))
+
+/* Don't start a new span until this many labelled items have been written to
+ * the current one - this keeps the index small compared to the data. */
+#define SPAN_MIN_ITEMS 256
+
+typedef struct {
+   long offset;
+   char *prefix;
+   size_t prefix_len;
+   char *label;
+   size_t label_len;
+   int style;
+   INT32_T days1, days2;
+   int have_point;
+   INT32_T x, y, z;
+} img_span;
+
+struct img_survey_index {
+   img_span *spans;
+   size_t n_spans, spans_size;
+   /* When writing: */
+   char *last_survey;
+   size_t last_survey_len, last_survey_size;
+   unsigned long items;
+   int have_point;
+   INT32_T x, y, z;
+   /* When reading: */
+   size_t next_span, end_span;
+   long read_end_pos;
+};
+
+static void
+free_survey_index(img *pimg)
+{
+   struct img_survey_index *idx = pimg->survey_index;
+   size_t i;
+   if (!idx) return;
+   for (i = 0; i < idx->n_spans; ++i) {
+      osfree(idx->spans[i].prefix);
+      osfree(idx->spans[i].label);
+   }
+   osfree(idx->spans);
+   osfree(idx->last_survey);
+   osfree(idx);
+   pimg->survey_index = NULL;
+}
+
+static struct img_survey_index *
+new_survey_index(void)
+{
+   struct img_survey_index *idx = osnew(struct img_survey_index);
+   if (!idx) return NULL;
+   idx->spans = NULL;
+   idx->n_spans = idx->spans_size = 0;
+   idx->last_survey = NULL;
+   idx->last_survey_len = idx->last_survey_size = 0;
+   idx->items = 0;
+   idx->have_point = 0;
+   idx->x = idx->y = idx->z = 0;
+   idx->next_span = idx->end_span = 0;
+   idx->read_end_pos = 0;
+   return idx;
+}
+
+static img_span *
+add_span(struct img_survey_index *idx)
+{
+   img_span *span;
+   if (idx->n_spans == idx->spans_size) {
+      size_t size = idx->spans_size ? idx->spans_size * 2 : 64;
+      img_span *p = (img_span *)xosrealloc(idx->spans, size * sizeof(img_span));
+      if (!p) return NULL;
+      idx->spans = p;
+      idx->spans_size = size;
+   }
+   span = &(idx->spans[idx->n_spans++]);
+   span->prefix = span->label = NULL;
+   span->prefix_len = span->label_len = 0;
+   return span;
+}
+
+/* Start a new span at the current position in the file being written. */
+static int
+start_span(img *pimg)
+{
+   struct img_survey_index *idx = pimg->survey_index;
+   img_span *span;
+   long offset = ftell(pimg->fh);
+   if (offset < 0) return 0;
+   span = add_span(idx);
+   if (!span) return 0;
+   span->offset = offset;
+   span->label = (char *)xosmalloc(pimg->label_len + 1);
+   if (!span->label) return 0;
+   memcpy(span->label, pimg->label_buf, pimg->label_len);
+   span->label[pimg->label_len] = '\0';
+   span->label_len = pimg->label_len;
+   span->style = pimg->oldstyle;
+#if IMG_API_VERSION == 0
+   span->days1 = pimg->olddate1 ? pimg->olddate1 / 86400 + 25567 : -1;
+   span->days2 = pimg->olddate2 ? pimg->olddate2 / 86400 + 25567 : -1;
+#else /* IMG_API_VERSION == 1 */
+   span->days1 = pimg->olddays1;
+   span->days2 = pimg->olddays2;
+#endif
+   span->have_point = idx->have_point;
+   span->x = idx->x;
+   span->y = idx->y;
+   span->z = idx->z;
+   idx->items = 0;
+   return 1;
+}
+
+/* Return the length of the longest common prefix of a and b which ends at a
+ * survey level boundary in both. */
+static size_t
+common_survey_prefix(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+   size_t i, n = min(a_len, b_len);
+   size_t common = 0;
+   for (i = 0; i < n && a[i] == b[i]; ++i) {
+      if (a[i] == '.') common = i;
+   }
+   if (i == n && (i == a_len || a[i] == '.') && (i == b_len || b[i] == '.'))
+      common = i;
+   return common;
+}
+
+/* Note that the next labelled item written is in survey s (of length len).
+ * Must be called before anything is written for the item. */
+static void
+index_item(img *pimg, const char *s, size_t len)
+{
+   struct img_survey_index *idx = pimg->survey_index;
+   img_span *span;
+   if (!idx) return;
+   if (idx->last_survey && len == idx->last_survey_len &&
+       memcmp(s, idx->last_survey, len) == 0) {
+      ++idx->items;
+      return;
+   }
+
+   span = &(idx->spans[idx->n_spans - 1]);
+   if (idx->items >= SPAN_MIN_ITEMS) {
+      if (!start_span(pimg)) goto oom;
+      span = &(idx->spans[idx->n_spans - 1]);
+   }
+   if (!span->prefix) {
+      span->prefix = (char *)xosmalloc(len + 1);
+      if (!span->prefix) goto oom;
+      memcpy(span->prefix, s, len);
+      span->prefix[len] = '\0';
+      span->prefix_len = len;
+   } else {
+      span->prefix_len = common_survey_prefix(span->prefix, span->prefix_len,
+					      s, len);
+   }
+
+   if (len >= idx->last_survey_size) {
+      size_t size = max(len + 1, (size_t)64);
+      char *p = (char *)xosrealloc(idx->last_survey, size);
+      if (!p) goto oom;
+      idx->last_survey = p;
+      idx->last_survey_size = size;
+   }
+   memcpy(idx->last_survey, s, len);
+   idx->last_survey_len = len;
+   ++idx->items;
+   return;
+
+oom:
+   /* The index is optional, so just don't write one. */
+   free_survey_index(pimg);
+}
+
+/* Note that the next item written is for station s. */
+static void
+index_station(img *pimg, const char *s)
+{
+   const char *q = strrchr(s, '.');
+   index_item(pimg, s, q ? (size_t)(q - s) : 0);
+}
+
+/* Note the coordinates of a MOVE or LINE written. */
+static void
+index_point(img *pimg, double x, double y, double z)
+{
+   struct img_survey_index *idx = pimg->survey_index;
+   if (!idx) return;
+   idx->have_point = 1;
+   idx->x = (INT32_T)my_lround(x * 100.0);
+   idx->y = (INT32_T)my_lround(y * 100.0);
+   idx->z = (INT32_T)my_lround(z * 100.0);
+}
+
+static void
+write_survey_index(img *pimg)
+{
+   struct img_survey_index *idx = pimg->survey_index;
+   size_t i;
+   long offset;
+   /* With a single span, there's nothing which can be skipped. */
+   if (idx->n_spans < 2) return;
+   offset = ftell(pimg->fh);
+   if (offset < 0 || offset > 0x7fffffffl) return;
+   for (i = 0; i < idx->n_spans; ++i) {
+      const img_span *span = &(idx->spans[i]);
+      put32(span->offset, pimg->fh);
+      put16((short)span->style, pimg->fh);
+      put32(span->days1, pimg->fh);
+      put32(span->days2, pimg->fh);
+      PUTC(span->have_point, pimg->fh);
+      if (span->have_point) {
+	 put32(span->x, pimg->fh);
+	 put32(span->y, pimg->fh);
+	 put32(span->z, pimg->fh);
+      }
+      put32((long)span->label_len, pimg->fh);
+      fwrite(span->label, span->label_len, 1, pimg->fh);
+      put32((long)span->prefix_len, pimg->fh);
+      if (span->prefix_len)
+	 fwrite(span->prefix, span->prefix_len, 1, pimg->fh);
+   }
+   put32(offset, pimg->fh);
+   put32((long)idx->n_spans, pimg->fh);
+   fwrite(INDEX_MAGIC, LITLEN(INDEX_MAGIC), 1, pimg->fh);
+}
+
+/* Read a length-prefixed string from the index.  Returns NULL on error. */
+static char *
+read_index_string(FILE *fh, size_t *p_len, long max_len)
+{
+   char *p;
+   INT32_T len = get32(fh);
+   if (feof(fh) || len < 0 || len > max_len) return NULL;
+   p = (char *)xosmalloc(len + 1);
+   if (!p) return NULL;
+   if (len && fread(p, len, 1, fh) != 1) {
+      osfree(p);
+      return NULL;
+   }
+   p[len] = '\0';
+   *p_len = len;
+   return p;
+}
+
+/* Load the survey index if the file has one.  If anything is wrong with it,
+ * we just don't use it. */
+static void
+read_survey_index(img *pimg)
+{
+   struct img_survey_index *idx;
+   char magic[LITLEN(INDEX_MAGIC)];
+   long end, offset, prev = -1;
+   long pos = ftell(pimg->fh);
+   INT32_T n, i;
+
+   if (pos < 0 || fseek(pimg->fh, -(long)INDEX_FOOTER_LEN, SEEK_END) != 0) goto done;
+   end = ftell(pimg->fh);
+   offset = get32(pimg->fh);
+   n = get32(pimg->fh);
+   if (fread(magic, sizeof(magic), 1, pimg->fh) != 1 ||
+       memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0)
+      goto done;
+   if (offset < pimg->start || offset >= end || n < 2 ||
+       n > end - offset || fseek(pimg->fh, offset, SEEK_SET) != 0)
+      goto done;
+
+   idx = new_survey_index();
+   if (!idx) goto done;
+   pimg->survey_index = idx;
+   for (i = 0; i < n; ++i) {
+      img_span *span = add_span(idx);
+      if (!span) goto bad;
+      span->offset = get32(pimg->fh);
+      span->style = get16(pimg->fh);
+      span->days1 = get32(pimg->fh);
+      span->days2 = get32(pimg->fh);
+      span->have_point = GETC(pimg->fh);
+      if (span->have_point) {
+	 span->x = get32(pimg->fh);
+	 span->y = get32(pimg->fh);
+	 span->z = get32(pimg->fh);
+      }
+      if (feof(pimg->fh) || ferror(pimg->fh) ||
+	  span->offset <= prev || span->offset >= offset)
+	 goto bad;
+      prev = span->offset;
+      span->label = read_index_string(pimg->fh, &(span->label_len),
+				      end - offset);
+      if (!span->label) goto bad;
+      span->prefix = read_index_string(pimg->fh, &(span->prefix_len),
+				       end - offset);
+      if (!span->prefix) goto bad;
+   }
+   if (idx->spans[0].offset != pimg->start) goto bad;
+   idx->end_span = idx->n_spans;
+   idx->read_end_pos = pos;
+   goto done;
+
+bad:
+   free_survey_index(pimg);
+done:
+   clearerr(pimg->fh);
+   if (pos >= 0) fseek(pimg->fh, pos, SEEK_SET);
+}
+
+/* Return non-zero if a span with survey prefix p might contain data in the
+ * survey we're filtering for. */
+static int
+span_wanted(const img *pimg, const img_span *span)
+{
+   const char *p = span->prefix;
+   size_t p_len = span->prefix_len;
+   size_t f_len = pimg->survey_len;
+   if (f_len == 0) return 1;
+   if (p_len <= f_len) {
+      return memcmp(p, pimg->survey, p_len) == 0 &&
+	     (p_len == 0 || pimg->survey[p_len] == '.');
+   }
+   return memcmp(p, pimg->survey, f_len) == 0 && p[f_len] == '.';
+}
+
+/* Seek to the start of span i and restore the decoder state there.  If move
+ * is non-zero, the next LINE returned is preceded by a MOVE to the last point
+ * before the span.  Returns img_BAD on error, or 1 otherwise. */
+static int
+seek_to_span(img *pimg, size_t i, int move)
+{
+   struct img_survey_index *idx = pimg->survey_index;
+   const img_span *span = &(idx->spans[i]);
+   if (fseek(pimg->fh, span->offset, SEEK_SET) != 0) {
+      img_errno = pimg->errcode = IMG_READERROR;
+      return img_BAD;
+   }
+   pimg->read_p = pimg->read_end = pimg->read_buf;
+   idx->read_end_pos = span->offset;
+   if (!check_label_space(pimg, span->label_len + 1)) {
+      img_errno = pimg->errcode = IMG_OUTOFMEMORY;
+      return img_BAD;
+   }
+   memcpy(pimg->label_buf, span->label, span->label_len + 1);
+   pimg->label_len = span->label_len;
+   pimg->label = pimg->label_buf;
+   pimg->style = span->style;
+#if IMG_API_VERSION == 0
+   pimg->date1 = span->days1 < 0 ? 0 : (span->days1 - 25567) * 86400;
+   pimg->date2 = span->days2 < 0 ? 0 : (span->days2 - 25567) * 86400;
+#else /* IMG_API_VERSION == 1 */
+   pimg->days1 = span->days1;
+   pimg->days2 = span->days2;
+#endif
+   if (move && span->have_point) {
+      pimg->mv.x = span->x / 100.0;
+      pimg->mv.y = span->y / 100.0;
+      pimg->mv.z = span->z / 100.0;
+      pimg->pending = 15;
+   } else {
+      pimg->pending = 0;
+   }
+   return 1;
+}
+
+/* If we're at the start of a span, skip ahead to the next span which might
+ * contain data we want.  Returns 0 if there isn't one (or we've reached the
+ * end of the spans img_read_spans() asked for), img_BAD on error, or 1
+ * otherwise. */
+static int
+skip_unwanted_spans(img *pimg)
+{
+   struct img_survey_index *idx = pimg->survey_index;
+   size_t i = idx->next_span;
+   long pos = idx->read_end_pos - (long)(pimg->read_end - pimg->read_p);
+   if (i >= idx->end_span) {
+      return idx->end_span == idx->n_spans ||
+	     pos < idx->spans[idx->end_span].offset;
+   }
+   if (pos < idx->spans[i].offset) return 1;
+
+   while (i < idx->end_span && !span_wanted(pimg, &(idx->spans[i]))) ++i;
+   if (i == idx->end_span) return 0;
+   idx->next_span = i + 1;
+   if (pos >= idx->spans[i].offset) return 1;
+
+   /* Any LINE we return next needs a MOVE to the point we skipped to. */
+   return seek_to_span(pimg, i, 1);
+}
+
+size_t
+img_span_count(img *pimg)
+{
+   if (!pimg->fRead || pimg->version < 8) return 0;
+   if (!pimg->survey_index) read_survey_index(pimg);
+   return pimg->survey_index ? pimg->survey_index->n_spans : 0;
+}
+
+int
+img_read_spans(img *pimg, size_t first, size_t end)
+{
+   struct img_survey_index *idx;
+   if (img_span_count(pimg) == 0) {
+      img_errno = pimg->errcode = IMG_BADFORMAT;
+      return 0;
+   }
+   idx = pimg->survey_index;
+   if (first >= end || end > idx->n_spans) {
+      img_errno = pimg->errcode = IMG_BADFORMAT;
+      return 0;
+   }
+   idx->next_span = first + 1;
+   idx->end_span = end;
+   if (seek_to_span(pimg, first, 0) == img_BAD) return 0;
+   img_errno = pimg->errcode = IMG_NONE;
+   return 1;
+}
+
 #define has_ext(F,L,E) ((L) > LITLEN(E) + 1 &&\
 			(F)[(L) - LITLEN(E) - 1] == FNM_SEP_EXT &&\
 			my_strcasecmp((F) + (L) - LITLEN(E), E) == 0)
@@ -386,6 +830,11 @@ img_open_survey(const char *fnm, const char *survey)
       return NULL;
    }
 
+   pimg->read_buf = NULL;
+   pimg->read_buf_size = 0;
+   pimg->read_p = pimg->read_end = NULL;
+   pimg->survey_index = NULL;
+
    pimg->buf_len = 257;
    pimg->label_buf = (char *)xosmalloc(pimg->buf_len);
    if (!pimg->label_buf) {
@@ -403,7 +852,7 @@ img_open_survey(const char *fnm, const char *survey)
    }
 
    pimg->fRead = 1; /* reading from this file */
-   img_errno = IMG_NONE;
+   img_errno = pimg->errcode = IMG_NONE;
 
    pimg->flags = 0;
 
@@ -855,27 +1304,44 @@ bad_3d_date:
 
    pimg->start = ftell(pimg->fh);
 
+   if (pimg->version >= 8 && pimg->survey_len) read_survey_index(pimg);
+
    return pimg;
 }
 
+long
+img_tell(img *pimg)
+{
+   long pos = ftell(pimg->fh);
+   if (pos < 0) return pos;
+   /* Allow for data we've read into read_buf but not decoded yet. */
+   return pos - (long)(pimg->read_end - pimg->read_p);
+}
+
 int
 img_rewind(img *pimg)
 {
    if (!pimg->fRead) {
-      img_errno = IMG_WRITEERROR;
+      img_errno = pimg->errcode = IMG_WRITEERROR;
       return 0;
    }
    if (fseek(pimg->fh, pimg->start, SEEK_SET) != 0) {
-      img_errno = IMG_READERROR;
+      img_errno = pimg->errcode = IMG_READERROR;
       return 0;
    }
    clearerr(pimg->fh);
+   /* Discard any data buffered from the old position. */
+   pimg->read_p = pimg->read_end = pimg->read_buf;
+   if (pimg->survey_index) {
+      pimg->survey_index->next_span = 0;
+      pimg->survey_index->read_end_pos = pimg->start;
+   }
    /* [VERSION_SURVEX_POS] already skipped heading line, or there wasn't one
     * [version 0] not in the middle of a 'LINE' command
     * [version >= 3] not in the middle of turning a LINE into a MOVE */
    pimg->pending = 0;
 
-   img_errno = IMG_NONE;
+   img_errno = pimg->errcode = IMG_NONE;
 
    /* for version >= 3 we use label_buf to store the prefix for reuse */
    /* for VERSION_COMPASS_PLT, 0 value indicates we haven't entered a survey
@@ -904,6 +1370,11 @@ img_open_write_cs(const char *fnm, const char *title, const char * cs, int flags
       return NULL;
    }
 
+   pimg->read_buf = NULL;
+   pimg->read_buf_size = 0;
+   pimg->read_p = pimg->read_end = NULL;
+   pimg->survey_index = NULL;
+
    pimg->buf_len = 257;
    pimg->label_buf = (char *)xosmalloc(pimg->buf_len);
    if (!pimg->label_buf) {
@@ -979,7 +1450,7 @@ img_open_write_cs(const char *fnm, const char *title, const char * cs, int flags
    }
 #endif
    pimg->fRead = 0; /* writing to this file */
-   img_errno = IMG_NONE;
+   img_errno = pimg->errcode = IMG_NONE;
 
    /* for version >= 3 we use label_buf to store the prefix for reuse */
    pimg->label_buf[0] = '\0';
@@ -1000,6 +1471,14 @@ img_open_write_cs(const char *fnm, const char *title, const char * cs, int flags
    pimg->length = 0.0;
    pimg->E = pimg->H = pimg->V = 0.0;
 
+   if (pimg->version >= 8) {
+      /* The survey index is optional, so carry on without one if we run out
+       * of memory. */
+      pimg->survey_index = new_survey_index();
+      if (pimg->survey_index && !start_span(pimg))
+	 free_survey_index(pimg);
+   }
+
    /* Don't check for write errors now - let img_close() report them... */
    return pimg;
 }
@@ -1047,15 +1526,16 @@ subtract_xyz_shot_deltas(img_point *pt, const char *line)
 }
 
 static int
-read_coord(FILE *fh, img_point *pt)
+read_coord(img *pimg, img_point *pt)
 {
+   FILE *fh = pimg->fh;
    SVX_ASSERT(fh);
    SVX_ASSERT(pt);
    pt->x = get32(fh) / 100.0;
    pt->y = get32(fh) / 100.0;
    pt->z = get32(fh) / 100.0;
    if (ferror(fh) || feof(fh)) {
-      img_errno = feof(fh) ? IMG_BADFORMAT : IMG_READERROR;
+      img_errno = pimg->errcode = feof(fh) ? IMG_BADFORMAT : IMG_READERROR;
       return 0;
    }
    return 1;
@@ -1067,45 +1547,131 @@ skip_coord(FILE *fh)
     return (fseek(fh, 12, SEEK_CUR) == 0);
 }
 
+/* Format version 8 files are read in large blocks and decoded from memory,
+ * which is much quicker than calling getc() for every byte. */
+#define READ_BLOCK_SIZE 65536
+
+/* Make sure at least n bytes are buffered.  Returns 0 (and sets img_errno)
+ * if there aren't that many bytes left in the file. */
+static int
+fill_read_buf(img *pimg, size_t n)
+{
+   size_t avail = pimg->read_end - pimg->read_p;
+   size_t size = pimg->read_buf_size;
+   size_t got;
+
+   if (avail && pimg->read_p != pimg->read_buf)
+      memmove(pimg->read_buf, pimg->read_p, avail);
+   if (n > size) {
+      unsigned char *b;
+      size = max(n, (size_t)READ_BLOCK_SIZE);
+      b = (unsigned char *)xosrealloc(pimg->read_buf, size);
+      if (!b) {
+	 img_errno = pimg->errcode = IMG_OUTOFMEMORY;
+	 return 0;
+      }
+      pimg->read_buf = b;
+      pimg->read_buf_size = size;
+   }
+   pimg->read_p = pimg->read_buf;
+   got = fread(pimg->read_buf + avail, 1, size - avail, pimg->fh);
+   pimg->read_end = pimg->read_buf + avail + got;
+   if (pimg->survey_index) pimg->survey_index->read_end_pos += got;
+   if (avail + got >= n) return 1;
+   img_errno = pimg->errcode = ferror(pimg->fh) ? IMG_READERROR : IMG_BADFORMAT;
+   return 0;
+}
+
+/* Evaluates to non-zero if N bytes are available to decode. */
+#define NEED(PIMG, N) ((size_t)((PIMG)->read_end - (PIMG)->read_p) >= (N) ||\
+		       fill_read_buf((PIMG), (N)))
+
+/* These take data from the buffer, and must be preceded by NEED(). */
+#define buf_getc(PIMG) (*(PIMG)->read_p++)
+
+static INT32_T
+buf_get32(img *pimg)
+{
+   const unsigned char *p = pimg->read_p;
+   INT32_T w = p[0];
+   w |= (INT32_T)p[1] << 8l;
+   w |= (INT32_T)p[2] << 16l;
+   w |= (INT32_T)p[3] << 24l;
+   pimg->read_p += 4;
+   return w;
+}
+
+static short
+buf_get16(img *pimg)
+{
+   const unsigned char *p = pimg->read_p;
+   short w = p[0];
+   w |= (short)p[1] << 8l;
+   pimg->read_p += 2;
+   return w;
+}
+
+#define buf_getu16(PIMG) ((unsigned short)buf_get16(PIMG))
+
+static int
+buf_read_coord(img *pimg, img_point *pt)
+{
+   if (!NEED(pimg, 12)) return 0;
+   pt->x = buf_get32(pimg) / 100.0;
+   pt->y = buf_get32(pimg) / 100.0;
+   pt->z = buf_get32(pimg) / 100.0;
+   return 1;
+}
+
+static int
+buf_skip_coord(img *pimg)
+{
+   if (!NEED(pimg, 12)) return 0;
+   pimg->read_p += 12;
+   return 1;
+}
+
 static int
 read_v3label(img *pimg)
 {
    char *q;
    long len = GETC(pimg->fh);
    if (len == EOF) {
-      img_errno = feof(pimg->fh) ? IMG_BADFORMAT : IMG_READERROR;
+      img_errno = pimg->errcode =
+	 feof(pimg->fh) ? IMG_BADFORMAT : IMG_READERROR;
       return img_BAD;
    }
    if (len == 0xfe) {
       len += get16(pimg->fh);
       if (feof(pimg->fh)) {
-	 img_errno = IMG_BADFORMAT;
+	 img_errno = pimg->errcode = IMG_BADFORMAT;
 	 return img_BAD;
       }
       if (ferror(pimg->fh)) {
-	 img_errno = IMG_READERROR;
+	 img_errno = pimg->errcode = IMG_READERROR;
 	 return img_BAD;
       }
    } else if (len == 0xff) {
       len = get32(pimg->fh);
       if (ferror(pimg->fh)) {
-	 img_errno = IMG_READERROR;
+	 img_errno = pimg->errcode = IMG_READERROR;
 	 return img_BAD;
       }
       if (feof(pimg->fh) || len < 0xfe + 0xffff) {
-	 img_errno = IMG_BADFORMAT;
+	 img_errno = pimg->errcode = IMG_BADFORMAT;
 	 return img_BAD;
       }
    }
 
    if (!check_label_space(pimg, pimg->label_len + len + 1)) {
-      img_errno = IMG_OUTOFMEMORY;
+      img_errno = pimg->errcode = IMG_OUTOFMEMORY;
       return img_BAD;
    }
    q = pimg->label_buf + pimg->label_len;
    pimg->label_len += len;
    if (len && fread(q, len, 1, pimg->fh) != 1) {
-      img_errno = feof(pimg->fh) ? IMG_BADFORMAT : IMG_READERROR;
+      img_errno = pimg->errcode =
+	 feof(pimg->fh) ? IMG_BADFORMAT : IMG_READERROR;
       return img_BAD;
    }
    q[len] = '\0';
@@ -1121,60 +1687,47 @@ read_v8label(img *pimg, int common_flag, size_t common_val)
       if (common_val == 0) return 0;
       add = del = common_val;
    } else {
-      int ch = GETC(pimg->fh);
-      if (ch == EOF) {
-	 img_errno = feof(pimg->fh) ? IMG_BADFORMAT : IMG_READERROR;
-	 return img_BAD;
-      }
+      int ch;
+      if (!NEED(pimg, 1)) return img_BAD;
+      ch = buf_getc(pimg);
       if (ch != 0x00) {
 	 del = ch >> 4;
 	 add = ch & 0x0f;
       } else {
-	 ch = GETC(pimg->fh);
-	 if (ch == EOF) {
-	    img_errno = feof(pimg->fh) ? IMG_BADFORMAT : IMG_READERROR;
-	    return img_BAD;
-	 }
+	 if (!NEED(pimg, 1)) return img_BAD;
+	 ch = buf_getc(pimg);
 	 if (ch != 0xff) {
 	    del = ch;
 	 } else {
-	    del = get32(pimg->fh);
-	    if (ferror(pimg->fh)) {
-	       img_errno = IMG_READERROR;
-	       return img_BAD;
-	    }
-	 }
-	 ch = GETC(pimg->fh);
-	 if (ch == EOF) {
-	    img_errno = feof(pimg->fh) ? IMG_BADFORMAT : IMG_READERROR;
-	    return img_BAD;
+	    if (!NEED(pimg, 4)) return img_BAD;
+	    del = buf_get32(pimg);
 	 }
+	 if (!NEED(pimg, 1)) return img_BAD;
+	 ch = buf_getc(pimg);
 	 if (ch != 0xff) {
 	    add = ch;
 	 } else {
-	    add = get32(pimg->fh);
-	    if (ferror(pimg->fh)) {
-	       img_errno = IMG_READERROR;
-	       return img_BAD;
-	    }
+	    if (!NEED(pimg, 4)) return img_BAD;
+	    add = buf_get32(pimg);
 	 }
       }
 
       if (add > del && !check_label_space(pimg, pimg->label_len + add - del + 1)) {
-	 img_errno = IMG_OUTOFMEMORY;
+	 img_errno = pimg->errcode = IMG_OUTOFMEMORY;
 	 return img_BAD;
       }
    }
    if (del > pimg->label_len) {
-      img_errno = IMG_BADFORMAT;
+      img_errno = pimg->errcode = IMG_BADFORMAT;
       return img_BAD;
    }
    pimg->label_len -= del;
    q = pimg->label_buf + pimg->label_len;
    pimg->label_len += add;
-   if (add && fread(q, add, 1, pimg->fh) != 1) {
-      img_errno = feof(pimg->fh) ? IMG_BADFORMAT : IMG_READERROR;
-      return img_BAD;
+   if (add) {
+      if (!NEED(pimg, add)) return img_BAD;
+      memcpy(q, pimg->read_p, add);
+      pimg->read_p += add;
    }
    q[add] = '\0';
    return 0;
@@ -1219,12 +1772,13 @@ img_read_item_new(img *pimg, img_point *p)
       return img_LINE;
    }
    again3: /* label to goto if we get a prefix, date, or lrud */
-   pimg->label = pimg->label_buf;
-   opt = GETC(pimg->fh);
-   if (opt == EOF) {
-      img_errno = feof(pimg->fh) ? IMG_BADFORMAT : IMG_READERROR;
-      return img_BAD;
+   if (pimg->survey_index) {
+      result = skip_unwanted_spans(pimg);
+      if (result != 1) return result ? result : img_STOP;
    }
+   pimg->label = pimg->label_buf;
+   if (!NEED(pimg, 1)) return img_BAD;
+   opt = buf_getc(pimg);
    if (opt >> 6 == 0) {
       if (opt <= 4) {
 	 if (opt == 0 && pimg->style == 0)
@@ -1244,7 +1798,9 @@ img_read_item_new(img *pimg, img_point *p)
 		  break;
 	      }
 	      case 0x11: { /* Single date */
-		  int days1 = (int)getu16(pimg->fh);
+		  int days1;
+		  if (!NEED(pimg, 2)) return img_BAD;
+		  days1 = (int)buf_getu16(pimg);
 #if IMG_API_VERSION == 0
 		  pimg->date2 = pimg->date1 = (days1 - 25567) * 86400;
 #else /* IMG_API_VERSION == 1 */
@@ -1253,8 +1809,10 @@ img_read_item_new(img *pimg, img_point *p)
 		  break;
 	      }
 	      case 0x12: { /* Date range (short) */
-		  int days1 = (int)getu16(pimg->fh);
-		  int days2 = days1 + GETC(pimg->fh) + 1;
+		  int days1, days2;
+		  if (!NEED(pimg, 3)) return img_BAD;
+		  days1 = (int)buf_getu16(pimg);
+		  days2 = days1 + buf_getc(pimg) + 1;
 #if IMG_API_VERSION == 0
 		  pimg->date1 = (days1 - 25567) * 86400;
 		  pimg->date2 = (days2 - 25567) * 86400;
@@ -1265,8 +1823,10 @@ img_read_item_new(img *pimg, img_point *p)
 		  break;
 	      }
 	      case 0x13: { /* Date range (long) */
-		  int days1 = (int)getu16(pimg->fh);
-		  int days2 = (int)getu16(pimg->fh);
+		  int days1, days2;
+		  if (!NEED(pimg, 4)) return img_BAD;
+		  days1 = (int)buf_getu16(pimg);
+		  days2 = (int)buf_getu16(pimg);
 #if IMG_API_VERSION == 0
 		  pimg->date1 = (days1 - 25567) * 86400;
 		  pimg->date2 = (days2 - 25567) * 86400;
@@ -1277,26 +1837,29 @@ img_read_item_new(img *pimg, img_point *p)
 		  break;
 	      }
 	      case 0x1f: /* Error info */
-		  pimg->n_legs = get32(pimg->fh);
-		  pimg->length = get32(pimg->fh) / 100.0;
-		  pimg->E = get32(pimg->fh) / 100.0;
-		  pimg->H = get32(pimg->fh) / 100.0;
-		  pimg->V = get32(pimg->fh) / 100.0;
+		  if (!NEED(pimg, 20)) return img_BAD;
+		  pimg->n_legs = buf_get32(pimg);
+		  pimg->length = buf_get32(pimg) / 100.0;
+		  pimg->E = buf_get32(pimg) / 100.0;
+		  pimg->H = buf_get32(pimg) / 100.0;
+		  pimg->V = buf_get32(pimg) / 100.0;
 		  return img_ERROR_INFO;
 	      case 0x30: case 0x31: /* LRUD */
 	      case 0x32: case 0x33: /* Big LRUD! */
 		  if (read_v8label(pimg, 0, 0) == img_BAD) return img_BAD;
 		  pimg->flags = (int)opt & 0x01;
 		  if (opt < 0x32) {
-		      pimg->l = get16(pimg->fh) / 100.0;
-		      pimg->r = get16(pimg->fh) / 100.0;
-		      pimg->u = get16(pimg->fh) / 100.0;
-		      pimg->d = get16(pimg->fh) / 100.0;
+		      if (!NEED(pimg, 8)) return img_BAD;
+		      pimg->l = buf_get16(pimg) / 100.0;
+		      pimg->r = buf_get16(pimg) / 100.0;
+		      pimg->u = buf_get16(pimg) / 100.0;
+		      pimg->d = buf_get16(pimg) / 100.0;
 		  } else {
-		      pimg->l = get32(pimg->fh) / 100.0;
-		      pimg->r = get32(pimg->fh) / 100.0;
-		      pimg->u = get32(pimg->fh) / 100.0;
-		      pimg->d = get32(pimg->fh) / 100.0;
+		      if (!NEED(pimg, 16)) return img_BAD;
+		      pimg->l = buf_get32(pimg) / 100.0;
+		      pimg->r = buf_get32(pimg) / 100.0;
+		      pimg->u = buf_get32(pimg) / 100.0;
+		      pimg->d = buf_get32(pimg) / 100.0;
 		  }
 		  if (pimg->survey_len) {
 		      size_t l = pimg->survey_len;
@@ -1316,14 +1879,14 @@ img_read_item_new(img *pimg, img_point *p)
 		  }
 		  return img_XSECT;
 	      default: /* 0x25 - 0x2f and 0x34 - 0x3f are currently unallocated. */
-		  img_errno = IMG_BADFORMAT;
+		  img_errno = pimg->errcode = IMG_BADFORMAT;
 		  return img_BAD;
 	  }
 	  goto again3;
       }
       if (opt != 15) {
 	 /* 1-14 and 16-31 reserved */
-	 img_errno = IMG_BADFORMAT;
+	 img_errno = pimg->errcode = IMG_BADFORMAT;
 	 return img_BAD;
       }
       result = img_MOVE;
@@ -1336,7 +1899,7 @@ img_read_item_new(img *pimg, img_point *p)
 	 size_t l = pimg->survey_len;
 	 const char *s = pimg->label_buf;
 	 if (strncmp(pimg->survey, s, l + 1) != 0) {
-	    if (!skip_coord(pimg->fh)) return img_BAD;
+	    if (!buf_skip_coord(pimg)) return img_BAD;
 	    pimg->pending = 0;
 	    goto again3;
 	 }
@@ -1356,7 +1919,7 @@ img_read_item_new(img *pimg, img_point *p)
 	 const char *s = pimg->label_buf;
 	 if (strncmp(pimg->survey, s, l) != 0 ||
 	     !(s[l] == '.' || s[l] == '\0')) {
-	    if (!read_coord(pimg->fh, &(pimg->mv))) return img_BAD;
+	    if (!buf_read_coord(pimg, &(pimg->mv))) return img_BAD;
 	    pimg->pending = 15;
 	    goto again3;
 	 }
@@ -1367,16 +1930,16 @@ img_read_item_new(img *pimg, img_point *p)
 
       if (pimg->pending) {
 	 *p = pimg->mv;
-	 if (!read_coord(pimg->fh, &(pimg->mv))) return img_BAD;
+	 if (!buf_read_coord(pimg, &(pimg->mv))) return img_BAD;
 	 pimg->pending = opt;
 	 return img_MOVE;
       }
       pimg->flags = (int)opt & 0x1f;
    } else {
-      img_errno = IMG_BADFORMAT;
+      img_errno = pimg->errcode = IMG_BADFORMAT;
       return img_BAD;
    }
-   if (!read_coord(pimg->fh, p)) return img_BAD;
+   if (!buf_read_coord(pimg, p)) return img_BAD;
    pimg->pending = 0;
    return result;
 }
@@ -1401,7 +1964,8 @@ img_read_item_v3to7(img *pimg, img_point *p)
    pimg->label = pimg->label_buf;
    opt = GETC(pimg->fh);
    if (opt == EOF) {
-      img_errno = feof(pimg->fh) ? IMG_BADFORMAT : IMG_READERROR;
+      img_errno = pimg->errcode =
+	 feof(pimg->fh) ? IMG_BADFORMAT : IMG_READERROR;
       return img_BAD;
    }
    switch (opt >> 6) {
@@ -1416,7 +1980,7 @@ img_read_item_v3to7(img *pimg, img_point *p)
 	 int c;
 	 if (pimg->label_len <= 17) {
 	    /* zero prefix using "0" */
-	    img_errno = IMG_BADFORMAT;
+	    img_errno = pimg->errcode = IMG_BADFORMAT;
 	    return img_BAD;
 	 }
 	 /* extra - 1 because label_len points to one past the end */
@@ -1424,7 +1988,7 @@ img_read_item_v3to7(img *pimg, img_point *p)
 	 while (pimg->label_buf[c] != '.' || --opt > 0) {
 	    if (--c < 0) {
 	       /* zero prefix using "0" */
-	       img_errno = IMG_BADFORMAT;
+	       img_errno = pimg->errcode = IMG_BADFORMAT;
 	       return img_BAD;
 	    }
 	 }
@@ -1489,27 +2053,27 @@ img_read_item_v3to7(img *pimg, img_point *p)
 		  pimg->H = get32(pimg->fh) / 100.0;
 		  pimg->V = get32(pimg->fh) / 100.0;
 		  if (feof(pimg->fh)) {
-		      img_errno = IMG_BADFORMAT;
+		      img_errno = pimg->errcode = IMG_BADFORMAT;
 		      return img_BAD;
 		  }
 		  if (ferror(pimg->fh)) {
-		      img_errno = IMG_READERROR;
+		      img_errno = pimg->errcode = IMG_READERROR;
 		      return img_BAD;
 		  }
 		  return img_ERROR_INFO;
 	      case 0x23: { /* v7+: Date range (long) */
 		  if (pimg->version < 7) {
-		      img_errno = IMG_BADFORMAT;
+		      img_errno = pimg->errcode = IMG_BADFORMAT;
 		      return img_BAD;
 		  }
 		  int days1 = (int)getu16(pimg->fh);
 		  int days2 = (int)getu16(pimg->fh);
 		  if (feof(pimg->fh)) {
-		      img_errno = IMG_BADFORMAT;
+		      img_errno = pimg->errcode = IMG_BADFORMAT;
 		      return img_BAD;
 		  }
 		  if (ferror(pimg->fh)) {
-		      img_errno = IMG_READERROR;
+		      img_errno = pimg->errcode = IMG_READERROR;
 		      return img_BAD;
 		  }
 #if IMG_API_VERSION == 0
@@ -1545,11 +2109,11 @@ img_read_item_v3to7(img *pimg, img_point *p)
 		      pimg->d = get32(pimg->fh) / 100.0;
 		  }
 		  if (feof(pimg->fh)) {
-		      img_errno = IMG_BADFORMAT;
+		      img_errno = pimg->errcode = IMG_BADFORMAT;
 		      return img_BAD;
 		  }
 		  if (ferror(pimg->fh)) {
-		      img_errno = IMG_READERROR;
+		      img_errno = pimg->errcode = IMG_READERROR;
 		      return img_BAD;
 		  }
 		  if (pimg->survey_len) {
@@ -1570,15 +2134,15 @@ img_read_item_v3to7(img *pimg, img_point *p)
 		  }
 		  return img_XSECT;
 	      default: /* 0x25 - 0x2f and 0x34 - 0x3f are currently unallocated. */
-		  img_errno = IMG_BADFORMAT;
+		  img_errno = pimg->errcode = IMG_BADFORMAT;
 		  return img_BAD;
 	  }
 	  if (feof(pimg->fh)) {
-	      img_errno = IMG_BADFORMAT;
+	      img_errno = pimg->errcode = IMG_BADFORMAT;
 	      return img_BAD;
 	  }
 	  if (ferror(pimg->fh)) {
-	      img_errno = IMG_READERROR;
+	      img_errno = pimg->errcode = IMG_READERROR;
 	      return img_BAD;
 	  }
 	  goto again3;
@@ -1586,7 +2150,7 @@ img_read_item_v3to7(img *pimg, img_point *p)
       /* 16-31 mean remove (n - 15) characters from the prefix */
       /* zero prefix using 0 */
       if (pimg->label_len <= (size_t)(opt - 15)) {
-	 img_errno = IMG_BADFORMAT;
+	 img_errno = pimg->errcode = IMG_BADFORMAT;
 	 return img_BAD;
       }
       pimg->label_len -= (opt - 15);
@@ -1621,7 +2185,7 @@ img_read_item_v3to7(img *pimg, img_point *p)
 	 const char *s = pimg->label_buf;
 	 if (strncmp(pimg->survey, s, l) != 0 ||
 	     !(s[l] == '.' || s[l] == '\0')) {
-	    if (!read_coord(pimg->fh, &(pimg->mv))) return img_BAD;
+	    if (!read_coord(pimg, &(pimg->mv))) return img_BAD;
 	    pimg->pending = 15;
 	    goto again3;
 	 }
@@ -1632,17 +2196,17 @@ img_read_item_v3to7(img *pimg, img_point *p)
 
       if (pimg->pending) {
 	 *p = pimg->mv;
-	 if (!read_coord(pimg->fh, &(pimg->mv))) return img_BAD;
+	 if (!read_coord(pimg, &(pimg->mv))) return img_BAD;
 	 pimg->pending = opt;
 	 return img_MOVE;
       }
       pimg->flags = (int)opt & 0x3f;
       break;
     default:
-      img_errno = IMG_BADFORMAT;
+      img_errno = pimg->errcode = IMG_BADFORMAT;
       return img_BAD;
    }
-   if (!read_coord(pimg->fh, p)) return img_BAD;
+   if (!read_coord(pimg, p)) return img_BAD;
    pimg->pending = 0;
    return result;
 }
@@ -1671,11 +2235,11 @@ img_read_item_ancient(img *pimg, img_point *p)
    }
 
    if (feof(pimg->fh)) {
-      img_errno = IMG_BADFORMAT;
+      img_errno = pimg->errcode = IMG_BADFORMAT;
       return img_BAD;
    }
    if (ferror(pimg->fh)) {
-      img_errno = IMG_READERROR;
+      img_errno = pimg->errcode = IMG_READERROR;
       return img_BAD;
    }
 
@@ -1685,7 +2249,8 @@ img_read_item_ancient(img *pimg, img_point *p)
     case 1:
       /* skip coordinates */
       if (!skip_coord(pimg->fh)) {
-	 img_errno = feof(pimg->fh) ? IMG_BADFORMAT : IMG_READERROR;
+	 img_errno = pimg->errcode =
+	    feof(pimg->fh) ? IMG_BADFORMAT : IMG_READERROR;
 	 return img_BAD;
       }
       goto again;
@@ -1693,13 +2258,14 @@ img_read_item_ancient(img *pimg, img_point *p)
       size_t len;
       result = img_LABEL;
       if (!fgets(pimg->label_buf, pimg->buf_len, pimg->fh)) {
-	 img_errno = feof(pimg->fh) ? IMG_BADFORMAT : IMG_READERROR;
+	 img_errno = pimg->errcode =
+	    feof(pimg->fh) ? IMG_BADFORMAT : IMG_READERROR;
 	 return img_BAD;
       }
       if (pimg->label[0] == '\\') pimg->label++;
       len = strlen(pimg->label);
       if (len == 0 || pimg->label[len - 1] != '\n') {
-	 img_errno = IMG_BADFORMAT;
+	 img_errno = pimg->errcode = IMG_BADFORMAT;
 	 return img_BAD;
       }
       /* Ignore empty labels in some .3d files (caused by a bug) */
@@ -1721,22 +2287,23 @@ img_read_item_ancient(img *pimg, img_point *p)
       len = get32(pimg->fh);
 
       if (feof(pimg->fh)) {
-	 img_errno = IMG_BADFORMAT;
+	 img_errno = pimg->errcode = IMG_BADFORMAT;
 	 return img_BAD;
       }
       if (ferror(pimg->fh)) {
-	 img_errno = IMG_READERROR;
+	 img_errno = pimg->errcode = IMG_READERROR;
 	 return img_BAD;
       }
 
       /* Ignore empty labels in some .3d files (caused by a bug) */
       if (len == 0) goto again;
       if (!check_label_space(pimg, len + 1)) {
-	 img_errno = IMG_OUTOFMEMORY;
+	 img_errno = pimg->errcode = IMG_OUTOFMEMORY;
 	 return img_BAD;
       }
       if (fread(pimg->label_buf, len, 1, pimg->fh) != 1) {
-	 img_errno = feof(pimg->fh) ? IMG_BADFORMAT : IMG_READERROR;
+	 img_errno = pimg->errcode =
+	    feof(pimg->fh) ? IMG_BADFORMAT : IMG_READERROR;
 	 return img_BAD;
       }
       pimg->label_buf[len] = '\0';
@@ -1759,27 +2326,28 @@ img_read_item_ancient(img *pimg, img_point *p)
 	 pimg->flags = (int)opt & 0x3f;
 	 result = img_LABEL;
 	 if (!fgets(pimg->label_buf, pimg->buf_len, pimg->fh)) {
-	    img_errno = feof(pimg->fh) ? IMG_BADFORMAT : IMG_READERROR;
+	    img_errno = pimg->errcode =
+	       feof(pimg->fh) ? IMG_BADFORMAT : IMG_READERROR;
 	    return img_BAD;
 	 }
 	 q = pimg->label_buf + strlen(pimg->label_buf) - 1;
 	 /* Ignore empty-labels in some .3d files (caused by a bug) */
 	 if (q == pimg->label_buf) goto again;
 	 if (*q != '\n') {
-	    img_errno = IMG_BADFORMAT;
+	    img_errno = pimg->errcode = IMG_BADFORMAT;
 	    return img_BAD;
 	 }
 	 *q = '\0';
 	 break;
        }
        default:
-	 img_errno = IMG_BADFORMAT;
+	 img_errno = pimg->errcode = IMG_BADFORMAT;
 	 return img_BAD;
       }
       break;
    }
 
-   if (!read_coord(pimg->fh, &pt)) return img_BAD;
+   if (!read_coord(pimg, &pt)) return img_BAD;
 
    if (result == img_LABEL && pimg->survey_len) {
       if (strncmp(pimg->label, pimg->survey, pimg->survey_len + 1) != 0)
@@ -1795,11 +2363,11 @@ img_read_item_ancient(img *pimg, img_point *p)
       opt_lookahead = get32(pimg->fh);
 
       if (feof(pimg->fh)) {
-	 img_errno = IMG_BADFORMAT;
+	 img_errno = pimg->errcode = IMG_BADFORMAT;
 	 return img_BAD;
       }
       if (ferror(pimg->fh)) {
-	 img_errno = IMG_READERROR;
+	 img_errno = pimg->errcode = IMG_READERROR;
 	 return img_BAD;
       }
 
@@ -1850,7 +2418,8 @@ img_read_item_ascii(img *pimg, img_point *p)
 	    result = img_MOVE;
 	 } else if (strcmp(cmd, "cross") == 0) {
 	    if (fscanf(pimg->fh, "%lf%lf%lf", &p->x, &p->y, &p->z) < 3) {
-	       img_errno = feof(pimg->fh) ? IMG_BADFORMAT : IMG_READERROR;
+	       img_errno = pimg->errcode =
+		  feof(pimg->fh) ? IMG_BADFORMAT : IMG_READERROR;
 	       return img_BAD;
 	    }
 	    goto ascii_again;
@@ -1860,12 +2429,13 @@ img_read_item_ascii(img *pimg, img_point *p)
 	    if (ch == ' ') ch = GETC(pimg->fh);
 	    while (ch != ' ') {
 	       if (ch == '\n' || ch == EOF) {
-		  img_errno = ferror(pimg->fh) ? IMG_READERROR : IMG_BADFORMAT;
+		  img_errno = pimg->errcode =
+		     ferror(pimg->fh) ? IMG_READERROR : IMG_BADFORMAT;
 		  return img_BAD;
 	       }
 	       if (off == pimg->buf_len) {
 		  if (!check_label_space(pimg, pimg->buf_len * 2)) {
-		     img_errno = IMG_OUTOFMEMORY;
+		     img_errno = pimg->errcode = IMG_OUTOFMEMORY;
 		     return img_BAD;
 		  }
 	       }
@@ -1881,13 +2451,14 @@ img_read_item_ascii(img *pimg, img_point *p)
 
 	    result = img_LABEL;
 	 } else {
-	    img_errno = IMG_BADFORMAT;
+	    img_errno = pimg->errcode = IMG_BADFORMAT;
 	    return img_BAD; /* unknown keyword */
 	 }
       }
 
       if (fscanf(pimg->fh, "%lf%lf%lf", &p->x, &p->y, &p->z) < 3) {
-	 img_errno = ferror(pimg->fh) ? IMG_READERROR : IMG_BADFORMAT;
+	 img_errno = pimg->errcode =
+	    ferror(pimg->fh) ? IMG_READERROR : IMG_BADFORMAT;
 	 return img_BAD;
       }
 
@@ -1907,12 +2478,12 @@ img_read_item_ascii(img *pimg, img_point *p)
       off = 0;
       while (fscanf(pimg->fh, "(%lf,%lf,%lf )", &p->x, &p->y, &p->z) != 3) {
 	 if (ferror(pimg->fh)) {
-	    img_errno = IMG_READERROR;
+	    img_errno = pimg->errcode = IMG_READERROR;
 	    return img_BAD;
 	 }
 	 if (feof(pimg->fh)) return img_STOP;
 	 if (pimg->pending) {
-	    img_errno = IMG_BADFORMAT;
+	    img_errno = pimg->errcode = IMG_BADFORMAT;
 	    return img_BAD;
 	 }
 	 pimg->pending = 1;
@@ -1935,7 +2506,7 @@ img_read_item_ascii(img *pimg, img_point *p)
       off = 1;
       while (!feof(pimg->fh)) {
 	 if (!fgets(pimg->label_buf + off, pimg->buf_len - off, pimg->fh)) {
-	    img_errno = IMG_READERROR;
+	    img_errno = pimg->errcode = IMG_READERROR;
 	    return img_BAD;
 	 }
 
@@ -1945,7 +2516,7 @@ img_read_item_ascii(img *pimg, img_point *p)
 	    break;
 	 }
 	 if (!check_label_space(pimg, pimg->buf_len * 2)) {
-	    img_errno = IMG_OUTOFMEMORY;
+	    img_errno = pimg->errcode = IMG_OUTOFMEMORY;
 	    return img_BAD;
 	 }
       }
@@ -2001,14 +2572,14 @@ skip_to_N:
 	    case 'N':
 	       line = getline_alloc(pimg->fh);
 	       if (!line) {
-		  img_errno = IMG_OUTOFMEMORY;
+		  img_errno = pimg->errcode = IMG_OUTOFMEMORY;
 		  return img_BAD;
 	       }
 	       while (line[len] > 32) ++len;
 	       if (pimg->label_len == 0) pimg->pending = -1;
 	       if (!check_label_space(pimg, len + 1)) {
 		  osfree(line);
-		  img_errno = IMG_OUTOFMEMORY;
+		  img_errno = pimg->errcode = IMG_OUTOFMEMORY;
 		  return img_BAD;
 	       }
 	       pimg->label_len = len;
@@ -2041,16 +2612,16 @@ skip_to_N:
 	       }
 	       line = getline_alloc(pimg->fh);
 	       if (!line) {
-		  img_errno = IMG_OUTOFMEMORY;
+		  img_errno = pimg->errcode = IMG_OUTOFMEMORY;
 		  return img_BAD;
 	       }
 	       /* Compass stores coordinates as North, East, Up = (y,x,z)! */
 	       if (sscanf(line, "%lf%lf%lf", &p->y, &p->x, &p->z) != 3) {
 		  osfree(line);
 		  if (ferror(pimg->fh)) {
-		     img_errno = IMG_READERROR;
+		     img_errno = pimg->errcode = IMG_READERROR;
 		  } else {
-		     img_errno = IMG_BADFORMAT;
+		     img_errno = pimg->errcode = IMG_BADFORMAT;
 		  }
 		  return img_BAD;
 	       }
@@ -2060,7 +2631,7 @@ skip_to_N:
 	       q = strchr(line, 'S');
 	       if (!q) {
 		  osfree(line);
-		  img_errno = IMG_BADFORMAT;
+		  img_errno = pimg->errcode = IMG_BADFORMAT;
 		  return img_BAD;
 	       }
 	       ++q;
@@ -2069,7 +2640,7 @@ skip_to_N:
 	       q[len] = '\0';
 	       len += 2; /* ' ' and '\0' */
 	       if (!check_label_space(pimg, pimg->label_len + len)) {
-		  img_errno = IMG_OUTOFMEMORY;
+		  img_errno = pimg->errcode = IMG_OUTOFMEMORY;
 		  return img_BAD;
 	       }
 	       pimg->label = pimg->label_buf;
@@ -2091,9 +2662,9 @@ skip_to_N:
 			      &pimg->l, &pimg->r, &pimg->u, &pimg->d) != 4) {
 		       osfree(line);
 		       if (ferror(pimg->fh)) {
-			   img_errno = IMG_READERROR;
+			   img_errno = pimg->errcode = IMG_READERROR;
 		       } else {
-			   img_errno = IMG_BADFORMAT;
+			   img_errno = pimg->errcode = IMG_BADFORMAT;
 		       }
 		       return img_BAD;
 		   }
@@ -2114,7 +2685,7 @@ skip_to_N:
 	       return img_LABEL;
 	    }
 	    default:
-	       img_errno = IMG_BADFORMAT;
+	       img_errno = pimg->errcode = IMG_BADFORMAT;
 	       return img_BAD;
 	 }
       }
@@ -2156,7 +2727,7 @@ skip_to_N:
 	 if (feof(pimg->fh)) return img_STOP;
 	 line = getline_alloc(pimg->fh);
 	 if (!line) {
-	    img_errno = IMG_OUTOFMEMORY;
+	    img_errno = pimg->errcode = IMG_OUTOFMEMORY;
 	    return img_BAD;
 	 }
       } while (line[0] == ' ' || line[0] == '\0');
@@ -2167,7 +2738,7 @@ skip_to_N:
 	 /* station variant */
 	 if (len < 37) {
 	    osfree(line);
-	    img_errno = IMG_BADFORMAT;
+	    img_errno = pimg->errcode = IMG_BADFORMAT;
 	    return img_BAD;
 	 }
 	 memcpy(pimg->label, line, 6);
@@ -2185,7 +2756,7 @@ skip_to_N:
 	 char old[8], new_[8];
 	 if (len < 61) {
 	    osfree(line);
-	    img_errno = IMG_BADFORMAT;
+	    img_errno = pimg->errcode = IMG_BADFORMAT;
 	    return img_BAD;
 	 }
 
@@ -2531,10 +3102,12 @@ img_write_item_new(img *pimg, int code, int flags, const char *s,
 {
    switch (code) {
     case img_LABEL:
+      index_station(pimg, s);
       write_v8label(pimg, 0x80 | flags, 0, -1, s);
       break;
     case img_XSECT: {
       INT32_T l, r, u, d, max_dim;
+      index_station(pimg, s);
       img_write_item_date_new(pimg);
       l = (INT32_T)my_lround(pimg->l * 100.0);
       r = (INT32_T)my_lround(pimg->r * 100.0);
@@ -2564,8 +3137,11 @@ img_write_item_new(img *pimg, int code, int flags, const char *s,
     }
     case img_MOVE:
       PUTC(15, pimg->fh);
+      index_point(pimg, x, y, z);
       break;
     case img_LINE:
+      if (!s) s = "";
+      index_item(pimg, s, strlen(s));
       img_write_item_date_new(pimg);
       if (pimg->style != pimg->oldstyle) {
 	  switch (pimg->style) {
@@ -2579,7 +3155,8 @@ img_write_item_new(img *pimg, int code, int flags, const char *s,
 	  }
 	  pimg->oldstyle = pimg->style;
       }
-      write_v8label(pimg, 0x40 | flags, 0x20, 0x00, s ? s : "");
+      write_v8label(pimg, 0x40 | flags, 0x20, 0x00, s);
+      index_point(pimg, x, y, z);
       break;
     default: /* ignore for now */
       return;
@@ -2730,9 +3307,14 @@ img_close(img *pimg)
 	       put32((INT32_T)-1, pimg->fh);
 	       break;
 	     default:
+	       /* For version 8, 0x00 only marks the end of the data if the
+		* current style is STYLE_NORMAL, so we first need to reset
+		* the style if the last one actually written wasn't.  That's
+		* oldstyle - style is just what the caller set for the next
+		* leg, which may never have been written. */
 	       if (pimg->version <= 7 ?
 		   (pimg->label_len != 0) :
-		   (pimg->style != img_STYLE_NORMAL)) {
+		   (pimg->oldstyle != img_STYLE_NORMAL)) {
 		  PUTC(0, pimg->fh);
 	       }
 	       /* FALL THROUGH */
@@ -2740,11 +3322,14 @@ img_close(img *pimg)
 	       PUTC(0, pimg->fh);
 	       break;
 	    }
+	    if (pimg->survey_index) write_survey_index(pimg);
 	 }
 	 if (ferror(pimg->fh)) result = 0;
 	 if (fclose(pimg->fh)) result = 0;
 	 if (!result) img_errno = pimg->fRead ? IMG_READERROR : IMG_WRITEERROR;
       }
+      free_survey_index(pimg);
+      osfree(pimg->read_buf);
       osfree(pimg->label_buf);
       osfree(pimg->filename_opened);
       osfree(pimg);
@@ -83,6 +83,13 @@ extern "C" {
 # define img_STYLE_CYLPOLAR   3
 # define img_STYLE_NOSURVEY   4
 
+/* Codes returned by img_error */
+typedef enum {
+   IMG_NONE = 0, IMG_FILENOTFOUND, IMG_OUTOFMEMORY,
+   IMG_CANTOPENOUT, IMG_BADFORMAT, IMG_DIRECTORY,
+   IMG_READERROR, IMG_WRITEERROR, IMG_TOONEW
+} img_errcode;
+
 /* 3D coordinates (in metres) */
 typedef struct {
    double x, y, z;
@@ -119,6 +126,11 @@ typedef struct {
     */
    time_t datestamp_numeric;
    char separator; /* character used to separate survey levels ('.' usually) */
+   /* Why the last call which failed using this img struct failed.  Unlike
+    * img_error(), this isn't shared by all img structs, so it is reliable
+    * when several threads are each reading using their own img struct.
+    */
+   img_errcode errcode;
 
    /* Members that can be set when writing: */
 #if IMG_API_VERSION == 0
@@ -145,6 +157,10 @@ typedef struct {
 
    /* All other members are for internal use only: */
    FILE *fh;          /* file handle of image file */
+   /* Data read from fh but not yet decoded (format version >= 8 only): */
+   unsigned char *read_buf;
+   size_t read_buf_size;
+   const unsigned char *read_p, *read_end;
    char *label_buf;
    size_t buf_len;
    size_t label_len;
@@ -176,6 +192,9 @@ typedef struct {
    int olddays1, olddays2;
 #endif
    int oldstyle;
+   /* Index of which parts of the file hold data for which surveys (format
+    * version >= 8 only, NULL if there isn't one): */
+   struct img_survey_index *survey_index;
 } img;
 
 /* Which version of the file format to output (defaults to newest) */
@@ -197,7 +216,9 @@ extern unsigned int img_output_version;
  * fnm is the filename
  * Returns pointer to an img struct or NULL
  * survey points to a survey name to restrict reading to (or NULL for all
- * survey data in the file)
+ * survey data in the file).  If the file has a survey index (written by
+ * img_close() for format version >= 8), parts of the file which can't
+ * contain data for this survey aren't read at all.
  */
 img *img_open_survey(const char *fnm, const char *survey);
 
@@ -257,6 +278,34 @@ void img_write_item(img *pimg, int code, int flags, const char *s,
 void img_write_errors(img *pimg, int n_legs, double length,
 		      double E, double H, double V);
 
+/* Return the number of spans in the survey index of a .3d file opened for
+ * reading, or 0 if the file doesn't have an index.  Ranges of spans can be
+ * decoded independently using img_read_spans().
+ * pimg is a pointer to an img struct returned by img_open()
+ * Call this before reading any items.
+ */
+size_t img_span_count(img *pimg);
+
+/* Restrict reading to spans first to end - 1 of the survey index, seeking to
+ * the start of span first and restoring the decoder state there, so the data
+ * can be decoded in parallel using a separate img struct for each range.
+ * Without a survey filter, the items read from consecutive ranges are
+ * exactly those which would be read from the whole file.
+ * pimg is a pointer to an img struct returned by img_open()
+ * first and end give the range of spans (end must be at most the value
+ * returned by img_span_count())
+ * Returns: non-zero for success, zero for error (check img_error() for
+ *   details)
+ */
+int img_read_spans(img *pimg, size_t first, size_t end);
+
+/* Return the position in the file of the next data to be decoded, allowing
+ * for any data which has been read into a buffer but not decoded yet.  This
+ * can be used to report progress.
+ * pimg is a pointer to an img struct returned by img_open()
+ */
+long img_tell(img *pimg);
+
 /* rewind a .3d file opened for reading so the data can be read in
  * several passes
  * pimg is a pointer to an img struct returned by img_open()
@@ -273,17 +322,14 @@ int img_rewind(img *pimg);
  */
 int img_close(img *pimg);
 
-/* Codes returned by img_error */
-typedef enum {
-   IMG_NONE = 0, IMG_FILENOTFOUND, IMG_OUTOFMEMORY,
-   IMG_CANTOPENOUT, IMG_BADFORMAT, IMG_DIRECTORY,
-   IMG_READERROR, IMG_WRITEERROR, IMG_TOONEW
-} img_errcode;
-
 /* Read the error code
  * If img_open(), img_open_survey() or img_open_write() returns NULL, or
  * img_rewind() or img_close() returns 0, or img_read_item() returns img_BAD
  * then you can call this function to discover why.
+ *
+ * This is shared by all img structs, so if several threads are reading at
+ * once, use the errcode member of the img struct instead (except when
+ * opening a file fails).
  */
 img_errcode img_error(void);
 
@@ -1,6 +1,6 @@
 /* imgtest.c */
 /* Test img in unhosted mode */
-/* Copyright (C) 2014 Olly Betts
+/* Copyright (C) 2014,2016 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -22,9 +22,35 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 
 #include "img.h"
 
+/* Read all the items from pimg, counting stations and legs.  Returns 0 if
+ * there was an error. */
+static int
+read_all(img *pimg, unsigned long *c_stations, unsigned long *c_legs)
+{
+    *c_stations = *c_legs = 0;
+    while (1) {
+	img_point pt;
+	int code = img_read_item(pimg, &pt);
+	if (code == img_STOP) break;
+	switch (code) {
+	    case img_LINE:
+		++*c_legs;
+		break;
+	    case img_LABEL:
+		++*c_stations;
+		break;
+	    case img_BAD:
+		return 0;
+	}
+    }
+    return 1;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -32,13 +58,16 @@ main(int argc, char **argv)
     img *pimg;
     unsigned long c_stations = 0;
     unsigned long c_legs = 0;
+    int repeats = 0;
 
-    if (argc != 2) {
-	fprintf(stderr, "Syntax: %s 3DFILE\n", argv[0]);
+    if (argc != 2 && argc != 3) {
+	fprintf(stderr, "Syntax: %s 3DFILE [REPEATS]\n", argv[0]);
+	fprintf(stderr, "If REPEATS is given, time reading the file that many times\n");
 	return 1;
     }
 
     fnm = argv[1];
+    if (argc == 3) repeats = atoi(argv[2]);
 
     pimg = img_open(fnm);
     if (!pimg) {
@@ -52,27 +81,35 @@ main(int argc, char **argv)
     printf("Format-Version: %d\n", pimg->version);
     printf("Extended-Elevation: %s\n",
 	   pimg->is_extended_elevation ? "yes" : "no");
-    while (1) {
-	img_point pt;
-	int code = img_read_item(pimg, &pt);
-	if (code == img_STOP) break;
-	switch (code) {
-	    case img_LINE:
-		c_legs++;
-		break;
-	    case img_LABEL:
-		c_stations++;
-		break;
-	    case img_BAD:
+    if (!read_all(pimg, &c_stations, &c_legs)) {
+	img_close(pimg);
+	fprintf(stderr, "%s: img_read_item failed (error code %d)\n",
+		argv[0], (int)img_error());
+	return 1;
+    }
+
+    printf("Stations: %lu\nLegs: %lu\n", c_stations, c_legs);
+
+    if (repeats > 0) {
+	/* Time reading the data (with the file in the OS cache after the first
+	 * pass). */
+	clock_t start = clock();
+	double secs;
+	int i;
+	for (i = 0; i < repeats; i++) {
+	    if (!img_rewind(pimg) || !read_all(pimg, &c_stations, &c_legs)) {
 		img_close(pimg);
-		fprintf(stderr, "%s: img_read_item failed (error code %d)\n",
+		fprintf(stderr, "%s: reading failed (error code %d)\n",
 			argv[0], (int)img_error());
 		return 1;
+	    }
 	}
+	secs = (double)(clock() - start) / CLOCKS_PER_SEC / repeats;
+	printf("Time per read: %.3fs\n", secs);
+	if (secs > 0)
+	    printf("Throughput: %.0f legs/s\n", c_legs / secs);
     }
 
-    printf("Stations: %lu\nLegs: %lu\n", c_stations, c_legs);
-
     img_close(pimg);
 
     return 0;
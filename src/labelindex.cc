@@ -0,0 +1,195 @@
+//
+//  labelindex.cc
+//
+//  Spatial index of stations for Aven.
+//
+//  Copyright (C) 2016 Olly Betts
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "labelindex.h"
+#include "labelinfo.h"
+
+#include <algorithm>
+
+#include <float.h>
+
+// Nodes with this many stations or fewer aren't split further.
+const unsigned LEAF_SIZE = 8;
+
+// While building we work on a copy of the coordinates, which is much more
+// cache friendly than going via the LabelInfo pointers.
+struct LabelIndex::BuildEntry {
+    double c[3];
+    unsigned i;
+};
+
+class LabelIndex::CompareCoord {
+    int axis;
+
+  public:
+    CompareCoord(int axis_) : axis(axis_) { }
+
+    bool operator()(const BuildEntry & a,
+		    const BuildEntry & b) const {
+	return a.c[axis] < b.c[axis];
+    }
+};
+
+void
+LabelIndex::Build(vector<LabelInfo*>::const_iterator begin,
+		  vector<LabelInfo*>::const_iterator end)
+{
+    clear();
+    labels.assign(begin, end);
+    if (labels.empty()) return;
+
+    vector<BuildEntry> entries(labels.size());
+    for (unsigned i = 0; i != labels.size(); ++i) {
+	entries[i].c[0] = labels[i]->GetX();
+	entries[i].c[1] = labels[i]->GetY();
+	entries[i].c[2] = labels[i]->GetZ();
+	entries[i].i = i;
+    }
+
+    nodes.resize(1);
+    BuildNode(entries, 0, 0, entries.size());
+
+    ordered.resize(entries.size());
+    for (unsigned i = 0; i != entries.size(); ++i) {
+	ordered[i] = entries[i].i;
+    }
+}
+
+void
+LabelIndex::BuildNode(vector<BuildEntry> & entries,
+		      unsigned n, unsigned first, unsigned end)
+{
+    double min[3] = { DBL_MAX, DBL_MAX, DBL_MAX };
+    double max[3] = { -DBL_MAX, -DBL_MAX, -DBL_MAX };
+    for (unsigned i = first; i != end; ++i) {
+	for (int axis = 0; axis != 3; ++axis) {
+	    double c = entries[i].c[axis];
+	    if (c < min[axis]) min[axis] = c;
+	    if (c > max[axis]) max[axis] = c;
+	}
+    }
+
+    // Adding children below may reallocate nodes, so node mustn't be used
+    // after that.
+    Node & node = nodes[n];
+    for (int axis = 0; axis != 3; ++axis) {
+	node.min[axis] = min[axis];
+	node.max[axis] = max[axis];
+    }
+    node.first = first;
+    node.end = end;
+    node.child = 0;
+
+    if (end - first <= LEAF_SIZE) return;
+
+    // Split at the median along the longest side of the bounding box.
+    int axis = 0;
+    for (int i = 1; i != 3; ++i) {
+	if (max[i] - min[i] > max[axis] - min[axis]) axis = i;
+    }
+    unsigned mid = first + (end - first) / 2;
+    nth_element(entries.begin() + first, entries.begin() + mid,
+		entries.begin() + end, CompareCoord(axis));
+
+    unsigned child = nodes.size();
+    nodes[n].child = child;
+    nodes.resize(child + 2);
+    BuildNode(entries, child, first, mid);
+    BuildNode(entries, child + 1, mid, end);
+}
+
+void
+LabelIndex::FindInNode(unsigned n, const double (*planes)[4], int n_planes,
+		       vector<unsigned> & found) const
+{
+    const Node & node = nodes[n];
+    bool inside = true;
+    for (int i = 0; i != n_planes; ++i) {
+	const double * p = planes[i];
+	// Evaluate the plane at the corners of the bounding box which are
+	// furthest to the positive and negative sides.
+	double most = p[3], least = p[3];
+	for (int axis = 0; axis != 3; ++axis) {
+	    if (p[axis] > 0) {
+		most += p[axis] * node.max[axis];
+		least += p[axis] * node.min[axis];
+	    } else {
+		most += p[axis] * node.min[axis];
+		least += p[axis] * node.max[axis];
+	    }
+	}
+	// Wholly on the negative side of this plane.
+	if (most < 0) return;
+	if (least < 0) inside = false;
+    }
+
+    if (inside) {
+	found.insert(found.end(),
+		     ordered.begin() + node.first, ordered.begin() + node.end);
+	return;
+    }
+
+    if (node.child) {
+	FindInNode(node.child, planes, n_planes, found);
+	FindInNode(node.child + 1, planes, n_planes, found);
+	return;
+    }
+
+    // A leaf which straddles a plane, so check each station.
+    for (unsigned i = node.first; i != node.end; ++i) {
+	const LabelInfo * label = labels[ordered[i]];
+	int j;
+	for (j = 0; j != n_planes; ++j) {
+	    const double * p = planes[j];
+	    if (p[0] * label->GetX() + p[1] * label->GetY() +
+		p[2] * label->GetZ() + p[3] < 0) break;
+	}
+	if (j == n_planes) found.push_back(ordered[i]);
+    }
+}
+
+void
+LabelIndex::Find(const double (*planes)[4], int n_planes,
+		 vector<LabelInfo*> & result) const
+{
+    result.clear();
+    if (nodes.empty()) return;
+
+    vector<unsigned> found;
+    FindInNode(0, planes, n_planes, found);
+    if (found.size() == labels.size()) {
+	// Every station, so we can skip sorting.
+	result = labels;
+	return;
+    }
+
+    sort(found.begin(), found.end());
+    result.reserve(found.size());
+    vector<unsigned>::const_iterator i;
+    for (i = found.begin(); i != found.end(); ++i) {
+	result.push_back(labels[*i]);
+    }
+}
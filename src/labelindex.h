@@ -0,0 +1,82 @@
+//
+//  labelindex.h
+//
+//  Spatial index of stations for Aven.
+//
+//  Copyright (C) 2016 Olly Betts
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#ifndef labelindex_h
+#define labelindex_h
+
+#include <vector>
+
+using namespace std;
+
+class LabelInfo;
+
+// A bounding volume hierarchy over the stations.  This only depends on the
+// station positions, so is built once when a file is loaded, and lets us
+// find the stations in part of the view without looking at every station.
+class LabelIndex {
+    struct Node {
+	double min[3], max[3];
+	// The range of ordered[] this node covers.
+	unsigned first, end;
+	// Index of the first of this node's two children, or 0 for a leaf.
+	unsigned child;
+    };
+
+    vector<Node> nodes;
+
+    // The labels in the order they were passed to Build().
+    vector<LabelInfo*> labels;
+
+    // Indices into labels, ordered so that each node covers a contiguous
+    // range.
+    vector<unsigned> ordered;
+
+    struct BuildEntry;
+    class CompareCoord;
+
+    void BuildNode(vector<BuildEntry> & entries,
+		   unsigned n, unsigned first, unsigned end);
+
+    void FindInNode(unsigned n, const double (*planes)[4], int n_planes,
+		    vector<unsigned> & found) const;
+
+  public:
+    void Build(vector<LabelInfo*>::const_iterator begin,
+	       vector<LabelInfo*>::const_iterator end);
+
+    void clear() {
+	nodes.clear();
+	labels.clear();
+	ordered.clear();
+    }
+
+    // Set result to the labels which are on the positive side of all of
+    // the n_planes planes, each given as (a, b, c, d) for the plane
+    // a*x + b*y + c*z + d = 0.
+    //
+    // The labels are returned in the same relative order as they were
+    // passed to Build().
+    void Find(const double (*planes)[4], int n_planes,
+	      vector<LabelInfo*> & result) const;
+};
+
+#endif
@@ -0,0 +1,252 @@
+//
+//  labelinfo.cc
+//
+//  Station names for Aven.
+//
+//  Copyright (C) 2016 Olly Betts
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "labelinfo.h"
+#include "namecompare.h"
+
+const unsigned LabelNames::NO_NAME;
+
+// FNV-1a hash of length characters of s from start.
+static unsigned
+hash_text(const wxString & s, size_t start, size_t length)
+{
+    unsigned h = 2166136261u;
+    for (size_t i = start; i != start + length; ++i) {
+	int ch = s[i];
+	h = (h ^ unsigned(ch)) * 16777619u;
+    }
+    return h;
+}
+
+static inline unsigned
+hash_component(unsigned text_hash, unsigned prev)
+{
+    return (text_hash ^ prev) * 16777619u;
+}
+
+unsigned
+LabelNames::Add(const wxString & name)
+{
+    if (name.empty()) return NO_NAME;
+
+    unsigned i = NO_NAME;
+    size_t start = 0;
+    while (true) {
+	size_t end = name.find(separator, start);
+	if (end == wxString::npos) end = name.size();
+	i = AddComponent(i, name, start, end - start);
+	if (end == name.size()) return i;
+	start = end + 1;
+    }
+}
+
+unsigned
+LabelNames::AddComponent(unsigned prev, const wxString & name,
+			 size_t start, size_t length)
+{
+    // Keep the tables no more than half full.
+    if (2 * (components.size() + 1) > table.size()) Rehash(table, false);
+    if (2 * (n_texts + 1) > text_table.size()) Rehash(text_table, true);
+
+    unsigned text_hash = hash_text(name, start, length);
+    unsigned mask = table.size() - 1;
+    unsigned h = hash_component(text_hash, prev);
+    while (table[h & mask] != NO_NAME) {
+	unsigned i = table[h & mask];
+	const Component & c = components[i];
+	if (c.prev == prev && c.length == length &&
+	    chars.compare(c.offset, length, name, start, length) == 0) {
+	    return i;
+	}
+	++h;
+    }
+
+    Component c;
+    c.prev = prev;
+    c.length = length;
+    unsigned i = components.size();
+    table[h & mask] = i;
+
+    // Share the text of any existing component with the same text.
+    mask = text_table.size() - 1;
+    h = text_hash;
+    while (text_table[h & mask] != NO_NAME) {
+	const Component & t = components[text_table[h & mask]];
+	if (t.length == length &&
+	    chars.compare(t.offset, length, name, start, length) == 0) {
+	    break;
+	}
+	++h;
+    }
+    if (text_table[h & mask] != NO_NAME) {
+	c.offset = components[text_table[h & mask]].offset;
+    } else {
+	text_table[h & mask] = i;
+	++n_texts;
+	c.offset = chars.size();
+	chars.append(name, start, length);
+    }
+
+    components.push_back(c);
+    return i;
+}
+
+void
+LabelNames::Rehash(vector<unsigned> & tab, bool text_only)
+{
+    vector<unsigned> old;
+    old.swap(tab);
+    tab.resize(old.empty() ? 64 : old.size() * 2, NO_NAME);
+    unsigned mask = tab.size() - 1;
+    vector<unsigned>::const_iterator j;
+    for (j = old.begin(); j != old.end(); ++j) {
+	if (*j == NO_NAME) continue;
+	const Component & c = components[*j];
+	unsigned h = hash_text(chars, c.offset, c.length);
+	if (!text_only) h = hash_component(h, c.prev);
+	while (tab[h & mask] != NO_NAME) ++h;
+	tab[h & mask] = *j;
+    }
+}
+
+void
+LabelNames::Finish()
+{
+    vector<unsigned>().swap(table);
+    vector<unsigned>().swap(text_table);
+    n_texts = 0;
+    vector<Component>(components).swap(components);
+}
+
+void
+LabelNames::AppendName(wxString & result, unsigned i) const
+{
+    const Component & c = components[i];
+    if (c.prev != NO_NAME) {
+	AppendName(result, c.prev);
+	result += separator;
+    }
+    result.append(chars, c.offset, c.length);
+}
+
+int
+LabelNames::CompareComponent(unsigned i, const LabelNames & other,
+			     unsigned j) const
+{
+    const Component & a = components[i];
+    const Component & b = other.components[j];
+    // Components in the same pool with the same text share it.
+    if (this == &other && a.offset == b.offset && a.length == b.length)
+	return 0;
+    return name_cmp(chars, a.offset, a.length,
+		    other.chars, b.offset, b.length, separator);
+}
+
+// Compare names i and j, which have the same number of components.  The
+// separator isn't a digit, so comparing the full names with name_cmp() gives
+// the result of comparing the first components which differ.
+int
+LabelNames::CompareSameDepth(unsigned i, const LabelNames & other,
+			     unsigned j) const
+{
+    // If i and j are the same component, their prefixes are the same too.
+    if (i == NO_NAME || (this == &other && i == j)) return 0;
+    int r = CompareSameDepth(components[i].prev,
+			     other, other.components[j].prev);
+    if (r) return r;
+    return CompareComponent(i, other, j);
+}
+
+int
+LabelNames::Compare(unsigned i, const LabelNames & other, unsigned j) const
+{
+    unsigned depth_i = GetDepth(i);
+    unsigned depth_j = other.GetDepth(j);
+    unsigned a = i, b = j;
+    for (unsigned d = depth_i; d > depth_j; --d) a = components[a].prev;
+    for (unsigned d = depth_j; d > depth_i; --d) b = other.components[b].prev;
+    int r = CompareSameDepth(a, other, b);
+    if (r) return r;
+    // One name is a prefix of the other, so the shorter sorts first.
+    return int(depth_i) - int(depth_j);
+}
+
+// Compare the components of name i with those of name starting at pos, and
+// advance pos past the components compared.
+int
+LabelNames::ComparePrefix(unsigned i, const wxString & name,
+			  size_t & pos) const
+{
+    const Component & c = components[i];
+    if (c.prev != NO_NAME) {
+	int r = ComparePrefix(c.prev, name, pos);
+	if (r) return r;
+    }
+    // If name has run out of components, it sorts first.
+    if (pos > name.size()) return 1;
+    size_t end = name.find(separator, pos);
+    if (end == wxString::npos) end = name.size();
+    int r = name_cmp(chars, c.offset, c.length,
+		     name, pos, end - pos, separator);
+    pos = end + 1;
+    return r;
+}
+
+int
+LabelNames::Compare(unsigned i, const wxString & name) const
+{
+    size_t pos = 0;
+    int r = ComparePrefix(i, name, pos);
+    if (r) return r;
+    // If name has components left, name i is a prefix of it.
+    return pos <= name.size() ? -1 : 0;
+}
+
+bool
+LabelNames::InSurvey(unsigned i, const wxString & prefix) const
+{
+    // Find the survey name i is in which has the same length as prefix.
+    size_t len = GetLength(i);
+    if (len <= prefix.size()) return false;
+    do {
+	const Component & c = components[i];
+	if (c.prev == NO_NAME) return false;
+	len -= c.length + 1;
+	i = c.prev;
+    } while (len > prefix.size());
+    if (len != prefix.size()) return false;
+
+    // Check its text matches, working back from the end.
+    while (true) {
+	const Component & c = components[i];
+	len -= c.length;
+	if (chars.compare(c.offset, c.length, prefix, len, c.length) != 0)
+	    return false;
+	if (c.prev == NO_NAME) return true;
+	if (prefix[--len] != separator) return false;
+	i = c.prev;
+    }
+}
@@ -4,7 +4,7 @@
 //  Main frame handling for Aven.
 //
 //  Copyright (C) 2000-2003,2005 Mark R. Shinwell
-//  Copyright (C) 2001-2003,2004,2005,2006,2010,2011,2012,2013,2014 Olly Betts
+//  Copyright (C) 2001-2003,2004,2005,2006,2010,2011,2012,2013,2014,2016 Olly Betts
 //
 //  This program is free software; you can redistribute it and/or modify
 //  it under the terms of the GNU General Public License as published by
@@ -29,6 +29,10 @@
 #include "vector3.h"
 #include "wx.h"
 
+#include <vector>
+
+using namespace std;
+
 // Mac OS X headers pollute the global namespace with generic names like
 // "class Point", which clashes with our "class Point".  So for __WXMAC__
 // put our class in a namespace and define Point as a macro.
@@ -60,23 +64,182 @@ class Point : public Vector3 {
 #define LFLAG_ENTRANCE		0x40
 #define LFLAG_HIGHLIGHTED	0x80
 
+// Station names, stored as a tree of their components so that the prefix
+// naming a survey is only stored once however many stations it has, and the
+// text of a component which occurs in several surveys (such as a station
+// number) is only stored once too.  A name is identified by the index of its
+// last component.
+class LabelNames {
+    struct Component {
+	// The component before this one in the name, or NO_NAME.
+	unsigned prev;
+	// Where the text of this component is in chars.
+	unsigned offset, length;
+    };
+
+    vector<Component> components;
+
+    // The text of each distinct component, run together.
+    wxString chars;
+
+    // Open hash tables of indices into components, for finding an existing
+    // component with the same text and previous component (in table) or just
+    // the same text (in text_table).  These are only needed while names are
+    // being added.
+    vector<unsigned> table, text_table;
+    unsigned n_texts;
+
+    wxChar separator;
+
+    unsigned AddComponent(unsigned prev, const wxString & name,
+			  size_t start, size_t length);
+
+    void Rehash(vector<unsigned> & tab, bool text_only);
+
+    void AppendName(wxString & result, unsigned i) const;
+
+    unsigned GetDepth(unsigned i) const {
+	unsigned depth = 0;
+	for ( ; i != NO_NAME; i = components[i].prev) ++depth;
+	return depth;
+    }
+
+    int CompareComponent(unsigned i, const LabelNames & other,
+			 unsigned j) const;
+
+    int CompareSameDepth(unsigned i, const LabelNames & other,
+			 unsigned j) const;
+
+    int ComparePrefix(unsigned i, const wxString & name, size_t & pos) const;
+
+  public:
+    // The index of the empty name.
+    static const unsigned NO_NAME = unsigned(-1);
+
+    LabelNames() : n_texts(0), separator('.') { }
+
+    // Set the separator names are split at - this needs to be done before
+    // any names are added.
+    void set_separator(wxChar separator_) { separator = separator_; }
+
+    // Add name (if it isn't already present) and return its index.
+    unsigned Add(const wxString & name);
+
+    // Free the memory which is only needed while adding names.
+    void Finish();
+
+    wxString Get(unsigned i) const {
+	wxString result;
+	if (i != NO_NAME) AppendName(result, i);
+	return result;
+    }
+
+    // The last component of name i.
+    wxString GetLeaf(unsigned i) const {
+	if (i == NO_NAME) return wxString();
+	return chars.substr(components[i].offset, components[i].length);
+    }
+
+    size_t GetLength(unsigned i) const {
+	if (i == NO_NAME) return 0;
+	size_t len = components[i].length;
+	while ((i = components[i].prev) != NO_NAME) {
+	    len += components[i].length + 1;
+	}
+	return len;
+    }
+
+    size_t GetLeafLength(unsigned i) const {
+	if (i == NO_NAME) return 0;
+	return components[i].length;
+    }
+
+    // The following compare names in the same order name_cmp() would order
+    // the full names, but without assembling them.  Neither i nor j may be
+    // NO_NAME.
+
+    // Compare name i with name j of other (which may be this).
+    int Compare(unsigned i, const LabelNames & other, unsigned j) const;
+
+    // Compare name i with name.
+    int Compare(unsigned i, const wxString & name) const;
+
+    // Compare the last components of name i and name j of other.
+    int CompareLeaf(unsigned i, const LabelNames & other, unsigned j) const {
+	return CompareComponent(i, other, j);
+    }
+
+    // Is name i in survey prefix (i.e. does it start with prefix followed by
+    // the separator)?
+    bool InSurvey(unsigned i, const wxString & prefix) const;
+};
+
 class LabelInfo : public Point {
-    wxString text;
-    unsigned width;
-    int flags;
+    // The station's name is held in names, which is shared by all the
+    // stations loaded along with this one.
+    const LabelNames * names;
+    unsigned name;
+    // The LFLAG_* values all fit in a byte, and width is measured in
+    // multiples of the quantised font size, so we can keep these small.
+    unsigned short width;
+    unsigned char flags;
 
 public:
     wxTreeItemId tree_id;
 
-    LabelInfo() : Point(), text(), flags(0) { }
-    LabelInfo(const img_point &pt, const wxString &text_, int flags_)
-	: Point(pt), text(text_), flags(flags_) {
+    LabelInfo()
+	: Point(), names(NULL), name(LabelNames::NO_NAME), width(0), flags(0)
+    { }
+    LabelInfo(const img_point &pt, LabelNames & names_, const wxString &text,
+	      int flags_)
+	: Point(pt), names(&names_), name(names_.Add(text)),
+	  width(0), flags(flags_) {
 	if (text.empty())
 	    flags &= ~LFLAG_NOT_ANON;
     }
-    const wxString & GetText() const { return text; }
+    // The name is assembled from its components, so callers which want it
+    // more than once should keep the returned string.
+    wxString GetText() const {
+	if (name == LabelNames::NO_NAME) return wxString();
+	return names->Get(name);
+    }
+    // The last component of the name.
+    wxString GetLeaf() const {
+	if (name == LabelNames::NO_NAME) return wxString();
+	return names->GetLeaf(name);
+    }
+    size_t GetTextLength() const {
+	if (name == LabelNames::NO_NAME) return 0;
+	return names->GetLength(name);
+    }
+    // Compare names in the same order as name_cmp() would, without
+    // assembling them.
+    int CompareText(const LabelInfo & o) const {
+	if (name == LabelNames::NO_NAME || o.name == LabelNames::NO_NAME) {
+	    // An empty name sorts before any other.
+	    return int(GetTextLength()) - int(o.GetTextLength());
+	}
+	return names->Compare(name, *o.names, o.name);
+    }
+    int CompareText(const wxString & text) const {
+	if (name == LabelNames::NO_NAME) return -int(text.length());
+	if (text.empty()) return 1;
+	return names->Compare(name, text);
+    }
+    int CompareLeaf(const LabelInfo & o) const {
+	if (name == LabelNames::NO_NAME || o.name == LabelNames::NO_NAME) {
+	    return int(names ? names->GetLeafLength(name) : 0) -
+		   int(o.names ? o.names->GetLeafLength(o.name) : 0);
+	}
+	return names->CompareLeaf(name, *o.names, o.name);
+    }
+    // Is this station in survey prefix?
+    bool InSurvey(const wxString & prefix) const {
+	if (name == LabelNames::NO_NAME) return false;
+	return names->InSurvey(name, prefix);
+    }
     wxString name_or_anon() const {
-	if (!text.empty()) return text;
+	if (name != LabelNames::NO_NAME) return names->Get(name);
 	/* TRANSLATORS: Used in place of the station name when talking about an
 	 * anonymous station. */
 	return wmsg(/*anonymous station*/56);
@@ -44,6 +44,7 @@
 #include <wx/image.h>
 #include <wx/imaglist.h>
 #include <wx/process.h>
+#include <wx/progdlg.h>
 #include <wx/regex.h>
 #ifdef USING_GENERIC_TOOLBAR
 # include <wx/sysopt.h>
@@ -52,9 +53,9 @@
 #include <cerrno>
 #include <cstdlib>
 #include <float.h>
+#include <algorithm>
 #include <functional>
-#include <map>
-#include <stack>
+#include <string>
 #include <vector>
 
 #ifdef __WXMSW__
@@ -661,34 +662,38 @@ BEGIN_EVENT_TABLE(MainFrm, wxFrame)
     EVT_UPDATE_UI(menu_CTL_PERCENT, MainFrm::OnTogglePercentUpdate)
 END_EVENT_TABLE()
 
+// The names are compared a component at a time where they're stored, rather
+// than assembling them for every comparison.
 class LabelCmp : public greater<const LabelInfo*> {
-    wxChar separator;
 public:
-    explicit LabelCmp(wxChar separator_) : separator(separator_) {}
     bool operator()(const LabelInfo* pt1, const LabelInfo* pt2) {
-	return name_cmp(pt1->GetText(), pt2->GetText(), separator) < 0;
+	return pt1->CompareText(*pt2) < 0;
+    }
+};
+
+// For looking up a station by name in labels sorted by LabelCmp.
+class LabelTextCmp {
+public:
+    bool operator()(const LabelInfo* pt, const wxString & text) {
+	return pt->CompareText(text) < 0;
     }
 };
 
 class LabelPlotCmp : public greater<const LabelInfo*> {
-    wxChar separator;
 public:
-    explicit LabelPlotCmp(wxChar separator_) : separator(separator_) {}
     bool operator()(const LabelInfo* pt1, const LabelInfo* pt2) {
 	int n = pt1->get_flags() - pt2->get_flags();
 	if (n) return n > 0;
-	wxString l1 = pt1->GetText().AfterLast(separator);
-	wxString l2 = pt2->GetText().AfterLast(separator);
-	n = name_cmp(l1, l2, separator);
+	n = pt1->CompareLeaf(*pt2);
 	if (n) return n < 0;
 	// Prefer non-2-nodes...
 	// FIXME; implement
 	// if leaf names are the same, prefer shorter labels as we can
 	// display more of them
-	n = pt1->GetText().length() - pt2->GetText().length();
+	n = pt1->GetTextLength() - pt2->GetTextLength();
 	if (n) return n < 0;
 	// make sure that we don't ever compare different labels as equal
-	return name_cmp(pt1->GetText(), pt2->GetText(), separator) < 0;
+	return pt1->CompareText(*pt2) < 0;
     }
 };
 
@@ -1104,6 +1109,299 @@ void MainFrm::CreateSidePanel()
     m_Splitter->Initialize(m_Gfx);
 }
 
+// Shared by the threads decoding a .3d file, so that the GUI thread can
+// report progress, draw the legs decoded so far, and ask the threads to stop.
+class LoadProgress {
+    wxCriticalSection lock;
+    // Number of bytes of the file decoded so far.
+    long done;
+    int n_finished;
+    bool cancelled;
+    // Plan positions of the ends of legs decoded since the GUI thread last
+    // took them, in pairs.
+    vector<wxRealPoint> legs;
+
+  public:
+    LoadProgress() : done(0), n_finished(0), cancelled(false) { }
+
+    // Returns false if loading has been cancelled.
+    bool Add(long bytes, vector<wxRealPoint> & new_legs) {
+	wxCriticalSectionLocker enter(lock);
+	done += bytes;
+	legs.insert(legs.end(), new_legs.begin(), new_legs.end());
+	new_legs.clear();
+	return !cancelled;
+    }
+
+    // Append the legs decoded since the last call to out.
+    void TakeLegs(vector<wxRealPoint> & out) {
+	wxCriticalSectionLocker enter(lock);
+	out.insert(out.end(), legs.begin(), legs.end());
+	legs.clear();
+    }
+
+    long GetDone() {
+	wxCriticalSectionLocker enter(lock);
+	return done;
+    }
+
+    void Finished() {
+	wxCriticalSectionLocker enter(lock);
+	++n_finished;
+    }
+
+    int GetFinished() {
+	wxCriticalSectionLocker enter(lock);
+	return n_finished;
+    }
+
+    void Cancel() {
+	wxCriticalSectionLocker enter(lock);
+	cancelled = true;
+    }
+
+    bool Cancelled() {
+	wxCriticalSectionLocker enter(lock);
+	return cancelled;
+    }
+};
+
+// Survey data decoded from all or part of a .3d file.  Decoding doesn't touch
+// the GUI, so it can be done on worker threads, with MainFrm::LoadData()
+// merging the results in file order.
+struct LoadedItem {
+    // img_MOVE, img_LINE, img_XSECT, img_XSECT_END or img_ERROR_INFO.
+    int type;
+    int flags;
+    // Date for img_LINE.
+    int date;
+    // Index into xsects for img_XSECT, or into errors for img_ERROR_INFO.
+    unsigned index;
+    img_point pt;
+
+    LoadedItem(int type_, int flags_, int date_, unsigned index_,
+	       const img_point & pt_)
+	: type(type_), flags(flags_), date(date_), index(index_), pt(pt_) { }
+};
+
+struct LoadedXSect {
+    wxString label;
+    int date;
+    Double l, r, u, d;
+
+    LoadedXSect(const wxString & label_, int date_,
+		Double l_, Double r_, Double u_, Double d_)
+	: label(label_), date(date_), l(l_), r(r_), u(u_), d(d_) { }
+};
+
+struct LoadedErrorInfo {
+    int n_legs;
+    double length, E, H, V;
+
+    LoadedErrorInfo(int n_legs_, double length_,
+		    double E_, double H_, double V_)
+	: n_legs(n_legs_), length(length_), E(E_), H(H_), V(V_) { }
+};
+
+class LoadedChunk {
+  public:
+    vector<LoadedItem> items;
+    vector<LoadedXSect> xsects;
+    vector<LoadedErrorInfo> errors;
+    // Where the stations go.
+    LabelBlock * labels;
+
+    int n_entrances, n_fixed_pts, n_exported_pts;
+
+    // Extents of the leg ends, and the ranges of depths and dates of legs.
+    Double xmin, xmax, ymin, ymax, zmin, zmax;
+    Double depthmin, depthmax;
+    int datemin, datemax;
+    bool complete_dateinfo;
+
+    img_errcode error;
+    bool cancelled;
+
+    LoadedChunk()
+	: labels(NULL), n_entrances(0), n_fixed_pts(0), n_exported_pts(0),
+	  xmin(DBL_MAX), xmax(-DBL_MAX), ymin(DBL_MAX), ymax(-DBL_MAX),
+	  zmin(DBL_MAX), zmax(-DBL_MAX), depthmin(DBL_MAX), depthmax(-DBL_MAX),
+	  datemin(INT_MAX), datemax(-1), complete_dateinfo(true),
+	  error(IMG_NONE), cancelled(false) { }
+
+    // Read items from survey until img_STOP.  Returns false on error or if
+    // loading is cancelled.
+    bool Decode(img * survey, LoadProgress & progress);
+};
+
+bool
+LoadedChunk::Decode(img * survey, LoadProgress & progress)
+{
+    long pos = img_tell(survey);
+    unsigned items_read = 0;
+    // Legs to pass on to the GUI thread at the next sync point.
+    vector<wxRealPoint> new_legs;
+    img_point last_pt;
+    bool have_last_pt = false;
+    // wxCSConv sets itself up on first use without any locking, so each
+    // chunk needs its own rather than sharing a static one between threads.
+    wxCSConv ConvCP1252(wxFONTENCODING_CP1252);
+    labels->names.set_separator(survey->separator);
+    while (true) {
+	if (++items_read % 1024 == 0) {
+	    long new_pos = img_tell(survey);
+	    if (!progress.Add(new_pos - pos, new_legs)) {
+		cancelled = true;
+		return false;
+	    }
+	    pos = new_pos;
+	}
+
+	img_point pt;
+	int result = img_read_item(survey, &pt);
+	switch (result) {
+	    case img_STOP:
+		progress.Add(img_tell(survey) - pos, new_legs);
+		labels->names.Finish();
+		return true;
+
+	    case img_MOVE:
+		last_pt = pt;
+		have_last_pt = true;
+		// FALLTHRU
+	    case img_XSECT_END:
+		items.push_back(LoadedItem(result, 0, -1, 0, pt));
+		break;
+
+	    case img_LINE: {
+		// Update survey extents.
+		if (pt.x < xmin) xmin = pt.x;
+		if (pt.x > xmax) xmax = pt.x;
+		if (pt.y < ymin) ymin = pt.y;
+		if (pt.y > ymax) ymax = pt.y;
+		if (pt.z < zmin) zmin = pt.z;
+		if (pt.z > zmax) zmax = pt.z;
+
+		int date = survey->days1;
+		if (date != -1) {
+		    date += (survey->days2 - date) / 2;
+		    if (date < datemin) datemin = date;
+		    if (date > datemax) datemax = date;
+		} else {
+		    complete_dateinfo = false;
+		}
+
+		if (!(survey->flags & img_FLAG_SURFACE)) {
+		    if (pt.z < depthmin) depthmin = pt.z;
+		    if (pt.z > depthmax) depthmax = pt.z;
+		}
+
+		items.push_back(LoadedItem(img_LINE, survey->flags, date, 0, pt));
+		if (have_last_pt) {
+		    new_legs.push_back(wxRealPoint(last_pt.x, last_pt.y));
+		    new_legs.push_back(wxRealPoint(pt.x, pt.y));
+		}
+		last_pt = pt;
+		have_last_pt = true;
+		break;
+	    }
+
+	    case img_LABEL: {
+		wxString s(survey->label, wxConvUTF8);
+		if (s.empty()) {
+		    // If label isn't valid UTF-8 then this conversion will
+		    // give an empty string.  In this case, assume that the
+		    // label is CP1252 (the Microsoft superset of ISO8859-1).
+		    s = wxString(survey->label, ConvCP1252);
+		    if (s.empty()) {
+			// Or if that doesn't work (ConvCP1252 doesn't like
+			// strings with some bytes in) let's just go for
+			// ISO8859-1.
+			s = wxString(survey->label, wxConvISO8859_1);
+		    }
+		}
+		int flags = img2aven(survey->flags);
+		labels->labels.push_back(LabelInfo(pt, labels->names, s, flags));
+		const LabelInfo & label = labels->labels.back();
+		if (label.IsEntrance()) {
+		    n_entrances++;
+		}
+		if (label.IsFixedPt()) {
+		    n_fixed_pts++;
+		}
+		if (label.IsExportedPt()) {
+		    n_exported_pts++;
+		}
+		break;
+	    }
+
+	    case img_XSECT: {
+		int date = survey->days1;
+		if (date != -1) {
+		    date += (survey->days2 - date) / 2;
+		}
+		items.push_back(LoadedItem(img_XSECT, 0, date, xsects.size(), pt));
+		xsects.push_back(LoadedXSect(wxString(survey->label, wxConvUTF8),
+					     date, survey->l, survey->r,
+					     survey->u, survey->d));
+		break;
+	    }
+
+	    case img_ERROR_INFO:
+		items.push_back(LoadedItem(img_ERROR_INFO, 0, -1, errors.size(), pt));
+		errors.push_back(LoadedErrorInfo(survey->n_legs, survey->length,
+						 survey->E, survey->H,
+						 survey->V));
+		break;
+
+	    case img_BAD:
+		error = survey->errcode;
+		return false;
+
+	    default:
+		break;
+	}
+    }
+}
+
+// Decodes a .3d file (or if end is non-zero, a range of spans from its index)
+// on a worker thread.
+class LoadThread : public wxThread {
+    string filename, prefix;
+    size_t first, end;
+    LoadedChunk & chunk;
+    LoadProgress & progress;
+
+  protected:
+    virtual ExitCode Entry();
+
+  public:
+    LoadThread(const string & filename_, const string & prefix_,
+	       size_t first_, size_t end_,
+	       LoadedChunk & chunk_, LoadProgress & progress_)
+	: wxThread(wxTHREAD_JOINABLE),
+	  filename(filename_), prefix(prefix_), first(first_), end(end_),
+	  chunk(chunk_), progress(progress_) { }
+};
+
+wxThread::ExitCode
+LoadThread::Entry()
+{
+    img* survey = img_open_survey(filename.c_str(), prefix.c_str());
+    if (!survey) {
+	chunk.error = img_error();
+    } else {
+	if (end == 0 || img_read_spans(survey, first, end)) {
+	    chunk.Decode(survey, progress);
+	} else {
+	    chunk.error = survey->errcode;
+	}
+	img_close(survey);
+    }
+    progress.Finished();
+    return (wxThread::ExitCode)0;
+}
+
 bool MainFrm::LoadData(const wxString& file, const wxString & prefix)
 {
     // Load survey data from file, centre the dataset around the origin,
@@ -1122,6 +1420,125 @@ bool MainFrm::LoadData(const wxString& file, const wxString & prefix)
 	return false;
     }
 
+    // If the file has an index, split it into chunks which we decode in
+    // parallel.  We don't bother when restricting to a survey, as the index
+    // already lets us skip most of the file then.
+    size_t n_spans = prefix.empty() ? img_span_count(survey) : 0;
+    size_t n_chunks = 1;
+    if (n_spans > 1) {
+	int n_cpus = wxThread::GetCPUCount();
+	if (n_cpus > 1) n_chunks = min(n_spans, size_t(n_cpus));
+    }
+    vector<LoadedChunk> chunks(n_chunks);
+
+    // The stations refer to the names stored alongside them, so decode them
+    // straight into the blocks which we'll keep.
+    list<LabelBlock> label_blocks(n_chunks);
+    {
+	list<LabelBlock>::iterator block = label_blocks.begin();
+	for (size_t i = 0; i < n_chunks; ++i) {
+	    chunks[i].labels = &*block++;
+	}
+    }
+
+    // Decode on worker threads, so the GUI thread can show progress and let
+    // the user cancel loading a large file.
+    LoadProgress progress;
+    vector<LoadThread*> threads;
+    int n_threads = 0;
+    {
+	string filename(file.utf8_str());
+	string survey_prefix(prefix.utf8_str());
+	for (size_t i = 0; i < n_chunks; ++i) {
+	    size_t first = n_spans * i / n_chunks;
+	    size_t end = n_spans * (i + 1) / n_chunks;
+	    LoadThread * thread = new LoadThread(filename, survey_prefix,
+						 first, end,
+						 chunks[i], progress);
+	    if (thread->Create() != wxTHREAD_NO_ERROR ||
+		thread->Run() != wxTHREAD_NO_ERROR) {
+		// Decode this chunk ourselves once the threads are done.
+		delete thread;
+		thread = NULL;
+	    } else {
+		++n_threads;
+	    }
+	    threads.push_back(thread);
+	}
+    }
+
+    if (n_threads) {
+	// Keep handling events while the threads decode so the window still
+	// gets repainted, but don't let the user do anything else meanwhile.
+	wxWindowDisabler disabler;
+	// Only show the progress dialog if loading takes a noticeable time.
+	wxStopWatch timer;
+	wxProgressDialog * progress_dlg = NULL;
+	double file_size = wxFileName::GetSize(file).ToDouble();
+	// Legs decoded so far which haven't been drawn yet.
+	vector<wxRealPoint> legs;
+	bool previewing = false;
+	while (progress.GetFinished() < n_threads) {
+	    wxTheApp->Yield(true);
+	    wxMilliSleep(20);
+	    progress.TakeLegs(legs);
+	    if (!previewing && timer.Time() >= 500 && !legs.empty()) {
+		// Draw the legs as they're decoded, scaled to fit the extents
+		// of those we have so far.  The view is set up properly from
+		// the full extents once loading has finished.
+		Double xmin = DBL_MAX, xmax = -DBL_MAX;
+		Double ymin = DBL_MAX, ymax = -DBL_MAX;
+		vector<wxRealPoint>::const_iterator i;
+		for (i = legs.begin(); i != legs.end(); ++i) {
+		    if (i->x < xmin) xmin = i->x;
+		    if (i->x > xmax) xmax = i->x;
+		    if (i->y < ymin) ymin = i->y;
+		    if (i->y > ymax) ymax = i->y;
+		}
+		m_Gfx->StartPreview(xmin, xmax, ymin, ymax);
+		previewing = true;
+	    }
+	    if (previewing && !legs.empty()) {
+		m_Gfx->AddToPreview(legs);
+		legs.clear();
+	    }
+	    if (!progress_dlg) {
+		if (timer.Time() < 500) continue;
+		progress_dlg = new wxProgressDialog(APP_NAME,
+			wmsg(/*Reading in data - please wait…*/105), 1000, this,
+			wxPD_APP_MODAL|wxPD_CAN_ABORT|wxPD_ELAPSED_TIME|wxPD_REMAINING_TIME);
+	    }
+	    int value = 0;
+	    if (file_size > 0) {
+		value = int(progress.GetDone() * 1000.0 / file_size);
+		if (value > 999) value = 999;
+	    }
+	    if (!progress_dlg->Update(value)) progress.Cancel();
+	}
+	delete progress_dlg;
+    }
+
+    for (size_t i = 0; i < n_chunks; ++i) {
+	LoadThread * thread = threads[i];
+	if (thread) {
+	    thread->Wait();
+	    delete thread;
+	} else if (!progress.Cancelled()) {
+	    if (n_chunks == 1 || img_read_spans(survey, n_spans * i / n_chunks,
+						n_spans * (i + 1) / n_chunks)) {
+		chunks[i].Decode(survey, progress);
+	    } else {
+		chunks[i].error = survey->errcode;
+	    }
+	}
+    }
+
+    if (progress.Cancelled()) {
+	img_close(survey);
+	m_Gfx->EndPreview();
+	return false;
+    }
+
     m_IsExtendedElevation = survey->is_extended_elevation;
 
     m_Tree->DeleteAllItems();
@@ -1141,6 +1558,25 @@ bool MainFrm::LoadData(const wxString& file, const wxString & prefix)
 
     // Delete any existing list entries.
     m_Labels.clear();
+    m_TreeLabels.clear();
+    m_LabelStore.clear();
+    m_TrigramIndex.clear();
+
+    traverses.clear();
+    surface_traverses.clear();
+    tubes.clear();
+
+    for (size_t i = 0; i < n_chunks; ++i) {
+	if (chunks[i].error != IMG_NONE) {
+	    img_close(survey);
+	    m_Gfx->EndPreview();
+
+	    wxString m = wxString::Format(wmsg(img_error2msg(chunks[i].error)), file.c_str());
+	    wxGetApp().ReportError(m);
+
+	    return false;
+	}
+    }
 
     Double xmin = DBL_MAX;
     Double xmax = -DBL_MAX;
@@ -1156,9 +1592,41 @@ bool MainFrm::LoadData(const wxString& file, const wxString & prefix)
     int datemax = -1;
     complete_dateinfo = true;
 
-    traverses.clear();
-    surface_traverses.clear();
-    tubes.clear();
+    // Combine the totals and ranges from each chunk, and put the labels
+    // together in file order.  The labels stay where the chunk stored them,
+    // so they're contiguous in memory and don't each need allocating.
+    size_t n_labels = 0;
+    for (size_t i = 0; i < n_chunks; ++i) {
+	LoadedChunk & chunk = chunks[i];
+	if (chunk.xmin < xmin) xmin = chunk.xmin;
+	if (chunk.xmax > xmax) xmax = chunk.xmax;
+	if (chunk.ymin < ymin) ymin = chunk.ymin;
+	if (chunk.ymax > ymax) ymax = chunk.ymax;
+	if (chunk.zmin < zmin) zmin = chunk.zmin;
+	if (chunk.zmax > zmax) zmax = chunk.zmax;
+	if (chunk.depthmin < m_DepthMin) m_DepthMin = chunk.depthmin;
+	if (chunk.depthmax > depthmax) depthmax = chunk.depthmax;
+	if (chunk.datemin < m_DateMin) m_DateMin = chunk.datemin;
+	if (chunk.datemax > datemax) datemax = chunk.datemax;
+	if (!chunk.complete_dateinfo) complete_dateinfo = false;
+	m_NumEntrances += chunk.n_entrances;
+	m_NumFixedPts += chunk.n_fixed_pts;
+	m_NumExportedPts += chunk.n_exported_pts;
+	n_labels += chunk.labels->labels.size();
+    }
+    m_LabelStore.splice(m_LabelStore.end(), label_blocks);
+    m_Labels.reserve(n_labels);
+    list<LabelBlock>::iterator block;
+    for (block = m_LabelStore.begin(); block != m_LabelStore.end(); ++block) {
+	vector<LabelInfo>::iterator label;
+	for (label = block->labels.begin(); label != block->labels.end(); ++label) {
+	    m_Labels.push_back(&*label);
+	}
+    }
+
+    // Sort the labels ready for filling the tree, and so we can look up the
+    // stations which cross-sections are at.
+    sort(m_Labels.begin(), m_Labels.end(), LabelCmp());
 
     // Ultimately we probably want different types (subclasses perhaps?) for
     // underground and surface data, so we don't need to store LRUD for surface
@@ -1167,10 +1635,6 @@ bool MainFrm::LoadData(const wxString& file, const wxString & prefix)
     traverse * current_surface_traverse = NULL;
     vector<XSect> * current_tube = NULL;
 
-    map<wxString, LabelInfo *> labelmap;
-    list<LabelInfo*>::const_iterator last_mapped_label = m_Labels.begin();
-
-    int result;
     img_point prev_pt = {0,0,0};
     bool current_polyline_is_surface = false;
     bool current_polyline_is_splay = false;
@@ -1182,258 +1646,161 @@ bool MainFrm::LoadData(const wxString& file, const wxString & prefix)
     // traverse.
     size_t n_traverses = 0;
     size_t n_surface_traverses = 0;
-    do {
-#if 0
-	if (++items % 200 == 0) {
-	    long pos = ftell(survey->fh);
-	    int progress = int((double(pos) / double(file_size)) * 100.0);
-	    // SetProgress(progress);
-	}
-#endif
-
-	img_point pt;
-	result = img_read_item(survey, &pt);
-	switch (result) {
-	    case img_MOVE:
-		n_traverses = n_surface_traverses = 0;
-		pending_move = true;
-		prev_pt = pt;
-		break;
-
-	    case img_LINE: {
-		// Update survey extents.
-		if (pt.x < xmin) xmin = pt.x;
-		if (pt.x > xmax) xmax = pt.x;
-		if (pt.y < ymin) ymin = pt.y;
-		if (pt.y > ymax) ymax = pt.y;
-		if (pt.z < zmin) zmin = pt.z;
-		if (pt.z > zmax) zmax = pt.z;
+    for (size_t c = 0; c < n_chunks; ++c) {
+	const LoadedChunk & chunk = chunks[c];
+	vector<LoadedItem>::const_iterator item;
+	for (item = chunk.items.begin(); item != chunk.items.end(); ++item) {
+	    const img_point & pt = item->pt;
+	    switch (item->type) {
+		case img_MOVE:
+		    n_traverses = n_surface_traverses = 0;
+		    pending_move = true;
+		    prev_pt = pt;
+		    break;
 
-		int date = survey->days1;
-		if (date != -1) {
-		    date += (survey->days2 - date) / 2;
-		    if (date < m_DateMin) m_DateMin = date;
-		    if (date > datemax) datemax = date;
-		} else {
-		    complete_dateinfo = false;
-		}
+		case img_LINE: {
+		    int date = item->date;
+		    if (item->flags & img_FLAG_SPLAY)
+			m_HasSplays = true;
+		    bool is_surface = (item->flags & img_FLAG_SURFACE);
+		    bool is_splay = (item->flags & img_FLAG_SPLAY);
+		    if (pending_move || current_polyline_is_surface != is_surface || current_polyline_is_splay != is_splay) {
+			if (!current_polyline_is_surface && current_traverse) {
+			    //FixLRUD(*current_traverse);
+			}
 
-		if (survey->flags & img_FLAG_SPLAY)
-		    m_HasSplays = true;
-		bool is_surface = (survey->flags & img_FLAG_SURFACE);
-		bool is_splay = (survey->flags & img_FLAG_SPLAY);
-		if (!is_surface) {
-		    if (pt.z < m_DepthMin) m_DepthMin = pt.z;
-		    if (pt.z > depthmax) depthmax = pt.z;
-		}
-		if (pending_move || current_polyline_is_surface != is_surface || current_polyline_is_splay != is_splay) {
-		    if (!current_polyline_is_surface && current_traverse) {
-			//FixLRUD(*current_traverse);
-		    }
+			// Start new traverse (surface or underground).
+			if (is_surface) {
+			    m_HasSurfaceLegs = true;
+			    surface_traverses.push_back(traverse());
+			    current_surface_traverse = &surface_traverses.back();
+			    ++n_surface_traverses;
+			} else {
+			    m_HasUndergroundLegs = true;
+			    traverses.push_back(traverse());
+			    current_traverse = &traverses.back();
+			    current_traverse->isSplay = is_splay;
+			    ++n_traverses;
+			    // The previous point was at a surface->ug transition.
+			    if (current_polyline_is_surface) {
+				if (prev_pt.z < m_DepthMin) m_DepthMin = prev_pt.z;
+				if (prev_pt.z > depthmax) depthmax = prev_pt.z;
+			    }
+			}
 
-		    // Start new traverse (surface or underground).
-		    if (is_surface) {
-			m_HasSurfaceLegs = true;
-			surface_traverses.push_back(traverse());
-			current_surface_traverse = &surface_traverses.back();
-			++n_surface_traverses;
-		    } else {
-			m_HasUndergroundLegs = true;
-			traverses.push_back(traverse());
-			current_traverse = &traverses.back();
-			current_traverse->isSplay = is_splay;
-			++n_traverses;
-			// The previous point was at a surface->ug transition.
-			if (current_polyline_is_surface) {
-			    if (prev_pt.z < m_DepthMin) m_DepthMin = prev_pt.z;
-			    if (prev_pt.z > depthmax) depthmax = prev_pt.z;
+			current_polyline_is_surface = is_surface;
+			current_polyline_is_splay = is_splay;
+
+			if (pending_move) {
+			    // Update survey extents.  We only need to do this if
+			    // there's a pending move, since for a surface <->
+			    // underground transition, we'll already have handled
+			    // this point.
+			    if (prev_pt.x < xmin) xmin = prev_pt.x;
+			    if (prev_pt.x > xmax) xmax = prev_pt.x;
+			    if (prev_pt.y < ymin) ymin = prev_pt.y;
+			    if (prev_pt.y > ymax) ymax = prev_pt.y;
+			    if (prev_pt.z < zmin) zmin = prev_pt.z;
+			    if (prev_pt.z > zmax) zmax = prev_pt.z;
 			}
-		    }
 
-		    current_polyline_is_surface = is_surface;
-		    current_polyline_is_splay = is_splay;
-
-		    if (pending_move) {
-			// Update survey extents.  We only need to do this if
-			// there's a pending move, since for a surface <->
-			// underground transition, we'll already have handled
-			// this point.
-			if (prev_pt.x < xmin) xmin = prev_pt.x;
-			if (prev_pt.x > xmax) xmax = prev_pt.x;
-			if (prev_pt.y < ymin) ymin = prev_pt.y;
-			if (prev_pt.y > ymax) ymax = prev_pt.y;
-			if (prev_pt.z < zmin) zmin = prev_pt.z;
-			if (prev_pt.z > zmax) zmax = prev_pt.z;
+			if (is_surface) {
+			    current_surface_traverse->push_back(PointInfo(prev_pt));
+			} else {
+			    current_traverse->push_back(PointInfo(prev_pt));
+			}
 		    }
 
 		    if (is_surface) {
-			current_surface_traverse->push_back(PointInfo(prev_pt));
+			current_surface_traverse->push_back(PointInfo(pt, date));
 		    } else {
-			current_traverse->push_back(PointInfo(prev_pt));
+			current_traverse->push_back(PointInfo(pt, date));
 		    }
-		}
 
-		if (is_surface) {
-		    current_surface_traverse->push_back(PointInfo(pt, date));
-		} else {
-		    current_traverse->push_back(PointInfo(pt, date));
+		    prev_pt = pt;
+		    pending_move = false;
+		    break;
 		}
 
-		prev_pt = pt;
-		pending_move = false;
-		break;
-	    }
-
-	    case img_LABEL: {
-		wxString s(survey->label, wxConvUTF8);
-		if (s.empty()) {
-		    // If label isn't valid UTF-8 then this conversion will
-		    // give an empty string.  In this case, assume that the
-		    // label is CP1252 (the Microsoft superset of ISO8859-1).
-		    static wxCSConv ConvCP1252(wxFONTENCODING_CP1252);
-		    s = wxString(survey->label, ConvCP1252);
-		    if (s.empty()) {
-			// Or if that doesn't work (ConvCP1252 doesn't like
-			// strings with some bytes in) let's just go for
-			// ISO8859-1.
-			s = wxString(survey->label, wxConvISO8859_1);
+		case img_XSECT: {
+		    const LoadedXSect & xsect = chunk.xsects[item->index];
+		    if (!current_tube) {
+			// Start new current_tube.
+			tubes.push_back(vector<XSect>());
+			current_tube = &tubes.back();
 		    }
-		}
-		int flags = img2aven(survey->flags);
-		LabelInfo* label = new LabelInfo(pt, s, flags);
-		if (label->IsEntrance()) {
-		    m_NumEntrances++;
-		}
-		if (label->IsFixedPt()) {
-		    m_NumFixedPts++;
-		}
-		if (label->IsExportedPt()) {
-		    m_NumExportedPts++;
-		}
-		m_Labels.push_back(label);
-		break;
-	    }
-
-	    case img_XSECT: {
-		if (!current_tube) {
-		    // Start new current_tube.
-		    tubes.push_back(vector<XSect>());
-		    current_tube = &tubes.back();
-		}
 
-		LabelInfo * lab;
-		wxString label(survey->label, wxConvUTF8);
-		map<wxString, LabelInfo *>::const_iterator p;
-		p = labelmap.find(label);
-		if (p != labelmap.end()) {
-		    lab = p->second;
-		} else {
-		    // Initialise labelmap lazily - we may have no
-		    // cross-sections.
-		    list<LabelInfo*>::const_iterator i;
-		    if (labelmap.empty()) {
-			i = m_Labels.begin();
-		    } else {
-			i = last_mapped_label;
-			++i;
-		    }
-		    while (i != m_Labels.end() && (*i)->GetText() != label) {
-			labelmap[(*i)->GetText()] = *i;
-			++i;
-		    }
-		    last_mapped_label = i;
-		    if (i == m_Labels.end()) {
+		    const wxString & label = xsect.label;
+		    vector<LabelInfo*>::const_iterator i;
+		    i = lower_bound(m_Labels.begin(), m_Labels.end(), label,
+				    LabelTextCmp());
+		    if (i == m_Labels.end() || (*i)->CompareText(label) != 0) {
 			// Unattached cross-section - ignore for now.
 			printf("unattached cross-section\n");
 			if (current_tube->size() <= 1)
 			    tubes.resize(tubes.size() - 1);
 			current_tube = NULL;
-			if (!m_Labels.empty())
-			    --last_mapped_label;
 			break;
 		    }
-		    lab = *i;
-		    labelmap[label] = lab;
-		}
+		    LabelInfo * lab = *i;
 
-		int date = survey->days1;
-		if (date != -1) {
-		    date += (survey->days2 - date) / 2;
-		    if (date < m_DateMin) m_DateMin = date;
-		    if (date > datemax) datemax = date;
-		}
-
-		current_tube->push_back(XSect(*lab, date, survey->l, survey->r, survey->u, survey->d));
-		break;
-	    }
-
-	    case img_XSECT_END:
-		// Finish off current_tube.
-		// If there's only one cross-section in the tube, just
-		// discard it for now.  FIXME: we should handle this
-		// when we come to skinning the tubes.
-		if (current_tube && current_tube->size() <= 1)
-		    tubes.resize(tubes.size() - 1);
-		current_tube = NULL;
-		break;
+		    int date = xsect.date;
+		    if (date != -1) {
+			if (date < m_DateMin) m_DateMin = date;
+			if (date > datemax) datemax = date;
+		    }
 
-	    case img_ERROR_INFO: {
-		if (survey->E == 0.0) {
-		    // Currently cavern doesn't spot all articulating traverses
-		    // so we assume that any traverse with no error isn't part
-		    // of a loop.  FIXME: fix cavern!
+		    current_tube->push_back(XSect(*lab, date, xsect.l, xsect.r, xsect.u, xsect.d));
 		    break;
 		}
-		m_HasErrorInformation = true;
-		list<traverse>::reverse_iterator t;
-		t = surface_traverses.rbegin();
-		while (n_surface_traverses) {
-		    assert(t != surface_traverses.rend());
-		    t->n_legs = survey->n_legs;
-		    t->length = survey->length;
-		    t->E = survey->E;
-		    t->H = survey->H;
-		    t->V = survey->V;
-		    --n_surface_traverses;
-		    ++t;
-		}
-		t = traverses.rbegin();
-		while (n_traverses) {
-		    assert(t != traverses.rend());
-		    t->n_legs = survey->n_legs;
-		    t->length = survey->length;
-		    t->E = survey->E;
-		    t->H = survey->H;
-		    t->V = survey->V;
-		    --n_traverses;
-		    ++t;
-		}
-		break;
-	    }
-
-	    case img_BAD: {
-		m_Labels.clear();
-
-		// FIXME: Do we need to reset all these? - Olly
-		m_NumFixedPts = 0;
-		m_NumExportedPts = 0;
-		m_NumEntrances = 0;
-		m_HasUndergroundLegs = false;
-		m_HasSplays = false;
-		m_HasSurfaceLegs = false;
-
-		img_close(survey);
 
-		wxString m = wxString::Format(wmsg(img_error2msg(img_error())), file.c_str());
-		wxGetApp().ReportError(m);
+		case img_XSECT_END:
+		    // Finish off current_tube.
+		    // If there's only one cross-section in the tube, just
+		    // discard it for now.  FIXME: we should handle this
+		    // when we come to skinning the tubes.
+		    if (current_tube && current_tube->size() <= 1)
+			tubes.resize(tubes.size() - 1);
+		    current_tube = NULL;
+		    break;
 
-		return false;
+		case img_ERROR_INFO: {
+		    const LoadedErrorInfo & error = chunk.errors[item->index];
+		    if (error.E == 0.0) {
+			// Currently cavern doesn't spot all articulating traverses
+			// so we assume that any traverse with no error isn't part
+			// of a loop.  FIXME: fix cavern!
+			break;
+		    }
+		    m_HasErrorInformation = true;
+		    list<traverse>::reverse_iterator t;
+		    t = surface_traverses.rbegin();
+		    while (n_surface_traverses) {
+			assert(t != surface_traverses.rend());
+			t->n_legs = error.n_legs;
+			t->length = error.length;
+			t->E = error.E;
+			t->H = error.H;
+			t->V = error.V;
+			--n_surface_traverses;
+			++t;
+		    }
+		    t = traverses.rbegin();
+		    while (n_traverses) {
+			assert(t != traverses.rend());
+			t->n_legs = error.n_legs;
+			t->length = error.length;
+			t->E = error.E;
+			t->H = error.H;
+			t->V = error.V;
+			--n_traverses;
+			++t;
+		    }
+		    break;
+		}
 	    }
-
-	    default:
-		break;
 	}
-    } while (result != img_STOP);
+    }
 
     if (!current_polyline_is_surface && current_traverse) {
 	//FixLRUD(*current_traverse);
@@ -1474,13 +1841,14 @@ bool MainFrm::LoadData(const wxString& file, const wxString & prefix)
     // Check we've actually loaded some legs or stations!
     if (!m_HasUndergroundLegs && !m_HasSurfaceLegs && m_Labels.empty()) {
 	wxString m = wxString::Format(wmsg(/*No survey data in 3d file “%s”*/202), file.c_str());
+	m_Gfx->EndPreview();
 	wxGetApp().ReportError(m);
 	return false;
     }
 
     if (traverses.empty() && surface_traverses.empty()) {
 	// No legs, so get survey extents from stations
-	list<LabelInfo*>::const_iterator i;
+	vector<LabelInfo*>::const_iterator i;
 	for (i = m_Labels.begin(); i != m_Labels.end(); ++i) {
 	    if ((*i)->GetX() < xmin) xmin = (*i)->GetX();
 	    if ((*i)->GetX() > xmax) xmax = (*i)->GetX();
@@ -1514,10 +1882,8 @@ bool MainFrm::LoadData(const wxString& file, const wxString & prefix)
     // Update window title.
     SetTitle(m_Title + " - " APP_NAME);
 
-    // Sort the labels ready for filling the tree.
-    m_Labels.sort(LabelCmp(separator));
-
-    // Fill the tree of stations and prefixes.
+    // Fill the tree of stations and prefixes (we sorted the labels ready for
+    // this above).
     wxString root_name = wxFileNameFromPath(file);
     if (!prefix.empty()) {
 	root_name += " (";
@@ -1532,7 +1898,9 @@ bool MainFrm::LoadData(const wxString& file, const wxString & prefix)
     // Also sort by leaf name so that we'll tend to choose labels
     // from different surveys, rather than labels from surveys which
     // are earlier in the list.
-    m_Labels.sort(LabelPlotCmp(separator));
+    sort(m_Labels.begin(), m_Labels.end(), LabelPlotCmp());
+
+    m_TrigramIndex.Build(m_Labels.begin(), m_Labels.end());
 
     if (!m_FindBox->GetValue().empty()) {
 	// Highlight any stations matching the current search.
@@ -1617,132 +1985,113 @@ MainFrm::FixLRUD(traverse & centreline)
 
 void MainFrm::FillTree(const wxString & root_name)
 {
+    // The tree items are only created as branches are expanded, which
+    // saves a lot of time and memory for large surveys.  Each survey item
+    // notes the range of m_TreeLabels it covers so we can fill it in later.
+    m_TreeLabels.clear();
+    vector<LabelInfo*>::const_iterator pos;
+    for (pos = m_Labels.begin(); pos != m_Labels.end(); ++pos) {
+	if (!(*pos)->IsAnon()) m_TreeLabels.push_back(*pos);
+    }
+
     // Create the root of the tree.
     wxTreeItemId treeroot = m_Tree->AddRoot(root_name);
+    AddTreeItems(treeroot, wxString(), 0, m_TreeLabels.size());
 
-    // Fill the tree of stations and prefixes.
-    stack<wxTreeItemId> previous_ids;
-    wxString current_prefix;
-    wxTreeItemId current_id = treeroot;
-
-    list<LabelInfo*>::iterator pos = m_Labels.begin();
-    while (pos != m_Labels.end()) {
-	LabelInfo* label = *pos++;
-
-	if (label->IsAnon()) continue;
-
-	// Determine the current prefix.
-	wxString prefix = label->GetText().BeforeLast(separator);
-
-	// Determine if we're still on the same prefix.
-	if (prefix == current_prefix) {
-	    // no need to fiddle with branches...
-	}
-	// If not, then see if we've descended to a new prefix.
-	else if (prefix.length() > current_prefix.length() &&
-		 prefix.StartsWith(current_prefix) &&
-		 (prefix[current_prefix.length()] == separator ||
-		  current_prefix.empty())) {
-	    // We have, so start as many new branches as required.
-	    int current_prefix_length = current_prefix.length();
-	    current_prefix = prefix;
-	    size_t next_dot = current_prefix_length;
-	    if (!next_dot) --next_dot;
-	    do {
-		size_t prev_dot = next_dot + 1;
-
-		// Extract the next bit of prefix.
-		next_dot = prefix.find(separator, prev_dot + 1);
-
-		wxString bit = prefix.substr(prev_dot, next_dot - prev_dot);
-		assert(!bit.empty());
-
-		// Add the current tree ID to the stack.
-		previous_ids.push(current_id);
-
-		// Append the new item to the tree and set this as the current branch.
-		current_id = m_Tree->AppendItem(current_id, bit);
-		m_Tree->SetItemData(current_id, new TreeData(prefix.substr(0, next_dot)));
-	    } while (next_dot != wxString::npos);
-	}
-	// Otherwise, we must have moved up, and possibly then down again.
-	else {
-	    size_t count = 0;
-	    bool ascent_only = (prefix.length() < current_prefix.length() &&
-				current_prefix.StartsWith(prefix) &&
-				(current_prefix[prefix.length()] == separator ||
-				 prefix.empty()));
-	    if (!ascent_only) {
-		// Find out how much of the current prefix and the new prefix
-		// are the same.
-		// Note that we require a match of a whole number of parts
-		// between dots!
-		size_t n = min(prefix.length(), current_prefix.length());
-		size_t i;
-		for (i = 0; i < n && prefix[i] == current_prefix[i]; ++i) {
-		    if (prefix[i] == separator) count = i + 1;
-		}
-	    } else {
-		count = prefix.length() + 1;
-	    }
-
-	    // Extract the part of the current prefix after the bit (if any)
-	    // which has matched.
-	    // This gives the prefixes to ascend over.
-	    wxString prefixes_ascended = current_prefix.substr(count);
-
-	    // Count the number of prefixes to ascend over.
-	    int num_prefixes = prefixes_ascended.Freq(separator);
+    m_Tree->Expand(treeroot);
+    m_Tree->SetEnabled();
+}
 
-	    // Reverse up over these prefixes.
-	    for (int i = 1; i <= num_prefixes; i++) {
-		previous_ids.pop();
+void MainFrm::AddTreeItems(const wxTreeItemId & parent, const wxString & survey,
+			   size_t first, size_t end)
+{
+    // Names of stations in survey start with this many characters which
+    // we don't show.
+    size_t skip = survey.empty() ? 0 : survey.length() + 1;
+
+    size_t i = first;
+    while (i != end) {
+	LabelInfo* label = m_TreeLabels[i];
+	const wxString & name = label->GetText();
+	size_t next_dot = name.find(separator, skip);
+	if (next_dot == wxString::npos) {
+	    // A station in this survey, so add the leaf.
+	    wxString bit = name.substr(skip);
+	    assert(!bit.empty());
+	    wxTreeItemId id = m_Tree->AppendItem(parent, bit);
+	    m_Tree->SetItemData(id, new TreeData(label));
+	    label->tree_id = id;
+	    // Set the colour for an item in the survey tree.
+	    if (label->IsEntrance()) {
+		// Entrances are green (like entrance blobs).
+		m_Tree->SetItemTextColour(id, wxColour(0, 255, 40));
+	    } else if (label->IsSurface()) {
+		// Surface stations are dark green.
+		m_Tree->SetItemTextColour(id, wxColour(49, 158, 79));
 	    }
-	    current_id = previous_ids.top();
-	    previous_ids.pop();
-
-	    if (!ascent_only) {
-		// Add branches for this new part.
-		size_t next_dot = count - 1;
-		do {
-		    size_t prev_dot = next_dot + 1;
-
-		    // Extract the next bit of prefix.
-		    next_dot = prefix.find(separator, prev_dot + 1);
+	    ++i;
+	    continue;
+	}
 
-		    wxString bit = prefix.substr(prev_dot, next_dot - prev_dot);
-		    assert(!bit.empty());
+	// The labels are sorted, so the stations in this sub-survey follow
+	// on from this one.
+	wxString prefix = name.substr(0, next_dot);
+	size_t j = i + 1;
+	while (j != end && m_TreeLabels[j]->InSurvey(prefix)) ++j;
 
-		    // Add the current tree ID to the stack.
-		    previous_ids.push(current_id);
+	wxString bit = prefix.substr(skip);
+	assert(!bit.empty());
+	wxTreeItemId id = m_Tree->AppendItem(parent, bit);
+	m_Tree->SetItemData(id, new TreeData(prefix, i, j));
+	// Show the item as expandable - its children get added by
+	// FillTreeItem() when it's expanded.
+	m_Tree->SetItemHasChildren(id);
+	i = j;
+    }
+}
 
-		    // Append the new item to the tree and set this as the current branch.
-		    current_id = m_Tree->AppendItem(current_id, bit);
-		    m_Tree->SetItemData(current_id, new TreeData(prefix.substr(0, next_dot)));
-		} while (next_dot != wxString::npos);
+void MainFrm::FillTreeItem(const wxTreeItemId & id)
+{
+    if (m_Tree->GetChildrenCount(id, false) != 0) {
+	// Already filled in.
+	return;
+    }
+    const TreeData* data = static_cast<const TreeData*>(m_Tree->GetItemData(id));
+    // The root is filled in by FillTree().
+    if (!data || data->IsStation()) return;
+    AddTreeItems(id, data->GetSurvey(), data->GetFirst(), data->GetEnd());
+}
+
+void MainFrm::SelectTreeItem(const LabelInfo* label)
+{
+    if (!label->tree_id.IsOk() && !label->IsAnon()) {
+	// The station's item hasn't been created yet, so fill in the surveys
+	// containing it, working down from the root.
+	const wxString & name = label->GetText();
+	wxTreeItemId id = m_Tree->GetRootItem();
+	while (id.IsOk() && !label->tree_id.IsOk()) {
+	    FillTreeItem(id);
+	    wxTreeItemIdValue cookie;
+	    wxTreeItemId child = m_Tree->GetFirstChild(id, cookie);
+	    while (child.IsOk()) {
+		const TreeData* data =
+		    static_cast<const TreeData*>(m_Tree->GetItemData(child));
+		if (!data->IsStation()) {
+		    const wxString & survey = data->GetSurvey();
+		    size_t len = survey.length();
+		    if (name.length() > len && name[len] == separator &&
+			name.compare(0, len, survey) == 0) break;
+		}
+		child = m_Tree->GetNextChild(id, cookie);
 	    }
-
-	    current_prefix = prefix;
-	}
-
-	// Now add the leaf.
-	wxString bit = label->GetText().AfterLast(separator);
-	assert(!bit.empty());
-	wxTreeItemId id = m_Tree->AppendItem(current_id, bit);
-	m_Tree->SetItemData(id, new TreeData(label));
-	label->tree_id = id;
-	// Set the colour for an item in the survey tree.
-	if (label->IsEntrance()) {
-	    // Entrances are green (like entrance blobs).
-	    m_Tree->SetItemTextColour(id, wxColour(0, 255, 40));
-	} else if (label->IsSurface()) {
-	    // Surface stations are dark green.
-	    m_Tree->SetItemTextColour(id, wxColour(49, 158, 79));
+	    id = child;
 	}
     }
 
-    m_Tree->Expand(treeroot);
-    m_Tree->SetEnabled();
+    if (label->tree_id.IsOk())
+	m_Tree->SelectItem(label->tree_id);
+    else
+	m_Tree->UnselectAll();
 }
 
 void MainFrm::CentreDataset(const Vector3 & vmin)
@@ -1784,7 +2133,7 @@ void MainFrm::CentreDataset(const Vector3 & vmin)
 	++i;
     }
 
-    list<LabelInfo*>::iterator lpos = m_Labels.begin();
+    vector<LabelInfo*>::iterator lpos = m_Labels.begin();
     while (lpos != m_Labels.end()) {
 	Point & point = **lpos++;
 	point -= m_Offsets;
@@ -2009,8 +2358,13 @@ void MainFrm::OnOpenTerrain(wxCommandEvent&)
      * grid of height values). */
     wxFileDialog dlg(this, wmsg(/*Select a terrain file to view*/451),
 		     wxString(), wxString(),
-		     filetypes, wxFD_OPEN|wxFD_FILE_MUST_EXIST);
-    if (dlg.ShowModal() == wxID_OK && m_Gfx->LoadDEM(dlg.GetPath())) {
+		     filetypes, wxFD_OPEN|wxFD_FILE_MUST_EXIST|wxFD_MULTIPLE);
+    if (dlg.ShowModal() != wxID_OK) return;
+    // Several adjacent terrain files can be selected to cover a survey which
+    // crosses the edges of tiles.
+    wxArrayString files;
+    dlg.GetPaths(files);
+    if (m_Gfx->LoadDEM(files)) {
 	if (!m_Gfx->DisplayingTerrain()) m_Gfx->ToggleTerrain();
     }
 }
@@ -2081,6 +2435,16 @@ void MainFrm::PrintAndExit()
     m_Gfx->OnPrint(m_File, m_Title, m_DateStamp, m_DateStamp_numeric, m_cs_proj, true);
 }
 
+void MainFrm::RenderAndExit(const wxString & pres, const wxString & image,
+			    const wxString & movie, int width, int height)
+{
+    // Errors loading the survey have already been reported, but we also get
+    // here without any data if given an unprocessed survey.
+    if (m_File.empty()) exit(1);
+    if (!pres.empty() && !m_PresList->Load(pres)) exit(1);
+    m_Gfx->RenderAndExit(image, movie, width, height);
+}
+
 void MainFrm::OnPageSetup(wxCommandEvent&)
 {
     wxPageSetupDialog dlg(this, wxGetApp().GetPageSetupDialogData());
@@ -2717,7 +3081,7 @@ void MainFrm::DoFind()
     wxString pattern = m_FindBox->GetValue();
     if (pattern.empty()) {
 	// Hide any search result highlights.
-	list<LabelInfo*>::iterator pos = m_Labels.begin();
+	vector<LabelInfo*>::iterator pos = m_Labels.begin();
 	while (pos != m_Labels.end()) {
 	    LabelInfo* label = *pos++;
 	    label->clear_flags(LFLAG_HIGHLIGHTED);
@@ -2731,7 +3095,10 @@ void MainFrm::DoFind()
 	}
 
 	bool substring = true;
+	// Strings which any match must contain, used to narrow the search.
+	vector<wxString> literals(1);
 	if (false /*m_RegexpCheckBox->GetValue()*/) {
+	    literals.clear();
 	    re_flags |= wxRE_EXTENDED;
 	} else if (true /* simple glob-style */) {
 	    wxString pat;
@@ -2742,17 +3109,21 @@ void MainFrm::DoFind()
 		case '^': case '$': case '.': case '[': case '\\':
 		  pat += wxT('\\');
 		  pat += ch;
+		  literals.back() += ch;
 		  break;
 		case '*':
 		  pat += wxT(".*");
 		  substring = false;
+		  literals.push_back(wxString());
 		  break;
 		case '?':
 		  pat += wxT('.');
 		  substring = false;
+		  literals.push_back(wxString());
 		  break;
 		default:
 		  pat += ch;
+		  literals.back() += ch;
 	       }
 	    }
 	    pattern = pat;
@@ -2768,6 +3139,7 @@ void MainFrm::DoFind()
 	       }
 	       pat += ch;
 	    }
+	    literals.back() = pattern;
 	    pattern = pat;
 	    re_flags |= wxRE_BASIC;
 	}
@@ -2785,24 +3157,28 @@ void MainFrm::DoFind()
 	    return;
 	}
 
-	int found = 0;
-
-	list<LabelInfo*>::iterator pos = m_Labels.begin();
+	vector<LabelInfo*>::iterator pos = m_Labels.begin();
 	while (pos != m_Labels.end()) {
 	    LabelInfo* label = *pos++;
+	    label->clear_flags(LFLAG_HIGHLIGHTED);
+	}
 
+	// Only the stations whose names contain all the literal parts of the
+	// pattern can match, so we only need to try the regex on those.
+	vector<LabelInfo*> candidates;
+	m_TrigramIndex.Find(literals, candidates);
+
+	int found = 0;
+	vector<LabelInfo*>::const_iterator i;
+	for (i = candidates.begin(); i != candidates.end(); ++i) {
+	    LabelInfo* label = *i;
 	    if (regex.Matches(label->GetText())) {
 		label->set_flags(LFLAG_HIGHLIGHTED);
 		++found;
-	    } else {
-		label->clear_flags(LFLAG_HIGHLIGHTED);
 	    }
 	}
 
 	m_NumHighlighted = found;
-
-	// Re-sort so highlighted points get names in preference
-	if (found) m_Labels.sort(LabelPlotCmp(separator));
     }
 
     m_Gfx->UpdateBlobs();
@@ -2831,7 +3207,7 @@ void MainFrm::OnGotoFound(wxCommandEvent&)
     Double zmin = DBL_MAX;
     Double zmax = -DBL_MAX;
 
-    list<LabelInfo*>::iterator pos = m_Labels.begin();
+    vector<LabelInfo*>::iterator pos = m_Labels.begin();
     while (pos != m_Labels.end()) {
 	LabelInfo* label = *pos++;
 
@@ -37,6 +37,7 @@
 #include "img_hosted.h"
 #include "labelinfo.h"
 #include "message.h"
+#include "trigramindex.h"
 #include "vector3.h"
 #include "aven.h"
 //#include "prefsdlg.h"
@@ -180,6 +181,14 @@ class traverse : public vector<PointInfo> {
     traverse() : n_legs(0), isSplay(false), length(0), E(-1), H(-1), V(-1) { }
 };
 
+// The stations loaded from all or part of a .3d file.  Each LabelInfo refers
+// to names, so a block mustn't be copied once it has stations in.
+class LabelBlock {
+  public:
+    LabelNames names;
+    vector<LabelInfo> labels;
+};
+
 class MainFrm : public wxFrame {
     wxFileHistory m_history;
     int m_SashPosition;
@@ -187,7 +196,12 @@ class MainFrm : public wxFrame {
     list<traverse> traverses;
     list<traverse> surface_traverses;
     list<vector<XSect> > tubes;
-    list<LabelInfo*> m_Labels;
+    // The labels, one block per chunk of the file they were loaded from.
+    list<LabelBlock> m_LabelStore;
+    vector<LabelInfo*> m_Labels;
+    // The named stations, sorted for the survey tree.
+    vector<LabelInfo*> m_TreeLabels;
+    TrigramIndex m_TrigramIndex;
     Vector3 m_Ext;
     Double m_DepthMin, m_DepthExt;
     int m_DateMin, m_DateExt;
@@ -233,6 +247,8 @@ private:
 #endif
 
     void FillTree(const wxString & root_name);
+    void AddTreeItems(const wxTreeItemId & parent, const wxString & survey,
+		      size_t first, size_t end);
     bool ProcessSVXFile(const wxString & file);
 //    void FixLRUD(traverse & centreline);
     void CentreDataset(const Vector3 & vmin);
@@ -295,6 +311,8 @@ public:
     void OnFilePreferences(wxCommandEvent& event);
     void OnPrint(wxCommandEvent& event);
     void PrintAndExit();
+    void RenderAndExit(const wxString & pres, const wxString & image,
+		       const wxString & movie, int width, int height);
     void OnPageSetup(wxCommandEvent& event);
     void OnPresNew(wxCommandEvent& event);
     void OnPresOpen(wxCommandEvent& event);
@@ -452,12 +470,9 @@ public:
     int GetDateExtent() const { return m_DateExt; }
     int GetDateMin() const { return m_DateMin; }
 
-    void SelectTreeItem(const LabelInfo* label) {
-	if (label->tree_id.IsOk())
-	    m_Tree->SelectItem(label->tree_id);
-	else
-	    m_Tree->UnselectAll();
-    }
+    void SelectTreeItem(const LabelInfo* label);
+
+    void FillTreeItem(const wxTreeItemId & id);
 
     void ClearTreeSelection();
 
@@ -516,27 +531,27 @@ public:
 	return tubes.end();
     }
 
-    list<LabelInfo*>::const_iterator GetLabels() const {
+    vector<LabelInfo*>::const_iterator GetLabels() const {
 	return m_Labels.begin();
     }
 
-    list<LabelInfo*>::const_iterator GetLabelsEnd() const {
+    vector<LabelInfo*>::const_iterator GetLabelsEnd() const {
 	return m_Labels.end();
     }
 
-    list<LabelInfo*>::const_reverse_iterator GetRevLabels() const {
+    vector<LabelInfo*>::const_reverse_iterator GetRevLabels() const {
 	return m_Labels.rbegin();
     }
 
-    list<LabelInfo*>::const_reverse_iterator GetRevLabelsEnd() const {
+    vector<LabelInfo*>::const_reverse_iterator GetRevLabelsEnd() const {
 	return m_Labels.rend();
     }
 
-    list<LabelInfo*>::iterator GetLabelsNC() {
+    vector<LabelInfo*>::iterator GetLabelsNC() {
 	return m_Labels.begin();
     }
 
-    list<LabelInfo*>::iterator GetLabelsNCEnd() {
+    vector<LabelInfo*>::iterator GetLabelsNCEnd() {
 	return m_Labels.end();
     }
 
@@ -1,6 +1,6 @@
 /* matrix.c
  * Matrix building and solving routines
- * Copyright (C) 1993-2003,2010,2013 Olly Betts
+ * Copyright (C) 1993-2003,2010,2013,2016 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -29,11 +29,14 @@
 
 #include "debug.h"
 #include "cavern.h"
+#include "choleski.h"
 #include "filename.h"
 #include "message.h"
 #include "netbits.h"
 #include "matrix.h"
 #include "out.h"
+#include "solvecache.h"
+#include "stntab.h"
 
 #undef PRINT_MATRICES
 #define PRINT_MATRICES 0
@@ -48,8 +51,6 @@
 static void print_matrix(real *M, real *B, long n);
 #endif
 
-static void choleski(real *M, real *B, long n);
-
 #ifdef SOR
 static void sor(real *M, real *B, long n);
 #endif
@@ -59,50 +60,81 @@ static void sor(real *M, real *B, long n);
 	      /* +(Y>X?0*printf("row<col (line %d)\n",__LINE__):0) */
 /*#define M_(X, Y) ((real *)M)[((((OSSIZE_T)(Y)) * ((Y) + 1)) >> 1) + (X)]*/
 
-static int find_stn_in_tab(node *stn);
-static int add_stn_to_tab(node *stn);
-static void build_matrix(node *list);
-
-static long n_stn_tab;
+/* FOR_EACH_STN() uses a global iterator so can't be used here as several
+ * components may be being solved at once in different threads.  We never
+ * remove stations from the list while solving, so a plain loop will do. */
+#define FOR_EACH_STN_IN_MATRIX(S, L) for ((S) = (L); (S); (S) = (S)->next)
 
-static pos **stn_tab;
+static bool init_stn_tab(stn_table *tab, node *list);
+static int find_stn_in_tab(const stn_table *tab, node *stn);
+static int add_stn_to_tab(stn_table *tab, node *stn);
+static void build_matrix(const stn_table *tab, node *list);
+static void build_dense_matrix(const stn_table *tab, node *list);
+static bool build_sparse_matrix(const stn_table *tab, node *list);
+static void set_positions(const stn_table *tab, const real *B, int dim);
 
 extern void
 solve_matrix(node *list)
+{
+   stn_table tab;
+   if (!init_stn_tab(&tab, list)) return;
+   report_matrix(tab.n_stn_tab);
+   build_matrix(&tab, list);
+   stn_tab_free(&tab);
+}
+
+extern long
+solve_matrix_quietly(node *list)
+{
+   stn_table tab;
+   long n;
+   if (!init_stn_tab(&tab, list)) return -1;
+   build_matrix(&tab, list);
+   n = tab.n_stn_tab;
+   stn_tab_free(&tab);
+   return n;
+}
+
+extern void
+report_matrix(long n)
+{
+   if (n < 0 || fQuiet) return;
+   if (n == 0) {
+      puts(msg(/*Network solved by reduction - no simultaneous equations to solve.*/74));
+   } else if (n == 1) {
+      out_current_action(msg(/*Solving one equation*/78));
+   } else {
+      out_current_action1(msg(/*Solving %d simultaneous equations*/75), (int)n);
+   }
+}
+
+/* Set up the table of unfixed stations in list.  Returns fFalse if there
+ * aren't any. */
+static bool
+init_stn_tab(stn_table *tab, node *list)
 {
    node *stn;
    long n = 0;
-   FOR_EACH_STN(stn, list) {
+   FOR_EACH_STN_IN_MATRIX(stn, list) {
       if (!fixed(stn)) n++;
    }
-   if (n == 0) return;
+   if (n == 0) return fFalse;
 
    /* we just need n to be a reasonable estimate >= the number
     * of stations left after reduction. If memory is
     * plentiful, we can be crass.
     */
-   stn_tab = osmalloc((OSSIZE_T)(n * ossizeof(pos*)));
-   n_stn_tab = 0;
+   stn_tab_init(tab, n);
 
-   FOR_EACH_STN(stn, list) {
-      if (!fixed(stn)) add_stn_to_tab(stn);
+   FOR_EACH_STN_IN_MATRIX(stn, list) {
+      if (!fixed(stn)) add_stn_to_tab(tab, stn);
    }
 
-   if (n_stn_tab < n) {
+   if (tab->n_stn_tab < n) {
       /* release unused entries in stn_tab */
-      stn_tab = osrealloc(stn_tab, n_stn_tab * ossizeof(pos*));
-   }
-
-   build_matrix(list);
-#if DEBUG_MATRIX
-   FOR_EACH_STN(stn, list) {
-      printf("(%8.2f, %8.2f, %8.2f ) ", POS(stn, 0), POS(stn, 1), POS(stn, 2));
-      print_prefix(stn->name);
-      putnl();
+      tab->stn_tab = osrealloc(tab->stn_tab, tab->n_stn_tab * ossizeof(pos*));
    }
-#endif
-
-   osfree(stn_tab);
+   return fTrue;
 }
 
 #ifdef NO_COVARIANCES
@@ -111,28 +143,107 @@ solve_matrix(node *list)
 # define FACTOR 3
 #endif
 
+/* Record everything which goes into the matrix for this component, so we can
+ * tell if it's the same as one solved last time. */
 static void
-build_matrix(node *list)
+make_solve_key(solve_key *key, const stn_table *tab, node *list)
 {
-   real *M;
-   real *B;
-   int dim;
+   node *stn;
+   solve_key_init(key, tab->n_stn_tab);
+   /* Which solver is used affects the rounding of the results. */
+   solve_key_add(key, &optimize, sizeof(optimize));
+   FOR_EACH_STN_IN_MATRIX(stn, list) {
+      int dirn, t;
+      if (fixed(stn)) continue;
+      /* Which row of the solution this station's coordinates are in. */
+      t = find_stn_in_tab(tab, stn);
+      solve_key_add(key, &t, sizeof(t));
+      for (dirn = 0; dirn <= 2 && stn->leg[dirn]; dirn++) {
+	 linkfor *leg = stn->leg[dirn];
+	 node *to = leg->l.to;
+	 char type;
+	 if (fixed(to)) {
+	    bool fRev = !data_here(leg);
+	    if (fRev) leg = reverse_leg(leg);
+	    type = fRev ? 'R' : 'F';
+	    solve_key_add(key, &type, 1);
+	    solve_key_add(key, &POSD(to), sizeof(POSD(to)));
+	 } else if (data_here(leg)) {
+	    t = find_stn_in_tab(tab, to);
+	    type = 'L';
+	    solve_key_add(key, &type, 1);
+	    solve_key_add(key, &t, sizeof(t));
+	 } else {
+	    continue;
+	 }
+	 solve_key_add(key, &leg->d, sizeof(leg->d));
+	 solve_key_add(key, &leg->v, sizeof(leg->v));
+      }
+      /* Mark the end of each station's legs. */
+      solve_key_add(key, "", 1);
+   }
+}
 
-   if (n_stn_tab == 0) {
-      if (!fQuiet)
-	 puts(msg(/*Network solved by reduction - no simultaneous equations to solve.*/74));
-      return;
+static void
+build_matrix(const stn_table *tab, node *list)
+{
+   solve_key key;
+   real *sol = NULL;
+   long m;
+
+   if (tab->n_stn_tab == 0) return;
+
+   if (solvecache_is_open()) {
+      make_solve_key(&key, tab, list);
+      sol = osmalloc(3 * tab->n_stn_tab * ossizeof(real));
+      if (solvecache_find(&key, sol)) {
+	 for (m = 0; m < tab->n_stn_tab; m++) {
+	    int i;
+	    for (i = 0; i < 3; i++) tab->stn_tab[m]->p[i] = sol[m * 3 + i];
+#if EXPLICIT_FIXED_FLAG
+	    fixpos(tab->stn_tab[m]);
+#endif
+	 }
+	 solvecache_add(&key, sol);
+	 solve_key_free(&key);
+	 osfree(sol);
+	 return;
+      }
    }
-   /* (OSSIZE_T) cast may be needed if n_stn_tab>=181 */
-   M = osmalloc((OSSIZE_T)((((OSSIZE_T)n_stn_tab * FACTOR * (n_stn_tab * FACTOR + 1)) >> 1)) * ossizeof(real));
-   B = osmalloc((OSSIZE_T)(n_stn_tab * FACTOR * ossizeof(real)));
 
-   if (!fQuiet) {
-      if (n_stn_tab == 1)
-	 out_current_action(msg(/*Solving one equation*/78));
-      else
-	 out_current_action1(msg(/*Solving %d simultaneous equations*/75), n_stn_tab);
+   if (!build_sparse_matrix(tab, list)) build_dense_matrix(tab, list);
+
+   if (sol) {
+      for (m = 0; m < tab->n_stn_tab; m++) {
+	 int i;
+	 for (i = 0; i < 3; i++) sol[m * 3 + i] = tab->stn_tab[m]->p[i];
+      }
+      solvecache_add(&key, sol);
+      solve_key_free(&key);
+      osfree(sol);
+   }
+#if DEBUG_MATRIX
+   {
+      node *stn;
+      FOR_EACH_STN_IN_MATRIX(stn, list) {
+	 printf("(%8.2f, %8.2f, %8.2f ) ", POS(stn, 0), POS(stn, 1), POS(stn, 2));
+	 print_prefix(stn->name);
+	 putnl();
+      }
    }
+#endif
+}
+
+static void
+build_dense_matrix(const stn_table *tab, node *list)
+{
+   real *M;
+   real *B;
+   int dim;
+
+   /* (OSSIZE_T) cast may be needed if tab->n_stn_tab>=181 */
+   M = osmalloc((OSSIZE_T)((((OSSIZE_T)tab->n_stn_tab * FACTOR * (tab->n_stn_tab * FACTOR + 1)) >> 1)) * ossizeof(real));
+   B = osmalloc((OSSIZE_T)(tab->n_stn_tab * FACTOR * ossizeof(real)));
 
 #ifdef NO_COVARIANCES
    dim = 2;
@@ -146,9 +257,9 @@ build_matrix(node *list)
       /* Initialise M and B to zero - zeroing "linearly" will minimise
        * paging when the matrix is large */
       {
-	 int end = n_stn_tab * FACTOR;
+	 int end = tab->n_stn_tab * FACTOR;
 	 for (row = 0; row < end; row++) B[row] = (real)0.0;
-	 end = ((OSSIZE_T)n_stn_tab * FACTOR * (n_stn_tab * FACTOR + 1)) >> 1;
+	 end = ((OSSIZE_T)tab->n_stn_tab * FACTOR * (tab->n_stn_tab * FACTOR + 1)) >> 1;
 	 for (row = 0; row < end; row++) M[row] = (real)0.0;
       }
 
@@ -161,7 +272,7 @@ build_matrix(node *list)
        * from the unfixed end (if we consider them from the fixed end we'd
        * need to somehow detect when we're at a fixed point cut line and work
        * out which side we're dealing with at this time. */
-      FOR_EACH_STN(stn, list) {
+      FOR_EACH_STN_IN_MATRIX(stn, list) {
 #ifdef NO_COVARIANCES
 	 real e;
 #else
@@ -191,7 +302,7 @@ build_matrix(node *list)
 #endif /* DEBUG_MATRIX_BUILD */
 
 	 if (!fixed(stn)) {
-	    f = find_stn_in_tab(stn);
+	    f = find_stn_in_tab(tab, stn);
 	    for (dirn = 0; dirn <= 2 && stn->leg[dirn]; dirn++) {
 	       linkfor *leg = stn->leg[dirn];
 	       node *to = leg->l.to;
@@ -232,7 +343,7 @@ build_matrix(node *list)
 #endif
 	       } else if (data_here(leg)) {
 		  /* forward leg, unfixed -> unfixed */
-		  t = find_stn_in_tab(to);
+		  t = find_stn_in_tab(tab, to);
 #if DEBUG_MATRIX
 		  printf("Leg %d to %d, var %f, delta %f\n", f, t, e,
 			 leg->d[dim]);
@@ -293,121 +404,533 @@ build_matrix(node *list)
       }
 
 #if PRINT_MATRICES
-      print_matrix(M, B, n_stn_tab * FACTOR); /* 'ave a look! */
+      print_matrix(M, B, tab->n_stn_tab * FACTOR); /* 'ave a look! */
 #endif
 
 #ifdef SOR
       /* defined in network.c, may be altered by -z<letters> on command line */
       if (optimize & BITA('i'))
-	 sor(M, B, n_stn_tab * FACTOR);
+	 sor(M, B, tab->n_stn_tab * FACTOR);
       else
 #endif
-	 choleski(M, B, n_stn_tab * FACTOR);
+	 choleski(M, B, tab->n_stn_tab * FACTOR);
 
-      {
-	 int m;
-	 for (m = (int)(n_stn_tab - 1); m >= 0; m--) {
+      set_positions(tab, B, dim);
+   }
+   osfree(B);
+   osfree(M);
+}
+
+/* Copy the solution in B into the positions of the stations in stn_tab */
+static void
+set_positions(const stn_table *tab, const real *B, int dim)
+{
+   int m;
+#ifndef NO_COVARIANCES
+   (void)dim;
+#endif
+   for (m = (int)(tab->n_stn_tab - 1); m >= 0; m--) {
 #ifdef NO_COVARIANCES
-	    stn_tab[m]->p[dim] = B[m];
-	    if (dim == 0) {
-	       SVX_ASSERT2(pos_fixed(stn_tab[m]),
-		       "setting station coordinates didn't mark pos as fixed");
-	    }
+      tab->stn_tab[m]->p[dim] = B[m];
+      if (dim == 0) {
+	 SVX_ASSERT2(pos_fixed(tab->stn_tab[m]),
+		 "setting station coordinates didn't mark pos as fixed");
+      }
 #else
-	    int i;
-	    for (i = 0; i < 3; i++) {
-	       stn_tab[m]->p[i] = B[m * FACTOR + i];
-	    }
-	    SVX_ASSERT2(pos_fixed(stn_tab[m]),
-		    "setting station coordinates didn't mark pos as fixed");
+      int i;
+      for (i = 0; i < 3; i++) {
+	 tab->stn_tab[m]->p[i] = B[m * FACTOR + i];
+      }
+      SVX_ASSERT2(pos_fixed(tab->stn_tab[m]),
+	      "setting station coordinates didn't mark pos as fixed");
 #endif
-	 }
+   }
 #if EXPLICIT_FIXED_FLAG
-	 for (m = n_stn_tab - 1; m >= 0; m--) fixpos(stn_tab[m]);
+   for (m = tab->n_stn_tab - 1; m >= 0; m--) fixpos(tab->stn_tab[m]);
 #endif
-      }
-   }
-   osfree(B);
-   osfree(M);
 }
 
-static int
-find_stn_in_tab(node *stn)
+/* Sparse solver
+ *
+ * After reduction, each station in the matrix is usually only connected to
+ * a handful of others, so the matrix is almost entirely zeros.  For all but
+ * small networks it's much quicker (and uses much less memory) to store just
+ * the non-zero entries, reorder the stations to limit fill-in, and factor
+ * with a sparse LDL' decomposition.  The numerical method is the same as in
+ * choleski() so the results agree to within rounding.
+ *
+ * The matrix is stored in compressed column form with both triangles
+ * present.  Each station has a block of FACTOR columns, and each column
+ * holds a FACTOR-high block of rows for the station itself followed by one
+ * for each leg to another unfixed station (so parallel legs give repeated
+ * blocks, which just get summed during factorisation).
+ */
+
+/* Use the dense solver for networks smaller than this. */
+#define SPARSE_MIN_STNS 16
+
+/* Build the adjacency lists for the stations in stn_tab.  If adjp is NULL,
+ * just count the number of legs at each station into deg.  Otherwise fill in
+ * adji (indexed by adjp) and also assemble the matrix into Ax and B. */
+static void
+sparse_assemble(const stn_table *tab, node *list, long *deg,
+		const long *adjp, long *adji, const long *Ap, real *Ax, real *B,
+		int dim)
 {
-   int i = 0;
-   pos *p = stn->name->pos;
-   while (stn_tab[i] != p)
-      if (++i == n_stn_tab) {
-#if DEBUG_INVALID
-	 fputs("Station ", stderr);
-	 fprint_prefix(stderr, stn->name);
-	 fputs(" not in table\n\n", stderr);
+   node *stn;
+   long i;
+#ifdef NO_COVARIANCES
+   real e;
+#else
+   svar e;
+   delta a;
+   (void)dim;
 #endif
-#if 0
-	 print_prefix(stn->name);
-	 printf(" used: %d colour %d\n",
-		(!!stn->leg[2])<<2 | (!!stn->leg[1])<<1 | (!!stn->leg[0]),
-		stn->colour);
+
+#define AX(S, K, R, C) Ax[Ap[(S) * FACTOR + (C)] + (K) * FACTOR + (R)]
+#ifdef NO_COVARIANCES
+# define ADD_BLOCK(S, K, OP) (AX(S, K, 0, 0) OP e)
+#else
+# define ADD_BLOCK(S, K, OP) do {\
+      int r_;\
+      for (r_ = 0; r_ < 3; r_++) AX(S, K, r_, r_) OP e[r_];\
+      AX(S, K, 1, 0) OP e[3];\
+      AX(S, K, 0, 1) OP e[3];\
+      AX(S, K, 2, 0) OP e[4];\
+      AX(S, K, 0, 2) OP e[4];\
+      AX(S, K, 2, 1) OP e[5];\
+      AX(S, K, 1, 2) OP e[5];\
+   } while (0)
+#endif
+
+   for (i = 0; i < tab->n_stn_tab; i++) deg[i] = 0;
+   if (adjp) {
+      long end = Ap[tab->n_stn_tab * FACTOR];
+      for (i = 0; i < end; i++) Ax[i] = (real)0.0;
+      for (i = 0; i < tab->n_stn_tab * FACTOR; i++) B[i] = (real)0.0;
+   }
+
+   FOR_EACH_STN_IN_MATRIX(stn, list) {
+      int dirn;
+      long f;
+      if (fixed(stn)) continue;
+      f = find_stn_in_tab(tab, stn);
+      for (dirn = 0; dirn <= 2 && stn->leg[dirn]; dirn++) {
+	 linkfor *leg = stn->leg[dirn];
+	 node *to = leg->l.to;
+	 if (fixed(to)) {
+	    bool fRev;
+	    if (!adjp) continue;
+	    fRev = !data_here(leg);
+	    if (fRev) leg = reverse_leg(leg);
+#ifdef NO_COVARIANCES
+	    e = leg->v[dim];
+	    if (e != (real)0.0) {
+	       e = ((real)1.0) / e;
+	       ADD_BLOCK(f, 0, +=);
+	       B[f] += e * POS(to, dim);
+	       if (fRev) {
+		  B[f] += leg->d[dim];
+	       } else {
+		  B[f] -= leg->d[dim];
+	       }
+	    }
+#else
+	    if (invert_svar(&e, &leg->v)) {
+	       delta b;
+	       if (fRev) {
+		  adddd(&a, &POSD(to), &leg->d);
+	       } else {
+		  subdd(&a, &POSD(to), &leg->d);
+	       }
+	       mulsd(&b, &e, &a);
+	       ADD_BLOCK(f, 0, +=);
+	       for (i = 0; i < 3; i++) B[f * FACTOR + i] += b[i];
+	    }
+#endif
+	 } else if (data_here(leg)) {
+	    /* forward leg, unfixed -> unfixed */
+	    long t = find_stn_in_tab(tab, to);
+	    long kf, kt;
+	    /* Ignore equated nodes & lollipops */
+	    if (t == f) continue;
+	    kf = ++deg[f];
+	    kt = ++deg[t];
+	    if (!adjp) continue;
+	    adji[adjp[f] + kf - 1] = t;
+	    adji[adjp[t] + kt - 1] = f;
+#ifdef NO_COVARIANCES
+	    e = leg->v[dim];
+	    if (e != (real)0.0) {
+	       real d;
+	       e = ((real)1.0) / e;
+	       ADD_BLOCK(f, 0, +=);
+	       ADD_BLOCK(t, 0, +=);
+	       ADD_BLOCK(f, kf, -=);
+	       ADD_BLOCK(t, kt, -=);
+	       d = e * leg->d[dim];
+	       B[f] -= d;
+	       B[t] += d;
+	    }
+#else
+	    if (invert_svar(&e, &leg->v)) {
+	       mulsd(&a, &e, &leg->d);
+	       ADD_BLOCK(f, 0, +=);
+	       ADD_BLOCK(t, 0, +=);
+	       ADD_BLOCK(f, kf, -=);
+	       ADD_BLOCK(t, kt, -=);
+	       for (i = 0; i < 3; i++) {
+		  B[f * FACTOR + i] -= a[i];
+		  B[t * FACTOR + i] += a[i];
+	       }
+	    }
 #endif
-	 fatalerror(/*Bug in program detected! Please report this to the authors*/11);
+	 }
       }
-   return i;
+   }
+#undef ADD_BLOCK
+#undef AX
 }
 
-static int
-add_stn_to_tab(node *stn)
+/* Find an ordering of the n stations which keeps the fill-in produced by
+ * factorisation low, using the minimum degree heuristic: repeatedly
+ * eliminate the station with fewest neighbours, connecting all its
+ * neighbours to each other.  On return, perm[k] is the k-th station to
+ * eliminate.
+ */
+static void
+min_degree_order(long n, const long *adjp, const long *adji, long *perm)
 {
-   int i;
-   pos *p = stn->name->pos;
-   for (i = 0; i < n_stn_tab; i++) {
-      if (stn_tab[i] == p) return i;
+   long **adj;
+   long *len, *cap;
+   long *head, *next, *prev, *tag;
+   long i, k, mindeg = 0, stamp = 0;
+
+   adj = osmalloc(n * ossizeof(long*));
+   len = osmalloc(n * ossizeof(long));
+   cap = osmalloc(n * ossizeof(long));
+   head = osmalloc(n * ossizeof(long));
+   next = osmalloc(n * ossizeof(long));
+   prev = osmalloc(n * ossizeof(long));
+   tag = osmalloc(n * ossizeof(long));
+
+   for (i = 0; i < n; i++) {
+      head[i] = -1;
+      tag[i] = -1;
    }
-   stn_tab[n_stn_tab++] = p;
-   return i;
+
+   /* Copy the adjacency lists, dropping repeats. */
+   for (i = 0; i < n; i++) {
+      long p;
+      cap[i] = adjp[i + 1] - adjp[i];
+      if (cap[i] < 4) cap[i] = 4;
+      adj[i] = osmalloc(cap[i] * ossizeof(long));
+      len[i] = 0;
+      for (p = adjp[i]; p < adjp[i + 1]; p++) {
+	 long j = adji[p];
+	 if (tag[j] == i) continue;
+	 tag[j] = i;
+	 adj[i][len[i]++] = j;
+      }
+   }
+
+#define BUCKET_REMOVE(I) do {\
+      if (prev[I] >= 0) next[prev[I]] = next[I]; else head[len[I]] = next[I];\
+      if (next[I] >= 0) prev[next[I]] = prev[I];\
+   } while (0)
+#define BUCKET_INSERT(I) do {\
+      prev[I] = -1;\
+      next[I] = head[len[I]];\
+      if (next[I] >= 0) prev[next[I]] = I;\
+      head[len[I]] = I;\
+      if (len[I] < mindeg) mindeg = len[I];\
+   } while (0)
+
+   for (i = n - 1; i >= 0; i--) BUCKET_INSERT(i);
+   mindeg = 0;
+
+   for (i = 0; i < n; i++) tag[i] = -1;
+
+   for (k = 0; k < n; k++) {
+      long v, *nb, nnb, q;
+      while (head[mindeg] < 0) mindeg++;
+      v = head[mindeg];
+      BUCKET_REMOVE(v);
+      perm[k] = v;
+      nb = adj[v];
+      nnb = len[v];
+      for (q = 0; q < nnb; q++) {
+	 long u = nb[q], r, w;
+	 BUCKET_REMOVE(u);
+	 /* Remove v from u's list and mark u's remaining neighbours. */
+	 ++stamp;
+	 w = 0;
+	 for (r = 0; r < len[u]; r++) {
+	    long x = adj[u][r];
+	    if (x == v) continue;
+	    tag[x] = stamp;
+	    adj[u][w++] = x;
+	 }
+	 len[u] = w;
+	 /* Connect u to each of v's other neighbours. */
+	 for (r = 0; r < nnb; r++) {
+	    long x = nb[r];
+	    if (x == u || tag[x] == stamp) continue;
+	    if (len[u] == cap[u]) {
+	       cap[u] *= 2;
+	       adj[u] = osrealloc(adj[u], cap[u] * ossizeof(long));
+	    }
+	    adj[u][len[u]++] = x;
+	 }
+	 BUCKET_INSERT(u);
+      }
+      osfree(adj[v]);
+      adj[v] = NULL;
+   }
+#undef BUCKET_REMOVE
+#undef BUCKET_INSERT
+
+   osfree(tag);
+   osfree(prev);
+   osfree(next);
+   osfree(head);
+   osfree(cap);
+   osfree(len);
+   osfree(adj);
 }
 
-/* Solve MX=B for X by Choleski factorisation - modified Choleski actually
- * since we factor into LDL' while Choleski is just LL'
+/* Sparse LDL' factorisation and solution of MX=B for X, where M is given
+ * in compressed column form by Ap, Ai and Ax, and P is the order in which to
+ * eliminate the unknowns (Pinv is its inverse).
+ *
+ * This uses the "up-looking" approach from Tim Davis's LDL package - the
+ * elimination tree is used to find the non-zero pattern of each row of L
+ * without needing to search.  The solution overwrites B.
  */
-/* Note M must be symmetric positive definite */
-/* routine is entitled to scribble on M and B if it wishes */
 static void
-choleski(real *M, real *B, long n)
+sparse_ldl(long n, const long *Ap, const long *Ai, const real *Ax,
+	   const long *P, const long *Pinv, real *B)
+{
+   long *Lp, *Parent, *Lnz, *Flag, *Pattern, *Li;
+   real *Lx, *D, *Y;
+   long i, k, p;
+
+   Lp = osmalloc((n + 1) * ossizeof(long));
+   Parent = osmalloc(n * ossizeof(long));
+   Lnz = osmalloc(n * ossizeof(long));
+   Flag = osmalloc(n * ossizeof(long));
+   Pattern = osmalloc(n * ossizeof(long));
+   D = osmalloc(n * ossizeof(real));
+   Y = osmalloc(n * ossizeof(real));
+
+   /* Symbolic factorisation - find the elimination tree and the number of
+    * non-zeros in each column of L. */
+   for (k = 0; k < n; k++) {
+      long kk = P[k];
+      Parent[k] = -1;
+      Flag[k] = k;
+      Lnz[k] = 0;
+      for (p = Ap[kk]; p < Ap[kk + 1]; p++) {
+	 i = Pinv[Ai[p]];
+	 if (i < k) {
+	    for ( ; Flag[i] != k; i = Parent[i]) {
+	       if (Parent[i] == -1) Parent[i] = k;
+	       Lnz[i]++;
+	       Flag[i] = k;
+	    }
+	 }
+      }
+   }
+   Lp[0] = 0;
+   for (k = 0; k < n; k++) Lp[k + 1] = Lp[k] + Lnz[k];
+
+   Li = osmalloc((Lp[n] ? Lp[n] : 1) * ossizeof(long));
+   Lx = osmalloc((Lp[n] ? Lp[n] : 1) * ossizeof(real));
+
+   /* Numeric factorisation - compute row k of L and D[k] by solving a
+    * triangular system with the rows of L found so far. */
+   for (k = 0; k < n; k++) {
+      long kk = P[k];
+      long top = n;
+      Y[k] = (real)0.0;
+      Flag[k] = k;
+      Lnz[k] = 0;
+      for (p = Ap[kk]; p < Ap[kk + 1]; p++) {
+	 i = Pinv[Ai[p]];
+	 if (i <= k) {
+	    long len;
+	    Y[i] += Ax[p];
+	    for (len = 0; Flag[i] != k; i = Parent[i]) {
+	       Pattern[len++] = i;
+	       Flag[i] = k;
+	    }
+	    while (len > 0) Pattern[--top] = Pattern[--len];
+	 }
+      }
+      D[k] = Y[k];
+      Y[k] = (real)0.0;
+      for ( ; top < n; top++) {
+	 real yi, l_ki;
+	 long p2;
+	 i = Pattern[top];
+	 yi = Y[i];
+	 Y[i] = (real)0.0;
+	 p2 = Lp[i] + Lnz[i];
+	 for (p = Lp[i]; p < p2; p++) Y[Li[p]] -= Lx[p] * yi;
+	 l_ki = yi / D[i];
+	 D[k] -= l_ki * yi;
+	 Li[p] = k;
+	 Lx[p] = l_ki;
+	 Lnz[i]++;
+      }
+   }
+
+   /* Permute B, then multiply by L inverse, D inverse, and (L transpose)
+    * inverse, and finally permute back. */
+   for (k = 0; k < n; k++) Y[k] = B[P[k]];
+   for (k = 0; k < n; k++) {
+      for (p = Lp[k]; p < Lp[k + 1]; p++) Y[Li[p]] -= Lx[p] * Y[k];
+   }
+   for (k = 0; k < n; k++) Y[k] /= D[k];
+   for (k = n - 1; k >= 0; k--) {
+      for (p = Lp[k]; p < Lp[k + 1]; p++) Y[k] -= Lx[p] * Y[Li[p]];
+   }
+   for (k = 0; k < n; k++) B[P[k]] = Y[k];
+
+   osfree(Lx);
+   osfree(Li);
+   osfree(Y);
+   osfree(D);
+   osfree(Pattern);
+   osfree(Flag);
+   osfree(Lnz);
+   osfree(Parent);
+   osfree(Lp);
+}
+
+/* Solve using the sparse solver if the network is large enough and sparse
+ * enough for it to be worthwhile.  Returns fFalse if the dense solver should
+ * be used instead. */
+static bool
+build_sparse_matrix(const stn_table *tab, node *list)
 {
-   int i, j, k;
-
-   for (j = 1; j < n; j++) {
-      real V;
-      for (i = 0; i < j; i++) {
-	 V = (real)0.0;
-	 for (k = 0; k < i; k++) V += M(i,k) * M(j,k) * M(k,k);
-	 M(j,i) = (M(j,i) - V) / M(i,i);
+   long n = tab->n_stn_tab, N = tab->n_stn_tab * FACTOR;
+   long *deg, *adjp, *adji, *Ap, *Ai, *perm, *P, *Pinv;
+   real *Ax, *B;
+   long i, s, legs;
+   int dim;
+
+   /* defined in network.c, may be altered by -z<letters> on command line */
+   if (!(optimize & BITA('s')) || n < SPARSE_MIN_STNS) return fFalse;
+#ifdef SOR
+   if (optimize & BITA('i')) return fFalse;
+#endif
+
+   deg = osmalloc(n * ossizeof(long));
+   sparse_assemble(tab, list, deg, NULL, NULL, NULL, NULL, NULL, 0);
+
+   legs = 0;
+   for (s = 0; s < n; s++) legs += deg[s];
+   /* legs counts each leg twice, so this is checking that on average each
+    * station is connected to fewer than a quarter of the others. */
+   if (legs * 4 >= n * n) {
+      osfree(deg);
+      return fFalse;
+   }
+
+   /* Set up the column pointers and row indices of the stored matrix. */
+   adjp = osmalloc((n + 1) * ossizeof(long));
+   adji = osmalloc((legs ? legs : 1) * ossizeof(long));
+   Ap = osmalloc((N + 1) * ossizeof(long));
+   adjp[0] = 0;
+   Ap[0] = 0;
+   for (s = 0; s < n; s++) {
+      int c;
+      adjp[s + 1] = adjp[s] + deg[s];
+      for (c = 0; c < FACTOR; c++) {
+	 Ap[s * FACTOR + c + 1] = Ap[s * FACTOR + c] + (deg[s] + 1) * FACTOR;
       }
-      V = (real)0.0;
-      for (k = 0; k < j; k++) V += M(j,k) * M(j,k) * M(k,k);
-      M(j,j) -= V; /* may be best to add M() last for numerical reasons too */
    }
+   Ai = osmalloc(Ap[N] * ossizeof(long));
+   Ax = osmalloc(Ap[N] * ossizeof(real));
+   B = osmalloc(N * ossizeof(real));
 
-   /* Multiply x by L inverse */
-   for (i = 0; i < n - 1; i++) {
-      for (j = i + 1; j < n; j++) {
-	 B[j] -= M(j,i) * B[i];
+#ifdef NO_COVARIANCES
+   dim = 2;
+#else
+   dim = 0;
+#endif
+   sparse_assemble(tab, list, deg, adjp, adji, Ap, Ax, B, dim);
+
+   for (s = 0; s < n; s++) {
+      int c;
+      for (c = 0; c < FACTOR; c++) {
+	 long p = Ap[s * FACTOR + c];
+	 long k;
+	 for (k = 0; k <= deg[s]; k++) {
+	    long t = (k == 0 ? s : adji[adjp[s] + k - 1]);
+	    int r;
+	    for (r = 0; r < FACTOR; r++) Ai[p++] = t * FACTOR + r;
+	 }
       }
    }
 
-   /* Multiply x by D inverse */
+   perm = osmalloc(n * ossizeof(long));
+   min_degree_order(n, adjp, adji, perm);
+   P = osmalloc(N * ossizeof(long));
+   Pinv = osmalloc(N * ossizeof(long));
    for (i = 0; i < n; i++) {
-      B[i] /= M(i,i);
+      int c;
+      for (c = 0; c < FACTOR; c++) {
+	 P[i * FACTOR + c] = perm[i] * FACTOR + c;
+	 Pinv[perm[i] * FACTOR + c] = i * FACTOR + c;
+      }
    }
+   osfree(perm);
 
-   /* Multiply x by (L transpose) inverse */
-   for (i = (int)(n - 1); i > 0; i--) {
-      for (j = i - 1; j >= 0; j--) {
-	 B[j] -= M(i,j) * B[i];
-      }
+   while (1) {
+      sparse_ldl(N, Ap, Ai, Ax, P, Pinv, B);
+      set_positions(tab, B, dim);
+      if (--dim < 0) break;
+      sparse_assemble(tab, list, deg, adjp, adji, Ap, Ax, B, dim);
    }
 
-   /* printf("\n%ld/%ld\n\n",flops,flopsTot); */
+   osfree(Pinv);
+   osfree(P);
+   osfree(B);
+   osfree(Ax);
+   osfree(Ai);
+   osfree(Ap);
+   osfree(adji);
+   osfree(adjp);
+   osfree(deg);
+   return fTrue;
+}
+
+static int
+find_stn_in_tab(const stn_table *tab, node *stn)
+{
+   long i = stn_tab_find(tab, stn->name->pos);
+   if (i >= 0) return (int)i;
+#if DEBUG_INVALID
+   fputs("Station ", stderr);
+   fprint_prefix(stderr, stn->name);
+   fputs(" not in table\n\n", stderr);
+#endif
+#if 0
+   print_prefix(stn->name);
+   printf(" used: %d colour %d\n",
+	  (!!stn->leg[2])<<2 | (!!stn->leg[1])<<1 | (!!stn->leg[0]),
+	  stn->colour);
+#endif
+   fatalerror(/*Bug in program detected! Please report this to the authors*/11);
+   return -1;
+}
+
+static int
+add_stn_to_tab(stn_table *tab, node *stn)
+{
+   return (int)stn_tab_add(tab, stn->name->pos);
 }
 
 #ifdef SOR
@@ -1,6 +1,6 @@
 /* matrix.h
  * Header file for matrix building and solving routines
- * Copyright (C) 1993,1994,2001 Olly Betts
+ * Copyright (C) 1993,1994,2001,2016 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -18,3 +18,12 @@
  */
 
 void solve_matrix(node *list);
+
+/* Like solve_matrix() but without reporting progress.  This may be called
+ * from several threads at once for independent parts of the network.
+ * Returns the number of stations solved for, or -1 if there weren't any
+ * unfixed stations in list. */
+long solve_matrix_quietly(node *list);
+
+/* Report progress for a matrix of n stations as solve_matrix() does. */
+void report_matrix(long n);
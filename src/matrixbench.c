@@ -0,0 +1,254 @@
+/* matrixbench.c */
+/* Time parts of cavern's matrix code on synthetic grid-shaped networks */
+/* Copyright (C) 2016 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "arena.h"
+#include "cavern.h"
+#include "choleski.h"
+#include "stntab.h"
+
+/* for PACKED(M, row, col) col must be <= row */
+#define PACKED(A, X, Y) (A)[((((size_t)(X)) * ((X) + 1)) >> 1) + (Y)]
+
+/* Add a leg between stations a and b (a > b) to the packed matrix, in the
+ * same form as cavern's matrix building code: a 3x3 block of weights on each
+ * station's diagonal block, and subtracted from the block linking them. */
+static void
+add_leg(real *M, long a, long b, double w)
+{
+   /* A symmetric positive definite 3x3 block standing in for the inverse of
+    * a leg's covariance matrix. */
+   double e[3][3] = {
+      { 4.0, 0.5, 0.2 },
+      { 0.5, 3.0, 0.4 },
+      { 0.2, 0.4, 2.0 }
+   };
+   int i, j;
+   for (i = 0; i < 3; i++) {
+      for (j = 0; j < 3; j++) {
+	 double v = e[i][j] * w;
+	 if (j <= i) {
+	    PACKED(M, a * 3 + i, a * 3 + j) += v;
+	    PACKED(M, b * 3 + i, b * 3 + j) += v;
+	 }
+	 PACKED(M, a * 3 + i, b * 3 + j) -= v;
+      }
+   }
+}
+
+/* Time mapping stations to matrix rows for a network of n_stns junctions
+ * laid out as a square-ish grid, as cavern does when setting up and filling
+ * in the matrix: each station is added to the table, then looked up once
+ * for each leg it's at the end of.  The linear search which cavern used to
+ * do is timed too, for comparison. */
+static int
+bench_lookup(const char *argv0, long n_stns, long repeats)
+{
+   long width = 1, s, r;
+   pos **stns;
+   clock_t elapsed_hash = 0, elapsed_linear = 0;
+   long check_hash = 0, check_linear = 0;
+
+   while (width * width < n_stns) width++;
+
+   stns = malloc(n_stns * sizeof(pos*));
+   if (!stns) {
+      fprintf(stderr, "%s: out of memory\n", argv0);
+      return 1;
+   }
+   /* Allocate each pos straight after a prefix as cavern does, so the
+    * addresses being hashed are spaced as they would be for real. */
+   for (s = 0; s < n_stns; s++) {
+      (void)arena_new(&names_arena, prefix);
+      stns[s] = arena_new(&names_arena, pos);
+   }
+
+   for (r = 0; r < repeats; r++) {
+      stn_table tab;
+      clock_t t = clock();
+      stn_tab_init(&tab, n_stns);
+      for (s = 0; s < n_stns; s++) stn_tab_add(&tab, stns[s]);
+      for (s = 0; s < n_stns; s++) {
+	 if (s % width > 0) check_hash += stn_tab_find(&tab, stns[s - 1]);
+	 if (s >= width) check_hash += stn_tab_find(&tab, stns[s - width]);
+      }
+      stn_tab_free(&tab);
+      elapsed_hash += clock() - t;
+   }
+
+   for (r = 0; r < repeats; r++) {
+      pos **stn_tab = malloc(n_stns * sizeof(pos*));
+      long n_stn_tab = 0, i;
+      clock_t t;
+      if (!stn_tab) {
+	 fprintf(stderr, "%s: out of memory\n", argv0);
+	 return 1;
+      }
+      t = clock();
+      for (s = 0; s < n_stns; s++) {
+	 for (i = 0; i < n_stn_tab; i++) {
+	    if (stn_tab[i] == stns[s]) break;
+	 }
+	 if (i == n_stn_tab) stn_tab[n_stn_tab++] = stns[s];
+      }
+      for (s = 0; s < n_stns; s++) {
+	 if (s % width > 0) {
+	    for (i = 0; stn_tab[i] != stns[s - 1]; i++) { }
+	    check_linear += i;
+	 }
+	 if (s >= width) {
+	    for (i = 0; stn_tab[i] != stns[s - width]; i++) { }
+	    check_linear += i;
+	 }
+      }
+      elapsed_linear += clock() - t;
+      free(stn_tab);
+   }
+
+   if (check_hash != check_linear) {
+      fprintf(stderr, "%s: hash table and linear search disagree\n", argv0);
+      return 1;
+   }
+
+   printf("%ld stations, %ld repeats: hash table %.3fs, linear search %.3fs "
+	  "per network\n", n_stns, repeats,
+	  (double)elapsed_hash / CLOCKS_PER_SEC / repeats,
+	  (double)elapsed_linear / CLOCKS_PER_SEC / repeats);
+
+   free(stns);
+   arena_release(&names_arena);
+   return 0;
+}
+
+/* Time the dense solver on a width by height grid.  If full is set, every
+ * station is also tied to the first, so the matrix has no zeros to the left
+ * of the diagonal for the solver to skip. */
+static int
+bench_solver(const char *argv0, long width, long height, long repeats,
+	     bool full)
+{
+   long n_stns, n, x, y, r;
+   size_t size;
+   real *M, *B, *M0, *B0;
+   double worst = 0.0;
+   clock_t elapsed = 0;
+
+   n_stns = width * height;
+   n = n_stns * 3;
+   size = ((size_t)n * (n + 1)) >> 1;
+   M0 = calloc(size, sizeof(real));
+   B0 = malloc(n * sizeof(real));
+   M = malloc(size * sizeof(real));
+   B = malloc(n * sizeof(real));
+   if (!M0 || !B0 || !M || !B) {
+      fprintf(stderr, "%s: out of memory\n", argv0);
+      return 1;
+   }
+
+   /* Stations are numbered along the rows of the grid, as they tend to be
+    * in a real survey.  The first station is tied to a fixed point. */
+   for (y = 0; y < height; y++) {
+      for (x = 0; x < width; x++) {
+	 long s = y * width + x;
+	 if (x > 0) add_leg(M0, s, s - 1, 1.0 + 0.01 * (s % 7));
+	 if (y > 0) add_leg(M0, s, s - width, 1.0 + 0.01 * (s % 5));
+	 if (full && s > 0) add_leg(M0, s, 0, 0.1);
+      }
+   }
+   for (r = 0; r < 3; r++) PACKED(M0, r, r) += 10.0;
+   for (r = 0; r < n; r++) B0[r] = (real)((r * 37) % 101) / 10.0;
+
+   for (r = 0; r < repeats; r++) {
+      clock_t t;
+      memcpy(M, M0, size * sizeof(real));
+      memcpy(B, B0, n * sizeof(real));
+      t = clock();
+      choleski(M, B, n);
+      elapsed += clock() - t;
+   }
+
+   /* Check the solution by calculating the residuals using the original
+    * matrix. */
+   for (r = 0; r < n; r++) {
+      double v = -B0[r];
+      long c;
+      for (c = 0; c <= r; c++) v += PACKED(M0, r, c) * B[c];
+      for (c = r + 1; c < n; c++) v += PACKED(M0, c, r) * B[c];
+      if (v < 0) v = -v;
+      if (v > worst) worst = v;
+   }
+
+   printf("%ld stations (%ld equations)%s, %ld repeats: %.3fs per solve, "
+	  "largest residual %g\n", n_stns, n, full ? ", full" : "", repeats,
+	  (double)elapsed / CLOCKS_PER_SEC / repeats, worst);
+
+   free(M0);
+   free(B0);
+   free(M);
+   free(B);
+   return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+   long args[3];
+   int n_args = argc - 1, i;
+   bool lookup = fFalse, full = fFalse;
+
+   if (argc > 1 && strcmp(argv[1], "--lookup") == 0) {
+      lookup = fTrue;
+      n_args--;
+   } else if (argc > 1 && strcmp(argv[1], "--full") == 0) {
+      full = fTrue;
+      n_args--;
+   }
+   if (n_args > (lookup ? 2 : 3)) {
+      fprintf(stderr,
+	      "Syntax: %s [--full] [WIDTH [HEIGHT [REPEATS]]]\n"
+	      "        %s --lookup [STATIONS [REPEATS]]\n", argv[0], argv[0]);
+      return 1;
+   }
+   for (i = 0; i < n_args; i++) {
+      args[i] = atol(argv[argc - n_args + i]);
+      if (args[i] < 1) {
+	 fprintf(stderr, "%s: arguments must be positive\n", argv[0]);
+	 return 1;
+      }
+   }
+
+   if (lookup) {
+      return bench_lookup(argv[0],
+			  n_args > 0 ? args[0] : 50000,
+			  n_args > 1 ? args[1] : 1);
+   }
+   return bench_solver(argv[0],
+		       n_args > 0 ? args[0] : 20,
+		       n_args > 1 ? args[1] : 20,
+		       n_args > 2 ? args[2] : 10,
+		       full);
+}
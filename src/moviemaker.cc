@@ -65,6 +65,7 @@ extern "C" {
 # include <libavformat/avformat.h>
 # include <libswscale/swscale.h>
 }
+# include <wx/thread.h>
 # ifndef AV_PKT_FLAG_KEY
 #  define AV_PKT_FLAG_KEY PKT_FLAG_KEY
 # endif
@@ -128,11 +129,93 @@ enum {
 # ifndef HAVE_AVCODEC_ENCODE_VIDEO2
 const int OUTBUF_SIZE = 200000;
 # endif
+
+// How many frames can be waiting to be encoded.  Once this many are queued,
+// AddFrame() waits for the encoder to catch up.
+const int N_BUFFERS = 3;
+
+class MovieMaker::EncoderThread : public wxThread {
+    MovieMaker & movie;
+
+    wxMutex mutex;
+    wxCondition cond;
+
+    // The number of frames queued which haven't been encoded yet.
+    int n_queued;
+
+    // The buffer holding the oldest frame queued.
+    int next;
+
+    bool closing;
+    bool failed;
+
+  protected:
+    virtual ExitCode Entry();
+
+  public:
+    EncoderThread(MovieMaker & movie_)
+	: wxThread(wxTHREAD_JOINABLE), movie(movie_), cond(mutex),
+	  n_queued(0), next(0), closing(false), failed(false) { }
+
+    // Queue the frame in the buffer after the last one queued, then wait
+    // until there's a free buffer for the next frame.  Returns false if
+    // encoding a frame failed.
+    bool Queue();
+
+    // Encode any frames still queued, then wait for the thread to exit.
+    void Finish();
+};
+
+wxThread::ExitCode
+MovieMaker::EncoderThread::Entry()
+{
+    mutex.Lock();
+    while (true) {
+	while (n_queued == 0 && !closing) cond.Wait();
+	if (n_queued == 0) break;
+	int buffer = next;
+	mutex.Unlock();
+	bool ok = movie.encode_frame(buffer);
+	mutex.Lock();
+	if (!ok) {
+	    failed = true;
+	    cond.Broadcast();
+	    break;
+	}
+	next = (next + 1) % N_BUFFERS;
+	--n_queued;
+	cond.Broadcast();
+    }
+    mutex.Unlock();
+    return (wxThread::ExitCode)0;
+}
+
+bool
+MovieMaker::EncoderThread::Queue()
+{
+    wxMutexLocker lock(mutex);
+    ++n_queued;
+    cond.Broadcast();
+    while (n_queued == N_BUFFERS && !failed) cond.Wait();
+    return !failed;
+}
+
+void
+MovieMaker::EncoderThread::Finish()
+{
+    {
+	wxMutexLocker lock(mutex);
+	closing = true;
+	cond.Broadcast();
+    }
+    Wait();
+}
 #endif
 
 MovieMaker::MovieMaker()
 #ifdef WITH_LIBAV
-    : oc(0), video_st(0), frame(0), outbuf(0), pixels(0), sws_ctx(0), averrno(0)
+    : oc(0), video_st(0), frame(0), outbuf(0), pixels(0), next_buffer(0),
+      sws_ctx(0), averrno(0), encoder(0)
 #endif
 {
 #ifdef WITH_LIBAV
@@ -264,7 +347,7 @@ bool MovieMaker::Open(const char *fnm, int width, int height)
 	abort();
     }
 
-    pixels = (unsigned char *)malloc(width * height * 6);
+    pixels = (unsigned char *)malloc(N_BUFFERS * width * height * 3);
     if (!pixels) {
 	averrno = AVERROR(ENOMEM);
 	return false;
@@ -303,6 +386,14 @@ bool MovieMaker::Open(const char *fnm, int width, int height)
     }
 
     averrno = 0;
+    next_buffer = 0;
+
+    encoder = new EncoderThread(*this);
+    if (encoder->Create() != wxTHREAD_NO_ERROR ||
+	encoder->Run() != wxTHREAD_NO_ERROR) {
+	delete encoder;
+	encoder = NULL;
+    }
     return true;
 #else
     (void)fnm;
@@ -315,7 +406,7 @@ bool MovieMaker::Open(const char *fnm, int width, int height)
 unsigned char * MovieMaker::GetBuffer() const {
 #ifdef WITH_LIBAV
     AVCodecContext * c = video_st->codec;
-    return pixels + c->height * c->width * 3;
+    return pixels + next_buffer * c->height * c->width * 3;
 #else
     return NULL;
 #endif
@@ -344,6 +435,18 @@ int MovieMaker::GetHeight() const {
 bool MovieMaker::AddFrame()
 {
 #ifdef WITH_LIBAV
+    int buffer = next_buffer;
+    next_buffer = (next_buffer + 1) % N_BUFFERS;
+    if (encoder) return encoder->Queue();
+    return encode_frame(buffer);
+#else
+    return true;
+#endif
+}
+
+#ifdef WITH_LIBAV
+bool MovieMaker::encode_frame(int buffer)
+{
     AVCodecContext * c = video_st->codec;
 
     if (c->pix_fmt != AV_PIX_FMT_YUV420P) {
@@ -351,19 +454,12 @@ bool MovieMaker::AddFrame()
 	abort();
     }
 
+    // The rows read back from OpenGL are bottom to top, so we start at the
+    // last row and use a negative stride to flip the image as we convert it.
     int len = 3 * c->width;
-    {
-	// Flip image vertically
-	int h = c->height;
-	unsigned char * src = pixels + h * len;
-	unsigned char * dest = src - len;
-	while (h--) {
-	    memcpy(dest, src, len);
-	    src += len;
-	    dest -= len;
-	}
-    }
-    sws_scale(sws_ctx, &pixels, &len, 0, c->height, frame->data, frame->linesize);
+    unsigned char * src = pixels + (buffer + 1) * c->height * len - len;
+    int stride = -len;
+    sws_scale(sws_ctx, &src, &stride, 0, c->height, frame->data, frame->linesize);
 
     if (oc->oformat->flags & AVFMT_RAWPICTURE) {
 	abort();
@@ -424,15 +520,23 @@ bool MovieMaker::AddFrame()
 	    return false;
 	}
     }
-#endif
 #endif
     return true;
 }
+#endif
 
 bool
 MovieMaker::Close()
 {
 #ifdef WITH_LIBAV
+    if (encoder) {
+	stop_encoder();
+	if (averrno) {
+	    release();
+	    return false;
+	}
+    }
+
     if (video_st && averrno == 0) {
 	// No more frames to compress.  The codec may have a few frames
 	// buffered if we're using B frames, so write those too.
@@ -509,9 +613,19 @@ MovieMaker::Close()
 }
 
 #ifdef WITH_LIBAV
+void
+MovieMaker::stop_encoder()
+{
+    encoder->Finish();
+    delete encoder;
+    encoder = NULL;
+}
+
 void
 MovieMaker::release()
 {
+    if (encoder) stop_encoder();
+
     if (video_st) {
 	// Close codec.
 	avcodec_close(video_st->codec);
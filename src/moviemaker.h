@@ -3,7 +3,7 @@
 //
 //  Class for writing movies from Aven.
 //
-//  Copyright (C) 2004,2010,2011,2013,2014 Olly Betts
+//  Copyright (C) 2004,2010,2011,2013,2014,2016 Olly Betts
 //
 //  This program is free software; you can redistribute it and/or modify
 //  it under the terms of the GNU General Public License as published by
@@ -42,10 +42,21 @@ class MovieMaker {
 # ifndef HAVE_AVCODEC_ENCODE_VIDEO2
     AVPicture *out;
 # endif
+    // A ring of buffers for frames waiting to be encoded.
     unsigned char *pixels;
+    // The buffer which GetBuffer() returns.
+    int next_buffer;
     SwsContext *sws_ctx;
     int averrno;
 
+    // Converts and encodes frames on a separate thread, so the caller can
+    // render the next frame meanwhile.  NULL if we couldn't start a thread,
+    // in which case AddFrame() encodes each frame itself.
+    class EncoderThread;
+    EncoderThread *encoder;
+
+    bool encode_frame(int buffer);
+    void stop_encoder();
     void release();
 #endif
 
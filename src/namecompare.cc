@@ -27,7 +27,21 @@ inline bool u_digit(unsigned ch) {
     return (ch - unsigned('0')) <= unsigned('9' - '0');
 }
 
-int name_cmp(const wxString &a, const wxString &b, int separator) {
+// Part of a wxString, so we can compare the components of station names
+// stored in a LabelNames without copying them out.
+class Substring {
+    const wxString & s;
+    size_t start, len;
+
+  public:
+    Substring(const wxString & s_, size_t start_, size_t len_)
+	: s(s_), start(start_), len(len_) { }
+    int operator[](size_t i) const { return s[start + i]; }
+    size_t size() const { return len; }
+};
+
+template<typename S>
+static int name_cmp_(const S &a, const S &b, int separator) {
    size_t i = 0;
    size_t shorter = std::min(a.size(), b.size());
    while (i != shorter) {
@@ -77,3 +91,13 @@ int name_cmp(const wxString &a, const wxString &b, int separator) {
    }
    return int(a.size()) - int(b.size());
 }
+
+int name_cmp(const wxString &a, const wxString &b, int separator) {
+   return name_cmp_(a, b, separator);
+}
+
+int name_cmp(const wxString &a, size_t a_start, size_t a_len,
+	     const wxString &b, size_t b_start, size_t b_len, int separator) {
+   return name_cmp_(Substring(a, a_start, a_len),
+		    Substring(b, b_start, b_len), separator);
+}
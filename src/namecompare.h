@@ -1,6 +1,6 @@
 /* namecompare.h */
 /* Ordering function for station names */
-/* Copyright (C) 2001,2002,2008,2012 Olly Betts
+/* Copyright (C) 2001,2002,2008,2012,2016 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -20,3 +20,9 @@
 #include "wx.h"
 
 extern int name_cmp(const wxString &a, const wxString &b, int separator);
+
+/* Compare a_len characters of a from a_start with b_len characters of b from
+ * b_start, in the same way as the version above. */
+extern int name_cmp(const wxString &a, size_t a_start, size_t a_len,
+		    const wxString &b, size_t b_start, size_t b_len,
+		    int separator);
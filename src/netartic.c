@@ -1,6 +1,6 @@
 /* netartic.c
  * Split up network at articulation points
- * Copyright (C) 1993-2003,2005,2012,2014,2015 Olly Betts
+ * Copyright (C) 1993-2003,2005,2012,2014,2015,2016 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -26,6 +26,10 @@
 # include <config.h>
 #endif
 
+#ifdef HAVE_PTHREADS
+# include <pthread.h>
+#endif
+
 #include "debug.h"
 #include "cavern.h"
 #include "filename.h"
@@ -35,6 +39,7 @@
 #include "netbits.h"
 #include "matrix.h"
 #include "out.h"
+#include "stntab.h"
 
 /* We want to split station list into a list of components, each of which
  * consists of a list of "articulations" - the first has all the fixed points
@@ -74,6 +79,8 @@ static unsigned long cMaxVisits;
 static unsigned char *dirn_stack = NULL;
 static long *min_stack = NULL;
 
+static void solve_components(node **lists, long n);
+
 static unsigned long
 visit(node *stn, int back)
 {
@@ -411,11 +418,19 @@ articulate(void)
    }
 
    {
-      component *comp = component_list;
+      component *comp;
+      node **lists, **listends;
+      long n_lists = 0, c;
+
+      for (comp = component_list; comp; comp = comp->next) n_lists++;
+      lists = osmalloc(n_lists * ossizeof(node*));
+      listends = osmalloc(n_lists * ossizeof(node*));
 
 #ifdef DEBUG_ARTIC
       printf("\nDump of %d components:\n", cComponents);
 #endif
+      comp = component_list;
+      c = 0;
       while (comp) {
 	 node *list = NULL, *listend = NULL;
 	 articulation *art;
@@ -458,23 +473,32 @@ articulate(void)
 	    printf(")\n");
 	 }
 #endif
-	 solve_matrix(list);
+	 lists[c] = list;
+	 listends[c] = listend;
+	 c++;
+
+	 old_comp = comp;
+	 comp = comp->next;
+	 osfree(old_comp);
+      }
+
+      solve_components(lists, n_lists);
+
+      for (c = 0; c < n_lists; c++) {
 #ifdef DEBUG_ARTIC
 	 putnl();
-	 FOR_EACH_STN(stn, list) {
+	 FOR_EACH_STN(stn, lists[c]) {
 	    printf("%c %p (", fixed(stn)?'*':' ', stn);
 	    print_prefix(stn->name);
 	    printf(")\n");
 	 }
 #endif
-	 listend->next = stnlist;
-	 if (stnlist) stnlist->prev = listend;
-	 stnlist = list;
-
-	 old_comp = comp;
-	 comp = comp->next;
-	 osfree(old_comp);
+	 listends[c]->next = stnlist;
+	 if (stnlist) stnlist->prev = listends[c];
+	 stnlist = lists[c];
       }
+      osfree(listends);
+      osfree(lists);
 #ifdef DEBUG_ARTIC
       printf("done articulating\n");
 #endif
@@ -580,3 +604,187 @@ articulate(void)
       SVX_ASSERT(fixed(stn));
    }
 }
+
+#ifdef HAVE_PTHREADS
+/* State shared between the threads solving components in parallel, all
+ * protected by solve_mutex. */
+typedef struct {
+   node *list;
+   /* Return value from solve_matrix_quietly(). */
+   long result;
+   /* Number of components which must be solved before this one which
+    * haven't been yet. */
+   long n_deps;
+   /* Components which depend on this one. */
+   long *dependents;
+   long n_dependents;
+   bool done;
+} solve_job;
+
+static solve_job *jobs;
+static long n_jobs, n_jobs_started;
+
+/* Queue of components which are ready to solve. */
+static long *ready;
+static long ready_head, ready_tail;
+
+static pthread_mutex_t solve_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t solve_cond = PTHREAD_COND_INITIALIZER;
+
+static void
+add_dependency(long before, long after, long *tag)
+{
+   solve_job *job = &jobs[before];
+   if (tag[before] == after) return;
+   tag[before] = after;
+   /* Grow the array when its size hits a power of 2. */
+   if ((job->n_dependents & (job->n_dependents - 1)) == 0) {
+      long size = job->n_dependents ? job->n_dependents * 2 : 1;
+      job->dependents = osrealloc(job->dependents, size * ossizeof(long));
+   }
+   job->dependents[job->n_dependents++] = after;
+   jobs[after].n_deps++;
+}
+
+static void *
+solve_worker(void *arg)
+{
+   (void)arg;
+   pthread_mutex_lock(&solve_mutex);
+   while (1) {
+      long c, i;
+      while (ready_head == ready_tail && n_jobs_started < n_jobs)
+	 pthread_cond_wait(&solve_cond, &solve_mutex);
+      if (ready_head == ready_tail) break;
+      c = ready[ready_head++];
+      n_jobs_started++;
+      pthread_mutex_unlock(&solve_mutex);
+
+      jobs[c].result = solve_matrix_quietly(jobs[c].list);
+
+      pthread_mutex_lock(&solve_mutex);
+      jobs[c].done = fTrue;
+      for (i = 0; i < jobs[c].n_dependents; i++) {
+	 long d = jobs[c].dependents[i];
+	 if (--jobs[d].n_deps == 0) ready[ready_tail++] = d;
+      }
+      pthread_cond_broadcast(&solve_cond);
+   }
+   pthread_mutex_unlock(&solve_mutex);
+   return NULL;
+}
+
+/* Solve the components using cJobs threads.  The results (and the order of
+ * progress messages) are the same as solving them in order.
+ */
+static void
+solve_components_in_parallel(node **lists, long n)
+{
+   pthread_t *threads;
+   long *tag, *owner;
+   long c, n_threads, n_stns;
+   stn_table owners;
+   node *stn;
+
+   jobs = osmalloc(n * ossizeof(solve_job));
+   for (c = 0; c < n; c++) {
+      jobs[c].list = lists[c];
+      jobs[c].result = -1;
+      jobs[c].n_deps = 0;
+      jobs[c].dependents = NULL;
+      jobs[c].n_dependents = 0;
+      jobs[c].done = fFalse;
+   }
+
+   /* A component can't be solved until all the stations it connects to
+    * which are solved by an earlier component have been fixed.  Several
+    * nodes can share a pos, so this needs to be tracked per pos - owners
+    * maps each unfixed pos to an index into owner, which records the first
+    * component which will solve for it. */
+   n_stns = 0;
+   for (c = 0; c < n; c++) {
+      FOR_EACH_STN(stn, lists[c]) {
+	 if (!fixed(stn)) n_stns++;
+      }
+   }
+   stn_tab_init(&owners, n_stns);
+   owner = osmalloc(n_stns * ossizeof(long));
+   for (c = 0; c < n; c++) {
+      FOR_EACH_STN(stn, lists[c]) {
+	 long n_before, i;
+	 if (fixed(stn)) continue;
+	 n_before = owners.n_stn_tab;
+	 i = stn_tab_add(&owners, stn->name->pos);
+	 if (owners.n_stn_tab > n_before) owner[i] = c;
+      }
+   }
+   tag = osmalloc(n * ossizeof(long));
+   for (c = 0; c < n; c++) tag[c] = -1;
+   for (c = 0; c < n; c++) {
+      FOR_EACH_STN(stn, lists[c]) {
+	 int d;
+	 long o;
+	 if (fixed(stn)) continue;
+	 o = owner[stn_tab_find(&owners, stn->name->pos)];
+	 if (o != c) add_dependency(o, c, tag);
+	 for (d = 0; d <= 2 && stn->leg[d]; d++) {
+	    node *to = stn->leg[d]->l.to;
+	    if (fixed(to)) continue;
+	    o = owner[stn_tab_find(&owners, to->name->pos)];
+	    SVX_ASSERT(o <= c);
+	    if (o != c) add_dependency(o, c, tag);
+	 }
+      }
+   }
+   osfree(tag);
+   osfree(owner);
+   stn_tab_free(&owners);
+
+   ready = osmalloc(n * ossizeof(long));
+   ready_head = ready_tail = 0;
+   for (c = 0; c < n; c++) {
+      if (jobs[c].n_deps == 0) ready[ready_tail++] = c;
+   }
+   n_jobs = n;
+   n_jobs_started = 0;
+
+   n_threads = (cJobs < n ? cJobs : n);
+   threads = osmalloc(n_threads * ossizeof(pthread_t));
+   for (c = 0; c < n_threads; c++) {
+      if (pthread_create(&threads[c], NULL, solve_worker, NULL) != 0) break;
+   }
+   n_threads = c;
+   /* If we couldn't create any threads, just do the work ourselves. */
+   if (n_threads == 0) solve_worker(NULL);
+
+   /* Report on each component in order as it's finished. */
+   for (c = 0; c < n; c++) {
+      pthread_mutex_lock(&solve_mutex);
+      while (!jobs[c].done) pthread_cond_wait(&solve_cond, &solve_mutex);
+      pthread_mutex_unlock(&solve_mutex);
+      report_matrix(jobs[c].result);
+   }
+
+   for (c = 0; c < n_threads; c++) pthread_join(threads[c], NULL);
+   osfree(threads);
+
+   osfree(ready);
+   for (c = 0; c < n; c++) osfree(jobs[c].dependents);
+   osfree(jobs);
+   jobs = NULL;
+}
+#endif
+
+/* Solve each of the n components in lists. */
+static void
+solve_components(node **lists, long n)
+{
+   long c;
+#ifdef HAVE_PTHREADS
+   if (cJobs > 1 && n > 1) {
+      solve_components_in_parallel(lists, n);
+      return;
+   }
+#endif
+   for (c = 0; c < n; c++) solve_matrix(lists[c]);
+}
@@ -1,6 +1,6 @@
 /* netbits.c
  * Miscellaneous primitive network routines for Survex
- * Copyright (C) 1992-2003,2006,2011,2013,2014,2015 Olly Betts
+ * Copyright (C) 1992-2003,2006,2011,2013,2014,2015,2016 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -26,6 +26,7 @@
 #endif
 
 #include "debug.h"
+#include "arena.h"
 #include "cavern.h"
 #include "filename.h"
 #include "message.h"
@@ -226,7 +227,7 @@ copy_link(linkfor *leg)
 {
    linkfor *legOut;
    int d;
-   legOut = osnew(linkfor);
+   legOut = arena_new(&network_arena, linkfor);
    if (data_here(leg)) {
       for (d = 2; d >= 0; d--) legOut->d[d] = leg->d[d];
    } else {
@@ -252,6 +253,17 @@ copy_link(linkfor *leg)
    return legOut;
 }
 
+void
+free_leg(linkfor *leg)
+{
+   /* Only forward legs have room for the data. */
+   if (data_here(leg)) {
+      arena_delete(&network_arena, leg, linkfor);
+   } else {
+      arena_delete(&network_arena, leg, linkrev);
+   }
+}
+
 /* Adds to the forward leg “leg”, the data in leg2, or the reversed data
  * in the reverse of leg2, if leg2 doesn't hold data
  */
@@ -284,8 +296,8 @@ addleg_(node *fr, node *to,
     * - this should be trapped by the caller */
    SVX_ASSERT(fr->name != to->name);
 
-   leg = osnew(linkfor);
-   leg2 = (linkfor*)osnew(linkrev);
+   leg = arena_new(&network_arena, linkfor);
+   leg2 = (linkfor*)arena_new(&network_arena, linkrev);
 
    i = freeleg(&fr);
    j = freeleg(&to);
@@ -431,7 +443,7 @@ replace_pfx(const prefix *pfx_replace, const prefix *pfx_with)
 #endif
 
    /* free the (now-unused) old pos */
-   osfree(pos_replace);
+   arena_delete(&names_arena, pos_replace, pos);
 }
 
 /* Add an equating leg between existing stations *fr and *to (whose names are
@@ -535,9 +547,9 @@ freeleg(node **stnptr)
 
    /* All legs used, so split node in two */
    oldstn = stn;
-   stn = osnew(node);
-   leg = osnew(linkfor);
-   leg2 = (linkfor*)osnew(linkrev);
+   stn = arena_new(&network_arena, node);
+   leg = arena_new(&network_arena, linkfor);
+   leg2 = (linkfor*)arena_new(&network_arena, linkrev);
 
    *stnptr = stn;
 
@@ -578,10 +590,10 @@ StnFromPfx(prefix *name)
 {
    node *stn;
    if (name->stn != NULL) return (name->stn);
-   stn = osnew(node);
+   stn = arena_new(&network_arena, node);
    stn->name = name;
    if (name->pos == NULL) {
-      name->pos = osnew(pos);
+      name->pos = arena_new(&names_arena, pos);
       unfix(stn);
    }
    stn->leg[0] = stn->leg[1] = stn->leg[2] = NULL;
@@ -1,6 +1,6 @@
 /* netbits.h
  * Header file for miscellaneous primitive network routines for Survex
- * Copyright (C) 1994,1997,1998,2001,2006,2015 Olly Betts
+ * Copyright (C) 1994,1997,1998,2001,2006,2015,2016 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -22,6 +22,9 @@ void clear_last_leg(void);
 node *StnFromPfx(prefix *name);
 
 linkfor *copy_link(linkfor *leg);
+
+/* Free a leg, which may be either a forward or a reverse leg. */
+void free_leg(linkfor *leg);
 linkfor *addto_link(linkfor *leg, const linkfor *leg2);
 
 void addlegbyname(prefix *fr_name, prefix *to_name, bool fToFirst,
@@ -1,7 +1,7 @@
 /* netskel.c
  * Survex network reduction - remove trailing traverses and concatenate
  * traverses between junctions
- * Copyright (C) 1991-2004,2005,2006,2010,2011,2012,2013,2014,2015 Olly Betts
+ * Copyright (C) 1991-2004,2005,2006,2010,2011,2012,2013,2014,2015,2016 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -32,6 +32,7 @@
 
 #include "validate.h"
 #include "debug.h"
+#include "arena.h"
 #include "cavern.h"
 #include "filename.h"
 #include "message.h"
@@ -262,7 +263,7 @@ concatenate_trav(node *stn, int i)
    if (fixed(stn2) || !two_node(stn2)) return;
 
    trav = osnew(stack);
-   newleg2 = (linkfor*)osnew(linkrev);
+   newleg2 = (linkfor*)arena_new(&network_arena, linkrev);
 
 #if PRINT_NETBITS
    printf("Concatenating trav "); print_prefix(stn->name); printf("<%p>",stn);
@@ -581,10 +582,10 @@ replace_travs(void)
 		     POS(stn1, 0), POS(stn1, 1), POS(stn1, 2));
 
       fArtic = stn1->leg[i]->l.reverse & FLAG_ARTICULATION;
-      osfree(stn1->leg[i]);
+      free_leg(stn1->leg[i]);
       stn1->leg[i] = ptr->join1; /* put old link back in */
 
-      osfree(stn2->leg[j]);
+      free_leg(stn2->leg[j]);
       stn2->leg[j] = ptr->join2; /* and the other end */
 
 #ifdef BLUNDER_DETECTION
@@ -896,7 +897,7 @@ replace_trailing_travs(void)
       osfree(p);
    }
 
-   /* write stations to .3d file and free legs and stations */
+   /* write stations to .3d file */
    FOR_EACH_STN(stn1, stnlist) {
       int d;
       SVX_ASSERT(fixed(stn1));
@@ -994,8 +995,6 @@ replace_trailing_travs(void)
 		  totvert += fabs(leg->d[2]);
 	       }
 	    }
-	    osfree(leg);
-	    osfree(legRev);
 	    stn1->leg[i] = stnB->leg[iB] = NULL;
 	 }
       }
@@ -1004,12 +1003,12 @@ replace_trailing_travs(void)
    /* The station position is attached to the name, so we leave the names and
     * positions in place - they can then be picked up if we have a *solve
     * followed by more data */
-   for (stn1 = stnlist; stn1; stn1 = stn2) {
-      stn2 = stn1->next;
+   for (stn1 = stnlist; stn1; stn1 = stn1->next) {
       stn1->name->stn = NULL;
-      osfree(stn1);
    }
    stnlist = NULL;
+   /* All the legs and stations are now unused. */
+   arena_release(&network_arena);
 }
 
 static void
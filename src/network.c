@@ -1,6 +1,6 @@
 /* network.c
  * Survex network reduction - find patterns and apply network reductions
- * Copyright (C) 1991-2002,2005 Olly Betts
+ * Copyright (C) 1991-2002,2005,2016 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -29,6 +29,7 @@
 
 #include "validate.h"
 #include "debug.h"
+#include "arena.h"
 #include "cavern.h"
 #include "message.h"
 #include "netbits.h"
@@ -65,8 +66,8 @@ typedef struct StackRed {
 static stackRed *ptrRed; /* Ptr to TRaverse linked list for C*-*< , -*=*- */
 
 /* can be altered by -z<letters> on command line */
-unsigned long optimize = BITA('l') | BITA('p') | BITA('d');
-/* Lollipops, Parallel legs, Iterate mx, Delta* */
+unsigned long optimize = BITA('l') | BITA('p') | BITA('d') | BITA('s');
+/* Lollipops, Parallel legs, Iterate mx, Delta*, Sparse mx */
 
 extern void
 remove_subnets(void)
@@ -117,7 +118,7 @@ remove_subnets(void)
 	       dirn3 = reverse_leg_dirn(stn2->leg[dirn2]);
 
 	       trav = osnew(stackRed);
-	       newleg2 = (linkfor*)osnew(linkrev);
+	       newleg2 = (linkfor*)arena_new(&network_arena, linkrev);
 
 	       newleg = copy_link(stn3->leg[dirn3]);
 
@@ -249,8 +250,8 @@ remove_subnets(void)
 		    }
 #endif
 		 }
-	       osfree(newleg2);
-	       newleg2 = (linkfor*)osnew(linkrev);
+	       arena_delete(&network_arena, newleg2, linkfor);
+	       newleg2 = (linkfor*)arena_new(&network_arena, linkrev);
 
 	       addto_link(newleg, stn2->leg[dirn2]);
 	       addto_link(newleg, stn3->leg[dirn3]);
@@ -416,9 +417,9 @@ remove_subnets(void)
 		       BUG("loop of zero variance found");
 		    }
 
-		    legAZ = osnew(linkfor);
-		    legBZ = osnew(linkfor);
-		    legCZ = osnew(linkfor);
+		    legAZ = arena_new(&network_arena, linkfor);
+		    legBZ = arena_new(&network_arena, linkfor);
+		    legCZ = arena_new(&network_arena, linkfor);
 
 		    /* AZBZ */
 		    /* done above: addvv(&sum, &legBC->v, &legCA->v); */
@@ -452,9 +453,9 @@ remove_subnets(void)
 		    subdd(&temp, &temp, &temp2);
 		    mulsd(&legCZ->d, &sumCZAZ, &temp);
 
-		    osfree(legAB);
-		    osfree(legBC);
-		    osfree(legCA);
+		    arena_delete(&network_arena, legAB, linkfor);
+		    arena_delete(&network_arena, legBC, linkfor);
+		    arena_delete(&network_arena, legCA, linkfor);
 
 		    /* Now add two, subtract third, and scale by 0.5 */
 		    addss(&sum, &sumAZBZ, &sumCZAZ);
@@ -469,11 +470,11 @@ remove_subnets(void)
 		    subss(&sum, &sum, &sumAZBZ);
 		    mulsc(&legCZ->v, &sum, 0.5);
 
-		    nameZ = osnew(prefix);
-		    nameZ->pos = osnew(pos);
+		    nameZ = arena_new(&names_arena, prefix);
+		    nameZ->pos = arena_new(&names_arena, pos);
 		    nameZ->ident = NULL;
 		    nameZ->shape = 3;
-		    stnZ = osnew(node);
+		    stnZ = arena_new(&network_arena, node);
 		    stnZ->name = nameZ;
 		    nameZ->stn = stnZ;
 		    nameZ->up = NULL;
@@ -486,9 +487,9 @@ remove_subnets(void)
 		    legBZ->l.reverse = 1 | FLAG_DATAHERE | FLAG_REPLACEMENTLEG;
 		    legCZ->l.to = stnZ;
 		    legCZ->l.reverse = 2 | FLAG_DATAHERE | FLAG_REPLACEMENTLEG;
-		    stnZ->leg[0] = (linkfor*)osnew(linkrev);
-		    stnZ->leg[1] = (linkfor*)osnew(linkrev);
-		    stnZ->leg[2] = (linkfor*)osnew(linkrev);
+		    stnZ->leg[0] = (linkfor*)arena_new(&network_arena, linkrev);
+		    stnZ->leg[1] = (linkfor*)arena_new(&network_arena, linkrev);
+		    stnZ->leg[2] = (linkfor*)arena_new(&network_arena, linkrev);
 		    stnZ->leg[0]->l.to = stn4;
 		    stnZ->leg[0]->l.reverse = dirn4;
 		    stnZ->leg[1]->l.to = stn5;
@@ -621,9 +622,9 @@ replace_subnets(void)
 	 add_stn_to_list(&stnlist, stn);
 	 add_stn_to_list(&stnlist, stn2);
 
-	 osfree(stn3->leg[dirn3]);
+	 free_leg(stn3->leg[dirn3]);
 	 stn3->leg[dirn3] = ptrRed->join1;
-	 osfree(stn4->leg[dirn4]);
+	 free_leg(stn4->leg[dirn4]);
 	 stn4->leg[dirn4] = ptrRed->join2;
       } else if (IS_PARALLEL(ptrRed)) {
 	 /* parallel legs */
@@ -690,9 +691,9 @@ replace_subnets(void)
 	 add_stn_to_list(&stnlist, stn);
 	 add_stn_to_list(&stnlist, stn2);
 
-	 osfree(stn3->leg[dirn3]);
+	 free_leg(stn3->leg[dirn3]);
 	 stn3->leg[dirn3] = ptrRed->join1;
-	 osfree(stn4->leg[dirn4]);
+	 free_leg(stn4->leg[dirn4]);
 	 stn4->leg[dirn4] = ptrRed->join2;
       } else if (IS_DELTASTAR(ptrRed)) {
 	 node *stnZ;
@@ -748,20 +749,21 @@ replace_subnets(void)
 	    }
 	    fix(stn2);
 	    add_stn_to_list(&stnlist, stn2);
-	    osfree(leg);
+	    arena_delete(&network_arena, leg, linkfor);
 	    stn[i]->leg[dirn[i]] = legs[i];
 	    /* transfer the articulation status of the radial legs */
 	    if (stnZ->leg[i]->l.reverse & FLAG_ARTICULATION) {
 	       legs[i]->l.reverse |= FLAG_ARTICULATION;
 	       reverse_leg(legs[i])->l.reverse |= FLAG_ARTICULATION;
 	    }
-	    osfree(stnZ->leg[i]);
+	    arena_delete(&network_arena, stnZ->leg[i], linkrev);
 	    stnZ->leg[i] = NULL;
 	 }
 /*printf("---%f %f %f\n",POS(stnZ, 0), POS(stnZ, 1), POS(stnZ, 2));*/
 	 remove_stn_from_list(&stnlist, stnZ);
-	 osfree(stnZ->name);
-	 osfree(stnZ);
+	 arena_delete(&names_arena, stnZ->name->pos, pos);
+	 arena_delete(&names_arena, stnZ->name, prefix);
+	 arena_delete(&network_arena, stnZ, node);
       } else {
 	 BUG("ptrRed has unknown type");
       }
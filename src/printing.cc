@@ -31,6 +31,7 @@
 #include <wx/statbox.h>
 #include <wx/valgen.h>
 
+#include <algorithm>
 #include <vector>
 
 #include <stdio.h>
@@ -190,6 +191,30 @@ class svxPrintout : public wxPrintout {
 
     bool fBlankPage;
 
+    // The map is projected once per print job into lines and labels in the
+    // coordinates MoveTo() and DrawTo() take, and each is binned by the
+    // pages it overlaps, so a page only draws what's on it.
+    struct MapPrimitive {
+	// A line from (x0, y0) to (x1, y1), or if text is non-NULL, a label
+	// anchored at (x0, y0).
+	long x0, y0, x1, y1;
+	const wxPen * pen;
+	const wxString * text;
+    };
+    vector<MapPrimitive> primitives;
+    // page_bins[pg - 1] lists the primitives which overlap page pg, in the
+    // order they were recorded.
+    vector<vector<unsigned> > page_bins;
+    // The page size in pixels the primitives were recorded for, or 0 if
+    // they haven't been.
+    int binned_width, binned_depth;
+    double binned_scX, binned_scY;
+    // True while RecordMap() is running, which makes MoveTo(), DrawTo() and
+    // WriteString() record primitives rather than draw them.
+    bool recording;
+    const wxPen * recording_pen;
+    long x_r, y_r;
+
     int check_intersection(long x_p, long y_p);
     void draw_info_box();
     void draw_scale_bar(double x, double y, double MaxLength);
@@ -214,6 +239,9 @@ class svxPrintout : public wxPrintout {
     void NewPage(int pg, int pagesX, int pagesY);
     void PlotLR(const vector<XSect> & centreline);
     void PlotUD(const vector<XSect> & centreline);
+    void RecordMap();
+    void RecordPrimitive(const MapPrimitive & p,
+			 long x_min, long y_min, long x_max, long y_max);
   public:
     svxPrintout(MainFrm *mainfrm, layout *l, wxPageSetupDialogData *data, const wxString & title);
     bool OnPrintPage(int pageNum);
@@ -969,7 +997,7 @@ svxPrintDlg::RecalcBounds()
 	}
     }
     if (m_layout.show_mask & (LABELS|STNS)) {
-	list<LabelInfo*>::const_iterator label = mainfrm->GetLabels();
+	vector<LabelInfo*>::const_iterator label = mainfrm->GetLabels();
 	while (label != mainfrm->GetLabelsEnd()) {
 	    double x = (*label)->GetX();
 	    double y = (*label)->GetY();
@@ -998,7 +1026,8 @@ static const char *fontname = "Arial", *fontname_labels = "Arial";
 svxPrintout::svxPrintout(MainFrm *mainfrm_, layout *l,
 			 wxPageSetupDialogData *data, const wxString & title)
     : wxPrintout(title), font_labels(NULL), font_default(NULL),
-      scan_for_blank_pages(false)
+      scan_for_blank_pages(false), binned_width(0), binned_depth(0),
+      binned_scX(0), binned_scY(0), recording(false), recording_pen(NULL)
 {
     mainfrm = mainfrm_;
     m_layout = l;
@@ -1448,11 +1477,6 @@ svxPrintout::OnPrintPage(int pageNum) {
 	l->PaperDepth = pdepth -= MarginTop + MarginBottom;
     }
 
-    double SIN = sin(rad(l->rot));
-    double COS = cos(rad(l->rot));
-    double SINT = sin(rad(l->tilt));
-    double COST = cos(rad(l->tilt));
-
     NewPage(pageNum, l->pagesX, l->pagesY);
 
     if (l->Legend && pageNum == (l->pagesY - 1) * l->pagesX + 1) {
@@ -1462,6 +1486,48 @@ svxPrintout::OnPrintPage(int pageNum) {
 
     pdc->SetClippingRegion(x_offset, y_offset, xpPageWidth + 1, ypPageDepth + 1);
 
+    if (xpPageWidth != binned_width || ypPageDepth != binned_depth ||
+	l->scX != binned_scX || l->scY != binned_scY) {
+	RecordMap();
+    }
+
+    SetFont(font_labels);
+    pdc->SetTextForeground(colour_labels);
+    const wxPen * pen = NULL;
+    const vector<unsigned> & bin = page_bins[pageNum - 1];
+    vector<unsigned>::const_iterator i;
+    for (i = bin.begin(); i != bin.end(); ++i) {
+	const MapPrimitive & p = primitives[*i];
+	MoveTo(p.x0, p.y0);
+	if (p.text) {
+	    WriteString(*p.text);
+	    continue;
+	}
+	if (p.pen != pen) {
+	    pen = p.pen;
+	    pdc->SetPen(*pen);
+	}
+	DrawTo(p.x1, p.y1);
+    }
+
+    return true;
+}
+
+void
+svxPrintout::RecordMap()
+{
+    layout * l = m_layout;
+    primitives.clear();
+    page_bins.clear();
+    page_bins.resize(l->pagesX * l->pagesY);
+
+    double SIN = sin(rad(l->rot));
+    double COS = cos(rad(l->rot));
+    double SINT = sin(rad(l->tilt));
+    double COST = cos(rad(l->tilt));
+
+    recording = true;
+
     const double Sc = 1000 / l->Scale;
 
     if (l->show_mask & LEGS) {
@@ -1471,9 +1537,9 @@ svxPrintout::OnPrintPage(int pageNum) {
 	    if (trav->isSplay) {
 		if (!(l->show_mask & SPLAYS))
 		    continue;
-		pdc->SetPen(*pen_splay);
+		recording_pen = pen_splay;
 	    } else {
-		pdc->SetPen(*pen_leg);
+		recording_pen = pen_leg;
 	    }
 	    vector<PointInfo>::const_iterator pos = trav->begin();
 	    vector<PointInfo>::const_iterator end = trav->end();
@@ -1496,7 +1562,7 @@ svxPrintout::OnPrintPage(int pageNum) {
 
     if ((l->show_mask & XSECT) &&
 	(l->tilt == 0.0 || l->tilt == 90.0 || l->tilt == -90.0)) {
-	pdc->SetPen(*pen_splay);
+	recording_pen = pen_splay;
 	list<vector<XSect> >::const_iterator trav = mainfrm->tubes_begin();
 	list<vector<XSect> >::const_iterator tend = mainfrm->tubes_end();
 	for ( ; trav != tend; ++trav) {
@@ -1516,9 +1582,9 @@ svxPrintout::OnPrintPage(int pageNum) {
 	    if (trav->isSplay) {
 		if (!(l->show_mask & SPLAYS))
 		    continue;
-		pdc->SetPen(*pen_splay);
+		recording_pen = pen_splay;
 	    } else {
-		pdc->SetPen(*pen_surface_leg);
+		recording_pen = pen_surface_leg;
 	    }
 	    vector<PointInfo>::const_iterator pos = trav->begin();
 	    vector<PointInfo>::const_iterator end = trav->end();
@@ -1541,7 +1607,7 @@ svxPrintout::OnPrintPage(int pageNum) {
 
     if (l->show_mask & (LABELS|STNS)) {
 	if (l->show_mask & LABELS) SetFont(font_labels);
-	list<LabelInfo*>::const_iterator label = mainfrm->GetLabels();
+	vector<LabelInfo*>::const_iterator label = mainfrm->GetLabels();
 	while (label != mainfrm->GetLabelsEnd()) {
 	    double px = (*label)->GetX();
 	    double py = (*label)->GetY();
@@ -1553,11 +1619,10 @@ svxPrintout::OnPrintPage(int pageNum) {
 		xnew = (long)((X * Sc + l->xOrg) * l->scX);
 		ynew = (long)((Y * Sc + l->yOrg) * l->scY);
 		if (l->show_mask & STNS) {
-		    pdc->SetPen(*pen_cross);
+		    recording_pen = pen_cross;
 		    DrawCross(xnew, ynew);
 		}
 		if (l->show_mask & LABELS) {
-		    pdc->SetTextForeground(colour_labels);
 		    MoveTo(xnew, ynew);
 		    WriteString((*label)->GetText());
 		}
@@ -1566,7 +1631,42 @@ svxPrintout::OnPrintPage(int pageNum) {
 	}
     }
 
-    return true;
+    recording = false;
+
+    binned_width = xpPageWidth;
+    binned_depth = ypPageDepth;
+    binned_scX = l->scX;
+    binned_scY = l->scY;
+}
+
+void
+svxPrintout::RecordPrimitive(const MapPrimitive & p,
+			     long x_min, long y_min, long x_max, long y_max)
+{
+    // Allow for the width of the pen, and the clipping region being a pixel
+    // larger than the page.
+    const long MARGIN = 2;
+    const layout * l = m_layout;
+    int px_min = int(floor(double(x_min - MARGIN) / xpPageWidth));
+    int px_max = int(floor(double(x_max + MARGIN) / xpPageWidth));
+    int py_min = int(floor(double(y_min - MARGIN) / ypPageDepth));
+    int py_max = int(floor(double(y_max + MARGIN) / ypPageDepth));
+    if (px_max < 0 || px_min >= l->pagesX || py_max < 0 || py_min >= l->pagesY)
+	return;
+    px_min = max(px_min, 0);
+    px_max = min(px_max, l->pagesX - 1);
+    py_min = max(py_min, 0);
+    py_max = min(py_max, l->pagesY - 1);
+
+    unsigned n = primitives.size();
+    primitives.push_back(p);
+    // The inverse of the page numbering in NewPage().
+    for (int py = py_min; py <= py_max; ++py) {
+	int pg = (l->pagesY - 1 - py) * l->pagesX;
+	for (int px = px_min; px <= px_max; ++px) {
+	    page_bins[pg + px].push_back(n);
+	}
+    }
 }
 
 void
@@ -1612,6 +1712,10 @@ svxPrintout::OnBeginPrinting() {
 
 void
 svxPrintout::OnEndPrinting() {
+    // The primitives refer to the pens, which we're about to delete.
+    primitives.clear();
+    page_bins.clear();
+    binned_width = binned_depth = 0;
     delete font_labels;
     delete font_default;
     delete pen_frame;
@@ -1687,6 +1791,11 @@ svxPrintout::check_intersection(long x_p, long y_p)
 void
 svxPrintout::MoveTo(long x, long y)
 {
+    if (recording) {
+	x_r = x;
+	y_r = y;
+	return;
+    }
     x_t = x_offset + x - clip.x_min;
     y_t = y_offset + clip.y_max - y;
 }
@@ -1694,6 +1803,13 @@ svxPrintout::MoveTo(long x, long y)
 void
 svxPrintout::DrawTo(long x, long y)
 {
+    if (recording) {
+	MapPrimitive p = { x_r, y_r, x, y, recording_pen, NULL };
+	RecordPrimitive(p, min(x_r, x), min(y_r, y), max(x_r, x), max(y_r, y));
+	x_r = x;
+	y_r = y;
+	return;
+    }
     long x_p = x_t, y_p = y_t;
     x_t = x_offset + x - clip.x_min;
     y_t = y_offset + clip.y_max - y;
@@ -1733,7 +1849,16 @@ svxPrintout::WriteString(const wxString & s)
     double xsc, ysc;
     pdc->GetUserScale(&xsc, &ysc);
     pdc->SetUserScale(xsc * font_scaling_x, ysc * font_scaling_y);
-    if (!scan_for_blank_pages) {
+    if (recording) {
+	// The text is drawn to the right of the anchor, with its top a
+	// character height above it.
+	int w, h;
+	pdc->GetTextExtent(s, &w, &h);
+	long top = y_r + long(pdc->GetCharHeight() * font_scaling_y);
+	MapPrimitive p = { x_r, y_r, x_r, y_r, NULL, &s };
+	RecordPrimitive(p, x_r, top - long(h * font_scaling_y),
+			x_r + long(w * font_scaling_x), top);
+    } else if (!scan_for_blank_pages) {
 	pdc->DrawText(s,
 		      long(x_t / font_scaling_x),
 		      long(y_t / font_scaling_y) - pdc->GetCharHeight());
@@ -1,6 +1,6 @@
 /* readval.c
  * Routines to read a prefix or number from the current input file
- * Copyright (C) 1991-2003,2005,2006,2010,2011,2012,2013,2014,2015 Olly Betts
+ * Copyright (C) 1991-2003,2005,2006,2010,2011,2012,2013,2014,2015,2016 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -24,6 +24,7 @@
 #include <limits.h>
 #include <stddef.h> /* for offsetof */
 
+#include "arena.h"
 #include "cavern.h"
 #include "date.h"
 #include "debug.h"
@@ -46,7 +47,7 @@ int root_depr_count = 0;
 static prefix *
 new_anon_station(void)
 {
-    prefix *name = osnew(prefix);
+    prefix *name = arena_new(&names_arena, prefix);
     name->pos = NULL;
     name->ident = NULL;
     name->shape = 0;
@@ -63,6 +64,127 @@ new_anon_station(void)
     return name;
 }
 
+/* Surveys with a lot of children get a sorted array of pointers to them so
+ * we can find a child by binary chop rather than by walking along the
+ * linked list.  We switch once a walk along the list gets this long.
+ */
+#define CHILD_INDEX_THRESHOLD 32
+
+typedef struct {
+   prefix *survey;
+   prefix **child;
+   OSSIZE_T n_child, max_child;
+} child_index;
+
+/* Open hash table of child indices, keyed on the survey.  Surveys which have
+ * an entry are flagged with SFLAGS_CHILD_INDEX so we only need to look here
+ * for those. */
+static child_index *child_indices = NULL;
+static OSSIZE_T n_child_indices = 0;
+static OSSIZE_T child_indices_mask = 0;
+
+static OSSIZE_T
+hash_survey(const prefix *survey)
+{
+   /* Prefixes come from names_arena in the order the names are first
+    * seen, so the surveys we index are often close together, and the low
+    * bits of their addresses are always zero.  Dividing by the size drops
+    * bits which never vary, then the multiply and shift scatter neighbouring
+    * surveys across the table rather than into one long run of probes. */
+   OSSIZE_T h = (OSSIZE_T)survey / ossizeof(prefix);
+   h *= (OSSIZE_T)2654435761UL;
+   return (h ^ (h >> 15)) & child_indices_mask;
+}
+
+static child_index *
+find_child_index(const prefix *survey)
+{
+   OSSIZE_T h = hash_survey(survey);
+   SVX_ASSERT(TSTBIT(survey->sflags, SFLAGS_CHILD_INDEX));
+   while (child_indices[h].survey != survey) {
+      SVX_ASSERT(child_indices[h].survey);
+      h = (h + 1) & child_indices_mask;
+   }
+   return &child_indices[h];
+}
+
+static child_index *
+add_child_index(prefix *survey)
+{
+   child_index *ci;
+   prefix *p;
+   OSSIZE_T n = 0;
+
+   if ((n_child_indices + 1) * 2 > child_indices_mask) {
+      /* Grow the table, keeping it at most half full. */
+      child_index *old = child_indices;
+      OSSIZE_T old_size = child_indices_mask + 1;
+      OSSIZE_T i;
+      child_indices_mask = old ? old_size * 2 - 1 : 15;
+      child_indices = osmalloc((child_indices_mask + 1) * ossizeof(child_index));
+      for (i = 0; i <= child_indices_mask; i++) child_indices[i].survey = NULL;
+      if (old) {
+	 for (i = 0; i < old_size; i++) {
+	    OSSIZE_T h;
+	    if (!old[i].survey) continue;
+	    h = hash_survey(old[i].survey);
+	    while (child_indices[h].survey) h = (h + 1) & child_indices_mask;
+	    child_indices[h] = old[i];
+	 }
+	 osfree(old);
+      }
+   }
+
+   survey->sflags |= BIT(SFLAGS_CHILD_INDEX);
+   ci = &child_indices[hash_survey(survey)];
+   while (ci->survey) {
+      if (++ci == child_indices + child_indices_mask + 1) ci = child_indices;
+   }
+   ++n_child_indices;
+
+   for (p = survey->down; p; p = p->right) ++n;
+   ci->survey = survey;
+   ci->max_child = n * 2;
+   ci->child = osmalloc(ci->max_child * ossizeof(prefix *));
+   n = 0;
+   for (p = survey->down; p; p = p->right) ci->child[n++] = p;
+   ci->n_child = n;
+   return ci;
+}
+
+/* Return the position of the first child in ci which doesn't sort before
+ * name. */
+static OSSIZE_T
+child_index_position(const child_index *ci, const char *name)
+{
+   OSSIZE_T lo = 0, hi = ci->n_child;
+   /* Names are often added in increasing order. */
+   if (hi && strcmp(ci->child[hi - 1]->ident, name) < 0) return hi;
+   while (lo < hi) {
+      OSSIZE_T mid = (lo + hi) >> 1;
+      if (strcmp(ci->child[mid]->ident, name) < 0) {
+	 lo = mid + 1;
+      } else {
+	 hi = mid;
+      }
+   }
+   return lo;
+}
+
+/* Insert child into ci at position i. */
+static void
+insert_into_child_index(child_index *ci, OSSIZE_T i, prefix *child)
+{
+   if (ci->n_child == ci->max_child) {
+      ci->max_child *= 2;
+      ci->child = osrealloc(ci->child, ci->max_child * ossizeof(prefix *));
+   }
+   memmove(ci->child + i + 1, ci->child + i,
+	   (ci->n_child - i) * ossizeof(prefix *));
+   ci->child[i] = child;
+   ++ci->n_child;
+}
+
 /* if prefix is omitted: if PFX_OPT set return NULL, otherwise use longjmp */
 extern prefix *
 read_prefix(unsigned pfx_flags)
@@ -212,7 +334,7 @@ anon_wall_station:
       if (ptr == NULL) {
 	 /* Special case first time around at each level */
 	 name = osrealloc(name, i);
-	 ptr = osnew(prefix);
+	 ptr = arena_new(&names_arena, prefix);
 	 ptr->ident = name;
 	 name = NULL;
 	 ptr->right = ptr->down = NULL;
@@ -234,19 +356,35 @@ anon_wall_station:
 	 static prefix *cached_survey = NULL, *cached_station = NULL;
 	 prefix *ptrPrev = NULL;
 	 int cmp = 1; /* result of strcmp ( -ve for <, 0 for =, +ve for > ) */
-	 if (cached_survey == back_ptr) {
-	    cmp = strcmp(cached_station->ident, name);
-	    if (cmp <= 0) ptr = cached_station;
-	 }
-	 while (ptr && (cmp = strcmp(ptr->ident, name))<0) {
-	    ptrPrev = ptr;
-	    ptr = ptr->right;
+	 child_index *ci = NULL;
+	 OSSIZE_T ci_pos = 0;
+	 if (TSTBIT(back_ptr->sflags, SFLAGS_CHILD_INDEX)) {
+	    ci = find_child_index(back_ptr);
+	    ci_pos = child_index_position(ci, name);
+	    if (ci_pos) ptrPrev = ci->child[ci_pos - 1];
+	    ptr = (ci_pos < ci->n_child ? ci->child[ci_pos] : NULL);
+	    if (ptr) cmp = strcmp(ptr->ident, name);
+	 } else {
+	    int steps = 0;
+	    if (cached_survey == back_ptr) {
+	       cmp = strcmp(cached_station->ident, name);
+	       if (cmp <= 0) ptr = cached_station;
+	    }
+	    while (ptr && (cmp = strcmp(ptr->ident, name))<0) {
+	       ptrPrev = ptr;
+	       ptr = ptr->right;
+	       ++steps;
+	    }
+	    if (steps >= CHILD_INDEX_THRESHOLD) {
+	       ci = add_child_index(back_ptr);
+	       ci_pos = child_index_position(ci, name);
+	    }
 	 }
 	 if (cmp) {
 	    /* ie we got to one that was higher, or the end */
 	    prefix *newptr;
 	    name = osrealloc(name, i);
-	    newptr = osnew(prefix);
+	    newptr = arena_new(&names_arena, prefix);
 	    newptr->ident = name;
 	    name = NULL;
 	    if (ptrPrev == NULL)
@@ -265,6 +403,7 @@ anon_wall_station:
 	    newptr->sflags = BIT(SFLAGS_SURVEY);
 	    if (fSuspectTypo && !fImplicitPrefix)
 	       newptr->sflags |= BIT(SFLAGS_SUSPECTTYPO);
+	    if (ci) insert_into_child_index(ci, ci_pos, newptr);
 	    ptr = newptr;
 	    fNew = fTrue;
 	 }
@@ -0,0 +1,273 @@
+/* solvecache.c
+ * Reuse the solutions of network components which haven't changed
+ * Copyright (C) 2016 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* When survey data is being entered, each run of cavern usually changes only
+ * a few legs, so most of the components of the network which are solved with
+ * simultaneous equations are exactly the same as in the previous run.  With
+ * --cache, we save the solution for each component, keyed on all the leg
+ * vectors, variances and fixed positions which go into its matrix, and the
+ * order of the stations in it, and reuse it if exactly the same component
+ * comes up next time.
+ *
+ * The file holds the solutions from one run, in the machine's native format
+ * (it's only a cache, so if it's from a different machine or version we just
+ * ignore it).  After a header, each solution is stored as:
+ *
+ * hash, n, key length: unsigned long
+ * key: key length bytes
+ * 3 * n coordinates: real
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#ifdef HAVE_PTHREADS
+# include <pthread.h>
+#endif
+
+#include "solvecache.h"
+#include "message.h"
+
+#define SOLVECACHE_MAGIC "Survex solve cache 2 " VERSION "\n"
+
+typedef struct solution {
+   struct solution *next;
+   solve_key key;
+   real *sol;
+} solution;
+
+static char *fnm_solvecache = NULL;
+
+/* Solutions from the previous run, in an open hash table. */
+static solution **old_table = NULL;
+static unsigned long old_mask = 0;
+static solution *old_solutions = NULL;
+
+/* Solutions from this run. */
+static solution *new_solutions = NULL;
+
+#ifdef HAVE_PTHREADS
+static pthread_mutex_t new_solutions_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* 32 bit FNV-1a. */
+#define FNV_PRIME 16777619ul
+
+void
+solve_key_init(solve_key *key, long n)
+{
+   key->hash = 2166136261ul;
+   key->n = n;
+   key->data = NULL;
+   key->len = key->size = 0;
+   solve_key_add(key, &n, sizeof(n));
+}
+
+void
+solve_key_add(solve_key *key, const void *p, size_t len)
+{
+   const unsigned char *q = (const unsigned char *)p;
+   unsigned char *d;
+   unsigned long h = key->hash;
+   if (key->len + len > key->size) {
+      key->size = key->size ? key->size * 2 : 256;
+      while (key->len + len > key->size) key->size *= 2;
+      key->data = osrealloc(key->data, key->size);
+   }
+   d = key->data + key->len;
+   key->len += len;
+   while (len--) {
+      h = ((h ^ *q) * FNV_PRIME) & 0xfffffffful;
+      *d++ = *q++;
+   }
+   key->hash = h;
+}
+
+void
+solve_key_free(solve_key *key)
+{
+   osfree(key->data);
+   key->data = NULL;
+   key->len = key->size = 0;
+}
+
+/* Write the header identifying the format of the file to fh, or check it
+ * matches if fh is NULL and p points to the data read from the file.
+ * Returns the length of the header. */
+static size_t
+header(FILE *fh, const char *p, size_t len)
+{
+   static const real check = (real)1.5;
+   unsigned char sizes[2];
+   size_t magic_len = sizeof(SOLVECACHE_MAGIC) - 1;
+   size_t header_len = magic_len + sizeof(sizes) + sizeof(check);
+   sizes[0] = (unsigned char)sizeof(unsigned long);
+   sizes[1] = (unsigned char)sizeof(real);
+   if (fh) {
+      fputs(SOLVECACHE_MAGIC, fh);
+      fwrite(sizes, sizeof(sizes), 1, fh);
+      fwrite(&check, sizeof(check), 1, fh);
+      return header_len;
+   }
+   if (len < header_len ||
+       memcmp(p, SOLVECACHE_MAGIC, magic_len) != 0 ||
+       memcmp(p + magic_len, sizes, sizeof(sizes)) != 0 ||
+       memcmp(p + magic_len + sizeof(sizes), &check, sizeof(check)) != 0)
+      return 0;
+   return header_len;
+}
+
+void
+solvecache_open(const char *fnm)
+{
+   FILE *fh;
+   char *data = NULL;
+   size_t len = 0, size = 0, offset;
+   solution *s;
+   unsigned long n_old = 0;
+
+   fnm_solvecache = osstrdup(fnm);
+
+   fh = fopen(fnm, "rb");
+   if (!fh) return;
+   while (!feof(fh)) {
+      if (len == size) {
+	 size = size ? size * 2 : 65536;
+	 data = osrealloc(data, size);
+      }
+      len += fread(data + len, 1, size - len, fh);
+      if (ferror(fh)) {
+	 len = 0;
+	 break;
+      }
+   }
+   fclose(fh);
+
+   offset = header(NULL, data, len);
+   if (offset) {
+      while (len - offset >= 3 * sizeof(unsigned long)) {
+	 unsigned long k[3];
+	 size_t sol_len;
+	 memcpy(k, data + offset, sizeof(k));
+	 offset += sizeof(k);
+	 /* Ignore a truncated final entry. */
+	 if (k[2] > len - offset) break;
+	 if (k[1] > (len - offset - k[2]) / (3 * sizeof(real))) break;
+	 sol_len = 3 * k[1] * sizeof(real);
+	 s = osnew(solution);
+	 s->key.hash = k[0];
+	 s->key.n = (long)k[1];
+	 s->key.len = s->key.size = k[2];
+	 s->key.data = osmalloc(k[2] ? k[2] : 1);
+	 memcpy(s->key.data, data + offset, k[2]);
+	 offset += k[2];
+	 s->sol = osmalloc(sol_len);
+	 memcpy(s->sol, data + offset, sol_len);
+	 offset += sol_len;
+	 s->next = old_solutions;
+	 old_solutions = s;
+	 ++n_old;
+      }
+   }
+   osfree(data);
+
+   if (n_old) {
+      unsigned long i;
+      /* Size the hash table so it's at most half full. */
+      old_mask = 1;
+      while (old_mask < n_old * 2) old_mask <<= 1;
+      old_table = osmalloc(old_mask * ossizeof(solution *));
+      for (i = 0; i < old_mask; i++) old_table[i] = NULL;
+      --old_mask;
+      for (s = old_solutions; s; s = s->next) {
+	 i = s->key.hash & old_mask;
+	 while (old_table[i]) i = (i + 1) & old_mask;
+	 old_table[i] = s;
+      }
+   }
+}
+
+bool
+solvecache_is_open(void)
+{
+   return fnm_solvecache != NULL;
+}
+
+bool
+solvecache_find(const solve_key *key, real *sol)
+{
+   unsigned long i;
+   solution *s;
+   if (!old_table) return fFalse;
+   for (i = key->hash & old_mask; (s = old_table[i]) != NULL;
+	i = (i + 1) & old_mask) {
+      if (s->key.hash == key->hash && s->key.n == key->n &&
+	  s->key.len == key->len &&
+	  memcmp(s->key.data, key->data, key->len) == 0) {
+	 memcpy(sol, s->sol, 3 * key->n * sizeof(real));
+	 return fTrue;
+      }
+   }
+   return fFalse;
+}
+
+void
+solvecache_add(const solve_key *key, const real *sol)
+{
+   solution *s = osnew(solution);
+   size_t sol_len = 3 * key->n * sizeof(real);
+   s->key = *key;
+   /* Keep our own copy, so the caller can free theirs. */
+   s->key.data = osmalloc(key->len ? key->len : 1);
+   memcpy(s->key.data, key->data, key->len);
+   s->key.size = key->len;
+   s->sol = osmalloc(sol_len);
+   memcpy(s->sol, sol, sol_len);
+#ifdef HAVE_PTHREADS
+   pthread_mutex_lock(&new_solutions_mutex);
+#endif
+   s->next = new_solutions;
+   new_solutions = s;
+#ifdef HAVE_PTHREADS
+   pthread_mutex_unlock(&new_solutions_mutex);
+#endif
+}
+
+void
+solvecache_write(void)
+{
+   FILE *fh;
+   solution *s;
+   if (!fnm_solvecache) return;
+   fh = fopen(fnm_solvecache, "wb");
+   if (!fh) return;
+   header(fh, NULL, 0);
+   for (s = new_solutions; s; s = s->next) {
+      unsigned long k[3];
+      k[0] = s->key.hash;
+      k[1] = (unsigned long)s->key.n;
+      k[2] = (unsigned long)s->key.len;
+      fwrite(k, sizeof(k), 1, fh);
+      fwrite(s->key.data, 1, s->key.len, fh);
+      fwrite(s->sol, sizeof(real), 3 * s->key.n, fh);
+   }
+   if (ferror(fh) | (fclose(fh) != 0)) (void)remove(fnm_solvecache);
+}
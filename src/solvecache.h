@@ -0,0 +1,59 @@
+/* solvecache.h
+ * Reuse the solutions of network components which haven't changed
+ * Copyright (C) 2016 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef SOLVECACHE_H /* only include once */
+#define SOLVECACHE_H
+
+#include "cavern.h"
+
+/* A component is identified by everything which goes into its matrix, in
+ * the order the stations being solved for appear in it.  The hash is just
+ * used to find possible matches quickly. */
+typedef struct {
+   unsigned long hash;
+   long n;
+   unsigned char *data;
+   size_t len, size;
+} solve_key;
+
+void solve_key_init(solve_key *key, long n);
+void solve_key_add(solve_key *key, const void *p, size_t len);
+void solve_key_free(solve_key *key);
+
+/* Read the solutions saved from the last run from file fnm, and start
+ * recording the solutions from this run.
+ */
+void solvecache_open(const char *fnm);
+
+bool solvecache_is_open(void);
+
+/* If there's a saved solution for key, copy its 3 * key->n coordinates into
+ * sol and return fTrue.  This may be called from several threads at once.
+ */
+bool solvecache_find(const solve_key *key, real *sol);
+
+/* Save the 3 * key->n coordinates in sol as the solution for key.  This may
+ * be called from several threads at once.
+ */
+void solvecache_add(const solve_key *key, const real *sol);
+
+/* Write the solutions from this run to the file. */
+void solvecache_write(void);
+
+#endif
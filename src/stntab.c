@@ -0,0 +1,89 @@
+/* stntab.c
+ * Map the unfixed stations being solved for to rows in the matrix
+ * Copyright (C) 2016 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "stntab.h"
+#include "osalloc.h"
+
+/* Return the first slot to look in stn_hash for pos p */
+static OSSIZE_T
+hash_pos(const stn_table *tab, const pos *p)
+{
+   /* Each pos comes from names_arena straight after the prefix naming it,
+    * so successive stations are a roughly constant stride apart, and that
+    * stride is rarely a power of two.  Dropping the alignment bits and
+    * multiplying by a constant close to 2^32 divided by the golden ratio
+    * spreads such an arithmetic sequence evenly over the table, and the
+    * shift folds the well mixed upper bits into the ones the mask keeps. */
+   OSSIZE_T h = (OSSIZE_T)p / ossizeof(pos);
+   h *= (OSSIZE_T)2654435761UL;
+   return (h ^ (h >> 15)) & tab->stn_hash_mask;
+}
+
+void
+stn_tab_init(stn_table *tab, long n)
+{
+   OSSIZE_T i;
+
+   tab->stn_tab = osmalloc((OSSIZE_T)(n * ossizeof(pos*)));
+   tab->n_stn_tab = 0;
+
+   /* Size the hash table so it's at most half full. */
+   tab->stn_hash_mask = 1;
+   while (tab->stn_hash_mask < (OSSIZE_T)n * 2) tab->stn_hash_mask <<= 1;
+   tab->stn_hash = osmalloc(tab->stn_hash_mask * ossizeof(long));
+   for (i = 0; i < tab->stn_hash_mask; i++) tab->stn_hash[i] = -1;
+   tab->stn_hash_mask--;
+}
+
+long
+stn_tab_add(stn_table *tab, pos *p)
+{
+   OSSIZE_T h = hash_pos(tab, p);
+   long i;
+   while ((i = tab->stn_hash[h]) >= 0) {
+      if (tab->stn_tab[i] == p) return i;
+      h = (h + 1) & tab->stn_hash_mask;
+   }
+   tab->stn_hash[h] = tab->n_stn_tab;
+   tab->stn_tab[tab->n_stn_tab] = p;
+   return tab->n_stn_tab++;
+}
+
+long
+stn_tab_find(const stn_table *tab, const pos *p)
+{
+   OSSIZE_T h = hash_pos(tab, p);
+   long i;
+   while ((i = tab->stn_hash[h]) >= 0) {
+      if (tab->stn_tab[i] == p) return i;
+      h = (h + 1) & tab->stn_hash_mask;
+   }
+   return -1;
+}
+
+void
+stn_tab_free(stn_table *tab)
+{
+   osfree(tab->stn_hash);
+   osfree(tab->stn_tab);
+}
@@ -0,0 +1,50 @@
+/* stntab.h
+ * Map the unfixed stations being solved for to rows in the matrix
+ * Copyright (C) 2016 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef STNTAB_H /* only include once */
+#define STNTAB_H
+
+#include "cavern.h"
+
+/* The unfixed stations being solved for, each of which has a row (or
+ * FACTOR rows) in the matrix.  This is passed around rather than being
+ * static so that separate components of the network can be solved at once.
+ */
+typedef struct {
+   long n_stn_tab;
+   pos **stn_tab;
+   /* Open hash table mapping each pos in stn_tab to its index in stn_tab (or
+    * -1 for an empty slot), so we can find the row for a station in the
+    * matrix without searching stn_tab. */
+   long *stn_hash;
+   OSSIZE_T stn_hash_mask;
+} stn_table;
+
+/* Set up an empty table with room for up to n stations. */
+void stn_tab_init(stn_table *tab, long n);
+
+/* Add p to the table if it isn't already there, and return its index. */
+long stn_tab_add(stn_table *tab, pos *p);
+
+/* Return the index of p in the table, or -1 if it isn't there. */
+long stn_tab_find(const stn_table *tab, const pos *p);
+
+void stn_tab_free(stn_table *tab);
+
+#endif
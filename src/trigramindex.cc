@@ -0,0 +1,159 @@
+//
+//  trigramindex.cc
+//
+//  Index of station names for finding stations in Aven.
+//
+//  Copyright (C) 2016 Olly Betts
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "trigramindex.h"
+#include "labelinfo.h"
+
+#include <algorithm>
+#include <iterator>
+
+// Each character of a trigram is ASCII, so takes 7 bits.
+const unsigned TRIGRAM_BITS = 21;
+
+void
+TrigramIndex::GetTrigrams(const wxString & s, vector<unsigned> & result)
+{
+    // Set result to the trigrams in s (which may include duplicates).
+    result.clear();
+    unsigned trigram = 0;
+    int n = 0;
+    for (size_t i = 0; i < s.size(); ++i) {
+	wxChar wch = s[i];
+	unsigned ch = unsigned(wch);
+	if (ch >= 128) {
+	    // Start again after a non-ASCII character.
+	    n = 0;
+	    continue;
+	}
+	if (ch >= 'A' && ch <= 'Z') ch += 'a' - 'A';
+	trigram = ((trigram << 7) | ch) & ((1u << TRIGRAM_BITS) - 1);
+	if (++n >= 3) result.push_back(trigram);
+    }
+}
+
+void
+TrigramIndex::Build(vector<LabelInfo*>::const_iterator begin,
+		    vector<LabelInfo*>::const_iterator end)
+{
+    clear();
+    labels.assign(begin, end);
+
+    // There are few enough possible trigrams to count how many stations
+    // contain each directly, and then place the ids in one more pass.
+    // We note the last station each trigram was seen in so we only count a
+    // trigram once per station.
+    vector<unsigned> pos(1u << TRIGRAM_BITS);
+    vector<unsigned> last(1u << TRIGRAM_BITS, unsigned(-1));
+    vector<unsigned> label_trigrams;
+    for (unsigned i = 0; i != labels.size(); ++i) {
+	GetTrigrams(labels[i]->GetText(), label_trigrams);
+	vector<unsigned>::const_iterator t;
+	for (t = label_trigrams.begin(); t != label_trigrams.end(); ++t) {
+	    if (last[*t] == i) continue;
+	    last[*t] = i;
+	    ++pos[*t];
+	}
+    }
+
+    unsigned total = 0;
+    for (unsigned t = 0; t != pos.size(); ++t) {
+	unsigned count = pos[t];
+	if (count == 0) continue;
+	trigrams.push_back(t);
+	offsets.push_back(total);
+	pos[t] = total;
+	total += count;
+    }
+    offsets.push_back(total);
+
+    ids.resize(total);
+    fill(last.begin(), last.end(), unsigned(-1));
+    for (unsigned i = 0; i != labels.size(); ++i) {
+	GetTrigrams(labels[i]->GetText(), label_trigrams);
+	vector<unsigned>::const_iterator t;
+	for (t = label_trigrams.begin(); t != label_trigrams.end(); ++t) {
+	    if (last[*t] == i) continue;
+	    last[*t] = i;
+	    ids[pos[*t]++] = i;
+	}
+    }
+}
+
+void
+TrigramIndex::Find(const vector<wxString> & substrings,
+		   vector<LabelInfo*> & result) const
+{
+    result.clear();
+
+    // Find the list of stations for each trigram we need, as a pair of
+    // (size, index into trigrams).
+    vector<pair<unsigned, size_t> > lists;
+    vector<unsigned> needed;
+    vector<wxString>::const_iterator s;
+    for (s = substrings.begin(); s != substrings.end(); ++s) {
+	GetTrigrams(*s, needed);
+	sort(needed.begin(), needed.end());
+	needed.erase(unique(needed.begin(), needed.end()), needed.end());
+	vector<unsigned>::const_iterator t;
+	for (t = needed.begin(); t != needed.end(); ++t) {
+	    vector<unsigned>::const_iterator j;
+	    j = lower_bound(trigrams.begin(), trigrams.end(), *t);
+	    if (j == trigrams.end() || *j != *t) {
+		// No station contains this trigram.
+		return;
+	    }
+	    size_t k = j - trigrams.begin();
+	    lists.push_back(make_pair(offsets[k + 1] - offsets[k], k));
+	}
+    }
+
+    if (lists.empty()) {
+	// Nothing to narrow the search with.
+	result = labels;
+	return;
+    }
+
+    // Intersect the lists, starting with the shortest.
+    sort(lists.begin(), lists.end());
+    size_t k = lists[0].second;
+    vector<unsigned> found(ids.begin() + offsets[k],
+			   ids.begin() + offsets[k + 1]);
+    vector<unsigned> tmp;
+    for (size_t i = 1; i != lists.size() && !found.empty(); ++i) {
+	k = lists[i].second;
+	tmp.clear();
+	set_intersection(found.begin(), found.end(),
+			 ids.begin() + offsets[k], ids.begin() + offsets[k + 1],
+			 back_inserter(tmp));
+	found.swap(tmp);
+    }
+
+    result.reserve(found.size());
+    vector<unsigned>::const_iterator i;
+    for (i = found.begin(); i != found.end(); ++i) {
+	result.push_back(labels[*i]);
+    }
+}
@@ -0,0 +1,73 @@
+//
+//  trigramindex.h
+//
+//  Index of station names for finding stations in Aven.
+//
+//  Copyright (C) 2016 Olly Betts
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#ifndef trigramindex_h
+#define trigramindex_h
+
+#include <vector>
+
+#include "wx.h"
+
+using namespace std;
+
+class LabelInfo;
+
+// For each sequence of three characters, lists the stations whose names
+// contain it (ignoring case).  Only trigrams of ASCII characters are
+// indexed, which covers most station names, and means we know exactly how
+// a case-insensitive match folds them.
+class TrigramIndex {
+    // The trigrams which occur, in ascending order.
+    vector<unsigned> trigrams;
+
+    // The stations containing trigrams[i] are ids[offsets[i]] to
+    // ids[offsets[i + 1] - 1], in ascending order.
+    vector<unsigned> offsets;
+    vector<unsigned> ids;
+
+    // The labels in the order they were passed to Build().
+    vector<LabelInfo*> labels;
+
+    static void GetTrigrams(const wxString & s, vector<unsigned> & result);
+
+  public:
+    void Build(vector<LabelInfo*>::const_iterator begin,
+	       vector<LabelInfo*>::const_iterator end);
+
+    void clear() {
+	trigrams.clear();
+	offsets.clear();
+	ids.clear();
+	labels.clear();
+    }
+
+    // Set result to the labels whose names might contain all of substrings,
+    // ignoring case.  Substrings shorter than three characters don't narrow
+    // the search.
+    //
+    // The labels are returned in the same relative order as they were
+    // passed to Build().
+    void Find(const vector<wxString> & substrings,
+	      vector<LabelInfo*> & result) const;
+};
+
+#endif
@@ -0,0 +1,174 @@
+#!/bin/sh
+#
+# Survex test suite - check reading with the .3d survey index
+# Copyright (C) 2016 Olly Betts
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+testdir=`echo $0 | sed 's!/[^/]*$!!' || echo '.'`
+
+# allow us to run tests standalone more easily
+: ${srcdir="$testdir"}
+
+# force VERBOSE if we're run on a subset of tests
+test -n "$*" && VERBOSE=1
+
+test -x "$testdir"/../src/cavern || testdir=.
+
+: ${CAVERN="$testdir"/../src/cavern}
+: ${DUMP3D="$testdir"/../src/dump3d}
+
+: ${SURVEYS="a b b.d c nosuch"}
+
+LC_ALL=C
+export LC_ALL
+SURVEXLANG=en
+export SURVEXLANG
+
+vg_error=123
+vg_log=vg.log
+if [ -n "$VALGRIND" ] ; then
+  rm -f "$vg_log"
+  CAVERN="$VALGRIND --log-file=$vg_log --error-exitcode=$vg_error $CAVERN"
+  DUMP3D="$VALGRIND --log-file=$vg_log --error-exitcode=$vg_error $DUMP3D"
+fi
+
+check_vg() {
+  if [ -n "$VALGRIND" ] ; then
+    if [ $1 = "$vg_error" ] ; then
+      cat "$vg_log"
+      rm "$vg_log"
+      exit 1
+    fi
+    rm "$vg_log"
+  fi
+}
+
+rm -f tmp.* tmp_*
+
+# Write a survey with several surveys, each with many more stations than go
+# in one span of the index (SPAN_MIN_ITEMS in img.c), with survey "a" split
+# in two so the spans for it aren't all together.
+awk 'function legs(first, n,  i) {
+  for (i = first; i < first + n; i++)
+    print i " " i + 1 " " 5 + i % 7 " " (i * 37) % 360 " " i % 11 - 5
+}
+BEGIN {
+  print "*fix a.0 0 0 0"
+  print "*equate a.300 b.0"
+  print "*equate b.300 b.d.0"
+  print "*equate b.d.300 c.0"
+  print "*begin a"
+  print "*date 2001.02.03"
+  legs(0, 300)
+  print "*end a"
+  print "*begin b"
+  print "*date 2002.03.04-2002.03.05"
+  legs(0, 300)
+  print "*begin d"
+  print "*flags duplicate"
+  legs(0, 300)
+  print "*end d"
+  print "*end b"
+  print "*begin c"
+  print "*flags splay"
+  legs(0, 300)
+  print "*end c"
+  print "*begin a"
+  legs(300, 300)
+  print "*end a"
+}' > tmp.svx
+
+$CAVERN tmp.svx > tmp.out
+exitcode=$?
+check_vg $exitcode
+if [ "$exitcode" != 0 ] ; then
+  cat tmp.out
+  exit 1
+fi
+
+# The index ends with a fixed size footer: 4 bytes giving the offset of the
+# start of the index, 4 bytes giving the number of spans, then "Svx3dIdx".
+if [ "`tail -c 8 tmp.3d`" != Svx3dIdx ] ; then
+  echo "No survey index written"
+  exit 1
+fi
+size=`wc -c < tmp.3d`
+set -- `od -A n -t u1 -j \`expr $size - 16\` -N 8 tmp.3d`
+offset=`expr $1 + 256 \* \( $2 + 256 \* \( $3 + 256 \* $4 \) \)`
+spans=`expr $5 + 256 \* \( $6 + 256 \* \( $7 + 256 \* $8 \) \)`
+test -n "$VERBOSE" && echo "Index at offset $offset with $spans spans"
+if [ "$spans" -lt 5 ] ; then
+  echo "Expected at least 5 spans in the index, got $spans"
+  exit 1
+fi
+
+# The same file without the index.
+dd if=tmp.3d of=tmp_noindex.3d bs=$offset count=1 2> /dev/null
+
+# A file with a bad footer magic, and another with an invalid index offset -
+# both should be read as if there was no index.
+cp tmp.3d tmp_badmagic.3d
+printf 'X' | dd of=tmp_badmagic.3d bs=1 seek=`expr $size - 1` conv=notrunc 2> /dev/null
+cp tmp.3d tmp_badoffset.3d
+printf '\377\377\377\177' | dd of=tmp_badoffset.3d bs=1 seek=`expr $size - 16` conv=notrunc 2> /dev/null
+
+# A sequential read returns a MOVE before each run of legs it passes over,
+# even if none of them are in the survey wanted, whereas spans skipped using
+# the index return nothing at all.  A MOVE which is followed by another MOVE
+# rather than a LINE has no effect, so drop these before comparing.
+drop_unused_moves() {
+  awk '/^MOVE / { for (i = 0; i < n; i++) print held[i]; n = 0; move = $0; next }
+/^LINE / {
+  if (move != "") print move
+  for (i = 0; i < n; i++) print held[i]
+  move = ""; n = 0; print; next
+}
+{ if (move != "") held[n++] = $0; else print }
+END { for (i = 0; i < n; i++) print held[i] }' "$1"
+}
+
+for survey in $SURVEYS ; do
+  echo "$survey"
+  for file in tmp tmp_noindex tmp_badmagic tmp_badoffset ; do
+    $DUMP3D --survey="$survey" $file.3d > $file.dump
+    exitcode=$?
+    check_vg $exitcode
+    test $exitcode = 0 || exit 1
+  done
+  if [ "$survey" != nosuch ] && ! grep '^LINE' tmp_noindex.dump > /dev/null ; then
+    echo "No legs read for survey $survey"
+    exit 1
+  fi
+  # With a bad footer, the index should be ignored.
+  for file in tmp_badmagic tmp_badoffset ; do
+    if ! cmp tmp_noindex.dump $file.dump > /dev/null ; then
+      echo "Reading survey $survey from $file.3d gave different results"
+      test -n "$VERBOSE" && diff tmp_noindex.dump $file.dump
+      exit 1
+    fi
+  done
+  drop_unused_moves tmp_noindex.dump > tmp_noindex.cmp
+  drop_unused_moves tmp.dump > tmp.cmp
+  if ! cmp tmp_noindex.cmp tmp.cmp > /dev/null ; then
+    echo "Reading survey $survey using the index gave different results"
+    test -n "$VERBOSE" && diff tmp_noindex.cmp tmp.cmp
+    exit 1
+  fi
+done
+
+rm -f tmp.* tmp_*
+test -n "$VERBOSE" && echo "Test passed"
+exit 0
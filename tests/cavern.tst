@@ -69,7 +69,8 @@ testdir=`(cd "$testdir" && pwd)`
  skipafterbadomit passagebad badreadingdotplus badcalibrate calibrate_clino\
  badunits badbegin anonstn anonstnbad anonstnrev doubleinc reenterlots\
  cs csbad csbadsdfix cslonglat omitfixaroundsolve repeatreading\
- mixedeols\
+ mixedeols sparsegrid unsortednames\
+ cache jobs\
 "}}
 
 # Test file stnsurvey3.svx missing: pos=fail # We exit before the error count.
@@ -88,12 +89,68 @@ if [ -n "$VALGRIND" ] ; then
   CAD3D="$VALGRIND --log-file=$vg_log --error-exitcode=$vg_error $CAD3D"
 fi
 
+# Run cavern on file $2 with output files $1.*, passing any further
+# arguments on, and save copies of the output to compare in $1.*.cmp.
+run_cavern() {
+  out=$1
+  input=$2
+  shift
+  shift
+  $CAVERN "$input" --output="$out" "$@" > "$out.out"
+  exitcode=$?
+  test -n "$VERBOSE" && cat "$out.out"
+  if [ -n "$VALGRIND" ] ; then
+    if [ $exitcode = "$vg_error" ] ; then
+      cat "$vg_log"
+      rm "$vg_log"
+      exit 1
+    fi
+    rm "$vg_log"
+  fi
+  test $exitcode = 0 || exit 1
+  # The fourth line of the .3d file is the time it was written.
+  { head -n 3 "$out.3d" ; tail -n +5 "$out.3d" ; } > "$out.3d.cmp"
+  sed '1,/^Copyright/d;/^\(CPU t\|T\)ime used  *[0-9][0-9.]*s$/d' "$out.out" > "$out.out.cmp"
+}
+
+# Write a survey made up of grids of legs, each with a fixed station, so the
+# network splits into several parts with loops which are solved separately.
+# If $1 is non-zero, one reading in grid $1 is changed.
+components_svx() {
+  awk -v change="$1" 'BEGIN {
+  for (g = 1; g <= 4; g++) {
+    print "*fix g" g ".0_0", g * 100, 0, 0
+    print "*begin g" g
+    for (i = 0; i < 4; i++) for (j = 0; j < 4; j++) {
+      tape = 10 + (i + j + g) % 5 / 20
+      if (g == change && i == 1 && j == 1) tape += 0.25
+      if (i < 3) print i "_" j, i + 1 "_" j, tape, 90 + (i * j + g) % 3, 0
+      if (j < 3) print i "_" j, i "_" j + 1, 10 + (i * j + g) % 4 / 20, (i + j * g) % 3, 0
+    }
+    print "*end g" g
+  }
+}'
+}
+
+# Check the output from two runs of run_cavern is the same.
+same_output() {
+  for ext in 3d.cmp err out.cmp ; do
+    if ! cmp -s "$1.$ext" "$2.$ext" ; then
+      test -n "$VERBOSE" && echo "$1.$ext and $2.$ext differ"
+      exit 1
+    fi
+  done
+}
+
 for file in $TESTS ; do
   case $file in
     nonexistent_file*|ONELEG)
       # ONELEG tests that we don't apply special handling to command line
       # arguments, only those in *include.
       realfile= ;;
+    cache|jobs)
+      # The survey data for these tests is generated by components_svx.
+      realfile= ;;
     *.*) realfile=$file ;;
     *) realfile=$file.svx ;;
   esac
@@ -105,6 +162,40 @@ for file in $TESTS ; do
 
   echo "$file"
 
+  case $file in
+    cache)
+      # Reusing saved solutions should give exactly the same results as
+      # solving from scratch - check this when the .solve file is written,
+      # when it's reused, and after changing a reading in one part of the
+      # network so only some of the solutions saved can be reused.
+      rm -f tmp.* tmpcache.*
+      components_svx 0 > tmp.svx
+      run_cavern tmp tmp.svx
+      run_cavern tmpcache tmp.svx --cache
+      test -f tmpcache.solve || exit 1
+      same_output tmp tmpcache
+      run_cavern tmpcache tmp.svx --cache
+      same_output tmp tmpcache
+      components_svx 2 > tmp.svx
+      run_cavern tmp tmp.svx
+      run_cavern tmpcache tmp.svx --cache
+      same_output tmp tmpcache
+      rm -f tmp.* tmpcache.*
+      continue ;;
+    jobs)
+      # Solving parts of the network in parallel should give exactly the
+      # same results as solving them one after another.
+      rm -f tmp.* tmpjobs.*
+      components_svx 0 > tmp.svx
+      run_cavern tmp tmp.svx
+      run_cavern tmpjobs tmp.svx --jobs=4
+      same_output tmp tmpjobs
+      run_cavern tmpjobs tmp.svx -j1
+      same_output tmp tmpjobs
+      rm -f tmp.* tmpjobs.*
+      continue ;;
+  esac
+
   # how many warnings to expect
   warn=
   # how many errors to expect